@@ -17,38 +17,14 @@
  */
 /***********************************************************************/
 
-#if defined(_MSC_VER) && _MSC_VER >= 1400
-#define _CRT_SECURE_NO_WARNINGS /* suppress warnings about fopen() and similar "unsafe" functions defined by MS */
-#endif
-
-#include "clbt.h"
+#include "clbt_internal.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
-
-#ifndef CLBT_OS
-#if defined(unix)        || defined(__unix)      || defined(__unix__) \
-	|| defined(linux) || defined(__linux) || defined(__linux__) \
-	|| defined(sun) || defined(__sun) \
-	|| defined(BSD) || defined(__OpenBSD__) || defined(__NetBSD__) \
-	|| defined(__FreeBSD__) || defined (__DragonFly__) \
-	|| defined(sgi) || defined(__sgi) \
-	|| (defined(__MACOSX__) || defined(__APPLE__)) \
-	|| defined(__CYGWIN__) || defined(__MINGW32__)
-#define CLBT_OS 1
-#elif defined(_MSC_VER) || defined(WIN32)  || defined(_WIN32) || defined(__WIN32__) \
-	|| defined(WIN64) || defined(_WIN64) || defined(__WIN64__)
-#define CLBT_OS 0
-#else
-#error Unable to support this unknown OS.
-#endif
-#elif !(CLBT_OS==0 || CLBT_OS==1)
-#error CLBT: Invalid configuration variable 'CLBT_OS'.
-#error (correct values are '0 = Microsoft Windows', '1 = Unix-like OS').
-#endif
+#include <ctype.h>
 
 /* OS specific headers */
 #if CLBT_OS == 0
@@ -74,113 +50,72 @@
 #endif
 
 
-struct ClbtPath
-{
-	int flag;			/* status flag */
-	int length;			/* length of path char* buffer */
-	char* path;			/* char* buffer for this path */
-};
-
-
-struct ClbtList
-{
-	int flag;					/* status flag */
-	int size;					/* number of files/directories in list */
-	int capacity;				/* capacity of allocated Path arrays */
-	struct ClbtPath** paths;	/* Path array, each row contains the path of one file/directory */
-};
-
-typedef struct ClbtPath CP;
-typedef struct ClbtList CL;
-
 /*------------------------------------------------------------------------------------------------------*/
 static FILE* stdOut = NULL;
 static FILE* stdErr = NULL;
-/*------------------------------------------------------------------------------------------------------*/
+static int clbtQuiet = 0;		/* print nothing at all, checked before any formatting */
 
-static void clbt_unused(const char* dull){ dull++; }
+#define CLBT_MESSAGE_SIZE	1024	/* messages longer than this are malloc()ed */
+struct ClbtConfig clbtConfig = { 0 };
 
-static int clbt_system(const char *const command, const char *const moduleName)
-{
-#if CLBT_OS==1
-	const unsigned int l = strlen(command);
-	clbt_unused(moduleName);
-	if (l) 
-	{
-		int out_val = -1;
-		char *const ncommand = (char*)malloc(l+16);
-		strncpy(ncommand, command, l);
-		strcpy(ncommand + l, " 2> /dev/null"); /* Make command silent. */
-		out_val = system(ncommand);
-		free(ncommand);
-		return out_val;
-	}
-	else return -1;
-#elif CLBT_OS==0
-	PROCESS_INFORMATION pi;
-	STARTUPINFO si;
-	BOOL res;
-	memset(&pi, 0, sizeof(PROCESS_INFORMATION));
-	memset(&si, 0, sizeof(STARTUPINFO));
-	GetStartupInfoA(&si);
-	si.cb = sizeof(si);
-	si.wShowWindow = SW_HIDE;
-	si.dwFlags |= SW_HIDE | STARTF_USESHOWWINDOW;
-	res = CreateProcessA((LPCTSTR)moduleName, (LPTSTR)command, 0, 0, FALSE, 0, 0, 0, &si, &pi);
-	if (res) {
-		WaitForSingleObject(pi.hProcess, INFINITE);
-		CloseHandle(pi.hThread);
-		CloseHandle(pi.hProcess);
-		return 0;
-	}
-	else return system(command);
+/* keep one message in one piece when printed from worker threads */
+#if CLBT_OS == 1
+#define clbt_lock_stream(stream)	flockfile(stream)
+#define clbt_unlock_stream(stream)	funlockfile(stream)
+#else
+#define clbt_lock_stream(stream)	_lock_file(stream)
+#define clbt_unlock_stream(stream)	_unlock_file(stream)
 #endif
-}
-
+/*------------------------------------------------------------------------------------------------------*/
 
 static void clbt_enter_quiet_mode()
 {
-	/* open a null device, means disable printing any message */
-	stdOut = fopen("nul", "w");
-	if (stdOut == NULL)
-	{
-		fprintf(stderr, "[Warn] - Failed to enter quite mode.\n");
-		stdOut = stdout;
-		stdErr = stderr;
-	}
-	else
-	{
-		/* ok */
-		stdErr = stdOut;
-	}
+	/* a null sink, messages are dropped before they are formatted */
+	clbtQuiet = 1;
+	stdOut = stdout;
+	stdErr = stderr;
 }
 
 static void clbt_exit_quiet_mode()
 {
-	if (stdOut != stdout && stdOut != NULL)
-	{
-		fclose(stdOut);
-	}
+	clbtQuiet = 0;
 	stdOut = stdout;
 	stdErr = stderr;
 }
 
+/*
+ * Drop all messages with CLBT_OPT_QUIET, print them otherwise.
+ */
+void clbt_set_quiet(int options)
+{
+	if (options & CLBT_OPT_QUIET)
+		clbt_enter_quiet_mode();
+	else
+		clbt_exit_quiet_mode();
+}
+
+/*
+ * Write errors and warnings to stream instead of stderr, NULL restores stderr.
+ */
+void clbt_redirect_messages(FILE* stream)
+{
+	stdErr = stream != NULL ? stream : stderr;
+}
+
 static int clbt_end_with_newline(const char* str)
 {
-	int ret = 0;
-	int len = strlen(str);
-	if (len > 1)
-	{
-		if (str[len - 1] == 'n' && str[len - 2] == '\\') ret = 1;
-	}
-	return ret;
+	size_t len = strlen(str);
+	return len > 0 && str[len - 1] == '\n';
 }
 
-static void clbt_error(const char* format, ...)
+void clbt_error(const char* format, ...)
 {
 	va_list args;
 
+	if (clbtQuiet)
+		return;
 	assert(stdErr != NULL);
+	clbt_lock_stream(stdErr);
 	fprintf(stdErr, "[Error] - ");
 	va_start(args, format);
 	vfprintf(stdErr, format, args);
@@ -189,13 +124,17 @@ static void clbt_error(const char* format, ...)
 	/* make it newline if not */
 	if (!clbt_end_with_newline(format))
 		fprintf(stdErr, "\n");
+	clbt_unlock_stream(stdErr);
 }
 
-static void clbt_warning(const char* format, ...)
+void clbt_warning(const char* format, ...)
 {
 	va_list args;
 
+	if (clbtQuiet)
+		return;
 	assert(stdErr != NULL);
+	clbt_lock_stream(stdErr);
 	fprintf(stdErr, "[Warn] - ");
 	va_start(args, format);
 	vfprintf(stdErr, format, args);
@@ -204,36 +143,176 @@ static void clbt_warning(const char* format, ...)
 	/* make it newline if not */
 	if (!clbt_end_with_newline(format))
 		fprintf(stdErr, "\n");
+	clbt_unlock_stream(stdErr);
 }
 
-static void clbt_print(const char* format, ...)
+/*
+ * Format a message into buf, or into a malloc()ed buffer if it is too
+ * small. Room for one more char is always left.
+ */
+static char* clbt_format(char* buf, size_t size, int* len, const char* format, va_list args)
 {
+	char* out = buf;
+	int n;
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+	/* _vsnprintf() does not tell the length needed */
+	n = _vscprintf(format, args);
+	if (n >= 0 && (size_t)n + 2 > size && (out = (char*)malloc(n + 2)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for message!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	if (n >= 0)
+		n = _vsnprintf(out, n + 1, format, args);
+#else
+	va_list again;
+
+	va_copy(again, args);
+	n = vsnprintf(buf, size - 1, format, args);
+	if (n >= 0 && (size_t)n + 2 > size)
+	{
+		out = (char*)malloc(n + 2);
+		if (out == NULL)
+		{
+			clbt_error("Unable to allocate memory for message!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		vsnprintf(out, n + 1, format, again);
+	}
+	va_end(again);
+#endif
+
+	*len = n;
+	return out;
+}
+
+void clbt_print(const char* format, ...)
+{
+	char buf[CLBT_MESSAGE_SIZE];
+	char* out;
 	va_list args;
+	int len;
 
-	assert(stdOut != NULL);
+	if (clbtQuiet)
+		return;
 	va_start(args, format);
-	vfprintf(stdOut, format, args);
+	out = clbt_format(buf, sizeof(buf), &len, format, args);
 	va_end(args);
+
+	if (len > 0)
+		clbt_out_write(-1, out, len);
+	if (out != buf)
+		free(out);
 }
 
-static void clbt_println(const char* format, ...)
+void clbt_println(const char* format, ...)
 {
+	char buf[CLBT_MESSAGE_SIZE];
+	char* out;
 	va_list args;
+	int len;
 
-	assert(stdOut != NULL);
+	if (clbtQuiet)
+		return;
 	va_start(args, format);
-	vfprintf(stdOut, format, args);
+	out = clbt_format(buf, sizeof(buf), &len, format, args);
+	va_end(args);
+
+	if (len < 0)
+		len = 0;
+	/* make it newline if not, or NUL with --print0 */
+	if (len > 0 && out[len - 1] == '\n')
+		len--;
+	out[len++] = clbt_out_format() == CLBT_FORMAT_NUL ? '\0' : '\n';
+	clbt_out_write(-1, out, len);
+	if (out != buf)
+		free(out);
+}
+
+/*
+ * Print bytes as they are, in one piece.
+ */
+void clbt_print_raw(const void* data, size_t len)
+{
+	clbt_out_write(-1, data, len);
+}
+
+/*
+ * Print bytes as they are to the error stream, in one piece.
+ */
+void clbt_error_raw(const void* data, size_t len)
+{
+	if (clbtQuiet)
+		return;
+	assert(stdErr != NULL);
+	clbt_lock_stream(stdErr);
+	fwrite(data, 1, len, stdErr);
+	clbt_unlock_stream(stdErr);
+}
+
+/*
+ * Print a message only in verbose mode.
+ */
+void clbt_verbose(int options, const char* format, ...)
+{
+	va_list args;
+
+	if (!(options & CLBT_OPT_VERBOSE) || clbtQuiet)
+		return;
+
+	/* keep reports after the output they talk about */
+	clbt_out_flush();
+	assert(stdErr != NULL);
+	clbt_lock_stream(stdErr);
+	fprintf(stdErr, "[Info] - ");
+	va_start(args, format);
+	vfprintf(stdErr, format, args);
 	va_end(args);
 
 	/* make it newline if not */
 	if (!clbt_end_with_newline(format))
-		fprintf(stdOut, "\n");
+		fprintf(stdErr, "\n");
+	clbt_unlock_stream(stdErr);
+}
+
+/*
+ * Ask the user for confirmation, always yes if forced.
+ */
+int clbt_confirm(int options, const char* format, ...)
+{
+	va_list args;
+	char answer[16];
+
+	if (options & CLBT_OPT_FORCE)
+		return 1;
+
+	/* prompt goes to stderr so it never mixes with task output */
+	clbt_out_flush();
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, " [y/N] ");
+	fflush(stderr);
+
+	if (fgets(answer, sizeof(answer), stdin) == NULL)
+		return 0;
+	return answer[0] == 'y' || answer[0] == 'Y';
+}
+
+/*
+ * Report a task that can't run on this platform.
+ */
+int clbt_unsupported(const char* task)
+{
+	clbt_error("Task '%s' is not supported on this platform yet.", task);
+	return CLBT_FAILURE_OS;
 }
 
 /*
  * Init the specified path.
  */
-static void clbt_path_init(CP* path)
+void clbt_path_init(CP* path)
 {
 	assert(path != NULL);
 
@@ -251,7 +330,7 @@ static void clbt_path_init(CP* path)
 /*
  * Destroy the specified path.
  */
-static void clbt_path_destroy(CP* path)
+void clbt_path_destroy(CP* path)
 {
 	assert(path != NULL);
 	assert(path->flag & 0x1);
@@ -262,7 +341,7 @@ static void clbt_path_destroy(CP* path)
 	path->path = NULL;
 }
 
-static void clbt_path_clear(CP* path)
+void clbt_path_clear(CP* path)
 {
 	assert(path != NULL);
 
@@ -277,7 +356,7 @@ static void clbt_path_clear(CP* path)
 /*
  * Resizes the specified path.
  */
-static void clbt_path_resize(CP* path, int size)
+void clbt_path_resize(CP* path, int size)
 {
 	assert(path != NULL);
 	assert(size >= 1);
@@ -305,10 +384,28 @@ static void clbt_path_resize(CP* path, int size)
 	}
 }
 
+/*
+ * Copy a string into the specified path, len < 0 means strlen(str).
+ */
+void clbt_path_set(CP* path, const char* str, int len)
+{
+	assert(path != NULL);
+	assert(path->flag & 0x1);
+	assert(str != NULL);
+
+	if (len < 0)
+		len = strlen(str);
+	if (path->length < len + 1)
+		clbt_path_resize(path, len + 1);
+
+	memcpy(path->path, str, len);
+	path->path[len] = '\0';
+}
+
 /*
  * Init a List instance.
  */
-static void clbt_list_init(CL* list)
+void clbt_list_init(CL* list)
 {
 	int i = 0;
 
@@ -335,16 +432,18 @@ static void clbt_list_init(CL* list)
 /*
  * Destroy the specified list.
  */
-static void clbt_list_destroy(CL* list)
+void clbt_list_destroy(CL* list)
 {
 	int i = 0;
 
 	assert(list != NULL);
 	assert(list->flag & 0x1);
 
+	/* list owns inserted paths */
 	for (i = 0; i < list->size; i++)
 	{
 		clbt_path_destroy(list->paths[i]);
+		free(list->paths[i]);
 	}
 
 	free(list->paths);
@@ -389,7 +488,7 @@ static void clbt_list_increase(CL* list)
 	}
 }
 
-static void clbt_list_insert(CL* list, CP* path)
+void clbt_list_insert(CL* list, CP* path)
 {
 	if (list->size == list->capacity)
 	{
@@ -399,6 +498,24 @@ static void clbt_list_insert(CL* list, CP* path)
 	list->paths[list->size++] = path;
 }
 
+/*
+ * Append a copy of the string to the specified list.
+ */
+void clbt_list_append(CL* list, const char* str)
+{
+	CP* path = (CP*)malloc(sizeof(CP));
+
+	if (path == NULL)
+	{
+		clbt_error("Unable to allocate memory for path in list!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	clbt_path_init(path);
+	clbt_path_set(path, str, -1);
+	clbt_list_insert(list, path);
+}
+
 
 static int clbt_getcwd(CP* cwd)
 {
@@ -442,33 +559,540 @@ static int clbt_getcwd(CP* cwd)
 
 
 
-/* 
- * main entrance for clbt tasks
+/*
+ * Split a command line into words like a shell without expansion,
+ * quotes group and backslash escapes.
  */
-int clbt_run(int options, int tasks)
+int clbt_split_words(CL* list, const char* str)
 {
-	if (options & CLBT_OPT_QUIET)
-		clbt_enter_quiet_mode();
+	CP word;
+	int len, quote, ret = CLBT_OK;
+
+	clbt_path_init(&word);
+	clbt_path_resize(&word, (int)strlen(str) + 1);
+
+	while (*str)
+	{
+		while (isspace((unsigned char)*str))
+			str++;
+		if (*str == '\0')
+			break;
+
+		len = 0;
+		quote = 0;
+		while (*str && (quote || !isspace((unsigned char)*str)))
+		{
+			if (quote && *str == quote)
+				quote = 0;
+			else if (!quote && (*str == '\'' || *str == '"'))
+				quote = *str;
+			else if (*str == '\\' && quote != '\'' && str[1])
+				word.path[len++] = *++str;
+			else
+				word.path[len++] = *str;
+			str++;
+		}
+		if (quote)
+		{
+			ret = CLBT_INVALID_OP;
+			break;
+		}
+		word.path[len] = '\0';
+		clbt_list_append(list, word.path);
+	}
+
+	clbt_path_destroy(&word);
+	return ret;
+}
+
+/*
+ * Parse a comma separated list of list fields, printed in the order given.
+ */
+static int clbt_parse_fields(const char* str)
+{
+	static const char* const names[] = { "path", "name", "type", "size", "mtime", "mode", "uid", "gid", "ino" };
+	const char* end;
+	size_t len;
+	char order[sizeof(clbtConfig.fieldOrder)];
+	int i, count = 0, fields = 0;
+
+	while (*str)
+	{
+		end = strchr(str, ',');
+		len = end ? (size_t)(end - str) : strlen(str);
+		for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+		{
+			if (strlen(names[i]) == len && strncmp(names[i], str, len) == 0)
+				break;
+		}
+		if (i == (int)(sizeof(names) / sizeof(names[0])) || (fields & (1 << i)))
+			return CLBT_INVALID_OP;
+		order[count++] = (char)('0' + i);
+		fields |= 1 << i;
+		str += end ? len + 1 : len;
+	}
+
+	order[count] = '\0';
+	clbtConfig.fields = fields;
+	strcpy(clbtConfig.fieldOrder, order);
+	return CLBT_OK;
+}
+
+/*
+ * Compile --expr, one that always holds is dropped so walks pay nothing for it.
+ */
+static int clbt_set_expr(const char* str)
+{
+	struct ClbtExpr* expr = clbt_expr_compile(str);
+
+	if (expr == NULL)
+		return CLBT_INVALID_OP;
+
+	clbt_expr_free(clbtConfig.expr);
+	clbtConfig.expr = NULL;
+	if (clbt_expr_constant(expr) == 1)
+		clbt_expr_free(expr);
 	else
+		clbtConfig.expr = expr;
+	return CLBT_OK;
+}
+
+/*
+ * Set a config value for the following clbt_run().
+ */
+int clbt_config(int key, const char* value)
+{
+	if (!(clbtConfig.flag & 0x1))
+	{
+		clbtConfig.flag = 0x1;
+		/* values are checked here already, clbt_run() picks the streams again */
 		clbt_exit_quiet_mode();
+		clbtConfig.jobs = 0;
+		clbtConfig.hashAlgo = CLBT_DIGEST_NONE;
+		clbtConfig.dedupeLink = CLBT_LINK_NONE;
+		clbtConfig.limit = 0;
+		clbtConfig.convert = 0;
+		clbtConfig.fields = 0;
+		clbtConfig.fieldOrder[0] = '\0';
+		clbt_path_init(&clbtConfig.syncDest);
+		clbt_path_init(&clbtConfig.snapshot);
+		clbt_path_init(&clbtConfig.diffBase);
+		clbtConfig.index = CLBT_INDEX_NONE;
+		clbt_path_init(&clbtConfig.indexFile);
+		clbtConfig.indexFile.path[0] = '\0';
+		clbt_path_init(&clbtConfig.serveSocket);
+		clbt_path_init(&clbtConfig.connectSocket);
+		clbtConfig.connectSocket.path[0] = '\0';
+		clbtConfig.expr = NULL;
+		clbtConfig.top = 0;
+		clbtConfig.topBy = CLBT_TOP_SIZE;
+		clbtConfig.statsBy = CLBT_STATS_EXT;
+		clbtConfig.sort = CLBT_SORT_NONE;
+		clbt_list_init(&clbtConfig.targets);
+		clbt_list_init(&clbtConfig.patterns);
+		clbt_list_init(&clbtConfig.searches);
+		clbt_list_init(&clbtConfig.replaces);
+		clbt_list_init(&clbtConfig.execArgs);
+	}
 
-	clbt_println("Start execution...");
+	if (value == NULL)
+		return CLBT_INVALID_OP;
 
+	switch (key)
 	{
-		CP cwd;
-		clbt_path_init(&cwd);
-		clbt_getcwd(&cwd);
-		clbt_println("%s", cwd.path);
-		clbt_path_destroy(&cwd);
+	case CLBT_CFG_TARGET:
+		clbt_list_append(&clbtConfig.targets, value);
+		break;
+	case CLBT_CFG_PATTERN:
+		clbt_list_append(&clbtConfig.patterns, value);
+		break;
+	case CLBT_CFG_JOBS:
+		clbtConfig.jobs = atoi(value);
+		if (clbtConfig.jobs < 0)
+		{
+			clbtConfig.jobs = 0;
+			return CLBT_INVALID_OP;
+		}
+		break;
+	case CLBT_CFG_HASH:
+		clbtConfig.hashAlgo = clbt_digest_parse(value);
+		if (clbtConfig.hashAlgo == CLBT_DIGEST_NONE)
+			return CLBT_INVALID_OP;
+		break;
+	case CLBT_CFG_LINK:
+		if (strcmp(value, "hard") == 0)
+			clbtConfig.dedupeLink = CLBT_LINK_HARD;
+		else if (strcmp(value, "reflink") == 0)
+			clbtConfig.dedupeLink = CLBT_LINK_REFLINK;
+		else
+			return CLBT_INVALID_OP;
+		break;
+	case CLBT_CFG_SEARCH:
+		clbt_list_append(&clbtConfig.searches, value);
+		break;
+	case CLBT_CFG_REPLACE:
+		clbt_list_append(&clbtConfig.replaces, value);
+		break;
+	case CLBT_CFG_LIMIT:
+		clbtConfig.limit = atoi(value);
+		if (clbtConfig.limit < 0)
+		{
+			clbtConfig.limit = 0;
+			return CLBT_INVALID_OP;
+		}
+		break;
+	case CLBT_CFG_CONVERT:
+		if (strcmp(value, "lf") == 0)
+			clbtConfig.convert = (clbtConfig.convert & ~CLBT_CONVERT_CRLF) | CLBT_CONVERT_LF;
+		else if (strcmp(value, "crlf") == 0)
+			clbtConfig.convert = (clbtConfig.convert & ~CLBT_CONVERT_LF) | CLBT_CONVERT_CRLF;
+		else if (strcmp(value, "nobom") == 0)
+			clbtConfig.convert |= CLBT_CONVERT_NOBOM;
+		else if (strcmp(value, "utf8") == 0)
+			clbtConfig.convert |= CLBT_CONVERT_UTF8;
+		else
+			return CLBT_INVALID_OP;
+		break;
+	case CLBT_CFG_SYNC:
+		clbt_path_set(&clbtConfig.syncDest, value, -1);
+		break;
+	case CLBT_CFG_EXEC:
+		return clbt_split_words(&clbtConfig.execArgs, value);
+	case CLBT_CFG_FIELDS:
+		return clbt_parse_fields(value);
+	case CLBT_CFG_SNAPSHOT:
+		clbt_path_set(&clbtConfig.snapshot, value, -1);
+		break;
+	case CLBT_CFG_DIFF:
+		clbt_path_set(&clbtConfig.diffBase, value, -1);
+		break;
+	case CLBT_CFG_INDEX:
+		if (strcmp(value, "build") == 0)
+			clbtConfig.index = CLBT_INDEX_BUILD;
+		else if (strcmp(value, "refresh") == 0)
+			clbtConfig.index = CLBT_INDEX_REFRESH;
+		else
+			return CLBT_INVALID_OP;
+		break;
+	case CLBT_CFG_INDEX_FILE:
+		clbt_path_set(&clbtConfig.indexFile, value, -1);
+		break;
+	case CLBT_CFG_SERVE:
+		clbt_path_set(&clbtConfig.serveSocket, value, -1);
+		break;
+	case CLBT_CFG_CONNECT:
+		clbt_path_set(&clbtConfig.connectSocket, value, -1);
+		break;
+	case CLBT_CFG_EXPR:
+		return clbt_set_expr(value);
+	case CLBT_CFG_TOP:
+		clbtConfig.top = atoi(value);
+		if (clbtConfig.top < 1)
+		{
+			clbtConfig.top = 0;
+			return CLBT_INVALID_OP;
+		}
+		break;
+	case CLBT_CFG_BY:
+		if (strcmp(value, "size") == 0)
+			clbtConfig.topBy = CLBT_TOP_SIZE;
+		else if (strcmp(value, "mtime") == 0)
+			clbtConfig.topBy = CLBT_TOP_MTIME;
+		else
+			return CLBT_INVALID_OP;
+		break;
+	case CLBT_CFG_STATS_BY:
+		if (strcmp(value, "ext") == 0)
+			clbtConfig.statsBy = CLBT_STATS_EXT;
+		else if (strcmp(value, "uid") == 0)
+			clbtConfig.statsBy = CLBT_STATS_UID;
+		else if (strcmp(value, "age") == 0)
+			clbtConfig.statsBy = CLBT_STATS_AGE;
+		else if (strcmp(value, "sizebucket") == 0)
+			clbtConfig.statsBy = CLBT_STATS_SIZE;
+		else
+			return CLBT_INVALID_OP;
+		break;
+	case CLBT_CFG_SORT:
+		if (strcmp(value, "name") == 0)
+			clbtConfig.sort = CLBT_SORT_NAME;
+		else if (strcmp(value, "natural") == 0)
+			clbtConfig.sort = CLBT_SORT_NATURAL;
+		else if (strcmp(value, "size") == 0)
+			clbtConfig.sort = CLBT_SORT_SIZE;
+		else if (strcmp(value, "mtime") == 0)
+			clbtConfig.sort = CLBT_SORT_MTIME;
+		else
+			return CLBT_INVALID_OP;
+		break;
+	default:
+		return CLBT_INVALID_OP;
 	}
 
-	clbt_exit_quiet_mode();
 	return CLBT_OK;
 }
 
+/*
+ * Match string against a wildcard pattern with '*' and '?'.
+ */
+int clbt_wildcard(const char* pattern, const char* str)
+{
+	const char* star = NULL;	/* last '*' seen in pattern */
+	const char* retry = NULL;	/* where str resumes after backtracking to star */
 
+	while (*str)
+	{
+#if CLBT_OS == 0
+		if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*str))
+#else
+		if (*pattern == '?' || *pattern == *str)
+#endif
+		{
+			pattern++;
+			str++;
+		}
+		else if (*pattern == '*')
+		{
+			star = pattern++;
+			retry = str;
+		}
+		else if (star)
+		{
+			pattern = star + 1;
+			str = ++retry;
+		}
+		else
+		{
+			return 0;
+		}
+	}
 
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == '\0';
+}
 
+/*
+ * Match a file name against input filename patterns, everything matches if none given.
+ */
+int clbt_match_patterns(const char* name)
+{
+	int i;
 
+	if (clbtConfig.patterns.size < 1)
+		return 1;
 
+	for (i = 0; i < clbtConfig.patterns.size; i++)
+	{
+		if (clbt_wildcard(clbtConfig.patterns.paths[i]->path, name))
+			return 1;
+	}
+	return 0;
+}
 
+/*------------------------------------------------------------------------------------------------------*/
+#if CLBT_OS == 1
+
+struct ClbtListTask
+{
+	CP* buffers;	/* per thread path buffer */
+	int threads;
+};
+
+/*
+ * Print the fields asked for, stat() only if one of them needs it, walker
+ * is only used to report a failed stat().
+ */
+void clbt_list_record(struct ClbtWalker* walker, struct ClbtEntry* entry, const char* path, int len, int tid)
+{
+	static const char* const types[] = { "unknown", "file", "dir", "link", "other" };
+	const char* field;
+	struct ClbtRecord r;
+	char mode[8];
+
+	if ((clbtConfig.fields & ~(CLBT_FIELD_PATH | CLBT_FIELD_NAME | CLBT_FIELD_TYPE)) && clbt_entry_stat(entry) != CLBT_OK)
+	{
+		clbt_error("Cannot stat '%s': %s", path, strerror(errno));
+		clbt_walk_failed(walker);
+		return;
+	}
+
+	clbt_record_begin(&r);
+	for (field = clbtConfig.fieldOrder; *field != '\0'; field++)
+	{
+		switch (1 << (*field - '0'))
+		{
+		case CLBT_FIELD_PATH:
+			clbt_record_string(&r, "path", path, len);
+			break;
+		case CLBT_FIELD_NAME:
+			clbt_record_string(&r, "name", entry->name, entry->namelen);
+			break;
+		case CLBT_FIELD_TYPE:
+			clbt_record_string(&r, "type", types[entry->type], strlen(types[entry->type]));
+			break;
+		case CLBT_FIELD_SIZE:
+			clbt_record_number(&r, "size", (unsigned long long)entry->st.st_size);
+			break;
+		case CLBT_FIELD_MTIME:
+			clbt_record_number(&r, "mtime", (unsigned long long)entry->st.st_mtime);
+			break;
+		case CLBT_FIELD_MODE:
+			sprintf(mode, "%04o", (unsigned)(entry->st.st_mode & 07777));
+			clbt_record_string(&r, "mode", mode, strlen(mode));
+			break;
+		case CLBT_FIELD_UID:
+			clbt_record_number(&r, "uid", (unsigned long long)entry->st.st_uid);
+			break;
+		case CLBT_FIELD_GID:
+			clbt_record_number(&r, "gid", (unsigned long long)entry->st.st_gid);
+			break;
+		case CLBT_FIELD_INO:
+			clbt_record_number(&r, "ino", (unsigned long long)entry->st.st_ino);
+			break;
+		}
+	}
+	clbt_record_end(&r, tid);
+}
+
+static int clbt_list_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtListTask* task = (struct ClbtListTask*)walker->user;
+	int len;
+
+	if (!clbt_out_enabled() || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	len = clbt_entry_path(entry, &task->buffers[tid]);
+	if (clbtConfig.fields == 0)
+		clbt_out_path(tid, task->buffers[tid].path, len);
+	else
+		clbt_list_record(walker, entry, task->buffers[tid].path, len, tid);
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtListOps = { clbt_list_on_entry, NULL, NULL, NULL };
+
+/*
+ * List files in targets.
+ */
+int clbt_task_list(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtListTask task;
+	int i, ret;
+
+	if (clbtConfig.connectSocket.path[0] != '\0')
+		return clbt_serve_ask(options);
+	if (options & CLBT_OPT_USEINDEX)
+		return clbt_index_list(options);
+	if (clbtConfig.sort != CLBT_SORT_NONE)
+		return clbt_list_sorted(options);
+
+	ret = clbt_walk_begin(&walker, &clbtListOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	task.threads = clbt_walk_threads(&walker);
+	task.buffers = (CP*)malloc(sizeof(CP) * task.threads);
+	if (task.buffers == NULL)
+	{
+		clbt_error("Unable to allocate memory for list task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < task.threads; i++)
+		clbt_path_init(&task.buffers[i]);
+	clbt_out_begin(task.threads);
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+	clbt_out_end();
+
+	for (i = 0; i < task.threads; i++)
+		clbt_path_destroy(&task.buffers[i]);
+	free(task.buffers);
+	return ret;
+}
+
+#else
+
+int clbt_task_list(int options)
+{
+	(void)options;
+	return clbt_unsupported("list");
+}
+
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/* 
+ * main entrance for clbt tasks
+ */
+int clbt_run(int options, int tasks)
+{
+	int ret = CLBT_OK;
+
+	clbt_set_quiet(options);
+	clbt_out_open(clbtQuiet ? NULL : stdOut, (options & CLBT_OPT_JSONL) ? CLBT_FORMAT_JSONL
+		: (options & CLBT_OPT_PRINT0) ? CLBT_FORMAT_NUL : CLBT_FORMAT_TEXT);
+
+	clbt_verbose(options, "Start execution...");
+
+	/* make sure config is initialized, default target is current directory */
+	clbt_config(-1, NULL);
+	if (clbtConfig.targets.size < 1 && (tasks & CLBT_TASK_DELETE))
+	{
+		/* never fall back to removing the working directory */
+		clbt_error("Delete needs explicit targets.");
+		ret = CLBT_INVALID_OP;
+	}
+	else if (clbtConfig.targets.size < 1)
+	{
+		CP cwd;
+		clbt_path_init(&cwd);
+		if (clbt_getcwd(&cwd) == CLBT_OK)
+			clbt_list_append(&clbtConfig.targets, cwd.path);
+		else
+			clbt_error("Unable to get current directory!");
+		clbt_path_destroy(&cwd);
+	}
+
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_INDEX))
+		ret = clbt_task_index(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_LIST))
+		ret = clbt_task_list(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_DELETE))
+		ret = clbt_task_delete(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_HASH))
+		ret = clbt_task_hash(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_DEDUPE))
+		ret = clbt_task_dedupe(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_MODIFY))
+		ret = clbt_task_modify(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_DU))
+		ret = clbt_task_du(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_TOP))
+		ret = clbt_task_top(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_STATS))
+		ret = clbt_task_stats(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_CONVERT))
+		ret = clbt_task_convert(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_SYNC))
+		ret = clbt_task_sync(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_EXEC))
+		ret = clbt_task_exec(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_SNAPSHOT))
+		ret = clbt_task_snapshot(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_DIFF))
+		ret = clbt_task_diff(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_SERVE))
+		ret = clbt_task_serve(options);
+	if (ret == CLBT_OK && (tasks & CLBT_TASK_WATCH))
+		ret = clbt_task_watch(options);
+
+	clbt_out_close();
+	clbt_exit_quiet_mode();
+	return ret;
+}
@@ -31,14 +31,40 @@ extern "C" {
 #define CLBT_FAILURE_OS		3
 
 /* Possible options for CLBT */
-enum { CLBT_OPT_DEFAULT = 0, CLBT_OPT_QUIET = 1, CLBT_OPT_VERBOSE = 2, CLBT_OPT_RECURSIVE = 4, CLBT_OPT_FORCE = 8 };
+enum { CLBT_OPT_DEFAULT = 0, CLBT_OPT_QUIET = 1, CLBT_OPT_VERBOSE = 2, CLBT_OPT_RECURSIVE = 4, CLBT_OPT_FORCE = 8, CLBT_OPT_REGEX = 16, CLBT_OPT_VERIFY = 32, CLBT_OPT_COPROC = 64, CLBT_OPT_NULL = 128, CLBT_OPT_KEEPORDER = 256, CLBT_OPT_PRINT0 = 512, CLBT_OPT_JSONL = 1024, CLBT_OPT_USEINDEX = 2048, CLBT_OPT_STAT = 4096 };
 /* Possible tasks for CLBT */
-enum { CLBT_TASK_DEFAULT = 0, CLBT_TASK_LIST = 1, CLBT_TASK_RENAME = 2 };
+enum { CLBT_TASK_DEFAULT = 0, CLBT_TASK_LIST = 1, CLBT_TASK_RENAME = 2, CLBT_TASK_DELETE = 4, CLBT_TASK_HASH = 8, CLBT_TASK_DEDUPE = 16, CLBT_TASK_MODIFY = 32, CLBT_TASK_DU = 64, CLBT_TASK_CONVERT = 128, CLBT_TASK_SYNC = 256, CLBT_TASK_EXEC = 512, CLBT_TASK_SNAPSHOT = 1024, CLBT_TASK_DIFF = 2048, CLBT_TASK_INDEX = 4096, CLBT_TASK_WATCH = 8192, CLBT_TASK_SERVE = 16384, CLBT_TASK_TOP = 32768, CLBT_TASK_STATS = 65536 };
+/* Possible config keys for CLBT */
+enum { CLBT_CFG_TARGET = 0, CLBT_CFG_PATTERN = 1, CLBT_CFG_JOBS = 2, CLBT_CFG_HASH = 3, CLBT_CFG_LINK = 4, CLBT_CFG_SEARCH = 5, CLBT_CFG_REPLACE = 6, CLBT_CFG_LIMIT = 7, CLBT_CFG_CONVERT = 8, CLBT_CFG_SYNC = 9, CLBT_CFG_EXEC = 10, CLBT_CFG_FIELDS = 11, CLBT_CFG_SNAPSHOT = 12, CLBT_CFG_DIFF = 13, CLBT_CFG_INDEX = 14, CLBT_CFG_INDEX_FILE = 15, CLBT_CFG_SERVE = 16, CLBT_CFG_CONNECT = 17, CLBT_CFG_EXPR = 18, CLBT_CFG_TOP = 19, CLBT_CFG_BY = 20, CLBT_CFG_STATS_BY = 21, CLBT_CFG_SORT = 22 };
 
+/* Entry types reported by the walker */
+enum { CLBT_TYPE_UNKNOWN = 0, CLBT_TYPE_FILE = 1, CLBT_TYPE_DIR = 2, CLBT_TYPE_LINK = 3, CLBT_TYPE_OTHER = 4 };
+
+/* One entry of clbt_walk_next(), borrowed from the walk until the next call */
+struct ClbtWalkEntry
+{
+	const char* path;			/* full path */
+	int length;					/* strlen of path */
+	const char* name;			/* last component, inside path */
+	int type;					/* CLBT_TYPE_XXX */
+	int depth;					/* 1 below a root directory, 0 for a root that is a file */
+	int hasStat;				/* size, mtime and mode are valid */
+	unsigned long long size;
+	long long mtime;			/* nanoseconds since the epoch */
+	unsigned int mode;			/* st_mode */
+};
+
+struct ClbtWalkIter;
 
 /* CLBT functions */
+int clbt_config(int key, const char* value);
 int clbt_run(int options, int tasks);
 
+/* Walk for embedding, see clbt_iter.c */
+struct ClbtWalkIter* clbt_walk_open(const char* root, int options);
+int clbt_walk_next(struct ClbtWalkIter* it, const struct ClbtWalkEntry** entry);
+int clbt_walk_close(struct ClbtWalkIter* it);
+
 #ifdef __cplusplus
 }
 #endif
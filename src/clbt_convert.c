@@ -0,0 +1,642 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_convert.c
+ *
+ *   Description:
+ *
+ *   Line ending and text encoding conversion task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CLBT_CONVERT_BLOCK	(256 << 10)	/* bytes per read */
+
+/*
+ * Every file is scanned first, read only. Most of a tree is usually fine
+ * already, so the scan skips 16 byte blocks with SSE2 unless they hold a NUL,
+ * a line ending to change or, when UTF-8 validity matters, a byte above 0x7F,
+ * and stops as soon as the outcome is known. Only files that really change
+ * get a temporary file, the unchanged prefix is copied by the kernel and the
+ * rest converted.
+ *
+ * Files with a NUL byte are binary and left alone. UTF-16 is recognized by
+ * its BOM. With --to-utf8 a file without BOM that is not valid UTF-8 is
+ * taken as Latin-1.
+ */
+enum { CLBT_ENC_UTF8, CLBT_ENC_LATIN1, CLBT_ENC_UTF16LE, CLBT_ENC_UTF16BE };
+
+/* results of one file */
+enum { CLBT_CONVERT_FAILED = -1, CLBT_CONVERT_SAME = 0, CLBT_CONVERT_DONE = 1, CLBT_CONVERT_BINARY = 2 };
+
+struct ClbtUtf8Check
+{
+	int need;					/* continuation bytes still expected */
+	unsigned char lo, hi;		/* range of the next continuation byte */
+	int invalid;
+};
+
+struct ClbtConvertScan
+{
+	int flags;					/* CLBT_CONVERT_XXX */
+	int encoding;
+	int bom;					/* bytes of BOM at the start */
+	int binary;
+	int prevCR;
+	off_t first;				/* first byte that changes, -1 if none */
+	struct ClbtUtf8Check utf8;
+};
+
+struct ClbtConvertWorker
+{
+	unsigned char* in;
+	unsigned char* mid;			/* decoded UTF-8 */
+	unsigned char* out;			/* with converted line endings */
+	CP tmp;
+	struct ClbtDeferred deferred;
+};
+
+struct ClbtConvertTask
+{
+	int flags;
+	struct ClbtConvertWorker* workers;	/* per thread */
+	unsigned long scanned;		/* atomic */
+	unsigned long converted;	/* atomic */
+	unsigned long binary;		/* atomic */
+};
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_utf8_check(struct ClbtUtf8Check* u, unsigned char c)
+{
+	if (u->need == 0)
+	{
+		if (c < 0x80)
+			return;
+		if (c >= 0xC2 && c <= 0xDF)
+		{
+			u->need = 1;
+			u->lo = 0x80;
+			u->hi = 0xBF;
+		}
+		else if (c >= 0xE0 && c <= 0xEF)
+		{
+			u->need = 2;
+			u->lo = c == 0xE0 ? 0xA0 : 0x80;
+			u->hi = c == 0xED ? 0x9F : 0xBF;
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			u->need = 3;
+			u->lo = c == 0xF0 ? 0x90 : 0x80;
+			u->hi = c == 0xF4 ? 0x8F : 0xBF;
+		}
+		else
+		{
+			u->invalid = 1;
+		}
+		return;
+	}
+
+	if (c < u->lo || c > u->hi)
+	{
+		u->invalid = 1;
+		return;
+	}
+	u->need--;
+	u->lo = 0x80;
+	u->hi = 0xBF;
+}
+
+static void clbt_convert_mark(struct ClbtConvertScan* s, off_t offset)
+{
+	if (s->first < 0 || offset < s->first)
+		s->first = offset;
+}
+
+static void clbt_convert_scan_byte(struct ClbtConvertScan* s, unsigned char c, off_t offset)
+{
+	if (c == 0)
+	{
+		s->binary = 1;
+		return;
+	}
+
+	if (c == '\n')
+	{
+		if ((s->flags & CLBT_CONVERT_LF) && s->prevCR)
+			clbt_convert_mark(s, offset - 1);
+		else if ((s->flags & CLBT_CONVERT_CRLF) && !s->prevCR)
+			clbt_convert_mark(s, offset);
+	}
+
+	if ((s->flags & CLBT_CONVERT_UTF8) && !s->utf8.invalid && (c >= 0x80 || s->utf8.need > 0))
+		clbt_utf8_check(&s->utf8, c);
+	s->prevCR = c == '\r';
+}
+
+/*
+ * Scan one chunk of a UTF-8 or unknown 8 bit file at offset base.
+ */
+static void clbt_convert_scan_chunk(struct ClbtConvertScan* s, const unsigned char* p, size_t n, off_t base)
+{
+	size_t i = 0, end;
+#if defined(__SSE2__)
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	int high = (s->flags & CLBT_CONVERT_UTF8) && !s->utf8.invalid;
+	__m128i v;
+	int mask, crs, lfs;
+#endif
+
+	while (i < n && !s->binary)
+	{
+		end = n - i < 16 ? n : i + 16;
+
+#if defined(__SSE2__)
+		/* nothing that may change in the block, and no sequence to finish */
+		if (end - i == 16 && s->utf8.need == 0)
+		{
+			v = _mm_loadu_si128((const __m128i*)(p + i));
+			crs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+			lfs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+			if (high)
+				mask |= _mm_movemask_epi8(v);
+			if (s->flags & CLBT_CONVERT_LF)
+				mask |= crs | (lfs & s->prevCR);
+			if (s->flags & CLBT_CONVERT_CRLF)
+				mask |= lfs & ~((crs << 1) | s->prevCR);
+			if (mask == 0)
+			{
+				s->prevCR = (crs >> 15) & 1;
+				i = end;
+				continue;
+			}
+		}
+#endif
+
+		for (; i < end; i++)
+			clbt_convert_scan_byte(s, p[i], base + (off_t)i);
+	}
+}
+
+/*
+ * Decide whether and from where a file changes.
+ */
+static int clbt_convert_scan(struct ClbtConvertScan* s, int fd, unsigned char* buf)
+{
+	off_t base = 0;
+	ssize_t n;
+
+	s->encoding = CLBT_ENC_UTF8;
+	s->bom = 0;
+	s->binary = 0;
+	s->prevCR = 0;
+	s->first = -1;
+	memset(&s->utf8, 0, sizeof(s->utf8));
+
+	while ((n = clbt_read_full(fd, buf, CLBT_CONVERT_BLOCK, -1)) > 0)
+	{
+		if (base == 0)
+		{
+			if (n >= 3 && buf[0] == 0xEF && buf[1] == 0xBB && buf[2] == 0xBF)
+			{
+				s->bom = 3;
+				if (s->flags & CLBT_CONVERT_NOBOM)
+					clbt_convert_mark(s, 0);
+			}
+			else if (n >= 2 && ((buf[0] == 0xFF && buf[1] == 0xFE) || (buf[0] == 0xFE && buf[1] == 0xFF)))
+			{
+				/* bytes of UTF-16 mean nothing on their own, transcode or leave alone */
+				s->encoding = buf[0] == 0xFF ? CLBT_ENC_UTF16LE : CLBT_ENC_UTF16BE;
+				s->bom = 2;
+				if (!(s->flags & CLBT_CONVERT_UTF8))
+					return CLBT_CONVERT_SAME;
+				s->first = 0;
+				return CLBT_CONVERT_DONE;
+			}
+		}
+
+		clbt_convert_scan_chunk(s, buf, (size_t)n, base);
+		base += n;
+		if (s->binary)
+			return CLBT_CONVERT_BINARY;
+
+		/* validity of UTF-8 is only known at the end */
+		if (s->first >= 0 && (!(s->flags & CLBT_CONVERT_UTF8) || s->utf8.invalid))
+			break;
+		if (n < CLBT_CONVERT_BLOCK)
+			break;
+	}
+	if (n < 0)
+		return CLBT_CONVERT_FAILED;
+
+	if ((s->flags & CLBT_CONVERT_UTF8) && s->bom == 0 && (s->utf8.invalid || s->utf8.need > 0))
+	{
+		s->encoding = CLBT_ENC_LATIN1;
+		s->first = 0;
+	}
+	return s->first >= 0 ? CLBT_CONVERT_DONE : CLBT_CONVERT_SAME;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static unsigned char* clbt_convert_put(unsigned char* q, unsigned long cp)
+{
+	if (cp < 0x80)
+	{
+		*q++ = (unsigned char)cp;
+	}
+	else if (cp < 0x800)
+	{
+		*q++ = (unsigned char)(0xC0 | (cp >> 6));
+		*q++ = (unsigned char)(0x80 | (cp & 0x3F));
+	}
+	else if (cp < 0x10000)
+	{
+		*q++ = (unsigned char)(0xE0 | (cp >> 12));
+		*q++ = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+		*q++ = (unsigned char)(0x80 | (cp & 0x3F));
+	}
+	else
+	{
+		*q++ = (unsigned char)(0xF0 | (cp >> 18));
+		*q++ = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+		*q++ = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+		*q++ = (unsigned char)(0x80 | (cp & 0x3F));
+	}
+	return q;
+}
+
+/* state carried between chunks while converting */
+struct ClbtConvertState
+{
+	int encoding;
+	int flags;
+	int odd;					/* UTF-16: a byte of the next unit is pending */
+	unsigned char oddByte;
+	unsigned long high;			/* UTF-16: pending high surrogate, 0 if none */
+	int pendingCR;				/* LF: a CR held back until the next byte is known */
+	int prevCR;					/* CRLF: last byte written was CR */
+};
+
+/*
+ * Decode n input bytes to UTF-8, flush any incomplete unit when last.
+ */
+static size_t clbt_convert_decode(struct ClbtConvertState* c, const unsigned char* p, size_t n, unsigned char* out, int last)
+{
+	unsigned char* q = out;
+	unsigned long unit;
+	size_t i;
+
+	if (c->encoding == CLBT_ENC_UTF8)
+	{
+		memcpy(out, p, n);
+		return n;
+	}
+
+	if (c->encoding == CLBT_ENC_LATIN1)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (p[i] < 0x80)
+			{
+				*q++ = p[i];
+			}
+			else
+			{
+				*q++ = (unsigned char)(0xC0 | (p[i] >> 6));
+				*q++ = (unsigned char)(0x80 | (p[i] & 0x3F));
+			}
+		}
+		return q - out;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (!c->odd)
+		{
+			c->oddByte = p[i];
+			c->odd = 1;
+			continue;
+		}
+		c->odd = 0;
+		unit = c->encoding == CLBT_ENC_UTF16LE ? (unsigned long)c->oddByte | ((unsigned long)p[i] << 8)
+			: ((unsigned long)c->oddByte << 8) | p[i];
+
+		if (c->high != 0)
+		{
+			if (unit >= 0xDC00 && unit <= 0xDFFF)
+			{
+				q = clbt_convert_put(q, 0x10000 + ((c->high - 0xD800) << 10) + (unit - 0xDC00));
+				c->high = 0;
+				continue;
+			}
+			q = clbt_convert_put(q, 0xFFFD);
+			c->high = 0;
+		}
+
+		if (unit >= 0xD800 && unit <= 0xDBFF)
+			c->high = unit;
+		else if (unit >= 0xDC00 && unit <= 0xDFFF)
+			q = clbt_convert_put(q, 0xFFFD);
+		else
+			q = clbt_convert_put(q, unit);
+	}
+
+	if (last && (c->odd || c->high != 0))
+	{
+		q = clbt_convert_put(q, 0xFFFD);
+		c->odd = 0;
+		c->high = 0;
+	}
+	return q - out;
+}
+
+/*
+ * Rewrite line endings of n UTF-8 bytes into out.
+ */
+static size_t clbt_convert_eol(struct ClbtConvertState* c, const unsigned char* p, size_t n, unsigned char* out, int last)
+{
+	const unsigned char* end = p + n;
+	const unsigned char* hit;
+	unsigned char* q = out;
+
+	if (c->flags & CLBT_CONVERT_LF)
+	{
+		while (p < end)
+		{
+			if (c->pendingCR)
+			{
+				c->pendingCR = 0;
+				if (*p != '\n')
+					*q++ = '\r';
+			}
+			hit = (const unsigned char*)memchr(p, '\r', end - p);
+			if (hit == NULL)
+				hit = end;
+			memcpy(q, p, hit - p);
+			q += hit - p;
+			p = hit;
+			if (p < end)
+			{
+				c->pendingCR = 1;
+				p++;
+			}
+		}
+		if (last && c->pendingCR)
+		{
+			*q++ = '\r';
+			c->pendingCR = 0;
+		}
+	}
+	else if (c->flags & CLBT_CONVERT_CRLF)
+	{
+		while (p < end)
+		{
+			hit = (const unsigned char*)memchr(p, '\n', end - p);
+			if (hit == NULL)
+				hit = end;
+			memcpy(q, p, hit - p);
+			q += hit - p;
+			if (hit > p)
+				c->prevCR = hit[-1] == '\r';
+			p = hit;
+			if (p < end)
+			{
+				if (!c->prevCR)
+					*q++ = '\r';
+				*q++ = '\n';
+				c->prevCR = 0;
+				p++;
+			}
+		}
+	}
+	else
+	{
+		memcpy(q, p, n);
+		q += n;
+	}
+	return q - out;
+}
+
+/*
+ * Scan and, if needed, convert one file.
+ */
+static int clbt_convert_file(struct ClbtConvertTask* task, struct ClbtConvertWorker* w, int dirfd, const char* name, int tid)
+{
+	struct ClbtConvertScan scan;
+	struct ClbtConvertState state;
+	struct stat st;
+	off_t offset;
+	ssize_t n;
+	size_t len;
+	int fd, out, ret;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return CLBT_CONVERT_FAILED;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	scan.flags = task->flags;
+	ret = clbt_convert_scan(&scan, fd, w->in);
+	if (ret != CLBT_CONVERT_DONE)
+	{
+		close(fd);
+		return ret;
+	}
+
+	out = clbt_replace_begin(dirfd, name, &w->tmp, tid);
+	if (out < 0)
+	{
+		close(fd);
+		return CLBT_CONVERT_FAILED;
+	}
+
+	/* the BOM goes away when stripped or when leaving UTF-16 */
+	memset(&state, 0, sizeof(state));
+	state.encoding = scan.encoding;
+	state.flags = task->flags;
+	offset = scan.first;
+	if (offset == 0 && (scan.encoding != CLBT_ENC_UTF8 || (task->flags & CLBT_CONVERT_NOBOM)))
+		offset = scan.bom;
+
+	ret = clbt_copy_prefix(fd, out, scan.first, w->in, CLBT_CONVERT_BLOCK) == CLBT_OK ? CLBT_CONVERT_DONE : CLBT_CONVERT_FAILED;
+	while (ret == CLBT_CONVERT_DONE)
+	{
+		n = clbt_read_full(fd, w->in, CLBT_CONVERT_BLOCK, offset);
+		if (n < 0)
+		{
+			ret = CLBT_CONVERT_FAILED;
+			break;
+		}
+		offset += n;
+
+		len = clbt_convert_decode(&state, w->in, (size_t)n, w->mid, n < CLBT_CONVERT_BLOCK);
+		if (memchr(w->mid, 0, len) != NULL)
+		{
+			ret = CLBT_CONVERT_BINARY;
+			break;
+		}
+		len = clbt_convert_eol(&state, w->mid, len, w->out, n < CLBT_CONVERT_BLOCK);
+		if (clbt_write_full(out, w->out, len) != CLBT_OK)
+			ret = CLBT_CONVERT_FAILED;
+		if (n < CLBT_CONVERT_BLOCK)
+			break;
+	}
+	close(fd);
+
+	/* binary content found past the scan, keep the original */
+	if (clbt_replace_commit(dirfd, name, &w->tmp, out, &st, ret == CLBT_CONVERT_DONE) != CLBT_OK && ret == CLBT_CONVERT_DONE)
+		ret = CLBT_CONVERT_FAILED;
+	return ret;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_convert_report(struct ClbtWalker* walker, int ret, const char* dir, const char* name)
+{
+	struct ClbtConvertTask* task = (struct ClbtConvertTask*)walker->user;
+	struct ClbtRecord r;
+
+	clbt_atomic_add(&task->scanned, 1);
+	if (ret == CLBT_CONVERT_DONE)
+	{
+		clbt_atomic_add(&task->converted, 1);
+		clbt_record_begin(&r);
+		if (dir)
+			clbt_record_join(&r, "path", dir, name);
+		else
+			clbt_record_string(&r, "path", name, strlen(name));
+		clbt_record_end(&r, -1);
+	}
+	else if (ret == CLBT_CONVERT_BINARY)
+	{
+		clbt_atomic_add(&task->binary, 1);
+	}
+	else if (ret == CLBT_CONVERT_FAILED)
+	{
+		clbt_error("Cannot convert '%s%s%s': %s", dir ? dir : "", dir ? "/" : "", name, strerror(errno));
+		clbt_walk_failed(walker);
+	}
+}
+
+static void clbt_convert_one(struct ClbtWalker* walker, int dirfd, const char* dir, const char* name, int tid)
+{
+	struct ClbtConvertTask* task = (struct ClbtConvertTask*)walker->user;
+
+	clbt_convert_report(walker, clbt_convert_file(task, &task->workers[tid], dirfd, name, tid), dir, name);
+}
+
+static int clbt_convert_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtConvertTask* task = (struct ClbtConvertTask*)walker->user;
+
+	if (entry->type == CLBT_TYPE_FILE && clbt_match_entry(entry))
+		clbt_defer_file(walker, entry, &task->workers[tid].deferred, clbt_convert_one, tid);
+	return CLBT_WALK_CONTINUE;
+}
+
+static void clbt_convert_on_dir_end(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid)
+{
+	struct ClbtConvertTask* task = (struct ClbtConvertTask*)walker->user;
+
+	clbt_defer_run(walker, dir, dirfd, &task->workers[tid].deferred, clbt_convert_one, tid);
+}
+
+static const struct ClbtWalkOps clbtConvertOps = { clbt_convert_on_entry, clbt_convert_on_dir_end, NULL, NULL };
+
+/*
+ * Normalize line endings, BOM and encoding of matching files, prints the
+ * path of every converted file.
+ */
+int clbt_task_convert(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtConvertTask task;
+	int i, ret, threads;
+
+	memset(&task, 0, sizeof(task));
+	task.flags = clbtConfig.convert;
+
+	if (!clbt_confirm(options, "Convert matching files in %d target(s)?", clbtConfig.targets.size))
+		return CLBT_OK;
+
+	ret = clbt_walk_begin(&walker, &clbtConvertOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	threads = clbt_walk_threads(&walker);
+	task.workers = (struct ClbtConvertWorker*)calloc(threads, sizeof(struct ClbtConvertWorker));
+	if (task.workers == NULL)
+	{
+		clbt_error("Unable to allocate memory for convert task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		/* Latin-1 doubles at most, CRLF doubles again */
+		task.workers[i].in = (unsigned char*)malloc(CLBT_CONVERT_BLOCK);
+		task.workers[i].mid = (unsigned char*)malloc(CLBT_CONVERT_BLOCK * 2 + 8);
+		task.workers[i].out = (unsigned char*)malloc(CLBT_CONVERT_BLOCK * 4 + 16);
+		if (task.workers[i].in == NULL || task.workers[i].mid == NULL || task.workers[i].out == NULL)
+		{
+			clbt_error("Unable to allocate memory for convert task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		clbt_path_init(&task.workers[i].tmp);
+	}
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+	clbt_verbose(options, "Converted %lu of %lu file(s), %lu binary file(s) skipped.", task.converted, task.scanned, task.binary);
+
+	for (i = 0; i < threads; i++)
+	{
+		free(task.workers[i].in);
+		free(task.workers[i].mid);
+		free(task.workers[i].out);
+		free(task.workers[i].deferred.names);
+		clbt_path_destroy(&task.workers[i].tmp);
+	}
+	free(task.workers);
+	return ret;
+}
+
+#else
+
+int clbt_task_convert(int options)
+{
+	(void)options;
+	return clbt_unsupported("convert");
+}
+
+#endif
@@ -0,0 +1,588 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_dedupe.c
+ *
+ *   Description:
+ *
+ *   Staged duplicate file finder for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#define CLBT_DEDUPE_EDGE	4096		/* bytes hashed at each end in the partial stage */
+#define CLBT_DEDUPE_BLOCK	(1 << 20)	/* bytes per read in the full stage */
+#define CLBT_DEDUPE_BATCH	64			/* files per hashing job */
+
+/*
+ * Duplicates are narrowed down in stages, each one only looks at survivors of
+ * the previous one:
+ *   1. size from the walk, unique sizes are dropped without any read
+ *   2. hash of the first and last 4 KiB
+ *   3. hash of the whole content
+ * Files not larger than two edges are fully read in stage 2 already.
+ * Before a duplicate is replaced by a link it is compared byte by byte to
+ * the file kept, and both must still be what the walk saw.
+ */
+struct ClbtDupeFile
+{
+	char* path;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int failed;
+	int complete;				/* partial hash covered the whole content */
+	unsigned char partial[CLBT_DIGEST_MAX];
+	unsigned char full[CLBT_DIGEST_MAX];
+};
+
+struct ClbtDupeArray
+{
+	struct ClbtDupeFile* items;
+	int size;
+	int capacity;
+};
+
+struct ClbtDupeTask
+{
+	struct ClbtDupeArray* found;	/* per thread files found by the walk */
+	CP* buffers;					/* per thread path buffer */
+	struct ClbtDupeFile** files;	/* candidates of the current stage */
+	int count;
+	int stage;						/* 2 or 3 */
+	unsigned char** blocks;			/* per thread read buffer */
+	unsigned long long bytesRead;	/* atomic */
+	unsigned long errors;			/* atomic */
+};
+
+struct ClbtDupeJob
+{
+	struct ClbtDupeTask* task;
+	int begin;
+	int end;
+};
+
+static void clbt_dedupe_append(struct ClbtDupeArray* array, const struct ClbtDupeFile* file)
+{
+	struct ClbtDupeFile* items;
+
+	if (array->size == array->capacity)
+	{
+		array->capacity = array->capacity * 2 + 64;
+		items = (struct ClbtDupeFile*)realloc(array->items, sizeof(struct ClbtDupeFile) * array->capacity);
+		if (items == NULL)
+		{
+			clbt_error("Unable to allocate memory for dedupe task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		array->items = items;
+	}
+	array->items[array->size++] = *file;
+}
+
+static int clbt_dedupe_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtDupeTask* task = (struct ClbtDupeTask*)walker->user;
+	struct ClbtDupeFile file;
+
+	if (entry->type != CLBT_TYPE_FILE || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	clbt_entry_path(entry, &task->buffers[tid]);
+	if (clbt_entry_stat(entry) != CLBT_OK)
+	{
+		clbt_error("Cannot stat '%s': %s", task->buffers[tid].path, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	/* empty files carry no data worth deduplicating */
+	if (!S_ISREG(entry->st.st_mode) || entry->st.st_size == 0)
+		return CLBT_WALK_CONTINUE;
+
+	memset(&file, 0, sizeof(file));
+	file.path = strdup(task->buffers[tid].path);
+	if (file.path == NULL)
+	{
+		clbt_error("Unable to allocate memory for dedupe task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	file.size = entry->st.st_size;
+	file.dev = entry->st.st_dev;
+	file.ino = entry->st.st_ino;
+	file.mtime = entry->st.st_mtim;
+	clbt_dedupe_append(&task->found[tid], &file);
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtDedupeOps = { clbt_dedupe_on_entry, NULL, NULL, NULL };
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_dedupe_hash(struct ClbtDupeTask* task, struct ClbtDupeFile* file, unsigned char* block)
+{
+	struct ClbtDigest digest;
+	unsigned long long bytes = 0;
+	ssize_t n, want;
+	int fd;
+
+	fd = clbt_open_read(file->path, task->stage == 3);
+	if (fd < 0)
+	{
+		clbt_error("Cannot open '%s': %s", file->path, strerror(errno));
+		file->failed = 1;
+		clbt_atomic_add(&task->errors, 1);
+		return;
+	}
+
+	clbt_digest_init(&digest, CLBT_DIGEST_BLAKE3);
+	if (task->stage == 2 && file->size > 2 * CLBT_DEDUPE_EDGE)
+	{
+		n = clbt_read_full(fd, block, CLBT_DEDUPE_EDGE, 0);
+		if (n == CLBT_DEDUPE_EDGE)
+		{
+			clbt_digest_update(&digest, block, n);
+			bytes += n;
+			n = clbt_read_full(fd, block, CLBT_DEDUPE_EDGE, file->size - CLBT_DEDUPE_EDGE);
+		}
+		if (n == CLBT_DEDUPE_EDGE)
+		{
+			clbt_digest_update(&digest, block, n);
+			bytes += n;
+		}
+		else
+		{
+			n = -1;
+		}
+	}
+	else
+	{
+		/* whole content, either the full stage or a file no larger than both edges */
+		do
+		{
+			want = CLBT_DEDUPE_BLOCK;
+			n = clbt_read_full(fd, block, want, -1);
+			if (n > 0)
+			{
+				clbt_digest_update(&digest, block, n);
+				bytes += n;
+			}
+		} while (n == want);
+		if (n >= 0 && (off_t)bytes != file->size)
+			n = -1;
+		file->complete = 1;
+	}
+	close(fd);
+	clbt_atomic_add(&task->bytesRead, bytes);
+
+	if (n < 0)
+	{
+		clbt_error("Cannot read '%s' or it changed during scan.", file->path);
+		file->failed = 1;
+		clbt_atomic_add(&task->errors, 1);
+		return;
+	}
+
+	if (task->stage == 2)
+		clbt_digest_final(&digest, file->partial);
+	else
+		clbt_digest_final(&digest, file->full);
+	if (task->stage == 2 && file->complete)
+		memcpy(file->full, file->partial, CLBT_DIGEST_MAX);
+}
+
+static void clbt_dedupe_job(void* arg, int tid)
+{
+	struct ClbtDupeJob* job = (struct ClbtDupeJob*)arg;
+	struct ClbtDupeTask* task = job->task;
+	int i;
+
+	if (task->blocks[tid] == NULL && (task->blocks[tid] = (unsigned char*)malloc(CLBT_DEDUPE_BLOCK)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for dedupe task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	for (i = job->begin; i < job->end; i++)
+	{
+		/* small files were fully hashed in the partial stage */
+		if (task->stage == 3 && task->files[i]->complete)
+			continue;
+		clbt_dedupe_hash(task, task->files[i], task->blocks[tid]);
+	}
+	free(job);
+}
+
+static void clbt_dedupe_stage(struct ClbtDupeTask* task, struct ClbtPool* pool, int stage)
+{
+	struct ClbtDupeJob* job;
+	int i;
+
+	task->stage = stage;
+	for (i = 0; i < task->count; i += CLBT_DEDUPE_BATCH)
+	{
+		job = (struct ClbtDupeJob*)malloc(sizeof(struct ClbtDupeJob));
+		if (job == NULL)
+		{
+			clbt_error("Unable to allocate memory for dedupe task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		job->task = task;
+		job->begin = i;
+		job->end = i + CLBT_DEDUPE_BATCH < task->count ? i + CLBT_DEDUPE_BATCH : task->count;
+		clbt_pool_submit(pool, clbt_dedupe_job, job);
+	}
+	clbt_pool_wait(pool);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static int clbt_dedupe_cmp_size(const void* a, const void* b)
+{
+	const struct ClbtDupeFile* x = *(const struct ClbtDupeFile* const*)a;
+	const struct ClbtDupeFile* y = *(const struct ClbtDupeFile* const*)b;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return strcmp(x->path, y->path);
+}
+
+static int clbt_dedupe_cmp_partial(const void* a, const void* b)
+{
+	const struct ClbtDupeFile* x = *(const struct ClbtDupeFile* const*)a;
+	const struct ClbtDupeFile* y = *(const struct ClbtDupeFile* const*)b;
+	int c;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	c = memcmp(x->partial, y->partial, CLBT_DIGEST_MAX);
+	return c != 0 ? c : strcmp(x->path, y->path);
+}
+
+static int clbt_dedupe_cmp_full(const void* a, const void* b)
+{
+	const struct ClbtDupeFile* x = *(const struct ClbtDupeFile* const*)a;
+	const struct ClbtDupeFile* y = *(const struct ClbtDupeFile* const*)b;
+	int c;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	c = memcmp(x->full, y->full, CLBT_DIGEST_MAX);
+	return c != 0 ? c : strcmp(x->path, y->path);
+}
+
+static int clbt_dedupe_same(const struct ClbtDupeFile* x, const struct ClbtDupeFile* y, int stage)
+{
+	if (x->size != y->size)
+		return 0;
+	if (stage == 2)
+		return memcmp(x->partial, y->partial, CLBT_DIGEST_MAX) == 0;
+	if (stage == 3)
+		return memcmp(x->full, y->full, CLBT_DIGEST_MAX) == 0;
+	return 1;
+}
+
+/*
+ * Sort candidates by the key of a stage and keep only groups of two or more.
+ */
+static void clbt_dedupe_filter(struct ClbtDupeTask* task, int stage)
+{
+	int i, j, kept = 0;
+
+	/* failed files drop out of every later stage */
+	for (i = 0; i < task->count; i++)
+	{
+		if (!task->files[i]->failed)
+			task->files[kept++] = task->files[i];
+	}
+	task->count = kept;
+
+	qsort(task->files, task->count, sizeof(struct ClbtDupeFile*),
+		stage == 1 ? clbt_dedupe_cmp_size : (stage == 2 ? clbt_dedupe_cmp_partial : clbt_dedupe_cmp_full));
+
+	kept = 0;
+	for (i = 0; i < task->count; i = j)
+	{
+		for (j = i + 1; j < task->count && clbt_dedupe_same(task->files[i], task->files[j], stage); j++);
+		if (j - i < 2)
+			continue;
+		memmove(task->files + kept, task->files + i, sizeof(struct ClbtDupeFile*) * (j - i));
+		kept += j - i;
+	}
+	task->count = kept;
+}
+
+/*
+ * Hard links to one inode already share their data, keep one path per inode.
+ */
+static void clbt_dedupe_unique_inodes(struct ClbtDupeTask* task)
+{
+	int i, kept = 0;
+
+	qsort(task->files, task->count, sizeof(struct ClbtDupeFile*), clbt_dedupe_cmp_size);
+	for (i = 0; i < task->count; i++)
+	{
+		if (kept > 0 && task->files[kept - 1]->dev == task->files[i]->dev && task->files[kept - 1]->ino == task->files[i]->ino)
+			continue;
+		task->files[kept++] = task->files[i];
+	}
+	task->count = kept;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * The file behind fd, or at path if fd < 0, is still what the walk saw.
+ */
+static int clbt_dedupe_unchanged(const struct ClbtDupeFile* file, int fd, struct stat* st)
+{
+	if ((fd >= 0 ? fstat(fd, st) : lstat(file->path, st)) != 0)
+		return 0;
+	return st->st_dev == file->dev && st->st_ino == file->ino && st->st_size == file->size
+		&& st->st_mtim.tv_sec == file->mtime.tv_sec && st->st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+/*
+ * Compare two open files of equal size byte by byte, block holds two reads.
+ */
+static int clbt_dedupe_compare(int a, int b, off_t size, unsigned char* block)
+{
+	const size_t half = CLBT_DEDUPE_BLOCK / 2;
+	off_t offset;
+	ssize_t na, nb;
+
+	for (offset = 0; offset < size; offset += na)
+	{
+		na = clbt_read_full(a, block, half, offset);
+		nb = clbt_read_full(b, block + half, half, offset);
+		if (na <= 0 || na != nb || memcmp(block, block + half, na) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Replace dup by a link to keep, through a temporary name in the same directory.
+ */
+static int clbt_dedupe_link(const struct ClbtDupeFile* keep, const struct ClbtDupeFile* dup, int mode, unsigned char* block)
+{
+	CP tmp;
+	struct stat keepSt, dupSt, now;
+	int in, src, dst, err, ok = 0;
+
+	if (keep->dev != dup->dev)
+	{
+		clbt_warning("Skip '%s', not on the same device as '%s'.", dup->path, keep->path);
+		return CLBT_INVALID_OP;
+	}
+
+	/* equal hashes are not proof enough to drop data */
+	src = clbt_open_read(keep->path, 1);
+	in = clbt_open_read(dup->path, 1);
+	if (src < 0 || in < 0 || !clbt_dedupe_unchanged(keep, src, &keepSt) || !clbt_dedupe_unchanged(dup, in, &dupSt)
+		|| !clbt_dedupe_compare(src, in, keep->size, block))
+	{
+		clbt_warning("Skip '%s', it or '%s' changed since the scan.", dup->path, keep->path);
+		if (src >= 0)
+			close(src);
+		if (in >= 0)
+			close(in);
+		return CLBT_INVALID_OP;
+	}
+	close(in);
+
+	clbt_path_init(&tmp);
+	/* a last look at dup right before it is replaced */
+	if (mode == CLBT_LINK_HARD)
+	{
+		ok = clbt_replace_link(keep->path, AT_FDCWD, dup->path, &tmp, 0) == CLBT_OK;
+		if (ok && (!clbt_dedupe_unchanged(dup, -1, &now) || rename(tmp.path, dup->path) != 0))
+		{
+			err = errno;
+			unlink(tmp.path);
+			errno = err;
+			ok = 0;
+		}
+	}
+	else
+	{
+#ifdef FICLONE
+		dst = clbt_replace_begin(AT_FDCWD, dup->path, &tmp, 0);
+		if (dst >= 0)
+		{
+			ok = ioctl(dst, FICLONE, src) == 0 && clbt_dedupe_unchanged(dup, -1, &now);
+			ok = clbt_replace_commit(AT_FDCWD, dup->path, &tmp, dst, &dupSt, ok) == CLBT_OK;
+		}
+#else
+		(void)dst;
+		(void)err;
+		errno = ENOTSUP;
+#endif
+	}
+	close(src);
+
+	if (!ok)
+		clbt_error("Cannot link '%s' to '%s': %s", dup->path, keep->path, strerror(errno));
+	clbt_path_destroy(&tmp);
+	return ok ? CLBT_OK : CLBT_FAILURE_IO;
+}
+
+/*
+ * Print duplicate groups separated by blank lines, optionally link them.
+ */
+static int clbt_dedupe_report(struct ClbtDupeTask* task, int* groups, unsigned long long* wasted)
+{
+	struct ClbtRecord r;
+	unsigned char* block = NULL;
+	int i, j, k;
+	int ret = CLBT_OK;
+
+	if (clbtConfig.dedupeLink != CLBT_LINK_NONE && (block = (unsigned char*)malloc(CLBT_DEDUPE_BLOCK)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for dedupe task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	*groups = 0;
+	*wasted = 0;
+	for (i = 0; i < task->count; i = j)
+	{
+		for (j = i + 1; j < task->count && clbt_dedupe_same(task->files[i], task->files[j], 3); j++);
+
+		/* groups are separated by an empty line, or numbered in JSON */
+		if (*groups > 0 && clbt_out_format() != CLBT_FORMAT_JSONL)
+			clbt_println("");
+		(*groups)++;
+		*wasted += (unsigned long long)task->files[i]->size * (j - i - 1);
+		for (k = i; k < j; k++)
+		{
+			clbt_record_begin(&r);
+			if (clbt_out_format() == CLBT_FORMAT_JSONL)
+				clbt_record_number(&r, "group", *groups);
+			clbt_record_string(&r, "path", task->files[k]->path, strlen(task->files[k]->path));
+			clbt_record_end(&r, -1);
+			if (k > i && clbtConfig.dedupeLink != CLBT_LINK_NONE
+				&& clbt_dedupe_link(task->files[i], task->files[k], clbtConfig.dedupeLink, block) == CLBT_FAILURE_IO)
+				ret = CLBT_FAILURE_IO;
+		}
+	}
+	free(block);
+	return ret;
+}
+
+/*
+ * Find duplicate files among targets.
+ */
+int clbt_task_dedupe(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtDupeTask task;
+	struct ClbtPool* pool;
+	unsigned long long wasted;
+	int i, j, ret, threads, total, groups;
+
+	if (clbtConfig.dedupeLink != CLBT_LINK_NONE
+		&& !clbt_confirm(options, "Replace duplicate files by links?"))
+		return CLBT_OK;
+
+	memset(&task, 0, sizeof(task));
+	ret = clbt_walk_begin(&walker, &clbtDedupeOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	threads = clbt_walk_threads(&walker);
+	task.found = (struct ClbtDupeArray*)calloc(threads, sizeof(struct ClbtDupeArray));
+	task.buffers = (CP*)malloc(sizeof(CP) * threads);
+	task.blocks = (unsigned char**)calloc(threads, sizeof(unsigned char*));
+	if (task.found == NULL || task.buffers == NULL || task.blocks == NULL)
+	{
+		clbt_error("Unable to allocate memory for dedupe task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < threads; i++)
+		clbt_path_init(&task.buffers[i]);
+
+	/* stage 1: metadata only */
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	for (i = 0, total = 0; i < threads; i++)
+		total += task.found[i].size;
+	task.files = (struct ClbtDupeFile**)malloc(sizeof(struct ClbtDupeFile*) * (total + 1));
+	if (task.files == NULL)
+	{
+		clbt_error("Unable to allocate memory for dedupe task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < threads; i++)
+		for (j = 0; j < task.found[i].size; j++)
+			task.files[task.count++] = &task.found[i].items[j];
+
+	clbt_dedupe_unique_inodes(&task);
+	clbt_dedupe_filter(&task, 1);
+	clbt_verbose(options, "%d file(s) scanned, %d share a size.", total, task.count);
+
+	/* stage 2 and 3 read data, sharing one pool */
+	pool = clbt_pool_create(threads);
+	clbt_dedupe_stage(&task, pool, 2);
+	clbt_dedupe_filter(&task, 2);
+	clbt_verbose(options, "%d file(s) left after partial hash.", task.count);
+	clbt_dedupe_stage(&task, pool, 3);
+	clbt_dedupe_filter(&task, 3);
+	clbt_pool_destroy(pool);
+
+	if (clbt_dedupe_report(&task, &groups, &wasted) != CLBT_OK || task.errors > 0)
+		ret = CLBT_FAILURE_IO;
+	clbt_verbose(options, "%d duplicate file(s) in %d group(s), %llu byte(s) reclaimable, %llu byte(s) read.",
+		task.count - groups, groups, wasted, task.bytesRead);
+
+	for (i = 0; i < threads; i++)
+	{
+		for (j = 0; j < task.found[i].size; j++)
+			free(task.found[i].items[j].path);
+		free(task.found[i].items);
+		free(task.blocks[i]);
+		clbt_path_destroy(&task.buffers[i]);
+	}
+	free(task.files);
+	free(task.blocks);
+	free(task.buffers);
+	free(task.found);
+	return ret;
+}
+
+#else
+
+int clbt_task_dedupe(int options)
+{
+	(void)options;
+	return clbt_unsupported("dedupe");
+}
+
+#endif
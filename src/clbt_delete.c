@@ -0,0 +1,301 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_delete.c
+ *
+ *   Description:
+ *
+ *   Parallel tree delete task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+
+/* names unlinked inline per directory before the rest is handed to other workers */
+#define CLBT_DELETE_BATCH 512
+
+/* A run of names in one directory, unlinked by whichever worker picks it up */
+struct ClbtDeleteBatch
+{
+	struct ClbtDir* dir;		/* retained until the batch is done */
+	int dirfd;					/* dup of the directory fd, -1 if run inline */
+	int count;					/* number of names */
+	int used;					/* bytes used in names */
+	int capacity;				/* bytes allocated for names */
+	char* names;				/* NUL separated names */
+};
+
+struct ClbtDeleteTask
+{
+	int wholeTree;				/* no patterns or expression, remove directories too */
+	struct ClbtDeleteBatch** batches;	/* per thread batch of the directory being enumerated */
+	unsigned long files;		/* removed files, atomic */
+	unsigned long dirs;			/* removed directories, atomic */
+};
+
+static struct ClbtDeleteBatch* clbt_delete_batch_new(struct ClbtDir* dir)
+{
+	struct ClbtDeleteBatch* batch = (struct ClbtDeleteBatch*)malloc(sizeof(struct ClbtDeleteBatch));
+
+	if (batch == NULL || (batch->names = (char*)malloc(CLBT_DELETE_BATCH * 32)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for delete batch!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	clbt_dir_retain(dir);
+	batch->dir = dir;
+	batch->dirfd = -1;
+	batch->count = 0;
+	batch->used = 0;
+	batch->capacity = CLBT_DELETE_BATCH * 32;
+	return batch;
+}
+
+static void clbt_delete_batch_add(struct ClbtDeleteBatch* batch, const char* name, int namelen)
+{
+	char* buf;
+
+	if (batch->used + namelen + 1 > batch->capacity)
+	{
+		batch->capacity = (batch->used + namelen + 1) * 2;
+		buf = (char*)realloc(batch->names, batch->capacity);
+		if (buf == NULL)
+		{
+			clbt_error("Unable to reallocate memory for delete batch!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		batch->names = buf;
+	}
+
+	memcpy(batch->names + batch->used, name, namelen + 1);
+	batch->used += namelen + 1;
+	batch->count++;
+}
+
+/*
+ * Unlink every name of the batch relative to dirfd, then release the directory.
+ */
+static void clbt_delete_batch_run(struct ClbtDeleteBatch* batch, int dirfd, int tid)
+{
+	struct ClbtDir* dir = batch->dir;
+	struct ClbtWalker* walker = dir->walker;
+	struct ClbtDeleteTask* task = (struct ClbtDeleteTask*)walker->user;
+	const char* name = batch->names;
+	unsigned long removed = 0;
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+	{
+		if (unlinkat(dirfd, name, 0) == 0)
+		{
+			removed++;
+		}
+		else if (errno != ENOENT)
+		{
+			clbt_error("Cannot remove '%s/%s': %s", dir->path, name, strerror(errno));
+			clbt_walk_failed(walker);
+		}
+		name += strlen(name) + 1;
+	}
+	clbt_atomic_add(&task->files, removed);
+
+	if (batch->dirfd >= 0)
+		close(batch->dirfd);
+	free(batch->names);
+	free(batch);
+	clbt_dir_release(dir, tid);
+}
+
+static void clbt_delete_batch_job(void* arg, int tid)
+{
+	struct ClbtDeleteBatch* batch = (struct ClbtDeleteBatch*)arg;
+	clbt_delete_batch_run(batch, batch->dirfd, tid);
+}
+
+static int clbt_delete_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtDeleteTask* task = (struct ClbtDeleteTask*)walker->user;
+	struct ClbtDeleteBatch* batch;
+
+	if (entry->type == CLBT_TYPE_DIR)
+		return CLBT_WALK_CONTINUE;
+	if (!task->wholeTree && !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	/* a root that is not a directory */
+	if (entry->dir == NULL)
+	{
+		if (unlink(entry->name) == 0)
+		{
+			clbt_atomic_add(&task->files, 1);
+		}
+		else
+		{
+			clbt_error("Cannot remove '%s': %s", entry->name, strerror(errno));
+			clbt_walk_failed(walker);
+		}
+		return CLBT_WALK_CONTINUE;
+	}
+
+	batch = task->batches[tid];
+	if (batch == NULL)
+		batch = task->batches[tid] = clbt_delete_batch_new(entry->dir);
+	clbt_delete_batch_add(batch, entry->name, entry->namelen);
+
+	/* full batch of a large directory, let idle workers unlink it concurrently */
+	if (batch->count >= CLBT_DELETE_BATCH)
+	{
+		batch->dirfd = dup(entry->dirfd);
+		if (batch->dirfd >= 0)
+			clbt_pool_submit(walker->pool, clbt_delete_batch_job, batch);
+		else
+			clbt_delete_batch_run(batch, entry->dirfd, tid);
+		task->batches[tid] = NULL;
+	}
+	return CLBT_WALK_CONTINUE;
+}
+
+static void clbt_delete_on_dir_end(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid)
+{
+	struct ClbtDeleteTask* task = (struct ClbtDeleteTask*)walker->user;
+	struct ClbtDeleteBatch* batch = task->batches[tid];
+
+	/* tail of the directory is cheap, unlink while the fd is still open */
+	if (batch != NULL)
+	{
+		task->batches[tid] = NULL;
+		clbt_delete_batch_run(batch, dirfd, tid);
+	}
+	(void)dir;
+}
+
+static void clbt_delete_on_dir_post(struct ClbtWalker* walker, struct ClbtDir* dir, int tid)
+{
+	struct ClbtDeleteTask* task = (struct ClbtDeleteTask*)walker->user;
+
+	if (!task->wholeTree)
+		return;
+
+	/* every child is gone by now, counted down by the walker, and the parent is still open */
+	if (unlinkat(dir->parent != NULL ? dir->parent->fd : AT_FDCWD, dir->path + dir->name, AT_REMOVEDIR) == 0)
+	{
+		clbt_atomic_add(&task->dirs, 1);
+	}
+	else
+	{
+		clbt_error("Cannot remove directory '%s': %s", dir->path, strerror(errno));
+		clbt_walk_failed(walker);
+	}
+	(void)tid;
+}
+
+/*
+ * Like --preserve-root, refuse '/' under any spelling, and refuse '.' or '..'
+ * as the last component.
+ */
+static int clbt_delete_refused(const char* path)
+{
+	struct stat root, st;
+	const char* end = path + strlen(path);
+	const char* base;
+
+	while (end > path + 1 && end[-1] == '/')
+		end--;
+	for (base = end; base > path && base[-1] != '/'; base--)
+		;
+	if ((end - base == 1 && base[0] == '.') || (end - base == 2 && base[0] == '.' && base[1] == '.'))
+	{
+		clbt_error("Refuse to delete '%s'.", path);
+		return 1;
+	}
+
+	if (stat("/", &root) == 0 && lstat(path, &st) == 0 && st.st_dev == root.st_dev && st.st_ino == root.st_ino)
+	{
+		clbt_error("Refuse to delete '/' as '%s'.", path);
+		return 1;
+	}
+	return 0;
+}
+
+static const struct ClbtWalkOps clbtDeleteOps = { clbt_delete_on_entry, clbt_delete_on_dir_end, clbt_delete_on_dir_post, NULL };
+
+/*
+ * Delete targets. Without input patterns whole trees are removed, otherwise
+ * only matching files are unlinked and directories are kept.
+ */
+int clbt_task_delete(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtDeleteTask task;
+	int i, ret, flags;
+
+	task.wholeTree = clbtConfig.patterns.size < 1 && clbtConfig.expr == NULL;
+	task.files = 0;
+	task.dirs = 0;
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+	{
+		if (clbt_delete_refused(clbtConfig.targets.paths[i]->path))
+			return CLBT_INVALID_OP;
+	}
+
+	if (task.wholeTree)
+	{
+		if (!clbt_confirm(options, "Delete %d target(s) and everything below?", clbtConfig.targets.size))
+			return CLBT_OK;
+	}
+	else if (!clbt_confirm(options, "Delete matching files in %d target(s)?", clbtConfig.targets.size))
+	{
+		return CLBT_OK;
+	}
+
+	/* never read file data, keep directory atime untouched and remove a symlink root itself */
+	flags = CLBT_WALK_NOATIME | CLBT_WALK_NOFOLLOW;
+	if (task.wholeTree || (options & CLBT_OPT_RECURSIVE))
+		flags |= CLBT_WALK_RECURSE;
+
+	ret = clbt_walk_begin(&walker, &clbtDeleteOps, &task, flags);
+	if (ret != CLBT_OK)
+		return ret;
+
+	task.batches = (struct ClbtDeleteBatch**)calloc(clbt_walk_threads(&walker), sizeof(struct ClbtDeleteBatch*));
+	if (task.batches == NULL)
+	{
+		clbt_error("Unable to allocate memory for delete task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	free(task.batches);
+	clbt_verbose(options, "Removed %lu file(s) and %lu dir(s).", task.files, task.dirs);
+	return ret;
+}
+
+#else
+
+int clbt_task_delete(int options)
+{
+	(void)options;
+	return clbt_unsupported("delete");
+}
+
+#endif
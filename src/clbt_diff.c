@@ -0,0 +1,184 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_diff.c
+ *
+ *   Description:
+ *
+ *   Compare two listing snapshots for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <sys/mman.h>
+
+/*
+ * Both snapshots are sorted by path, so one pass of a merge join over two
+ * cursors finds every change while only the current block of each side is
+ * decoded. Nothing is loaded into lists and memory stays constant.
+ */
+struct ClbtDiffCount
+{
+	unsigned long long added;
+	unsigned long long removed;
+	unsigned long long modified;
+};
+
+/*
+ * Copy the root of a snapshot, ending in '/'.
+ */
+static void clbt_diff_root(CP* root, const struct ClbtSnap* snap)
+{
+	int len = snap->rootLength;
+
+	clbt_path_init(root);
+	if (root->length < len + 2)
+		clbt_path_resize(root, len + 2);
+	memcpy(root->path, snap->root, len);
+	if (len < 1 || root->path[len - 1] != '/')
+		root->path[len++] = '/';
+	root->path[len] = '\0';
+}
+
+/*
+ * Report one change as "+ path", "- path" or "* path", or a {"change","path"}
+ * record, under the root of the snapshot the entry comes from. Roots end in '/'.
+ */
+static void clbt_diff_report(const char* change, const CP* root, const struct ClbtSnapEntry* e)
+{
+	struct ClbtRecord r;
+	char mark = '+';
+
+	if (clbt_out_format() != CLBT_FORMAT_JSONL)
+	{
+		if (strcmp(change, "removed") == 0)
+			mark = '-';
+		else if (strcmp(change, "modified") == 0)
+			mark = '*';
+		clbt_println("%c %s%s", mark, root->path, e->path);
+		return;
+	}
+	clbt_record_begin(&r);
+	clbt_record_string(&r, "change", change, strlen(change));
+	clbt_record_join(&r, "path", root->path, e->path);
+	clbt_record_end(&r, -1);
+}
+
+/*
+ * Directories change their mtime with every entry added or removed, which the
+ * entries report themselves, so only their type and permissions count.
+ */
+static int clbt_diff_modified(const struct ClbtSnapEntry* a, const struct ClbtSnapEntry* b)
+{
+	if (a->mode != b->mode)
+		return 1;
+	if (S_ISDIR(a->mode))
+		return 0;
+	return a->size != b->size || a->mtime != b->mtime || a->ino != b->ino;
+}
+
+/*
+ * Print what changed from the snapshot given to --diff to the only target snapshot.
+ */
+int clbt_task_diff(int options)
+{
+	struct ClbtSnap snaps[2];
+	struct ClbtSnapCursor cur[2];
+	struct ClbtDiffCount count;
+	CP roots[2];
+	const char* files[2];
+	int i, cmp, more[2], ret = CLBT_OK;
+
+	if (clbtConfig.targets.size != 1)
+	{
+		clbt_error("Diff takes exactly one snapshot to compare with.");
+		return CLBT_INVALID_OP;
+	}
+	files[0] = clbtConfig.diffBase.path;
+	files[1] = clbtConfig.targets.paths[0]->path;
+	if ((ret = clbt_snap_open(&snaps[0], files[0])) != CLBT_OK)
+		return ret;
+	if ((ret = clbt_snap_open(&snaps[1], files[1])) != CLBT_OK)
+	{
+		clbt_snap_close(&snaps[0]);
+		return ret;
+	}
+
+	memset(&count, 0, sizeof(count));
+	for (i = 0; i < 2; i++)
+	{
+		madvise((void*)snaps[i].base, snaps[i].size, MADV_SEQUENTIAL);
+		clbt_diff_root(&roots[i], &snaps[i]);
+		clbt_snap_cursor_init(&cur[i], &snaps[i], 0);
+		more[i] = clbt_snap_next(&cur[i]);
+	}
+
+	while (more[0] || more[1])
+	{
+		if (!more[1])
+			cmp = -1;
+		else if (!more[0])
+			cmp = 1;
+		else
+			cmp = clbt_snap_compare(cur[0].entry.path, cur[0].entry.length, cur[1].entry.path, cur[1].entry.length);
+
+		if (cmp < 0)
+		{
+			clbt_diff_report("removed", &roots[0], &cur[0].entry);
+			count.removed++;
+		}
+		else if (cmp > 0)
+		{
+			clbt_diff_report("added", &roots[1], &cur[1].entry);
+			count.added++;
+		}
+		else if (clbt_diff_modified(&cur[0].entry, &cur[1].entry))
+		{
+			clbt_diff_report("modified", &roots[1], &cur[1].entry);
+			count.modified++;
+		}
+
+		if (cmp <= 0)
+			more[0] = clbt_snap_next(&cur[0]);
+		if (cmp >= 0)
+			more[1] = clbt_snap_next(&cur[1]);
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (cur[i].failed)
+		{
+			clbt_error("Snapshot '%s' is corrupt.", files[i]);
+			ret = CLBT_INVALID_OP;
+		}
+		clbt_snap_cursor_destroy(&cur[i]);
+		clbt_path_destroy(&roots[i]);
+		clbt_snap_close(&snaps[i]);
+	}
+
+	clbt_verbose(options, "Added %llu, removed %llu, modified %llu entries.", count.added, count.removed, count.modified);
+	return ret;
+}
+
+#else
+
+int clbt_task_diff(int options)
+{
+	(void)options;
+	return clbt_unsupported("diff");
+}
+
+#endif
@@ -0,0 +1,781 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_digest.c
+ *
+ *   Description:
+ *
+ *   Streaming content digests for CLBT: XXH3-64, SHA-256 and BLAKE3
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <string.h>
+#include <assert.h>
+
+/*------------------------------------------------------------------------------------------------------*/
+/* little endian helpers, independent of host byte order */
+
+static uint32_t clbt_read32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t clbt_read64(const unsigned char* p)
+{
+	return (uint64_t)clbt_read32(p) | ((uint64_t)clbt_read32(p + 4) << 32);
+}
+
+static void clbt_write32(unsigned char* p, uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t clbt_rotr32(uint32_t v, int n)
+{
+	return (v >> n) | (v << (32 - n));
+}
+
+static uint64_t clbt_rotl64(uint64_t v, int n)
+{
+	return (v << n) | (v >> (64 - n));
+}
+
+static uint32_t clbt_swap32(uint32_t v)
+{
+	return ((v << 24) & 0xff000000) | ((v << 8) & 0x00ff0000) | ((v >> 8) & 0x0000ff00) | ((v >> 24) & 0x000000ff);
+}
+
+static uint64_t clbt_swap64(uint64_t v)
+{
+	return ((uint64_t)clbt_swap32((uint32_t)v) << 32) | clbt_swap32((uint32_t)(v >> 32));
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* SHA-256, FIPS 180-4 */
+
+static const uint32_t clbtSha256K[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* also the BLAKE3 IV */
+static const uint32_t clbtSha256IV[8] =
+{
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static void clbt_sha256_block(uint32_t* h, const unsigned char* p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) | ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (i = 16; i < 64; i++)
+	{
+		t1 = clbt_rotr32(w[i - 2], 17) ^ clbt_rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = clbt_rotr32(w[i - 15], 7) ^ clbt_rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; i++)
+	{
+		t1 = k + (clbt_rotr32(e, 6) ^ clbt_rotr32(e, 11) ^ clbt_rotr32(e, 25)) + ((e & f) ^ (~e & g)) + clbtSha256K[i] + w[i];
+		t2 = (clbt_rotr32(a, 2) ^ clbt_rotr32(a, 13) ^ clbt_rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void clbt_sha256_init(struct ClbtSha256* s)
+{
+	memcpy(s->h, clbtSha256IV, sizeof(s->h));
+	s->total = 0;
+	s->used = 0;
+}
+
+static void clbt_sha256_update(struct ClbtSha256* s, const unsigned char* p, size_t len)
+{
+	size_t take;
+
+	s->total += len;
+	if (s->used > 0)
+	{
+		take = 64 - s->used;
+		if (take > len)
+			take = len;
+		memcpy(s->buf + s->used, p, take);
+		s->used += (int)take;
+		p += take;
+		len -= take;
+		if (s->used < 64)
+			return;
+		clbt_sha256_block(s->h, s->buf);
+		s->used = 0;
+	}
+
+	while (len >= 64)
+	{
+		clbt_sha256_block(s->h, p);
+		p += 64;
+		len -= 64;
+	}
+
+	memcpy(s->buf, p, len);
+	s->used = (int)len;
+}
+
+static void clbt_sha256_final(struct ClbtSha256* s, unsigned char* out)
+{
+	uint64_t bits = s->total * 8;
+	int i;
+
+	s->buf[s->used++] = 0x80;
+	if (s->used > 56)
+	{
+		memset(s->buf + s->used, 0, 64 - s->used);
+		clbt_sha256_block(s->h, s->buf);
+		s->used = 0;
+	}
+	memset(s->buf + s->used, 0, 56 - s->used);
+	for (i = 0; i < 8; i++)
+		s->buf[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+	clbt_sha256_block(s->h, s->buf);
+
+	for (i = 0; i < 8; i++)
+	{
+		out[i * 4] = (unsigned char)(s->h[i] >> 24);
+		out[i * 4 + 1] = (unsigned char)(s->h[i] >> 16);
+		out[i * 4 + 2] = (unsigned char)(s->h[i] >> 8);
+		out[i * 4 + 3] = (unsigned char)s->h[i];
+	}
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* XXH3 64 bit, seed 0 and default secret */
+
+#define CLBT_XXH_PRIME32_1	0x9E3779B1U
+#define CLBT_XXH_PRIME32_2	0x85EBCA77U
+#define CLBT_XXH_PRIME32_3	0xC2B2AE3DU
+#define CLBT_XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define CLBT_XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define CLBT_XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define CLBT_XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define CLBT_XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+#define CLBT_XXH_PRIME_MX1	0x165667919E3779F9ULL
+#define CLBT_XXH_PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define CLBT_XXH_SECRET_SIZE		192
+#define CLBT_XXH_STRIPE_LEN			64
+#define CLBT_XXH_STRIPES_PER_BLOCK	((CLBT_XXH_SECRET_SIZE - CLBT_XXH_STRIPE_LEN) / 8)
+#define CLBT_XXH_BUFFER_STRIPES		(CLBT_XXH_BUFFER_SIZE / CLBT_XXH_STRIPE_LEN)
+
+static const unsigned char clbtXxhSecret[CLBT_XXH_SECRET_SIZE] =
+{
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static uint64_t clbt_xxh_mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t)lhs * rhs;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+	uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+	uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+	uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+	uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+	uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+	return lower ^ upper;
+#endif
+}
+
+static uint64_t clbt_xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= CLBT_XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= CLBT_XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t clbt_xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= CLBT_XXH_PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t clbt_xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= clbt_rotl64(h, 49) ^ clbt_rotl64(h, 24);
+	h *= CLBT_XXH_PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= CLBT_XXH_PRIME_MX2;
+	h ^= h >> 28;
+	return h;
+}
+
+static uint64_t clbt_xxh3_mix16(const unsigned char* p, const unsigned char* secret)
+{
+	return clbt_xxh_mul128_fold64(clbt_read64(p) ^ clbt_read64(secret), clbt_read64(p + 8) ^ clbt_read64(secret + 8));
+}
+
+/* one shot hash of inputs up to 240 bytes */
+static uint64_t clbt_xxh3_short(const unsigned char* p, size_t len)
+{
+	const unsigned char* secret = clbtXxhSecret;
+	uint64_t acc, lo, hi;
+	uint32_t combined;
+	size_t i;
+
+	if (len == 0)
+		return clbt_xxh64_avalanche(clbt_read64(secret + 56) ^ clbt_read64(secret + 64));
+
+	if (len <= 3)
+	{
+		combined = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) | (uint32_t)p[len - 1] | ((uint32_t)len << 8);
+		return clbt_xxh64_avalanche((uint64_t)combined ^ (uint64_t)(clbt_read32(secret) ^ clbt_read32(secret + 4)));
+	}
+
+	if (len <= 8)
+	{
+		acc = (uint64_t)clbt_read32(p + len - 4) + ((uint64_t)clbt_read32(p) << 32);
+		acc ^= clbt_read64(secret + 8) ^ clbt_read64(secret + 16);
+		return clbt_xxh3_rrmxmx(acc, len);
+	}
+
+	if (len <= 16)
+	{
+		lo = clbt_read64(p) ^ (clbt_read64(secret + 24) ^ clbt_read64(secret + 32));
+		hi = clbt_read64(p + len - 8) ^ (clbt_read64(secret + 40) ^ clbt_read64(secret + 48));
+		acc = len + clbt_swap64(lo) + hi + clbt_xxh_mul128_fold64(lo, hi);
+		return clbt_xxh3_avalanche(acc);
+	}
+
+	acc = len * CLBT_XXH_PRIME64_1;
+	if (len <= 128)
+	{
+		if (len > 32)
+		{
+			if (len > 64)
+			{
+				if (len > 96)
+				{
+					acc += clbt_xxh3_mix16(p + 48, secret + 96);
+					acc += clbt_xxh3_mix16(p + len - 64, secret + 112);
+				}
+				acc += clbt_xxh3_mix16(p + 32, secret + 64);
+				acc += clbt_xxh3_mix16(p + len - 48, secret + 80);
+			}
+			acc += clbt_xxh3_mix16(p + 16, secret + 32);
+			acc += clbt_xxh3_mix16(p + len - 32, secret + 48);
+		}
+		acc += clbt_xxh3_mix16(p, secret);
+		acc += clbt_xxh3_mix16(p + len - 16, secret + 16);
+		return clbt_xxh3_avalanche(acc);
+	}
+
+	/* 129 - 240 bytes */
+	for (i = 0; i < 8; i++)
+		acc += clbt_xxh3_mix16(p + 16 * i, secret + 16 * i);
+	acc = clbt_xxh3_avalanche(acc);
+	for (i = 8; i < len / 16; i++)
+		acc += clbt_xxh3_mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+	acc += clbt_xxh3_mix16(p + len - 16, secret + 136 - 17);
+	return clbt_xxh3_avalanche(acc);
+}
+
+static void clbt_xxh3_accumulate512(uint64_t* acc, const unsigned char* p, const unsigned char* secret)
+{
+	uint64_t value, key;
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		value = clbt_read64(p + 8 * i);
+		key = value ^ clbt_read64(secret + 8 * i);
+		acc[i ^ 1] += value;
+		acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+	}
+}
+
+static void clbt_xxh3_scramble(uint64_t* acc, const unsigned char* secret)
+{
+	uint64_t a;
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		a = acc[i];
+		a ^= a >> 47;
+		a ^= clbt_read64(secret + 8 * i);
+		a *= CLBT_XXH_PRIME32_1;
+		acc[i] = a;
+	}
+}
+
+static void clbt_xxh3_accumulate(uint64_t* acc, const unsigned char* p, const unsigned char* secret, int stripes)
+{
+	int n;
+
+	for (n = 0; n < stripes; n++)
+		clbt_xxh3_accumulate512(acc, p + n * CLBT_XXH_STRIPE_LEN, secret + n * 8);
+}
+
+/* consume whole stripes, scrambling at every block boundary */
+static void clbt_xxh3_consume(uint64_t* acc, int* stripesSoFar, const unsigned char* p, int stripes)
+{
+	const unsigned char* secret = clbtXxhSecret;
+	int toEnd;
+
+	if (CLBT_XXH_STRIPES_PER_BLOCK - *stripesSoFar <= stripes)
+	{
+		toEnd = CLBT_XXH_STRIPES_PER_BLOCK - *stripesSoFar;
+		clbt_xxh3_accumulate(acc, p, secret + *stripesSoFar * 8, toEnd);
+		clbt_xxh3_scramble(acc, secret + CLBT_XXH_SECRET_SIZE - CLBT_XXH_STRIPE_LEN);
+		clbt_xxh3_accumulate(acc, p + toEnd * CLBT_XXH_STRIPE_LEN, secret, stripes - toEnd);
+		*stripesSoFar = stripes - toEnd;
+	}
+	else
+	{
+		clbt_xxh3_accumulate(acc, p, secret + *stripesSoFar * 8, stripes);
+		*stripesSoFar += stripes;
+	}
+}
+
+static void clbt_xxh3_init(struct ClbtXxh3* s)
+{
+	s->acc[0] = CLBT_XXH_PRIME32_3;
+	s->acc[1] = CLBT_XXH_PRIME64_1;
+	s->acc[2] = CLBT_XXH_PRIME64_2;
+	s->acc[3] = CLBT_XXH_PRIME64_3;
+	s->acc[4] = CLBT_XXH_PRIME64_4;
+	s->acc[5] = CLBT_XXH_PRIME32_2;
+	s->acc[6] = CLBT_XXH_PRIME64_5;
+	s->acc[7] = CLBT_XXH_PRIME32_1;
+	s->total = 0;
+	s->used = 0;
+	s->stripes = 0;
+}
+
+static void clbt_xxh3_update(struct ClbtXxh3* s, const unsigned char* p, size_t len)
+{
+	const unsigned char* end = p + len;
+	size_t take;
+
+	s->total += len;
+	if (s->used + len <= CLBT_XXH_BUFFER_SIZE)
+	{
+		memcpy(s->buf + s->used, p, len);
+		s->used += (int)len;
+		return;
+	}
+
+	if (s->used > 0)
+	{
+		take = CLBT_XXH_BUFFER_SIZE - s->used;
+		memcpy(s->buf + s->used, p, take);
+		p += take;
+		clbt_xxh3_consume(s->acc, &s->stripes, s->buf, CLBT_XXH_BUFFER_STRIPES);
+		s->used = 0;
+	}
+
+	/* keep at least one byte buffered, the last stripe is handled at digest time */
+	if (p + CLBT_XXH_BUFFER_SIZE < end)
+	{
+		do
+		{
+			clbt_xxh3_consume(s->acc, &s->stripes, p, CLBT_XXH_BUFFER_STRIPES);
+			p += CLBT_XXH_BUFFER_SIZE;
+		} while (p + CLBT_XXH_BUFFER_SIZE < end);
+		memcpy(s->buf + CLBT_XXH_BUFFER_SIZE - CLBT_XXH_STRIPE_LEN, p - CLBT_XXH_STRIPE_LEN, CLBT_XXH_STRIPE_LEN);
+	}
+
+	memcpy(s->buf, p, end - p);
+	s->used = (int)(end - p);
+}
+
+static uint64_t clbt_xxh3_digest(const struct ClbtXxh3* s)
+{
+	const unsigned char* secret = clbtXxhSecret;
+	unsigned char last[CLBT_XXH_STRIPE_LEN];
+	const unsigned char* lastStripe;
+	uint64_t acc[8];
+	uint64_t result;
+	int stripes, catchup, i;
+
+	if (s->total <= 240)
+		return clbt_xxh3_short(s->buf, (size_t)s->total);
+
+	memcpy(acc, s->acc, sizeof(acc));
+	stripes = s->stripes;
+	if (s->used >= CLBT_XXH_STRIPE_LEN)
+	{
+		clbt_xxh3_consume(acc, &stripes, s->buf, (s->used - 1) / CLBT_XXH_STRIPE_LEN);
+		lastStripe = s->buf + s->used - CLBT_XXH_STRIPE_LEN;
+	}
+	else
+	{
+		/* the tail of the previous stripe is still at the end of the buffer */
+		catchup = CLBT_XXH_STRIPE_LEN - s->used;
+		memcpy(last, s->buf + CLBT_XXH_BUFFER_SIZE - catchup, catchup);
+		memcpy(last + catchup, s->buf, s->used);
+		lastStripe = last;
+	}
+	clbt_xxh3_accumulate512(acc, lastStripe, secret + CLBT_XXH_SECRET_SIZE - CLBT_XXH_STRIPE_LEN - 7);
+
+	result = s->total * CLBT_XXH_PRIME64_1;
+	for (i = 0; i < 4; i++)
+	{
+		result += clbt_xxh_mul128_fold64(acc[2 * i] ^ clbt_read64(secret + 11 + 16 * i),
+			acc[2 * i + 1] ^ clbt_read64(secret + 11 + 16 * i + 8));
+	}
+	return clbt_xxh3_avalanche(result);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* BLAKE3, unkeyed 256 bit output */
+
+#define CLBT_B3_CHUNK_START	1
+#define CLBT_B3_CHUNK_END	2
+#define CLBT_B3_PARENT		4
+#define CLBT_B3_ROOT		8
+
+static const int clbtB3Permute[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+#define CLBT_B3_G(s, a, b, c, d, x, y) \
+	do { \
+		s[a] = s[a] + s[b] + (x); s[d] = clbt_rotr32(s[d] ^ s[a], 16); \
+		s[c] = s[c] + s[d]; s[b] = clbt_rotr32(s[b] ^ s[c], 12); \
+		s[a] = s[a] + s[b] + (y); s[d] = clbt_rotr32(s[d] ^ s[a], 8); \
+		s[c] = s[c] + s[d]; s[b] = clbt_rotr32(s[b] ^ s[c], 7); \
+	} while (0)
+
+static void clbt_blake3_compress(const uint32_t* cv, const uint32_t* block, uint64_t counter, uint32_t blockLen, uint32_t flags, uint32_t* out)
+{
+	uint32_t s[16], m[16], t[16];
+	int r, i;
+
+	memcpy(m, block, sizeof(m));
+	for (i = 0; i < 8; i++)
+		s[i] = cv[i];
+	s[8] = clbtSha256IV[0];
+	s[9] = clbtSha256IV[1];
+	s[10] = clbtSha256IV[2];
+	s[11] = clbtSha256IV[3];
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = blockLen;
+	s[15] = flags;
+
+	for (r = 0; r < 7; r++)
+	{
+		CLBT_B3_G(s, 0, 4, 8, 12, m[0], m[1]);
+		CLBT_B3_G(s, 1, 5, 9, 13, m[2], m[3]);
+		CLBT_B3_G(s, 2, 6, 10, 14, m[4], m[5]);
+		CLBT_B3_G(s, 3, 7, 11, 15, m[6], m[7]);
+		CLBT_B3_G(s, 0, 5, 10, 15, m[8], m[9]);
+		CLBT_B3_G(s, 1, 6, 11, 12, m[10], m[11]);
+		CLBT_B3_G(s, 2, 7, 8, 13, m[12], m[13]);
+		CLBT_B3_G(s, 3, 4, 9, 14, m[14], m[15]);
+		if (r < 6)
+		{
+			for (i = 0; i < 16; i++)
+				t[i] = m[clbtB3Permute[i]];
+			memcpy(m, t, sizeof(m));
+		}
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+static void clbt_blake3_load_block(const unsigned char* p, uint32_t blockLen, uint32_t* words)
+{
+	unsigned char tmp[CLBT_BLAKE3_BLOCK_LEN];
+	int i;
+
+	if (blockLen < CLBT_BLAKE3_BLOCK_LEN)
+	{
+		memset(tmp, 0, sizeof(tmp));
+		memcpy(tmp, p, blockLen);
+		p = tmp;
+	}
+	for (i = 0; i < 16; i++)
+		words[i] = clbt_read32(p + i * 4);
+}
+
+static void clbt_blake3_node_cv(const struct ClbtBlake3Node* node, uint32_t* cv)
+{
+	uint32_t out[16];
+
+	clbt_blake3_compress(node->cv, node->block, node->counter, node->blockLen, node->flags, out);
+	memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+/*
+ * Parent node of two subtree chaining values.
+ */
+void clbt_blake3_parent(const uint32_t* left, const uint32_t* right, struct ClbtBlake3Node* node)
+{
+	memcpy(node->cv, clbtSha256IV, sizeof(node->cv));
+	memcpy(node->block, left, 8 * sizeof(uint32_t));
+	memcpy(node->block + 8, right, 8 * sizeof(uint32_t));
+	node->counter = 0;
+	node->blockLen = CLBT_BLAKE3_BLOCK_LEN;
+	node->flags = CLBT_B3_PARENT;
+}
+
+/*
+ * Chaining value of a non root node.
+ */
+void clbt_blake3_cv(const struct ClbtBlake3Node* node, uint32_t* cv)
+{
+	clbt_blake3_node_cv(node, cv);
+}
+
+/*
+ * Finalize the root node into a 32 byte digest.
+ */
+void clbt_blake3_root(const struct ClbtBlake3Node* node, unsigned char* out)
+{
+	uint32_t words[16];
+	int i;
+
+	clbt_blake3_compress(node->cv, node->block, 0, node->blockLen, node->flags | CLBT_B3_ROOT, words);
+	for (i = 0; i < 8; i++)
+		clbt_write32(out + i * 4, words[i]);
+}
+
+/*
+ * Start a hasher whose first chunk has the given index in the whole input,
+ * so independent subtrees of one file can be hashed concurrently.
+ */
+void clbt_blake3_init(struct ClbtBlake3* s, uint64_t chunkOffset)
+{
+	memcpy(s->cv, clbtSha256IV, sizeof(s->cv));
+	s->chunkOffset = chunkOffset;
+	s->chunks = 0;
+	s->chunkLen = 0;
+	s->blockLen = 0;
+	s->stackLen = 0;
+}
+
+static void clbt_blake3_push_chunk(struct ClbtBlake3* s, const uint32_t* cv)
+{
+	struct ClbtBlake3Node parent;
+	uint32_t merged[8];
+	uint64_t total;
+
+	memcpy(merged, cv, sizeof(merged));
+	/* merge completed subtrees, counted locally so the offset never affects the shape */
+	total = ++s->chunks;
+	while ((total & 1) == 0)
+	{
+		clbt_blake3_parent(s->stack[--s->stackLen], merged, &parent);
+		clbt_blake3_node_cv(&parent, merged);
+		total >>= 1;
+	}
+	memcpy(s->stack[s->stackLen++], merged, sizeof(merged));
+}
+
+void clbt_blake3_update(struct ClbtBlake3* s, const unsigned char* p, size_t len)
+{
+	uint32_t words[16], out[16];
+	uint32_t flags;
+	size_t take;
+
+	while (len > 0)
+	{
+		/* a full chunk is only closed once more input arrives */
+		if (s->chunkLen == CLBT_BLAKE3_CHUNK_LEN)
+		{
+			clbt_blake3_load_block(s->block, s->blockLen, words);
+			flags = CLBT_B3_CHUNK_END | (s->chunkLen <= CLBT_BLAKE3_BLOCK_LEN ? CLBT_B3_CHUNK_START : 0);
+			clbt_blake3_compress(s->cv, words, s->chunkOffset + s->chunks, s->blockLen, flags, out);
+			clbt_blake3_push_chunk(s, out);
+			memcpy(s->cv, clbtSha256IV, sizeof(s->cv));
+			s->chunkLen = 0;
+			s->blockLen = 0;
+		}
+
+		if (s->blockLen == CLBT_BLAKE3_BLOCK_LEN)
+		{
+			clbt_blake3_load_block(s->block, s->blockLen, words);
+			flags = s->chunkLen == CLBT_BLAKE3_BLOCK_LEN ? CLBT_B3_CHUNK_START : 0;
+			clbt_blake3_compress(s->cv, words, s->chunkOffset + s->chunks, CLBT_BLAKE3_BLOCK_LEN, flags, out);
+			memcpy(s->cv, out, sizeof(s->cv));
+			s->blockLen = 0;
+		}
+
+		take = CLBT_BLAKE3_BLOCK_LEN - s->blockLen;
+		if (take > CLBT_BLAKE3_CHUNK_LEN - (size_t)s->chunkLen)
+			take = CLBT_BLAKE3_CHUNK_LEN - s->chunkLen;
+		if (take > len)
+			take = len;
+		memcpy(s->block + s->blockLen, p, take);
+		s->blockLen += (int)take;
+		s->chunkLen += (int)take;
+		p += take;
+		len -= take;
+	}
+}
+
+/*
+ * Top node of everything fed so far, without the root flag.
+ */
+void clbt_blake3_node(const struct ClbtBlake3* s, struct ClbtBlake3Node* node)
+{
+	uint32_t cv[8];
+	int i;
+
+	memcpy(node->cv, s->cv, sizeof(node->cv));
+	clbt_blake3_load_block(s->block, s->blockLen, node->block);
+	node->counter = s->chunkOffset + s->chunks;
+	node->blockLen = s->blockLen;
+	node->flags = CLBT_B3_CHUNK_END | (s->chunkLen <= CLBT_BLAKE3_BLOCK_LEN ? CLBT_B3_CHUNK_START : 0);
+
+	for (i = s->stackLen - 1; i >= 0; i--)
+	{
+		clbt_blake3_node_cv(node, cv);
+		clbt_blake3_parent(s->stack[i], cv, node);
+	}
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Parse a digest name, returns CLBT_DIGEST_NONE if unknown.
+ */
+int clbt_digest_parse(const char* name)
+{
+	if (name == NULL)
+		return CLBT_DIGEST_NONE;
+	if (strcmp(name, "xxh3") == 0)
+		return CLBT_DIGEST_XXH3;
+	if (strcmp(name, "sha256") == 0)
+		return CLBT_DIGEST_SHA256;
+	if (strcmp(name, "blake3") == 0)
+		return CLBT_DIGEST_BLAKE3;
+	return CLBT_DIGEST_NONE;
+}
+
+/*
+ * Size of digest in bytes.
+ */
+int clbt_digest_size(int algo)
+{
+	return algo == CLBT_DIGEST_XXH3 ? 8 : 32;
+}
+
+void clbt_digest_init(struct ClbtDigest* d, int algo)
+{
+	d->algo = algo;
+	switch (algo)
+	{
+	case CLBT_DIGEST_XXH3: clbt_xxh3_init(&d->u.xxh3); break;
+	case CLBT_DIGEST_SHA256: clbt_sha256_init(&d->u.sha256); break;
+	case CLBT_DIGEST_BLAKE3: clbt_blake3_init(&d->u.blake3, 0); break;
+	default: assert(0);
+	}
+}
+
+void clbt_digest_update(struct ClbtDigest* d, const void* data, size_t len)
+{
+	switch (d->algo)
+	{
+	case CLBT_DIGEST_XXH3: clbt_xxh3_update(&d->u.xxh3, (const unsigned char*)data, len); break;
+	case CLBT_DIGEST_SHA256: clbt_sha256_update(&d->u.sha256, (const unsigned char*)data, len); break;
+	case CLBT_DIGEST_BLAKE3: clbt_blake3_update(&d->u.blake3, (const unsigned char*)data, len); break;
+	default: assert(0);
+	}
+}
+
+/*
+ * Write the digest to out, returns its size in bytes.
+ */
+int clbt_digest_final(struct ClbtDigest* d, unsigned char* out)
+{
+	struct ClbtBlake3Node node;
+	uint64_t h;
+	int i;
+
+	switch (d->algo)
+	{
+	case CLBT_DIGEST_XXH3:
+		/* canonical form is big endian, as printed by xxhsum */
+		h = clbt_xxh3_digest(&d->u.xxh3);
+		for (i = 0; i < 8; i++)
+			out[i] = (unsigned char)(h >> (56 - i * 8));
+		break;
+	case CLBT_DIGEST_SHA256:
+		clbt_sha256_final(&d->u.sha256, out);
+		break;
+	case CLBT_DIGEST_BLAKE3:
+		clbt_blake3_node(&d->u.blake3, &node);
+		clbt_blake3_root(&node, out);
+		break;
+	default:
+		assert(0);
+	}
+	return clbt_digest_size(d->algo);
+}
+
+/*
+ * Hex encode a digest, out needs 2 * len + 1 bytes.
+ */
+void clbt_digest_hex(const unsigned char* digest, int len, char* out)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		out[i * 2] = hex[digest[i] >> 4];
+		out[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	out[len * 2] = '\0';
+}
@@ -0,0 +1,397 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_du.c
+ *
+ *   Description:
+ *
+ *   Parallel disk usage task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <pthread.h>
+
+#define CLBT_DU_SHARDS	64		/* independently locked parts of the inode set */
+
+/*
+ * Usage is counted in st_blocks, so sparse and compressed files count what
+ * they really occupy. The enumerating thread sums the files of a directory
+ * locally, the walker then reports directories bottom-up and every finished
+ * directory adds its total to the parent with a single atomic add, so no
+ * directory is ever visited twice.
+ *
+ * Files with more than one link are counted once, the first thread to insert
+ * (dev, ino) into the shared set wins.
+ */
+struct ClbtDuInode
+{
+	dev_t dev;
+	ino_t ino;					/* 0 marks an empty slot */
+};
+
+struct ClbtDuShard
+{
+	pthread_mutex_t lock;
+	struct ClbtDuInode* slots;
+	size_t capacity;			/* power of two */
+	size_t count;
+};
+
+struct ClbtDuRecord
+{
+	unsigned long long blocks;
+	char* path;
+};
+
+/* records kept by one thread, a min heap on blocks when limited */
+struct ClbtDuWorker
+{
+	unsigned long long blocks;	/* files of the directory being enumerated */
+	struct ClbtDuRecord* items;
+	int size;
+	int capacity;
+};
+
+struct ClbtDuTask
+{
+	int limit;					/* keep only the largest records, 0 keeps all */
+	struct ClbtDuWorker* workers;	/* per thread */
+	struct ClbtDuShard shards[CLBT_DU_SHARDS];
+	unsigned long files;		/* atomic */
+	unsigned long dirs;			/* atomic */
+	unsigned long links;		/* extra links skipped, atomic */
+};
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static uint64_t clbt_du_inode_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev * 0xC2B2AE3D27D4EB4FULL;
+	return h ^ (h >> 29);
+}
+
+/*
+ * Insert (dev, ino), returns 1 if it was there already.
+ */
+static int clbt_du_inode_seen(struct ClbtDuTask* task, dev_t dev, ino_t ino)
+{
+	uint64_t h = clbt_du_inode_hash(dev, ino);
+	struct ClbtDuShard* shard = &task->shards[h % CLBT_DU_SHARDS];
+	struct ClbtDuInode* old;
+	size_t i, j, mask, oldCapacity;
+
+	h /= CLBT_DU_SHARDS;
+	pthread_mutex_lock(&shard->lock);
+
+	/* keep at most half of the slots used */
+	if ((shard->count + 1) * 2 > shard->capacity)
+	{
+		old = shard->slots;
+		oldCapacity = shard->capacity;
+		shard->capacity = oldCapacity ? oldCapacity * 2 : 256;
+		shard->slots = (struct ClbtDuInode*)calloc(shard->capacity, sizeof(struct ClbtDuInode));
+		if (shard->slots == NULL)
+		{
+			clbt_error("Unable to allocate memory for inode set!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		mask = shard->capacity - 1;
+		for (i = 0; i < oldCapacity; i++)
+		{
+			if (old[i].ino == 0)
+				continue;
+			j = (size_t)(clbt_du_inode_hash(old[i].dev, old[i].ino) / CLBT_DU_SHARDS) & mask;
+			while (shard->slots[j].ino != 0)
+				j = (j + 1) & mask;
+			shard->slots[j] = old[i];
+		}
+		free(old);
+	}
+
+	mask = shard->capacity - 1;
+	for (j = (size_t)h & mask; shard->slots[j].ino != 0; j = (j + 1) & mask)
+	{
+		if (shard->slots[j].ino == ino && shard->slots[j].dev == dev)
+		{
+			pthread_mutex_unlock(&shard->lock);
+			return 1;
+		}
+	}
+	shard->slots[j].dev = dev;
+	shard->slots[j].ino = ino;
+	shard->count++;
+
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_du_heap_swap(struct ClbtDuRecord* a, struct ClbtDuRecord* b)
+{
+	struct ClbtDuRecord t = *a;
+	*a = *b;
+	*b = t;
+}
+
+static void clbt_du_heap_down(struct ClbtDuWorker* w, int i)
+{
+	int c;
+
+	while ((c = 2 * i + 1) < w->size)
+	{
+		if (c + 1 < w->size && w->items[c + 1].blocks < w->items[c].blocks)
+			c++;
+		if (w->items[i].blocks <= w->items[c].blocks)
+			break;
+		clbt_du_heap_swap(&w->items[i], &w->items[c]);
+		i = c;
+	}
+}
+
+static char* clbt_du_copy(const char* path)
+{
+	char* copy = strdup(path);
+
+	if (copy == NULL)
+	{
+		clbt_error("Unable to allocate memory for disk usage!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	return copy;
+}
+
+static void clbt_du_record(struct ClbtDuTask* task, int tid, const char* path, unsigned long long blocks)
+{
+	struct ClbtDuWorker* w = &task->workers[tid];
+	struct ClbtDuRecord* items;
+	int i;
+
+	/* full heap, only a larger record replaces the smallest kept */
+	if (task->limit > 0 && w->size == task->limit)
+	{
+		if (blocks <= w->items[0].blocks)
+			return;
+		free(w->items[0].path);
+		w->items[0].path = clbt_du_copy(path);
+		w->items[0].blocks = blocks;
+		clbt_du_heap_down(w, 0);
+		return;
+	}
+
+	if (w->size == w->capacity)
+	{
+		w->capacity = w->capacity ? w->capacity * 2 : 64;
+		items = (struct ClbtDuRecord*)realloc(w->items, w->capacity * sizeof(struct ClbtDuRecord));
+		if (items == NULL)
+		{
+			clbt_error("Unable to reallocate memory for disk usage!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		w->items = items;
+	}
+	i = w->size++;
+	w->items[i].path = clbt_du_copy(path);
+	w->items[i].blocks = blocks;
+
+	if (task->limit > 0)
+	{
+		while (i > 0 && w->items[(i - 1) / 2].blocks > w->items[i].blocks)
+		{
+			clbt_du_heap_swap(&w->items[(i - 1) / 2], &w->items[i]);
+			i = (i - 1) / 2;
+		}
+	}
+}
+
+static int clbt_du_compare(const void* a, const void* b)
+{
+	const struct ClbtDuRecord* x = (const struct ClbtDuRecord*)a;
+	const struct ClbtDuRecord* y = (const struct ClbtDuRecord*)b;
+
+	if (x->blocks != y->blocks)
+		return x->blocks > y->blocks ? -1 : 1;
+	return strcmp(x->path, y->path);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_du_on_dir_begin(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid)
+{
+	unsigned long long* total = (unsigned long long*)malloc(sizeof(unsigned long long));
+	struct stat st;
+
+	if (total == NULL)
+	{
+		clbt_error("Unable to allocate memory for disk usage!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	/* the directory itself, set up before any sub directory can report to it */
+	*total = fstat(dirfd, &st) == 0 ? (unsigned long long)st.st_blocks : 0;
+	dir->data = total;
+	(void)walker;
+	(void)tid;
+}
+
+static int clbt_du_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtDuTask* task = (struct ClbtDuTask*)walker->user;
+
+	/* sub directories count themselves */
+	if (entry->type == CLBT_TYPE_DIR)
+		return CLBT_WALK_CONTINUE;
+
+	if (clbt_entry_stat(entry) != CLBT_OK)
+	{
+		if (entry->dir)
+			clbt_error("Cannot stat '%s/%s': %s", entry->dir->path, entry->name, strerror(errno));
+		else
+			clbt_error("Cannot stat '%s': %s", entry->name, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	if (entry->st.st_nlink > 1 && clbt_du_inode_seen(task, entry->st.st_dev, entry->st.st_ino))
+	{
+		clbt_atomic_add(&task->links, 1);
+		return CLBT_WALK_CONTINUE;
+	}
+	clbt_atomic_add(&task->files, 1);
+
+	/* a root that is not a directory */
+	if (entry->dir == NULL)
+		clbt_du_record(task, tid, entry->name, (unsigned long long)entry->st.st_blocks);
+	else
+		task->workers[tid].blocks += (unsigned long long)entry->st.st_blocks;
+	return CLBT_WALK_CONTINUE;
+}
+
+static void clbt_du_on_dir_end(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid)
+{
+	struct ClbtDuTask* task = (struct ClbtDuTask*)walker->user;
+
+	/* sub directories may be reporting already */
+	clbt_atomic_add((unsigned long long*)dir->data, task->workers[tid].blocks);
+	task->workers[tid].blocks = 0;
+	(void)dirfd;
+}
+
+static void clbt_du_on_dir_post(struct ClbtWalker* walker, struct ClbtDir* dir, int tid)
+{
+	struct ClbtDuTask* task = (struct ClbtDuTask*)walker->user;
+	unsigned long long total;
+
+	/* a directory that could not be opened has nothing */
+	if (dir->data == NULL)
+		return;
+
+	total = clbt_atomic_load((unsigned long long*)dir->data);
+	free(dir->data);
+	dir->data = NULL;
+
+	clbt_atomic_add(&task->dirs, 1);
+	clbt_du_record(task, tid, dir->path, total);
+	if (dir->parent != NULL)
+		clbt_atomic_add((unsigned long long*)dir->parent->data, total);
+}
+
+static const struct ClbtWalkOps clbtDuOps = { clbt_du_on_entry, clbt_du_on_dir_end, clbt_du_on_dir_post, clbt_du_on_dir_begin };
+
+/*
+ * Print disk usage of every directory below targets in KiB, largest first.
+ */
+int clbt_task_du(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtDuTask task;
+	struct ClbtRecord r;
+	struct ClbtDuRecord* all;
+	int i, j, n, ret, threads;
+
+	memset(&task, 0, sizeof(task));
+	task.limit = clbtConfig.limit;
+	for (i = 0; i < CLBT_DU_SHARDS; i++)
+		pthread_mutex_init(&task.shards[i].lock, NULL);
+
+	ret = clbt_walk_begin(&walker, &clbtDuOps, &task, CLBT_WALK_RECURSE | CLBT_WALK_NOATIME);
+	if (ret != CLBT_OK)
+		return ret;
+
+	threads = clbt_walk_threads(&walker);
+	task.workers = (struct ClbtDuWorker*)calloc(threads, sizeof(struct ClbtDuWorker));
+	if (task.workers == NULL)
+	{
+		clbt_error("Unable to allocate memory for disk usage!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	/* merge what every thread kept, then sort once */
+	for (i = 0, n = 0; i < threads; i++)
+		n += task.workers[i].size;
+	all = (struct ClbtDuRecord*)malloc((n > 0 ? n : 1) * sizeof(struct ClbtDuRecord));
+	if (all == NULL)
+	{
+		clbt_error("Unable to allocate memory for disk usage!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0, n = 0; i < threads; i++)
+	{
+		for (j = 0; j < task.workers[i].size; j++)
+			all[n++] = task.workers[i].items[j];
+		free(task.workers[i].items);
+	}
+	qsort(all, n, sizeof(struct ClbtDuRecord), clbt_du_compare);
+
+	for (i = 0; i < n; i++)
+	{
+		if (task.limit <= 0 || i < task.limit)
+		{
+			clbt_record_begin(&r);
+			clbt_record_number(&r, "kib", (all[i].blocks + 1) / 2);
+			clbt_record_string(&r, "path", all[i].path, strlen(all[i].path));
+			clbt_record_end(&r, -1);
+		}
+		free(all[i].path);
+	}
+	free(all);
+
+	clbt_verbose(options, "Counted %lu file(s) in %lu dir(s), %lu extra hard link(s) skipped.", task.files, task.dirs, task.links);
+
+	for (i = 0; i < CLBT_DU_SHARDS; i++)
+	{
+		pthread_mutex_destroy(&task.shards[i].lock);
+		free(task.shards[i].slots);
+	}
+	free(task.workers);
+	return ret;
+}
+
+#else
+
+int clbt_task_du(int options)
+{
+	(void)options;
+	return clbt_unsupported("du");
+}
+
+#endif
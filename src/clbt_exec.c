@@ -0,0 +1,953 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_exec.c
+ *
+ *   Description:
+ *
+ *   Command execution task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* pipe2() */
+#endif
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+#define CLBT_EXEC_HEADROOM	4096		/* bytes of ARG_MAX kept free, like xargs */
+#define CLBT_EXEC_FALLBACK	(128 << 10)	/* command line budget if ARG_MAX is unknown */
+#define CLBT_EXEC_FEED		(64 << 10)	/* paths written to a co-process at once */
+#define CLBT_EXEC_READ		(64 << 10)	/* bytes read from a child at once */
+#define CLBT_EXEC_WINDOW	4			/* commands per thread waiting for their turn */
+
+/*
+ * Matching files are packed into as few command lines as the kernel
+ * accepts, each invocation costs one posix_spawn() without a shell.
+ * Every worker thread fills a batch of its own and queues it as a job
+ * once full, so one large directory still keeps all threads busy. A
+ * running command holds its pool thread, at most -j children are alive.
+ * Output of every command is captured and printed in one piece when it
+ * ends, and with --keep-order held back in a window until all earlier
+ * commands printed.
+ *
+ * With --coproc every thread instead owns one long-lived child started
+ * before the walk, paths are streamed to its stdin one per line, or NUL
+ * terminated with --null. Output of all children is collected by one
+ * thread and printed in whole lines so results never interleave.
+ */
+struct ClbtExecBatch
+{
+	struct ClbtExecTask* task;
+	char* names;			/* packed paths, NUL terminated or --coproc delimited */
+	size_t used;
+	size_t capacity;
+	size_t* offsets;		/* start of every path in names */
+	int size;
+	int offsetCapacity;
+	size_t bytes;			/* argument bytes as counted by execve() */
+	CP path;				/* entry path buffer */
+	pid_t pid;				/* co-process of this thread, -1 if none */
+	int in;					/* stdin of the co-process, -1 once closed */
+	int out;				/* stdout of the co-process, -1 if not captured */
+	char* line;				/* output after the last delimiter, collector only */
+	size_t lineLen;
+	size_t lineCapacity;
+};
+
+/* Captured output of one command, pooled once printed */
+struct ClbtExecOutput
+{
+	struct ClbtExecOutput* next;	/* spare list */
+	unsigned long seq;				/* start order */
+	char* data[2];					/* stdout and stderr */
+	size_t len[2];
+	size_t capacity[2];
+};
+
+struct ClbtExecTask
+{
+	struct ClbtExecBatch* batches;	/* per thread */
+	int threads;
+	int quiet;				/* children write to /dev/null */
+	int slot;				/* index of "{}" in command words, -1 to append */
+	char delim;				/* path and output delimiter of co-processes */
+	size_t budget;			/* argument bytes per command line */
+	unsigned long files;	/* atomic */
+	unsigned long spawns;	/* atomic */
+	unsigned long failures;	/* atomic */
+	int capture;			/* collect output of every command */
+	int keepOrder;			/* print in the order commands started */
+	pthread_mutex_t lock;	/* guards outputs, printing and the window */
+	pthread_cond_t turn;
+	struct ClbtExecOutput* spare;
+	struct ClbtExecOutput** window;	/* finished outputs by seq % windowSize */
+	unsigned long windowSize;
+	unsigned long started;	/* seq of next command */
+	unsigned long printed;	/* every seq below is printed */
+};
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Bytes one argument takes of ARG_MAX, the string plus its argv pointer.
+ */
+static size_t clbt_exec_cost(const char* arg)
+{
+	return strlen(arg) + 1 + sizeof(char*);
+}
+
+static size_t clbt_exec_budget(void)
+{
+	long max = sysconf(_SC_ARG_MAX);
+	size_t used = CLBT_EXEC_HEADROOM;
+	char** env;
+	int i;
+
+	if (max <= 0)
+		max = CLBT_EXEC_FALLBACK;
+
+	/* the environment shares the same limit */
+	for (env = environ; env && *env; env++)
+		used += clbt_exec_cost(*env);
+	for (i = 0; i < clbtConfig.execArgs.size; i++)
+		used += clbt_exec_cost(clbtConfig.execArgs.paths[i]->path);
+
+	if ((size_t)max <= used + CLBT_EXEC_HEADROOM)
+		return CLBT_EXEC_HEADROOM;
+	return (size_t)max - used;
+}
+
+static int clbt_exec_pipe(int* fds)
+{
+#if defined(__linux__)
+	return pipe2(fds, O_CLOEXEC) == 0 ? CLBT_OK : CLBT_FAILURE_OS;
+#else
+	/* racy with concurrent spawns, where pipe2() is missing */
+	if (pipe(fds) != 0)
+		return CLBT_FAILURE_OS;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return CLBT_OK;
+#endif
+}
+
+/*
+ * Start the command on a batch, returns pid or -1. With fds, stdout and
+ * stderr of the child are pipes returned there.
+ */
+static pid_t clbt_exec_spawn(struct ClbtExecTask* task, struct ClbtExecBatch* batch, int* fds)
+{
+	posix_spawn_file_actions_t actions;
+	const int words = clbtConfig.execArgs.size;
+	int out[2] = { -1, -1 }, err[2] = { -1, -1 };
+	char** argv;
+	pid_t pid = -1;
+	int i, j, k, ret;
+
+	/* only the child's own ends survive exec, via dup2 */
+	if (fds && (clbt_exec_pipe(out) != CLBT_OK || clbt_exec_pipe(err) != CLBT_OK))
+	{
+		clbt_error("Cannot create pipe: %s", strerror(errno));
+		clbt_atomic_add(&task->failures, 1);
+		for (i = 0; i < 2; i++)
+		{
+			if (out[i] >= 0)
+				close(out[i]);
+		}
+		batch->used = 0;
+		batch->size = 0;
+		batch->bytes = 0;
+		return -1;
+	}
+
+	argv = (char**)malloc(sizeof(char*) * (words + batch->size + 1));
+	if (argv == NULL)
+	{
+		clbt_error("Unable to allocate memory for exec task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0, k = 0; i < words; i++)
+	{
+		if (i == task->slot)
+		{
+			for (j = 0; j < batch->size; j++)
+				argv[k++] = batch->names + batch->offsets[j];
+		}
+		else
+		{
+			argv[k++] = clbtConfig.execArgs.paths[i]->path;
+		}
+	}
+	if (task->slot < 0)
+	{
+		for (j = 0; j < batch->size; j++)
+			argv[k++] = batch->names + batch->offsets[j];
+	}
+	argv[k] = NULL;
+
+	posix_spawn_file_actions_init(&actions);
+	if (task->quiet)
+	{
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	}
+	else if (fds)
+	{
+		posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+	}
+	ret = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (fds)
+	{
+		close(out[1]);
+		close(err[1]);
+		fds[0] = out[0];
+		fds[1] = err[0];
+	}
+	if (ret != 0)
+	{
+		clbt_error("Cannot run '%s': %s", argv[0], strerror(ret));
+		clbt_atomic_add(&task->failures, 1);
+		pid = -1;
+	}
+	else
+	{
+		clbt_atomic_add(&task->spawns, 1);
+		clbt_atomic_add(&task->files, batch->size);
+	}
+	free(argv);
+
+	batch->used = 0;
+	batch->size = 0;
+	batch->bytes = 0;
+	return pid;
+}
+
+static void clbt_exec_wait(struct ClbtExecTask* task, pid_t pid)
+{
+	const char* name = clbtConfig.execArgs.paths[0]->path;
+	int status;
+
+	if (pid < 0)
+		return;
+	while (waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+			return;
+	}
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+	{
+		clbt_error("'%s' exited with status %d", name, WEXITSTATUS(status));
+		clbt_atomic_add(&task->failures, 1);
+	}
+	else if (WIFSIGNALED(status))
+	{
+		clbt_error("'%s' was killed by signal %d", name, WTERMSIG(status));
+		clbt_atomic_add(&task->failures, 1);
+	}
+}
+
+/*
+ * Take an output buffer and the next seq, waits while the window is full.
+ */
+static struct ClbtExecOutput* clbt_exec_reserve(struct ClbtExecTask* task)
+{
+	struct ClbtExecOutput* output;
+
+	pthread_mutex_lock(&task->lock);
+	while (task->keepOrder && task->started >= task->printed + task->windowSize)
+		pthread_cond_wait(&task->turn, &task->lock);
+
+	output = task->spare;
+	if (output != NULL)
+	{
+		task->spare = output->next;
+	}
+	else
+	{
+		output = (struct ClbtExecOutput*)calloc(1, sizeof(struct ClbtExecOutput));
+		if (output == NULL)
+		{
+			clbt_error("Unable to allocate memory for exec task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+	}
+	output->seq = task->started++;
+	output->len[0] = 0;
+	output->len[1] = 0;
+	pthread_mutex_unlock(&task->lock);
+	return output;
+}
+
+/*
+ * Read stdout and stderr of a child until both are closed.
+ */
+static void clbt_exec_capture(struct ClbtExecOutput* output, const int* fds)
+{
+	struct pollfd pfd[2];
+	ssize_t n;
+	void* p;
+	int i, alive = 0;
+
+	for (i = 0; i < 2; i++)
+	{
+		pfd[i].fd = fds[i];
+		pfd[i].events = POLLIN;
+		if (fds[i] >= 0)
+			alive++;
+	}
+
+	while (alive > 0)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < 2; i++)
+		{
+			if (pfd[i].fd < 0 || pfd[i].revents == 0)
+				continue;
+			if (output->capacity[i] - output->len[i] < CLBT_EXEC_READ / 4)
+			{
+				p = realloc(output->data[i], output->capacity[i] * 2 + CLBT_EXEC_READ);
+				if (p == NULL)
+				{
+					clbt_error("Unable to reallocate memory for exec task!");
+					exit(CLBT_MEMORY_ERR);
+				}
+				output->data[i] = (char*)p;
+				output->capacity[i] = output->capacity[i] * 2 + CLBT_EXEC_READ;
+			}
+			n = read(pfd[i].fd, output->data[i] + output->len[i], output->capacity[i] - output->len[i]);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n > 0)
+			{
+				output->len[i] += n;
+				continue;
+			}
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			alive--;
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (pfd[i].fd >= 0)
+			close(pfd[i].fd);
+	}
+}
+
+/* lock held */
+static void clbt_exec_print(struct ClbtExecTask* task, struct ClbtExecOutput* output)
+{
+	if (output->len[0] > 0)
+		clbt_print_raw(output->data[0], output->len[0]);
+	if (output->len[1] > 0)
+		clbt_error_raw(output->data[1], output->len[1]);
+	output->next = task->spare;
+	task->spare = output;
+}
+
+/*
+ * Print a finished output now, or with --keep-order once it is its turn.
+ */
+static void clbt_exec_release(struct ClbtExecTask* task, struct ClbtExecOutput* output)
+{
+	unsigned long slot;
+
+	pthread_mutex_lock(&task->lock);
+	if (!task->keepOrder)
+	{
+		clbt_exec_print(task, output);
+	}
+	else
+	{
+		task->window[output->seq % task->windowSize] = output;
+		while ((output = task->window[(slot = task->printed % task->windowSize)]) != NULL && output->seq == task->printed)
+		{
+			task->window[slot] = NULL;
+			clbt_exec_print(task, output);
+			task->printed++;
+		}
+		pthread_cond_broadcast(&task->turn);
+	}
+	pthread_mutex_unlock(&task->lock);
+}
+
+/*
+ * Run the command on a full batch and wait for it.
+ */
+static void clbt_exec_run(struct ClbtExecTask* task, struct ClbtExecBatch* batch)
+{
+	struct ClbtExecOutput* output;
+	int fds[2] = { -1, -1 };
+	pid_t pid;
+
+	if (!task->capture)
+	{
+		clbt_exec_wait(task, clbt_exec_spawn(task, batch, NULL));
+		return;
+	}
+
+	/* an output is reserved even if spawning fails, its seq must pass */
+	output = clbt_exec_reserve(task);
+	pid = clbt_exec_spawn(task, batch, fds);
+	clbt_exec_capture(output, fds);
+	clbt_exec_wait(task, pid);
+	clbt_exec_release(task, output);
+}
+
+static void clbt_exec_flush_job(void* arg, int tid)
+{
+	struct ClbtExecBatch* batch = (struct ClbtExecBatch*)arg;
+
+	clbt_exec_run(batch->task, batch);
+	(void)tid;
+}
+
+static void clbt_exec_batch_job(void* arg, int tid)
+{
+	struct ClbtExecBatch* batch = (struct ClbtExecBatch*)arg;
+
+	clbt_exec_run(batch->task, batch);
+	free(batch->names);
+	free(batch->offsets);
+	free(batch);
+	(void)tid;
+}
+
+/*
+ * Move the paths of a full batch to a job of its own, the walk goes on.
+ */
+static void clbt_exec_submit(struct ClbtWalker* walker, struct ClbtExecBatch* batch)
+{
+	struct ClbtExecBatch* full = (struct ClbtExecBatch*)calloc(1, sizeof(struct ClbtExecBatch));
+
+	if (full == NULL)
+	{
+		clbt_error("Unable to allocate memory for exec task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	full->task = batch->task;
+	full->names = batch->names;
+	full->used = batch->used;
+	full->capacity = batch->capacity;
+	full->offsets = batch->offsets;
+	full->size = batch->size;
+	full->offsetCapacity = batch->offsetCapacity;
+	full->bytes = batch->bytes;
+
+	batch->names = NULL;
+	batch->used = 0;
+	batch->capacity = 0;
+	batch->offsets = NULL;
+	batch->size = 0;
+	batch->offsetCapacity = 0;
+	batch->bytes = 0;
+	clbt_pool_submit(walker->pool, clbt_exec_batch_job, full);
+}
+
+static void clbt_exec_add(struct ClbtExecBatch* batch, const char* path)
+{
+	size_t len = strlen(path) + 1;
+	void* p;
+
+	if (batch->used + len > batch->capacity)
+	{
+		batch->capacity = (batch->used + len) * 2;
+		p = realloc(batch->names, batch->capacity);
+		if (p == NULL)
+		{
+			clbt_error("Unable to reallocate memory for exec task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		batch->names = (char*)p;
+	}
+	if (batch->size == batch->offsetCapacity)
+	{
+		batch->offsetCapacity = batch->offsetCapacity ? batch->offsetCapacity * 2 : 256;
+		p = realloc(batch->offsets, batch->offsetCapacity * sizeof(size_t));
+		if (p == NULL)
+		{
+			clbt_error("Unable to reallocate memory for exec task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		batch->offsets = (size_t*)p;
+	}
+
+	memcpy(batch->names + batch->used, path, len);
+	batch->offsets[batch->size++] = batch->used;
+	batch->used += len;
+	batch->bytes += len + sizeof(char*);
+}
+
+static int clbt_exec_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtExecTask* task = (struct ClbtExecTask*)walker->user;
+	struct ClbtExecBatch* batch = &task->batches[tid];
+
+	if (entry->type != CLBT_TYPE_FILE || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	clbt_entry_path(entry, &batch->path);
+
+	/* run what we have if this path does not fit any more */
+	if (batch->size > 0 && batch->bytes + clbt_exec_cost(batch->path.path) > task->budget)
+		clbt_exec_submit(walker, batch);
+	clbt_exec_add(batch, batch->path.path);
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtExecOps = { clbt_exec_on_entry, NULL, NULL, NULL };
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Start the co-process of one thread, nothing else runs at this time.
+ */
+static int clbt_exec_start(struct ClbtExecTask* task, struct ClbtExecBatch* batch)
+{
+	posix_spawn_file_actions_t actions;
+	const int words = clbtConfig.execArgs.size;
+	int in[2] = { -1, -1 }, out[2] = { -1, -1 };
+	char** argv;
+	int i, err;
+
+	if (clbt_exec_pipe(in) != CLBT_OK || (!task->quiet && clbt_exec_pipe(out) != CLBT_OK))
+	{
+		clbt_error("Cannot create pipe: %s", strerror(errno));
+		for (i = 0; i < 2; i++)
+		{
+			if (in[i] >= 0)
+				close(in[i]);
+		}
+		return CLBT_FAILURE_OS;
+	}
+
+	argv = (char**)malloc(sizeof(char*) * (words + 1));
+	if (argv == NULL)
+	{
+		clbt_error("Unable to allocate memory for exec task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < words; i++)
+		argv[i] = clbtConfig.execArgs.paths[i]->path;
+	argv[words] = NULL;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+	if (task->quiet)
+	{
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	}
+	else
+	{
+		posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+	}
+	err = posix_spawnp(&batch->pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	free(argv);
+
+	close(in[0]);
+	if (out[1] >= 0)
+		close(out[1]);
+	if (err != 0)
+	{
+		clbt_error("Cannot run '%s': %s", clbtConfig.execArgs.paths[0]->path, strerror(err));
+		close(in[1]);
+		if (out[0] >= 0)
+			close(out[0]);
+		batch->pid = -1;
+		return CLBT_FAILURE_OS;
+	}
+
+	batch->in = in[1];
+	batch->out = out[0];
+	clbt_atomic_add(&task->spawns, 1);
+	return CLBT_OK;
+}
+
+/*
+ * Write buffered paths to the co-process, it is dropped if gone.
+ */
+static void clbt_exec_feed(struct ClbtExecTask* task, struct ClbtExecBatch* batch)
+{
+	if (batch->in >= 0 && batch->used > 0)
+	{
+		if (clbt_write_full(batch->in, batch->names, batch->used) == CLBT_OK)
+		{
+			clbt_atomic_add(&task->files, batch->size);
+		}
+		else
+		{
+			clbt_error("Cannot feed '%s': %s", clbtConfig.execArgs.paths[0]->path, strerror(errno));
+			clbt_atomic_add(&task->failures, 1);
+			close(batch->in);
+			batch->in = -1;
+		}
+	}
+	batch->used = 0;
+	batch->size = 0;
+}
+
+static int clbt_exec_feed_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtExecTask* task = (struct ClbtExecTask*)walker->user;
+	struct ClbtExecBatch* batch = &task->batches[tid];
+	size_t len;
+	void* p;
+
+	if (entry->type != CLBT_TYPE_FILE || !clbt_match_entry(entry) || batch->in < 0)
+		return CLBT_WALK_CONTINUE;
+
+	clbt_entry_path(entry, &batch->path);
+	len = strlen(batch->path.path);
+	if (batch->used + len + 1 > batch->capacity)
+	{
+		batch->capacity = batch->used + len + 1 + CLBT_EXEC_FEED;
+		p = realloc(batch->names, batch->capacity);
+		if (p == NULL)
+		{
+			clbt_error("Unable to reallocate memory for exec task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		batch->names = (char*)p;
+	}
+	memcpy(batch->names + batch->used, batch->path.path, len);
+	batch->names[batch->used + len] = task->delim;
+	batch->used += len + 1;
+	batch->size++;
+
+	if (batch->used >= CLBT_EXEC_FEED)
+		clbt_exec_feed(task, batch);
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtExecFeedOps = { clbt_exec_feed_on_entry, NULL, NULL, NULL };
+
+/*
+ * Print output of a co-process up to its last delimiter, keep the rest.
+ */
+static void clbt_exec_output(struct ClbtExecBatch* batch, const char* data, size_t len, char delim)
+{
+	size_t end = len;
+	void* p;
+
+	while (end > 0 && data[end - 1] != delim)
+		end--;
+
+	if (batch->lineLen + len > batch->lineCapacity)
+	{
+		batch->lineCapacity = (batch->lineLen + len) * 2;
+		p = realloc(batch->line, batch->lineCapacity);
+		if (p == NULL)
+		{
+			clbt_error("Unable to reallocate memory for exec task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		batch->line = (char*)p;
+	}
+
+	if (end > 0 && batch->lineLen == 0)
+	{
+		clbt_print_raw(data, end);
+	}
+	else if (end > 0)
+	{
+		memcpy(batch->line + batch->lineLen, data, end);
+		clbt_print_raw(batch->line, batch->lineLen + end);
+		batch->lineLen = 0;
+	}
+	memcpy(batch->line + batch->lineLen, data + end, len - end);
+	batch->lineLen += len - end;
+}
+
+static void* clbt_exec_collect(void* arg)
+{
+	struct ClbtExecTask* task = (struct ClbtExecTask*)arg;
+	struct ClbtExecBatch* batch;
+	struct pollfd* fds;
+	char* buf;
+	ssize_t n;
+	int i, alive = 0;
+
+	fds = (struct pollfd*)malloc(sizeof(struct pollfd) * task->threads);
+	buf = (char*)malloc(CLBT_EXEC_READ);
+	if (fds == NULL || buf == NULL)
+	{
+		clbt_error("Unable to allocate memory for exec task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < task->threads; i++)
+	{
+		fds[i].fd = task->batches[i].out;
+		fds[i].events = POLLIN;
+		if (fds[i].fd >= 0)
+			alive++;
+	}
+
+	while (alive > 0)
+	{
+		if (poll(fds, task->threads, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			clbt_error("Cannot poll co-processes: %s", strerror(errno));
+			break;
+		}
+		for (i = 0; i < task->threads; i++)
+		{
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+				continue;
+			batch = &task->batches[i];
+			n = read(fds[i].fd, buf, CLBT_EXEC_READ);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n > 0)
+			{
+				clbt_exec_output(batch, buf, n, task->delim);
+				continue;
+			}
+
+			/* closed, an unterminated last line is printed as is */
+			if (batch->lineLen > 0)
+				clbt_print_raw(batch->line, batch->lineLen);
+			batch->lineLen = 0;
+			close(fds[i].fd);
+			fds[i].fd = -1;
+			alive--;
+		}
+	}
+
+	free(buf);
+	free(fds);
+	return NULL;
+}
+
+/*
+ * Stream matching files to one long-lived co-process per thread.
+ */
+static int clbt_exec_coproc(int options, struct ClbtExecTask* task)
+{
+	struct ClbtWalker walker;
+	struct sigaction ignore, old;
+	pthread_t collector;
+	int i, ret, walked, collecting = 0;
+
+	ret = clbt_walk_begin(&walker, &clbtExecFeedOps, task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	/* a co-process that quits early must not kill us on the next write */
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &old);
+
+	task->threads = clbt_walk_threads(&walker);
+	task->batches = (struct ClbtExecBatch*)calloc(task->threads, sizeof(struct ClbtExecBatch));
+	if (task->batches == NULL)
+	{
+		clbt_error("Unable to allocate memory for exec task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < task->threads; i++)
+	{
+		clbt_path_init(&task->batches[i].path);
+		task->batches[i].pid = -1;
+		task->batches[i].in = -1;
+		task->batches[i].out = -1;
+	}
+	for (i = 0; i < task->threads && ret == CLBT_OK; i++)
+		ret = clbt_exec_start(task, &task->batches[i]);
+
+	if (ret == CLBT_OK && !task->quiet)
+	{
+		if (pthread_create(&collector, NULL, clbt_exec_collect, task) != 0)
+		{
+			clbt_error("Unable to create collector thread!");
+			ret = CLBT_FAILURE_OS;
+		}
+		else
+		{
+			collecting = 1;
+		}
+	}
+
+	if (ret == CLBT_OK)
+	{
+		for (i = 0; i < clbtConfig.targets.size; i++)
+			clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	}
+	walked = clbt_walk_end(&walker);
+	if (ret == CLBT_OK)
+		ret = walked;
+
+	/* end of input lets every co-process finish */
+	for (i = 0; i < task->threads; i++)
+	{
+		clbt_exec_feed(task, &task->batches[i]);
+		if (task->batches[i].in >= 0)
+			close(task->batches[i].in);
+	}
+	if (collecting)
+		pthread_join(collector, NULL);
+	for (i = 0; i < task->threads; i++)
+	{
+		if (!collecting && task->batches[i].out >= 0)
+			close(task->batches[i].out);
+		clbt_exec_wait(task, task->batches[i].pid);
+		free(task->batches[i].names);
+		free(task->batches[i].line);
+		clbt_path_destroy(&task->batches[i].path);
+	}
+	free(task->batches);
+	sigaction(SIGPIPE, &old, NULL);
+
+	clbt_verbose(options, "Fed %lu file(s) to %lu co-process(es), %lu failed.", task->files, task->spawns, task->failures);
+	if (ret == CLBT_OK && task->failures > 0)
+		ret = CLBT_FAILURE_OS;
+	return ret;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Run a command on matching files, as many per invocation as fit.
+ */
+int clbt_task_exec(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtExecTask task;
+	struct ClbtExecOutput* output;
+	struct ClbtPool* pool;
+	int i, ret;
+
+	if (clbtConfig.execArgs.size < 1)
+	{
+		clbt_error("No command to execute.");
+		return CLBT_INVALID_OP;
+	}
+
+	memset(&task, 0, sizeof(task));
+	task.quiet = (options & CLBT_OPT_QUIET) != 0;
+	task.delim = (options & CLBT_OPT_NULL) ? '\0' : '\n';
+	task.budget = clbt_exec_budget();
+	task.capture = !task.quiet;
+	task.keepOrder = (options & CLBT_OPT_KEEPORDER) != 0;
+	task.slot = -1;
+	for (i = 0; i < clbtConfig.execArgs.size; i++)
+	{
+		if (strcmp(clbtConfig.execArgs.paths[i]->path, "{}") == 0)
+		{
+			task.slot = i;
+			break;
+		}
+	}
+	if (task.slot == 0 || (task.slot > 0 && (options & CLBT_OPT_COPROC)))
+	{
+		clbt_error("'{}' can't start a command, nor be used with --coproc.");
+		return CLBT_INVALID_OP;
+	}
+	if (options & CLBT_OPT_COPROC)
+		return clbt_exec_coproc(options, &task);
+
+	ret = clbt_walk_begin(&walker, &clbtExecOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	task.threads = clbt_walk_threads(&walker);
+	task.batches = (struct ClbtExecBatch*)calloc(task.threads, sizeof(struct ClbtExecBatch));
+	task.windowSize = (unsigned long)task.threads * CLBT_EXEC_WINDOW;
+	task.window = (struct ClbtExecOutput**)calloc(task.windowSize, sizeof(struct ClbtExecOutput*));
+	if (task.batches == NULL || task.window == NULL)
+	{
+		clbt_error("Unable to allocate memory for exec task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < task.threads; i++)
+	{
+		task.batches[i].task = &task;
+		clbt_path_init(&task.batches[i].path);
+	}
+	pthread_mutex_init(&task.lock, NULL);
+	pthread_cond_init(&task.turn, NULL);
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	/* partial batches left by every thread run side by side */
+	pool = clbt_pool_create(task.threads);
+	for (i = 0; i < task.threads; i++)
+	{
+		if (task.batches[i].size > 0)
+			clbt_pool_submit(pool, clbt_exec_flush_job, &task.batches[i]);
+	}
+	clbt_pool_wait(pool);
+	clbt_pool_destroy(pool);
+
+	for (i = 0; i < task.threads; i++)
+	{
+		free(task.batches[i].names);
+		free(task.batches[i].offsets);
+		clbt_path_destroy(&task.batches[i].path);
+	}
+	free(task.batches);
+	free(task.window);
+	while ((output = task.spare) != NULL)
+	{
+		task.spare = output->next;
+		free(output->data[0]);
+		free(output->data[1]);
+		free(output);
+	}
+	pthread_cond_destroy(&task.turn);
+	pthread_mutex_destroy(&task.lock);
+
+	clbt_verbose(options, "Ran %lu command(s) on %lu file(s), %lu failed.", task.spawns, task.files, task.failures);
+	if (ret == CLBT_OK && task.failures > 0)
+		ret = CLBT_FAILURE_OS;
+	return ret;
+}
+
+#else
+
+int clbt_task_exec(int options)
+{
+	(void)options;
+	return clbt_unsupported("exec");
+}
+
+#endif
@@ -0,0 +1,684 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_expr.c
+ *
+ *   Description:
+ *
+ *   Find like filter expressions compiled to bytecode for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CLBT_EXPR_MAX_OPS	65535	/* jump targets are 16 bit */
+#define CLBT_EXPR_DAY		86400
+
+/*
+ * An expression like find's, in one string:
+ *
+ *   -name PATTERN  -type f|d|l  -size [+-]N[ckMG]  -mtime [+-]N  -true  -false
+ *   EXPR -and EXPR, EXPR -a EXPR or just EXPR EXPR, EXPR -or EXPR, EXPR -o EXPR
+ *   -not EXPR, ! EXPR, ( EXPR )
+ *
+ * -size rounds the size up to its unit, bytes by default, and -mtime counts
+ * whole days of age, with + meaning more and - meaning less than N. It is
+ * parsed once into a tree, folded where a test can never fail or never
+ * pass, and each -and/-or run is reordered so that tests on the name run
+ * before those needing a stat. No test has a side effect, so any order
+ * gives the same answer. The tree is then flattened to a few ops jumping
+ * past the rest of a run once its answer is known.
+ */
+
+/* ops of tree and program */
+enum
+{
+	CLBT_EXPR_FALSE = 0, CLBT_EXPR_TRUE, CLBT_EXPR_NAME, CLBT_EXPR_TYPE, CLBT_EXPR_SIZE, CLBT_EXPR_MTIME,
+	CLBT_EXPR_AND, CLBT_EXPR_OR, CLBT_EXPR_NOT, CLBT_EXPR_JF, CLBT_EXPR_JT, CLBT_EXPR_RET
+};
+
+/* what a test costs, an -and/-or run costs all of its tests */
+enum { CLBT_COST_CONST = 0, CLBT_COST_NAME = 1, CLBT_COST_TYPE = 2, CLBT_COST_STAT = 16 };
+
+struct ClbtExprNode
+{
+	int op;							/* CLBT_EXPR_XXX */
+	int cmp;						/* -1, 0 or 1 for less, equal or more with size and mtime */
+	int64_t value;					/* CLBT_TYPE_XXX, size in units or age in days */
+	int64_t unit;					/* bytes per size unit */
+	const char* pattern;			/* name pattern, a token of the source */
+	int cost;						/* CLBT_COST_XXX summed over the operands */
+	int count;						/* operands of and, or and not */
+	struct ClbtExprNode** args;
+};
+
+struct ClbtExprOp
+{
+	unsigned char op;				/* CLBT_EXPR_XXX */
+	signed char cmp;				/* as in ClbtExprNode */
+	unsigned short jump;			/* target of JF and JT, pattern number of NAME */
+	int64_t value;					/* as in ClbtExprNode, bytes per unit in unit */
+	int64_t unit;
+};
+
+struct ClbtExpr
+{
+	char* source;					/* expression as given */
+	CL patterns;					/* name patterns of NAME ops */
+	struct ClbtExprOp* ops;
+	int count;
+	int constant;					/* -1 unless the answer is always 0 or 1 */
+	time_t now;						/* -mtime counts from here */
+};
+
+struct ClbtExprParser
+{
+	CL tokens;
+	int pos;
+	int failed;
+};
+
+static void clbt_expr_oom(void)
+{
+	clbt_error("Unable to allocate memory for expression!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+static struct ClbtExprNode* clbt_expr_node(int op)
+{
+	struct ClbtExprNode* node = (struct ClbtExprNode*)calloc(1, sizeof(struct ClbtExprNode));
+	if (node == NULL)
+		clbt_expr_oom();
+	node->op = op;
+	return node;
+}
+
+static void clbt_expr_add(struct ClbtExprNode* node, struct ClbtExprNode* arg)
+{
+	struct ClbtExprNode** args = (struct ClbtExprNode**)realloc(node->args, (node->count + 1) * sizeof(*args));
+	if (args == NULL)
+		clbt_expr_oom();
+	args[node->count++] = arg;
+	node->args = args;
+}
+
+static void clbt_expr_free_node(struct ClbtExprNode* node)
+{
+	int i;
+
+	if (node == NULL)
+		return;
+	for (i = 0; i < node->count; i++)
+		clbt_expr_free_node(node->args[i]);
+	free(node->args);
+	free(node);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Parser, -or binds loosest, then -and, then -not */
+
+static const char* clbt_expr_peek(const struct ClbtExprParser* p)
+{
+	return p->pos < p->tokens.size ? p->tokens.paths[p->pos]->path : NULL;
+}
+
+static const char* clbt_expr_take(struct ClbtExprParser* p)
+{
+	const char* tok = clbt_expr_peek(p);
+	if (tok != NULL)
+		p->pos++;
+	return tok;
+}
+
+static struct ClbtExprNode* clbt_expr_fail(struct ClbtExprParser* p, struct ClbtExprNode* node, const char* format, const char* tok)
+{
+	if (!p->failed)
+		clbt_error(format, tok);
+	p->failed = 1;
+	clbt_expr_free_node(node);
+	return NULL;
+}
+
+/*
+ * Parse "[+-]N" with an optional unit suffix out of units.
+ */
+static int clbt_expr_number(const char* str, const char* units, struct ClbtExprNode* node)
+{
+	char* end;
+	long long n;
+
+	node->cmp = 0;
+	node->unit = 1;
+	if (*str == '+')
+		node->cmp = 1, str++;
+	else if (*str == '-')
+		node->cmp = -1, str++;
+	if (*str < '0' || *str > '9')
+		return CLBT_INVALID_OP;
+	n = strtoll(str, &end, 10);
+	if (*end != '\0')
+	{
+		if (units == NULL || end[1] != '\0' || strchr(units, *end) == NULL)
+			return CLBT_INVALID_OP;
+		switch (*end)
+		{
+		case 'k': node->unit = 1024; break;
+		case 'M': node->unit = 1024 * 1024; break;
+		case 'G': node->unit = 1024 * 1024 * 1024; break;
+		default: break;
+		}
+	}
+	node->value = n;
+	return CLBT_OK;
+}
+
+static struct ClbtExprNode* clbt_expr_or(struct ClbtExprParser* p);
+
+static struct ClbtExprNode* clbt_expr_primary(struct ClbtExprParser* p)
+{
+	struct ClbtExprNode* node;
+	struct ClbtExprNode* sub;
+	const char* tok = clbt_expr_take(p);
+	const char* arg;
+
+	if (tok == NULL)
+		return clbt_expr_fail(p, NULL, "Expression ends where a test is expected.", NULL);
+
+	if (strcmp(tok, "(") == 0)
+	{
+		node = clbt_expr_or(p);
+		if (node == NULL)
+			return NULL;
+		tok = clbt_expr_take(p);
+		if (tok == NULL || strcmp(tok, ")") != 0)
+			return clbt_expr_fail(p, node, "Expression misses a ')'.", NULL);
+		return node;
+	}
+	if (strcmp(tok, "-not") == 0 || strcmp(tok, "!") == 0)
+	{
+		if ((sub = clbt_expr_primary(p)) == NULL)
+			return NULL;
+		node = clbt_expr_node(CLBT_EXPR_NOT);
+		clbt_expr_add(node, sub);
+		return node;
+	}
+	if (strcmp(tok, "-true") == 0)
+		return clbt_expr_node(CLBT_EXPR_TRUE);
+	if (strcmp(tok, "-false") == 0)
+		return clbt_expr_node(CLBT_EXPR_FALSE);
+
+	if (strcmp(tok, "-name") == 0)
+		node = clbt_expr_node(CLBT_EXPR_NAME);
+	else if (strcmp(tok, "-type") == 0)
+		node = clbt_expr_node(CLBT_EXPR_TYPE);
+	else if (strcmp(tok, "-size") == 0)
+		node = clbt_expr_node(CLBT_EXPR_SIZE);
+	else if (strcmp(tok, "-mtime") == 0)
+		node = clbt_expr_node(CLBT_EXPR_MTIME);
+	else
+		return clbt_expr_fail(p, NULL, "Unknown test '%s' in expression.", tok);
+
+	if ((arg = clbt_expr_take(p)) == NULL)
+		return clbt_expr_fail(p, node, "Missing argument to '%s' in expression.", tok);
+
+	switch (node->op)
+	{
+	case CLBT_EXPR_NAME:
+		node->pattern = arg;
+		break;
+	case CLBT_EXPR_TYPE:
+		if (strcmp(arg, "f") == 0)
+			node->value = CLBT_TYPE_FILE;
+		else if (strcmp(arg, "d") == 0)
+			node->value = CLBT_TYPE_DIR;
+		else if (strcmp(arg, "l") == 0)
+			node->value = CLBT_TYPE_LINK;
+		else
+			return clbt_expr_fail(p, node, "Unknown type '%s' in expression, use f, d or l.", arg);
+		break;
+	case CLBT_EXPR_SIZE:
+		if (clbt_expr_number(arg, "ckMG", node) != CLBT_OK)
+			return clbt_expr_fail(p, node, "Bad size '%s' in expression.", arg);
+		break;
+	default:
+		if (clbt_expr_number(arg, NULL, node) != CLBT_OK)
+			return clbt_expr_fail(p, node, "Bad number of days '%s' in expression.", arg);
+		break;
+	}
+	return node;
+}
+
+static struct ClbtExprNode* clbt_expr_and(struct ClbtExprParser* p)
+{
+	struct ClbtExprNode* node;
+	struct ClbtExprNode* arg;
+	const char* tok;
+
+	if ((arg = clbt_expr_primary(p)) == NULL)
+		return NULL;
+	node = clbt_expr_node(CLBT_EXPR_AND);
+	clbt_expr_add(node, arg);
+
+	/* a test following another is joined by an implicit -and */
+	while ((tok = clbt_expr_peek(p)) != NULL && strcmp(tok, ")") != 0 && strcmp(tok, "-or") != 0 && strcmp(tok, "-o") != 0)
+	{
+		if (strcmp(tok, "-and") == 0 || strcmp(tok, "-a") == 0)
+			p->pos++;
+		if ((arg = clbt_expr_primary(p)) == NULL)
+		{
+			clbt_expr_free_node(node);
+			return NULL;
+		}
+		clbt_expr_add(node, arg);
+	}
+	return node;
+}
+
+static struct ClbtExprNode* clbt_expr_or(struct ClbtExprParser* p)
+{
+	struct ClbtExprNode* node;
+	struct ClbtExprNode* arg;
+	const char* tok;
+
+	if ((arg = clbt_expr_and(p)) == NULL)
+		return NULL;
+	node = clbt_expr_node(CLBT_EXPR_OR);
+	clbt_expr_add(node, arg);
+
+	while ((tok = clbt_expr_peek(p)) != NULL && (strcmp(tok, "-or") == 0 || strcmp(tok, "-o") == 0))
+	{
+		p->pos++;
+		if ((arg = clbt_expr_and(p)) == NULL)
+		{
+			clbt_expr_free_node(node);
+			return NULL;
+		}
+		clbt_expr_add(node, arg);
+	}
+	return node;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Folding and ordering */
+
+static struct ClbtExprNode* clbt_expr_replace(struct ClbtExprNode* node, int op)
+{
+	clbt_expr_free_node(node);
+	return clbt_expr_node(op);
+}
+
+/*
+ * Fold node bottom up, the result is a constant, a test, or a -not, -and or
+ * -or of no constants. The operands of a run are sorted by cost.
+ */
+static struct ClbtExprNode* clbt_expr_fold(struct ClbtExprNode* node)
+{
+	struct ClbtExprNode* arg;
+	const char* s;
+	int i, j, n, absorb, ignore;
+
+	switch (node->op)
+	{
+	case CLBT_EXPR_TRUE:
+	case CLBT_EXPR_FALSE:
+		node->cost = CLBT_COST_CONST;
+		return node;
+	case CLBT_EXPR_NAME:
+		for (s = node->pattern; *s == '*'; s++);
+		if (*s == '\0')
+			return clbt_expr_replace(node, CLBT_EXPR_TRUE);
+		node->cost = CLBT_COST_NAME;
+		return node;
+	case CLBT_EXPR_TYPE:
+		node->cost = CLBT_COST_TYPE;
+		return node;
+	case CLBT_EXPR_SIZE:
+		/* nothing is smaller than nothing */
+		if (node->cmp < 0 && node->value == 0)
+			return clbt_expr_replace(node, CLBT_EXPR_FALSE);
+		node->cost = CLBT_COST_STAT;
+		return node;
+	case CLBT_EXPR_MTIME:
+		node->cost = CLBT_COST_STAT;
+		return node;
+	case CLBT_EXPR_NOT:
+		arg = clbt_expr_fold(node->args[0]);
+		node->args[0] = arg;
+		if (arg->op == CLBT_EXPR_TRUE || arg->op == CLBT_EXPR_FALSE)
+			return clbt_expr_replace(node, arg->op == CLBT_EXPR_TRUE ? CLBT_EXPR_FALSE : CLBT_EXPR_TRUE);
+		if (arg->op == CLBT_EXPR_NOT)
+		{
+			node->args[0] = arg->args[0];
+			arg->count = 0;
+			clbt_expr_free_node(arg);
+			arg = node->args[0];
+			node->count = 0;
+			clbt_expr_free_node(node);
+			return arg;
+		}
+		node->cost = arg->cost;
+		return node;
+	default:
+		break;
+	}
+
+	/* -and: a false operand decides, a true one is dropped, -or the other way */
+	absorb = node->op == CLBT_EXPR_AND ? CLBT_EXPR_FALSE : CLBT_EXPR_TRUE;
+	ignore = node->op == CLBT_EXPR_AND ? CLBT_EXPR_TRUE : CLBT_EXPR_FALSE;
+	n = 0;
+	for (i = 0; i < node->count; i++)
+	{
+		arg = clbt_expr_fold(node->args[i]);
+		if (arg->op == absorb)
+		{
+			node->args[i] = arg;
+			return clbt_expr_replace(node, absorb);
+		}
+		if (arg->op == ignore)
+		{
+			clbt_expr_free_node(arg);
+			continue;
+		}
+		if (arg->op == node->op)
+		{
+			/* a run inside a run of the same op joins it */
+			for (j = 0; j < arg->count; j++)
+				clbt_expr_add(node, arg->args[j]);
+			arg->count = 0;
+			clbt_expr_free_node(arg);
+			continue;
+		}
+		node->args[n++] = arg;
+	}
+	node->count = n;
+
+	if (n == 0)
+		return clbt_expr_replace(node, ignore);
+	if (n == 1)
+	{
+		arg = node->args[0];
+		node->count = 0;
+		clbt_expr_free_node(node);
+		return arg;
+	}
+
+	/* cheap tests first, keeping the given order among equals */
+	node->cost = 0;
+	for (i = 1; i < n; i++)
+	{
+		arg = node->args[i];
+		for (j = i; j > 0 && node->args[j - 1]->cost > arg->cost; j--)
+			node->args[j] = node->args[j - 1];
+		node->args[j] = arg;
+	}
+	for (i = 0; i < n; i++)
+		node->cost += node->args[i]->cost;
+	return node;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Program */
+
+static void clbt_expr_emit_op(struct ClbtExpr* expr, int op, const struct ClbtExprNode* node)
+{
+	struct ClbtExprOp* ops;
+	struct ClbtExprOp* o;
+
+	if ((expr->count & (expr->count - 1)) == 0)
+	{
+		ops = (struct ClbtExprOp*)realloc(expr->ops, (expr->count ? expr->count * 2 : 8) * sizeof(struct ClbtExprOp));
+		if (ops == NULL)
+			clbt_expr_oom();
+		expr->ops = ops;
+	}
+
+	o = &expr->ops[expr->count++];
+	memset(o, 0, sizeof(struct ClbtExprOp));
+	o->op = (unsigned char)op;
+	if (node != NULL)
+	{
+		o->cmp = (signed char)node->cmp;
+		o->value = node->value;
+		o->unit = node->unit;
+	}
+	if (op == CLBT_EXPR_NAME)
+	{
+		o->jump = (unsigned short)expr->patterns.size;
+		clbt_list_append(&expr->patterns, node->pattern);
+	}
+}
+
+/*
+ * Emit node, each operand of a run but the last jumps to the end of the
+ * run once it decides it, leaving its answer for whatever follows.
+ */
+static int clbt_expr_emit(struct ClbtExpr* expr, const struct ClbtExprNode* node)
+{
+	int* jumps;
+	int i;
+
+	switch (node->op)
+	{
+	case CLBT_EXPR_NOT:
+		if (clbt_expr_emit(expr, node->args[0]) != CLBT_OK)
+			return CLBT_INVALID_OP;
+		clbt_expr_emit_op(expr, CLBT_EXPR_NOT, NULL);
+		break;
+	case CLBT_EXPR_AND:
+	case CLBT_EXPR_OR:
+		jumps = (int*)malloc(node->count * sizeof(int));
+		if (jumps == NULL)
+			clbt_expr_oom();
+		for (i = 0; i < node->count; i++)
+		{
+			if (clbt_expr_emit(expr, node->args[i]) != CLBT_OK)
+			{
+				free(jumps);
+				return CLBT_INVALID_OP;
+			}
+			jumps[i] = expr->count;
+			if (i + 1 < node->count)
+				clbt_expr_emit_op(expr, node->op == CLBT_EXPR_AND ? CLBT_EXPR_JF : CLBT_EXPR_JT, NULL);
+		}
+		for (i = 0; i + 1 < node->count; i++)
+			expr->ops[jumps[i]].jump = (unsigned short)expr->count;
+		free(jumps);
+		break;
+	default:
+		clbt_expr_emit_op(expr, node->op, node);
+		break;
+	}
+
+	if (expr->count >= CLBT_EXPR_MAX_OPS)
+	{
+		clbt_error("Expression is too long.");
+		return CLBT_INVALID_OP;
+	}
+	return CLBT_OK;
+}
+
+/*
+ * Compile an expression, NULL after reporting why if it is malformed.
+ */
+struct ClbtExpr* clbt_expr_compile(const char* source)
+{
+	struct ClbtExprParser parser;
+	struct ClbtExprNode* tree = NULL;
+	struct ClbtExpr* expr;
+	int ret = CLBT_OK;
+
+	parser.pos = 0;
+	parser.failed = 0;
+	clbt_list_init(&parser.tokens);
+	if (clbt_split_words(&parser.tokens, source) != CLBT_OK)
+	{
+		clbt_error("Unbalanced quote in expression.");
+		ret = CLBT_INVALID_OP;
+	}
+	else if (parser.tokens.size < 1)
+	{
+		clbt_error("Expression is empty.");
+		ret = CLBT_INVALID_OP;
+	}
+	else if ((tree = clbt_expr_or(&parser)) == NULL)
+	{
+		ret = CLBT_INVALID_OP;
+	}
+	else if (parser.pos < parser.tokens.size)
+	{
+		clbt_error("Unexpected '%s' in expression.", parser.tokens.paths[parser.pos]->path);
+		ret = CLBT_INVALID_OP;
+	}
+
+	expr = (struct ClbtExpr*)calloc(1, sizeof(struct ClbtExpr));
+	if (expr == NULL || (expr->source = (char*)malloc(strlen(source) + 1)) == NULL)
+		clbt_expr_oom();
+	strcpy(expr->source, source);
+	clbt_list_init(&expr->patterns);
+	expr->now = time(NULL);
+	expr->constant = -1;
+
+	if (ret == CLBT_OK)
+	{
+		tree = clbt_expr_fold(tree);
+		if (tree->op == CLBT_EXPR_TRUE || tree->op == CLBT_EXPR_FALSE)
+			expr->constant = tree->op == CLBT_EXPR_TRUE;
+		ret = clbt_expr_emit(expr, tree);
+		clbt_expr_emit_op(expr, CLBT_EXPR_RET, NULL);
+	}
+
+	clbt_expr_free_node(tree);
+	clbt_list_destroy(&parser.tokens);
+	if (ret != CLBT_OK)
+	{
+		clbt_expr_free(expr);
+		return NULL;
+	}
+	return expr;
+}
+
+void clbt_expr_free(struct ClbtExpr* expr)
+{
+	if (expr == NULL)
+		return;
+	free(expr->source);
+	free(expr->ops);
+	clbt_list_destroy(&expr->patterns);
+	free(expr);
+}
+
+/*
+ * The expression as given, to pass it on.
+ */
+const char* clbt_expr_source(const struct ClbtExpr* expr)
+{
+	return expr->source;
+}
+
+/*
+ * -1, 0 or 1 if the expression always says no or always says yes.
+ */
+int clbt_expr_constant(const struct ClbtExpr* expr)
+{
+	return expr->constant;
+}
+
+#if CLBT_OS == 1
+
+static int clbt_expr_compare(int64_t n, const struct ClbtExprOp* o)
+{
+	if (o->cmp < 0)
+		return n < o->value;
+	if (o->cmp > 0)
+		return n > o->value;
+	return n == o->value;
+}
+
+/*
+ * Run the program on entry, which is stat'ed only if a test needs it.
+ */
+int clbt_expr_run(const struct ClbtExpr* expr, struct ClbtEntry* entry)
+{
+	const struct ClbtExprOp* o = expr->ops;
+	const char* name = entry->name;
+	const char* slash;
+	int64_t size;
+	int flag = 0;
+
+	/* a root that is not a directory carries its path as name */
+	if (entry->dir == NULL && (slash = strrchr(name, '/')) != NULL && slash[1] != '\0')
+		name = slash + 1;
+
+	for (;; o++)
+	{
+		switch (o->op)
+		{
+		case CLBT_EXPR_FALSE:
+			flag = 0;
+			break;
+		case CLBT_EXPR_TRUE:
+			flag = 1;
+			break;
+		case CLBT_EXPR_NAME:
+			flag = clbt_wildcard(expr->patterns.paths[o->jump]->path, name);
+			break;
+		case CLBT_EXPR_TYPE:
+			if (entry->type == CLBT_TYPE_UNKNOWN && clbt_entry_stat(entry) != CLBT_OK)
+				flag = 0;
+			else
+				flag = entry->type == o->value;
+			break;
+		case CLBT_EXPR_SIZE:
+			if (clbt_entry_stat(entry) != CLBT_OK)
+			{
+				flag = 0;
+				break;
+			}
+			size = (int64_t)entry->st.st_size;
+			flag = clbt_expr_compare((size + o->unit - 1) / o->unit, o);
+			break;
+		case CLBT_EXPR_MTIME:
+			if (clbt_entry_stat(entry) != CLBT_OK)
+				flag = 0;
+			else
+				flag = clbt_expr_compare((int64_t)(expr->now - entry->st.st_mtime) / CLBT_EXPR_DAY, o);
+			break;
+		case CLBT_EXPR_NOT:
+			flag = !flag;
+			break;
+		case CLBT_EXPR_JF:
+			if (!flag)
+				o = expr->ops + o->jump - 1;
+			break;
+		case CLBT_EXPR_JT:
+			if (flag)
+				o = expr->ops + o->jump - 1;
+			break;
+		default:
+			return flag;
+		}
+	}
+}
+
+/*
+ * Match an entry of a walk against input filename patterns and --expr.
+ */
+int clbt_match_entry(struct ClbtEntry* entry)
+{
+	if (!clbt_match_patterns(entry->name))
+		return 0;
+	return clbtConfig.expr == NULL || clbt_expr_run(clbtConfig.expr, entry);
+}
+
+#endif
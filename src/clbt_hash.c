@@ -0,0 +1,506 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_hash.c
+ *
+ *   Description:
+ *
+ *   Multithreaded content hashing task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <pthread.h>
+
+#define CLBT_HASH_BLOCK		(1 << 20)	/* bytes per read */
+#define CLBT_HASH_QUEUE		2			/* blocks queued per hash worker */
+#define CLBT_HASH_SEGMENT	(1 << 20)	/* BLAKE3 subtree hashed by one worker, 1024 chunks */
+
+/*
+ * Readers run on the walker pool and feed hash workers through bounded
+ * queues. Every block of one file goes to the same hash worker, so blocks
+ * stay in order without any reordering. Large files hashed with BLAKE3 are
+ * split into subtrees that workers read and hash concurrently.
+ */
+struct ClbtHashTask;
+
+struct ClbtHashFile
+{
+	struct ClbtHashTask* task;
+	char* path;
+	int fd;
+	int failed;
+	struct ClbtDigest digest;
+	int segments;				/* BLAKE3 subtrees, 0 if hashed as a stream */
+	int remaining;				/* subtrees not done yet, atomic */
+	uint32_t(*cvs)[8];			/* chaining values of full subtrees */
+	struct ClbtBlake3Node last;	/* top node of the last subtree */
+};
+
+struct ClbtHashBlock
+{
+	struct ClbtHashFile* file;
+	unsigned char* data;
+	size_t len;
+	int last;					/* file is complete after this block */
+};
+
+struct ClbtHashQueue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+	struct ClbtHashBlock items[CLBT_HASH_QUEUE];
+	int head;
+	int count;
+	int stop;
+	struct ClbtHashTask* task;
+};
+
+struct ClbtHashSegment
+{
+	struct ClbtHashFile* file;
+	int index;
+	off_t offset;
+	size_t len;
+};
+
+struct ClbtHashTask
+{
+	int algo;
+	int hashers;
+	struct ClbtHashQueue* queues;
+	pthread_t* threads;
+	unsigned int next;			/* round robin hash worker, atomic */
+	struct ClbtWalker* walker;
+	pthread_mutex_t spareLock;
+	unsigned char** spare;		/* recycled read buffers */
+	int spareCount;
+	int spareCapacity;
+	CP* buffers;				/* per thread path buffer */
+	unsigned long files;		/* atomic */
+};
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static unsigned char* clbt_hash_buffer_get(struct ClbtHashTask* task)
+{
+	unsigned char* buf = NULL;
+
+	pthread_mutex_lock(&task->spareLock);
+	if (task->spareCount > 0)
+		buf = task->spare[--task->spareCount];
+	pthread_mutex_unlock(&task->spareLock);
+
+	if (buf == NULL && (buf = (unsigned char*)malloc(CLBT_HASH_BLOCK)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for read buffer!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	return buf;
+}
+
+static void clbt_hash_buffer_put(struct ClbtHashTask* task, unsigned char* buf)
+{
+	unsigned char** spare;
+
+	pthread_mutex_lock(&task->spareLock);
+	if (task->spareCount == task->spareCapacity)
+	{
+		spare = (unsigned char**)realloc(task->spare, sizeof(unsigned char*) * (task->spareCapacity * 2 + 8));
+		if (spare == NULL)
+		{
+			pthread_mutex_unlock(&task->spareLock);
+			free(buf);
+			return;
+		}
+		task->spare = spare;
+		task->spareCapacity = task->spareCapacity * 2 + 8;
+	}
+	task->spare[task->spareCount++] = buf;
+	pthread_mutex_unlock(&task->spareLock);
+}
+
+static void clbt_hash_queue_push(struct ClbtHashQueue* q, const struct ClbtHashBlock* block)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == CLBT_HASH_QUEUE)
+		pthread_cond_wait(&q->notFull, &q->lock);
+	q->items[(q->head + q->count) % CLBT_HASH_QUEUE] = *block;
+	q->count++;
+	pthread_cond_signal(&q->notEmpty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int clbt_hash_queue_pop(struct ClbtHashQueue* q, struct ClbtHashBlock* block)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->stop)
+		pthread_cond_wait(&q->notEmpty, &q->lock);
+	if (q->count == 0)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+	*block = q->items[q->head];
+	q->head = (q->head + 1) % CLBT_HASH_QUEUE;
+	q->count--;
+	pthread_cond_signal(&q->notFull);
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+static void clbt_hash_file_free(struct ClbtHashFile* file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+	free(file->cvs);
+	free(file->path);
+	free(file);
+}
+
+static void clbt_hash_file_done(struct ClbtHashTask* task, struct ClbtHashFile* file, const unsigned char* digest)
+{
+	char hex[CLBT_DIGEST_MAX * 2 + 1];
+	struct ClbtRecord r;
+
+	if (!file->failed)
+	{
+		if (clbt_out_enabled())
+		{
+			clbt_digest_hex(digest, clbt_digest_size(task->algo), hex);
+			if (clbt_out_format() == CLBT_FORMAT_JSONL)
+			{
+				clbt_record_begin(&r);
+				clbt_record_string(&r, "path", file->path, strlen(file->path));
+				clbt_record_string(&r, "hash", hex, strlen(hex));
+				clbt_record_end(&r, -1);
+			}
+			else
+			{
+				clbt_println("%s  %s", hex, file->path);
+			}
+		}
+		clbt_atomic_add(&task->files, 1);
+	}
+	clbt_hash_file_free(file);
+}
+
+static void* clbt_hash_worker(void* arg)
+{
+	struct ClbtHashQueue* q = (struct ClbtHashQueue*)arg;
+	struct ClbtHashTask* task = q->task;
+	struct ClbtHashBlock block;
+	unsigned char digest[CLBT_DIGEST_MAX];
+
+	while (clbt_hash_queue_pop(q, &block))
+	{
+		if (block.len > 0)
+			clbt_digest_update(&block.file->digest, block.data, block.len);
+		if (block.data != NULL)
+			clbt_hash_buffer_put(task, block.data);
+		if (block.last)
+		{
+			clbt_digest_final(&block.file->digest, digest);
+			clbt_hash_file_done(task, block.file, digest);
+		}
+	}
+	return NULL;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* BLAKE3 subtrees */
+
+static void clbt_hash_combine(struct ClbtHashTask* task, struct ClbtHashFile* file)
+{
+	uint32_t stack[64][8];
+	uint32_t cv[8];
+	struct ClbtBlake3Node node;
+	unsigned char digest[CLBT_DIGEST_MAX];
+	unsigned long total;
+	int len = 0;
+	int i;
+
+	if (file->failed)
+	{
+		clbt_hash_file_free(file);
+		return;
+	}
+
+	/* same lazy merge as chunks inside one hasher, one level per full subtree */
+	for (i = 0; i < file->segments - 1; i++)
+	{
+		memcpy(cv, file->cvs[i], sizeof(cv));
+		total = i + 1;
+		while ((total & 1) == 0)
+		{
+			clbt_blake3_parent(stack[--len], cv, &node);
+			clbt_blake3_cv(&node, cv);
+			total >>= 1;
+		}
+		memcpy(stack[len++], cv, sizeof(cv));
+	}
+
+	node = file->last;
+	for (i = len - 1; i >= 0; i--)
+	{
+		clbt_blake3_cv(&node, cv);
+		clbt_blake3_parent(stack[i], cv, &node);
+	}
+	clbt_blake3_root(&node, digest);
+	clbt_hash_file_done(task, file, digest);
+}
+
+static void clbt_hash_segment_job(void* arg, int tid)
+{
+	struct ClbtHashSegment* seg = (struct ClbtHashSegment*)arg;
+	struct ClbtHashFile* file = seg->file;
+	struct ClbtHashTask* task = file->task;
+	struct ClbtBlake3 hasher;
+	struct ClbtBlake3Node node;
+	unsigned char* buf = clbt_hash_buffer_get(task);
+	ssize_t n;
+
+	n = clbt_read_full(file->fd, buf, seg->len, seg->offset);
+	if (n != (ssize_t)seg->len)
+	{
+		if (n < 0)
+			clbt_error("Cannot read '%s': %s", file->path, strerror(errno));
+		else
+			clbt_error("File '%s' changed while hashing.", file->path);
+		file->failed = 1;
+		clbt_walk_failed(task->walker);
+	}
+	else
+	{
+		clbt_blake3_init(&hasher, (uint64_t)seg->index * (CLBT_HASH_SEGMENT / CLBT_BLAKE3_CHUNK_LEN));
+		clbt_blake3_update(&hasher, buf, seg->len);
+		clbt_blake3_node(&hasher, &node);
+		if (seg->index == file->segments - 1)
+			file->last = node;
+		else
+			clbt_blake3_cv(&node, file->cvs[seg->index]);
+	}
+
+	clbt_hash_buffer_put(task, buf);
+	if (clbt_atomic_sub(&file->remaining, 1) == 0)
+		clbt_hash_combine(task, file);
+	free(seg);
+	(void)tid;
+}
+
+static void clbt_hash_split(struct ClbtHashTask* task, struct ClbtHashFile* file, off_t size)
+{
+	struct ClbtHashSegment* seg;
+	int i;
+
+	file->segments = (int)((size + CLBT_HASH_SEGMENT - 1) / CLBT_HASH_SEGMENT);
+	file->remaining = file->segments;
+	file->cvs = (uint32_t(*)[8])malloc(sizeof(uint32_t) * 8 * file->segments);
+	if (file->cvs == NULL)
+	{
+		clbt_error("Unable to allocate memory for hash segments!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	for (i = 0; i < file->segments; i++)
+	{
+		seg = (struct ClbtHashSegment*)malloc(sizeof(struct ClbtHashSegment));
+		if (seg == NULL)
+		{
+			clbt_error("Unable to allocate memory for hash segments!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		seg->file = file;
+		seg->index = i;
+		seg->offset = (off_t)i * CLBT_HASH_SEGMENT;
+		seg->len = (size_t)(size - seg->offset < CLBT_HASH_SEGMENT ? size - seg->offset : CLBT_HASH_SEGMENT);
+		clbt_pool_submit(task->walker->pool, clbt_hash_segment_job, seg);
+	}
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_hash_read_job(void* arg, int tid)
+{
+	struct ClbtHashFile* file = (struct ClbtHashFile*)arg;
+	struct ClbtHashTask* task = file->task;
+	struct ClbtHashQueue* q;
+	struct ClbtHashBlock block;
+	struct stat st;
+	ssize_t n;
+
+	file->fd = clbt_open_read(file->path, 1);
+	if (file->fd < 0 || fstat(file->fd, &st) != 0)
+	{
+		clbt_error("Cannot open '%s': %s", file->path, strerror(errno));
+		clbt_walk_failed(task->walker);
+		clbt_hash_file_free(file);
+		return;
+	}
+
+	if (task->algo == CLBT_DIGEST_BLAKE3 && st.st_size > 2 * CLBT_HASH_SEGMENT)
+	{
+		clbt_hash_split(task, file, st.st_size);
+		return;
+	}
+
+	clbt_digest_init(&file->digest, task->algo);
+	q = &task->queues[clbt_atomic_add(&task->next, 1) % task->hashers];
+	block.file = file;
+	do
+	{
+		block.data = clbt_hash_buffer_get(task);
+		n = clbt_read_full(file->fd, block.data, CLBT_HASH_BLOCK, -1);
+		if (n < 0)
+		{
+			clbt_error("Cannot read '%s': %s", file->path, strerror(errno));
+			clbt_walk_failed(task->walker);
+			file->failed = 1;
+			n = 0;
+		}
+		block.len = (size_t)n;
+		block.last = n < CLBT_HASH_BLOCK;
+		clbt_hash_queue_push(q, &block);
+	} while (!block.last);
+	(void)tid;
+}
+
+static int clbt_hash_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtHashTask* task = (struct ClbtHashTask*)walker->user;
+	struct ClbtHashFile* file;
+
+	if (entry->type != CLBT_TYPE_FILE || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	file = (struct ClbtHashFile*)calloc(1, sizeof(struct ClbtHashFile));
+	if (file == NULL)
+	{
+		clbt_error("Unable to allocate memory for hash task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	clbt_entry_path(entry, &task->buffers[tid]);
+	file->task = task;
+	file->path = strdup(task->buffers[tid].path);
+	file->fd = -1;
+	if (file->path == NULL)
+	{
+		clbt_error("Unable to allocate memory for hash task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	/* reading is scheduled like directories, so any idle worker picks it up */
+	clbt_pool_submit(walker->pool, clbt_hash_read_job, file);
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtHashOps = { clbt_hash_on_entry, NULL, NULL, NULL };
+
+/*
+ * Hash every walked file, printed as "digest  path".
+ */
+int clbt_task_hash(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtHashTask task;
+	int i, ret, threads;
+
+	memset(&task, 0, sizeof(task));
+	task.algo = clbtConfig.hashAlgo;
+	if (task.algo == CLBT_DIGEST_NONE)
+	{
+		clbt_error("No hash algorithm specified.");
+		return CLBT_INVALID_OP;
+	}
+
+	ret = clbt_walk_begin(&walker, &clbtHashOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	threads = clbt_walk_threads(&walker);
+	task.walker = &walker;
+	task.hashers = clbtConfig.jobs > 0 ? clbtConfig.jobs : clbt_default_jobs();
+	task.queues = (struct ClbtHashQueue*)calloc(task.hashers, sizeof(struct ClbtHashQueue));
+	task.threads = (pthread_t*)malloc(sizeof(pthread_t) * task.hashers);
+	task.buffers = (CP*)malloc(sizeof(CP) * threads);
+	if (task.queues == NULL || task.threads == NULL || task.buffers == NULL)
+	{
+		clbt_error("Unable to allocate memory for hash task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	pthread_mutex_init(&task.spareLock, NULL);
+	for (i = 0; i < threads; i++)
+		clbt_path_init(&task.buffers[i]);
+
+	for (i = 0; i < task.hashers; i++)
+	{
+		pthread_mutex_init(&task.queues[i].lock, NULL);
+		pthread_cond_init(&task.queues[i].notEmpty, NULL);
+		pthread_cond_init(&task.queues[i].notFull, NULL);
+		task.queues[i].task = &task;
+		if (pthread_create(&task.threads[i], NULL, clbt_hash_worker, &task.queues[i]) != 0)
+		{
+			clbt_error("Unable to create hash worker: %s", strerror(errno));
+			exit(CLBT_FAILURE_OS);
+		}
+	}
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	/* all reads are queued, let hash workers drain and quit */
+	for (i = 0; i < task.hashers; i++)
+	{
+		pthread_mutex_lock(&task.queues[i].lock);
+		task.queues[i].stop = 1;
+		pthread_cond_broadcast(&task.queues[i].notEmpty);
+		pthread_mutex_unlock(&task.queues[i].lock);
+	}
+	for (i = 0; i < task.hashers; i++)
+	{
+		pthread_join(task.threads[i], NULL);
+		pthread_cond_destroy(&task.queues[i].notFull);
+		pthread_cond_destroy(&task.queues[i].notEmpty);
+		pthread_mutex_destroy(&task.queues[i].lock);
+	}
+
+	clbt_verbose(options, "Hashed %lu file(s).", task.files);
+
+	for (i = 0; i < task.spareCount; i++)
+		free(task.spare[i]);
+	for (i = 0; i < threads; i++)
+		clbt_path_destroy(&task.buffers[i]);
+	pthread_mutex_destroy(&task.spareLock);
+	free(task.spare);
+	free(task.buffers);
+	free(task.threads);
+	free(task.queues);
+	return ret;
+}
+
+#else
+
+int clbt_task_hash(int options)
+{
+	(void)options;
+	return clbt_unsupported("hash");
+}
+
+#endif
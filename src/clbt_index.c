@@ -0,0 +1,496 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_index.c
+ *
+ *   Description:
+ *
+ *   Persistent filename index and lookups for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+
+#define CLBT_INDEX_NAME		".clbt.index"	/* default index file in $HOME */
+
+/*
+ * The index is a recursive snapshot of one directory, by its real path.
+ * Entries are sorted with '/' before every other byte, so everything below
+ * a directory follows it in one run. A lookup binary searches the first
+ * paths of the blocks in the mapped file, then decodes forward from there
+ * until the run ends, without touching the indexed tree.
+ *
+ * With input patterns and a trigram file next to the index, only the
+ * entries whose names have every trigram of some pattern are decoded.
+ */
+struct ClbtIndexQuery
+{
+	const char* target;			/* as given, prefix of printed paths */
+	const char* rel;			/* target relative to the index root */
+	int relLength;
+	int recurse;
+	CP out;						/* printed path */
+	int base;					/* bytes of target and '/' in out */
+	CP skip;					/* sub directory being skipped without -R, then '\1' */
+	int skipLength;				/* strlen of the sub directory, 0 if none */
+	uint32_t* candidates;		/* entries the trigram index left to check, NULL for all */
+	size_t count;
+};
+
+/*
+ * The index file in use, $HOME/.clbt.index unless --index-file is given.
+ */
+const char* clbt_index_file(void)
+{
+	const char* home;
+
+	if (clbtConfig.indexFile.path[0] == '\0')
+	{
+		home = getenv("HOME");
+		if (home == NULL || home[0] == '\0')
+			home = ".";
+		clbt_path_resize(&clbtConfig.indexFile, (int)(strlen(home) + sizeof(CLBT_INDEX_NAME) + 1));
+		sprintf(clbtConfig.indexFile.path, "%s/%s", home, CLBT_INDEX_NAME);
+	}
+	return clbtConfig.indexFile.path;
+}
+
+/*
+ * Walk the only target into a new index file.
+ */
+static int clbt_index_build(const char* file, int options, int* walked)
+{
+	char* root;
+	int ret;
+
+	if (clbtConfig.targets.size != 1)
+	{
+		clbt_error("Index takes exactly one directory.");
+		return CLBT_INVALID_OP;
+	}
+	root = realpath(clbtConfig.targets.paths[0]->path, NULL);
+	if (root == NULL)
+	{
+		clbt_error("Cannot resolve '%s': %s", clbtConfig.targets.paths[0]->path, strerror(errno));
+		return CLBT_FAILURE_IO;
+	}
+	ret = clbt_snap_build(root, file, CLBT_WALK_RECURSE, 0, options, walked);
+	if (ret == CLBT_OK)
+		clbt_verbose(options, "Indexed '%s'.", root);
+	free(root);
+	return ret;
+}
+
+/*
+ * Write a new index file from the current one, reading only the directories
+ * changed since. Targets are not used, the index knows its directory.
+ */
+static int clbt_index_refresh(const char* index, const char* file, int options, int* walked)
+{
+	struct ClbtSnap old;
+	int ret;
+
+	if ((ret = clbt_snap_open(&old, index)) != CLBT_OK)
+		return ret;
+	ret = clbt_snap_refresh(&old, file, options, walked);
+	clbt_snap_close(&old);
+	return ret;
+}
+
+/*
+ * Build or refresh the index, the old one is replaced once the new one is complete.
+ */
+int clbt_task_index(int options)
+{
+	const char* file = clbt_index_file();
+	CP tmp, tri;
+	int walked = CLBT_OK;
+	int ret;
+
+	clbt_path_init(&tmp);
+	clbt_path_init(&tri);
+	clbt_path_resize(&tmp, (int)strlen(file) + 16);
+	clbt_path_resize(&tri, (int)strlen(file) + 16);
+	sprintf(tmp.path, "%s.tmp", file);
+	sprintf(tri.path, "%s.tri.tmp", file);
+	if (clbtConfig.index == CLBT_INDEX_REFRESH)
+		ret = clbt_index_refresh(file, tmp.path, options, &walked);
+	else
+		ret = clbt_index_build(tmp.path, options, &walked);
+	if (ret == CLBT_OK)
+		ret = clbt_trigram_build(tmp.path, tri.path, options);
+
+	/* trigrams go first, a reader pairs them with the index by its size and count */
+	if (ret == CLBT_OK)
+	{
+		sprintf(tri.path, "%s.tri", file);
+		sprintf(tmp.path, "%s.tri.tmp", file);
+		if (rename(tmp.path, tri.path) != 0)
+		{
+			clbt_error("Cannot replace '%s': %s", tri.path, strerror(errno));
+			unlink(tmp.path);
+			ret = CLBT_FAILURE_IO;
+		}
+		sprintf(tmp.path, "%s.tmp", file);
+	}
+	if (ret == CLBT_OK && rename(tmp.path, file) != 0)
+	{
+		clbt_error("Cannot replace '%s': %s", file, strerror(errno));
+		ret = CLBT_FAILURE_IO;
+	}
+	if (ret != CLBT_OK)
+		unlink(tmp.path);
+	else
+		clbt_verbose(options, "Replaced '%s'.", file);
+
+	clbt_path_destroy(&tri);
+	clbt_path_destroy(&tmp);
+	return ret != CLBT_OK ? ret : walked;
+}
+
+/*
+ * Print one entry found in the index, like list does from a walk.
+ */
+static void clbt_index_print(struct ClbtIndexQuery* q, const struct ClbtSnapEntry* e, const char* sub, int subLength)
+{
+	static const char* const types[] = { "file", "dir", "link", "other" };
+	const char* field;
+	const char* name;
+	const char* type;
+	struct ClbtRecord r;
+	char mode[8];
+	int len = q->base + subLength;
+
+	if (q->out.length < len + 1)
+		clbt_path_resize(&q->out, len * 2 + 1);
+	memcpy(q->out.path + q->base, sub, subLength);
+	q->out.path[len] = '\0';
+	if (clbtConfig.fields == 0)
+	{
+		clbt_out_path(0, q->out.path, len);
+		return;
+	}
+
+	name = strrchr(q->out.path, '/');
+	name = name != NULL && name[1] != '\0' ? name + 1 : q->out.path;
+	type = S_ISREG(e->mode) ? types[0] : S_ISDIR(e->mode) ? types[1] : S_ISLNK(e->mode) ? types[2] : types[3];
+	clbt_record_begin(&r);
+	for (field = clbtConfig.fieldOrder; *field != '\0'; field++)
+	{
+		/* uid and gid are not indexed, refused before the query */
+		switch (1 << (*field - '0'))
+		{
+		case CLBT_FIELD_PATH:
+			clbt_record_string(&r, "path", q->out.path, len);
+			break;
+		case CLBT_FIELD_NAME:
+			clbt_record_string(&r, "name", name, strlen(name));
+			break;
+		case CLBT_FIELD_TYPE:
+			clbt_record_string(&r, "type", type, strlen(type));
+			break;
+		case CLBT_FIELD_SIZE:
+			clbt_record_number(&r, "size", (unsigned long long)e->size);
+			break;
+		case CLBT_FIELD_MTIME:
+			clbt_record_number(&r, "mtime", (unsigned long long)(e->mtime / 1000000000));
+			break;
+		case CLBT_FIELD_MODE:
+			sprintf(mode, "%04o", (unsigned)(e->mode & 07777));
+			clbt_record_string(&r, "mode", mode, strlen(mode));
+			break;
+		case CLBT_FIELD_INO:
+			clbt_record_number(&r, "ino", (unsigned long long)e->ino);
+			break;
+		}
+	}
+	clbt_record_end(&r, 0);
+}
+
+/*
+ * Without -R, jump over the entries below the sub directory at path[0, len).
+ * They end before the sub directory followed by '\1', which is searched for
+ * once if the run spans past the block being decoded.
+ */
+static void clbt_index_skip(const struct ClbtSnap* snap, struct ClbtSnapCursor* cur, struct ClbtIndexQuery* q, const char* path, int len)
+{
+	uint32_t block;
+
+	if (q->skipLength == len && memcmp(q->skip.path, path, len) == 0)
+		return;
+	if (q->skip.length < len + 2)
+		clbt_path_resize(&q->skip, len * 2 + 2);
+	memcpy(q->skip.path, path, len);
+	q->skip.path[len] = '\1';
+	q->skipLength = len;
+
+	block = clbt_snap_find(snap, q->skip.path, len + 1);
+	if (block >= cur->block)
+		clbt_snap_seek(cur, block);
+}
+
+/*
+ * The part of an entry path below the target, NULL if it is not below it.
+ */
+static const char* clbt_index_below(const struct ClbtIndexQuery* q, const struct ClbtSnapEntry* e)
+{
+	if (q->relLength == 0)
+		return e->path;
+	if (e->length <= q->relLength || e->path[q->relLength] != '/' || memcmp(e->path, q->rel, q->relLength) != 0)
+		return NULL;
+	return e->path + q->relLength + 1;
+}
+
+/*
+ * Match the name of an entry against input patterns, and what the index
+ * knows of it against --expr.
+ */
+static int clbt_index_wanted(const struct ClbtSnapEntry* e, const char* name)
+{
+	struct ClbtEntry entry;
+
+	if (!clbt_match_patterns(name))
+		return 0;
+	if (clbtConfig.expr == NULL)
+		return 1;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.dirfd = -1;
+	entry.name = name;
+	entry.namelen = (int)strlen(name);
+	entry.type = clbt_mode_type((mode_t)e->mode);
+	entry.hasStat = 1;
+	entry.st.st_mode = (mode_t)e->mode;
+	entry.st.st_size = (off_t)e->size;
+	entry.st.st_mtime = (time_t)(e->mtime / 1000000000);
+	return clbt_expr_run(clbtConfig.expr, &entry);
+}
+
+static void clbt_index_match(struct ClbtIndexQuery* q, const struct ClbtSnapEntry* e, const char* sub)
+{
+	const char* name = strrchr(sub, '/');
+
+	name = name != NULL ? name + 1 : sub;
+	if (clbt_index_wanted(e, name))
+		clbt_index_print(q, e, sub, e->length - (int)(sub - e->path));
+}
+
+/*
+ * Check only the entries left by the trigram index, from entry first on.
+ * They are sorted, so the first one not below the target ends the run.
+ */
+static void clbt_index_candidates(struct ClbtSnapCursor* cur, struct ClbtIndexQuery* q, uint64_t first)
+{
+	const char* sub;
+	size_t i;
+
+	for (i = 0; i < q->count; i++)
+	{
+		if (q->candidates[i] < first)
+			continue;
+		if (!clbt_snap_goto(cur, q->candidates[i]) || (sub = clbt_index_below(q, &cur->entry)) == NULL)
+			break;
+		if (q->recurse || strchr(sub, '/') == NULL)
+			clbt_index_match(q, &cur->entry, sub);
+	}
+}
+
+/*
+ * List a target from the index, its entries if it is a directory.
+ */
+static int clbt_index_query(const struct ClbtSnap* snap, struct ClbtIndexQuery* q)
+{
+	struct ClbtSnapCursor cur;
+	const struct ClbtSnapEntry* e = &cur.entry;
+	const char* sub;
+	const char* slash;
+	int cmp, found = q->relLength == 0, ret = CLBT_OK;
+
+	q->skipLength = 0;
+	clbt_snap_cursor_init(&cur, snap, clbt_snap_find(snap, q->rel, q->relLength));
+	if (found && q->candidates != NULL)
+		clbt_index_candidates(&cur, q, 0);
+	else while (clbt_snap_next(&cur))
+	{
+		if (!found)
+		{
+			/* skip to the target itself */
+			cmp = clbt_snap_compare(e->path, e->length, q->rel, q->relLength);
+			if (cmp < 0)
+				continue;
+			if (cmp > 0)
+				break;
+			found = 1;
+			if (!S_ISDIR(e->mode))
+			{
+				q->base = 0;
+				sub = strrchr(e->path, '/');
+				if (clbt_index_wanted(e, sub != NULL ? sub + 1 : e->path))
+					clbt_index_print(q, e, q->target, (int)strlen(q->target));
+				break;
+			}
+			if (q->candidates != NULL)
+			{
+				clbt_index_candidates(&cur, q, e->ordinal + 1);
+				break;
+			}
+			continue;
+		}
+
+		/* the run below the target ends at the first path without its prefix */
+		if ((sub = clbt_index_below(q, e)) == NULL)
+			break;
+		if (!q->recurse && (slash = strchr(sub, '/')) != NULL)
+		{
+			clbt_index_skip(snap, &cur, q, e->path, (int)(slash - e->path));
+			continue;
+		}
+		clbt_index_match(q, e, sub);
+	}
+
+	if (cur.failed)
+	{
+		clbt_error("Index is corrupt, rebuild it with --index build.");
+		ret = CLBT_INVALID_OP;
+	}
+	else if (!found)
+	{
+		clbt_warning("'%s' is not in the index.", q->target);
+	}
+	clbt_snap_cursor_destroy(&cur);
+	return ret;
+}
+
+/*
+ * List the targets from a mapped index, narrowed by its trigrams unless tri is NULL.
+ */
+int clbt_index_answer(const struct ClbtSnap* snap, const struct ClbtTrigrams* tri, int options)
+{
+	struct ClbtIndexQuery q;
+	CP root;
+	char* real;
+	int i, len, ret = CLBT_OK;
+
+	if (clbtConfig.fields & (CLBT_FIELD_UID | CLBT_FIELD_GID))
+		clbt_warning("Owners are not kept in the index, uid and gid are left out.");
+
+	clbt_path_init(&root);
+	clbt_path_init(&q.out);
+	clbt_path_init(&q.skip);
+	q.recurse = (options & CLBT_OPT_RECURSIVE) != 0;
+	q.candidates = NULL;
+	q.count = 0;
+	if (tri != NULL && clbtConfig.patterns.size > 0)
+	{
+		q.count = clbt_trigram_candidates(tri, &q.candidates);
+		if (q.candidates != NULL)
+			clbt_verbose(options, "Trigrams left %lu of %llu names to check.",
+				(unsigned long)q.count, (unsigned long long)snap->entries);
+	}
+	clbt_path_set(&root, snap->root, snap->rootLength);
+	clbt_out_begin(1);
+
+	for (i = 0; i < clbtConfig.targets.size && ret == CLBT_OK; i++)
+	{
+		q.target = clbtConfig.targets.paths[i]->path;
+		real = realpath(q.target, NULL);
+		if (real == NULL)
+		{
+			clbt_error("Cannot resolve '%s': %s", q.target, strerror(errno));
+			ret = CLBT_FAILURE_IO;
+			break;
+		}
+
+		/* the target must be the indexed root or below it */
+		len = snap->rootLength;
+		if (len == 1 && root.path[0] == '/')
+			len = 0;
+		if (strncmp(real, root.path, len) != 0 || (real[len] != '\0' && real[len] != '/'))
+		{
+			clbt_error("'%s' is not below the indexed directory '%s'.", q.target, root.path);
+			free(real);
+			ret = CLBT_INVALID_OP;
+			break;
+		}
+		q.rel = real + len + (real[len] == '/');
+		q.relLength = (int)strlen(q.rel);
+
+		len = (int)strlen(q.target);
+		clbt_path_set(&q.out, q.target, len);
+		if (len < 1 || q.target[len - 1] != '/')
+		{
+			if (q.out.length < len + 2)
+				clbt_path_resize(&q.out, len + 2);
+			q.out.path[len++] = '/';
+		}
+		q.base = len;
+		ret = clbt_index_query(snap, &q);
+		free(real);
+	}
+
+	clbt_out_end();
+	free(q.candidates);
+	clbt_path_destroy(&q.out);
+	clbt_path_destroy(&q.skip);
+	clbt_path_destroy(&root);
+	return ret;
+}
+
+/*
+ * List the targets from the index file instead of walking them.
+ */
+int clbt_index_list(int options)
+{
+	const char* file = clbt_index_file();
+	struct ClbtSnap snap;
+	struct ClbtTrigrams tri;
+	CP name;
+	int hasTrigrams = 0;
+	int ret;
+
+	if ((ret = clbt_snap_open(&snap, file)) != CLBT_OK)
+		return ret;
+	if (clbtConfig.patterns.size > 0)
+	{
+		clbt_path_init(&name);
+		clbt_path_resize(&name, (int)strlen(file) + 8);
+		sprintf(name.path, "%s.tri", file);
+		hasTrigrams = clbt_trigram_open(&tri, name.path, &snap) == CLBT_OK;
+		clbt_path_destroy(&name);
+	}
+	ret = clbt_index_answer(&snap, hasTrigrams ? &tri : NULL, options);
+	if (hasTrigrams)
+		clbt_trigram_close(&tri);
+	clbt_snap_close(&snap);
+	return ret;
+}
+
+#else
+
+int clbt_task_index(int options)
+{
+	(void)options;
+	return clbt_unsupported("index");
+}
+
+int clbt_index_list(int options)
+{
+	(void)options;
+	return clbt_unsupported("index");
+}
+
+#endif
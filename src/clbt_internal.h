@@ -0,0 +1,544 @@
+/***********************************************************************/
+/*
+*   Script File: clbt_internal.h
+*
+*   Description:
+*
+*   Internal header shared by CLBT core modules, not part of public API
+*
+*
+*   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+*   Date since: Feb-2015
+*
+*   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+*
+*	 Open source according to LGPLv3 License.
+*	 No warrenty implied, use at your own risk.
+*/
+/***********************************************************************/
+
+#ifndef _CLBT_INTERNAL_H_
+#define _CLBT_INTERNAL_H_
+
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#define _CRT_SECURE_NO_WARNINGS /* suppress warnings about fopen() and similar "unsafe" functions defined by MS */
+#endif
+
+#include "clbt.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CLBT_OS
+#if defined(unix)        || defined(__unix)      || defined(__unix__) \
+	|| defined(linux) || defined(__linux) || defined(__linux__) \
+	|| defined(sun) || defined(__sun) \
+	|| defined(BSD) || defined(__OpenBSD__) || defined(__NetBSD__) \
+	|| defined(__FreeBSD__) || defined (__DragonFly__) \
+	|| defined(sgi) || defined(__sgi) \
+	|| (defined(__MACOSX__) || defined(__APPLE__)) \
+	|| defined(__CYGWIN__) || defined(__MINGW32__)
+#define CLBT_OS 1
+#elif defined(_MSC_VER) || defined(WIN32)  || defined(_WIN32) || defined(__WIN32__) \
+	|| defined(WIN64) || defined(_WIN64) || defined(__WIN64__)
+#define CLBT_OS 0
+#else
+#error Unable to support this unknown OS.
+#endif
+#elif !(CLBT_OS==0 || CLBT_OS==1)
+#error CLBT: Invalid configuration variable 'CLBT_OS'.
+#error (correct values are '0 = Microsoft Windows', '1 = Unix-like OS').
+#endif
+
+#if CLBT_OS == 1
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ClbtPath
+{
+	int flag;			/* status flag */
+	int length;			/* length of path char* buffer */
+	char* path;			/* char* buffer for this path */
+};
+
+
+struct ClbtList
+{
+	int flag;					/* status flag */
+	int size;					/* number of files/directories in list */
+	int capacity;				/* capacity of allocated Path arrays */
+	struct ClbtPath** paths;	/* Path array, each row contains the path of one file/directory */
+};
+
+typedef struct ClbtPath CP;
+typedef struct ClbtList CL;
+
+struct ClbtExpr;
+
+/* Values set through clbt_config(), shared by all tasks */
+struct ClbtConfig
+{
+	int flag;			/* status flag */
+	int jobs;			/* number of worker threads, 0 means one per online cpu */
+	CL targets;			/* target files/directories, current directory if empty */
+	CL patterns;		/* input filename patterns, match everything if empty */
+	int hashAlgo;		/* CLBT_DIGEST_XXX used by hash task */
+	int dedupeLink;		/* CLBT_LINK_XXX used by dedupe task */
+	CL searches;		/* search strings of modify task */
+	CL replaces;		/* replacements paired with searches, empty if missing */
+	int limit;			/* most records printed by du task, 0 means all */
+	int convert;		/* CLBT_CONVERT_XXX flags of convert task */
+	CP syncDest;		/* destination directory of sync task */
+	CL execArgs;		/* command words of exec task, "{}" marks where files go */
+	int fields;			/* CLBT_FIELD_XXX printed by list task, 0 for plain paths */
+	char fieldOrder[16];	/* '0' + bit number of each field in print order, NUL terminated */
+	CP snapshot;		/* file written by snapshot task */
+	CP diffBase;		/* older snapshot compared by diff task */
+	int index;			/* CLBT_INDEX_XXX done by index task */
+	CP indexFile;		/* index of index task and --use-index, $HOME/.clbt.index if empty */
+	CP serveSocket;		/* socket the serve task listens on */
+	CP connectSocket;	/* socket of a server answering list task, none if empty */
+	struct ClbtExpr* expr;	/* compiled --expr, match everything if NULL */
+	int top;			/* files printed by top task */
+	int topBy;			/* CLBT_TOP_XXX ranking them */
+	int statsBy;		/* CLBT_STATS_XXX grouping files of stats task */
+	int sort;			/* CLBT_SORT_XXX order of list task */
+};
+
+/* What index task does with the index */
+enum { CLBT_INDEX_NONE = 0, CLBT_INDEX_BUILD = 1, CLBT_INDEX_REFRESH = 2 };
+
+/* What top task ranks files by, larger first */
+enum { CLBT_TOP_SIZE = 0, CLBT_TOP_MTIME = 1 };
+
+/* What stats task groups files by */
+enum { CLBT_STATS_EXT = 0, CLBT_STATS_UID = 1, CLBT_STATS_AGE = 2, CLBT_STATS_SIZE = 3 };
+
+/* Order of list task output, none is walk order */
+enum { CLBT_SORT_NONE = 0, CLBT_SORT_NAME = 1, CLBT_SORT_NATURAL = 2, CLBT_SORT_SIZE = 3, CLBT_SORT_MTIME = 4 };
+
+/* How dedupe replaces duplicates */
+enum { CLBT_LINK_NONE = 0, CLBT_LINK_HARD = 1, CLBT_LINK_REFLINK = 2 };
+
+/* What list prints per entry with --fields, in the order given there */
+enum
+{
+	CLBT_FIELD_PATH = 1, CLBT_FIELD_NAME = 2, CLBT_FIELD_TYPE = 4, CLBT_FIELD_SIZE = 8, CLBT_FIELD_MTIME = 16,
+	CLBT_FIELD_MODE = 32, CLBT_FIELD_UID = 64, CLBT_FIELD_GID = 128, CLBT_FIELD_INO = 256
+};
+
+/* What convert changes, line endings are either LF or CRLF */
+enum { CLBT_CONVERT_LF = 1, CLBT_CONVERT_CRLF = 2, CLBT_CONVERT_NOBOM = 4, CLBT_CONVERT_UTF8 = 8 };
+
+extern struct ClbtConfig clbtConfig;
+
+/* Atomic helpers, the parallel engine relies on GCC/Clang builtins */
+#if CLBT_OS == 1
+#define clbt_atomic_add(ptr, val)	__atomic_add_fetch((ptr), (val), __ATOMIC_ACQ_REL)
+#define clbt_atomic_sub(ptr, val)	__atomic_sub_fetch((ptr), (val), __ATOMIC_ACQ_REL)
+#define clbt_atomic_load(ptr)		__atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define clbt_atomic_store(ptr, val)	__atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#endif
+
+/* messages, clbt.c */
+void clbt_error(const char* format, ...);
+void clbt_warning(const char* format, ...);
+void clbt_print(const char* format, ...);
+void clbt_println(const char* format, ...);
+void clbt_print_raw(const void* data, size_t len);
+void clbt_error_raw(const void* data, size_t len);
+void clbt_verbose(int options, const char* format, ...);
+int clbt_confirm(int options, const char* format, ...);
+int clbt_unsupported(const char* task);
+void clbt_set_quiet(int options);
+void clbt_redirect_messages(FILE* stream);
+
+/* path and list, clbt.c */
+void clbt_path_init(CP* path);
+void clbt_path_destroy(CP* path);
+void clbt_path_clear(CP* path);
+void clbt_path_resize(CP* path, int size);
+void clbt_path_set(CP* path, const char* str, int len);
+void clbt_list_init(CL* list);
+void clbt_list_destroy(CL* list);
+void clbt_list_insert(CL* list, CP* path);
+void clbt_list_append(CL* list, const char* str);
+int clbt_split_words(CL* list, const char* str);
+
+/* name matching, clbt.c */
+int clbt_wildcard(const char* pattern, const char* str);
+int clbt_match_patterns(const char* name);
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Parallel engine, clbt_walk.c */
+
+typedef void(*ClbtJobFn)(void* arg, int tid);
+
+struct ClbtPool;
+
+struct ClbtPool* clbt_pool_create(int threads);
+void clbt_pool_submit(struct ClbtPool* pool, ClbtJobFn fn, void* arg);
+void clbt_pool_wait(struct ClbtPool* pool);
+void clbt_pool_destroy(struct ClbtPool* pool);
+int clbt_pool_threads(const struct ClbtPool* pool);
+int clbt_default_jobs(void);
+
+/* return values of ClbtWalkOps.on_entry */
+enum { CLBT_WALK_CONTINUE = 0, CLBT_WALK_SKIP = 1 };
+
+/* walker flags, with VANISHED entries removed while walking are skipped quietly */
+enum { CLBT_WALK_RECURSE = 1, CLBT_WALK_NOATIME = 2, CLBT_WALK_NOFOLLOW = 4, CLBT_WALK_VANISHED = 8 };
+
+struct ClbtWalker;
+
+/*
+ * A directory being walked. It stays alive until every entry in it and every
+ * sub directory below it has been processed, which is tracked by the atomic
+ * pending counter instead of a second traversal.
+ */
+struct ClbtDir
+{
+	struct ClbtDir* parent;		/* NULL for a walk root */
+	struct ClbtWalker* walker;	/* owning walker */
+	char* path;					/* full path of this directory */
+	int length;					/* strlen of path */
+	int name;					/* offset of the last component in path */
+	int fd;						/* kept open for sub directories, -1 if none */
+	int depth;					/* 0 for a walk root */
+	int pending;				/* self enumeration + unfinished children, atomic */
+	void* data;					/* owned by the running task */
+};
+
+/* One directory entry handed to the task */
+struct ClbtEntry
+{
+	struct ClbtDir* dir;		/* parent directory, NULL if a root is not a directory */
+	int dirfd;					/* fd of parent directory, valid during callback only */
+	const char* name;			/* entry name, full path for a root */
+	int namelen;				/* strlen of name */
+	int type;					/* CLBT_TYPE_XXX */
+	int hasStat;				/* st is valid */
+#if CLBT_OS == 1
+	struct stat st;				/* lazily filled by clbt_entry_stat() */
+#endif
+};
+
+struct ClbtWalkOps
+{
+	/* called for every entry, return CLBT_WALK_SKIP to not descend into a directory */
+	int(*on_entry)(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid);
+	/* called after a directory is enumerated, its fd is still open */
+	void(*on_dir_end)(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid);
+	/* called bottom-up once a directory and all of its children are done */
+	void(*on_dir_post)(struct ClbtWalker* walker, struct ClbtDir* dir, int tid);
+	/* called once a directory is opened, before any entry or sub directory is seen */
+	void(*on_dir_begin)(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid);
+};
+
+struct ClbtWalker
+{
+	struct ClbtPool* pool;
+	const struct ClbtWalkOps* ops;
+	void* user;					/* task state */
+	int flags;					/* CLBT_WALK_XXX */
+	unsigned long errors;		/* number of failures, atomic */
+};
+
+/*
+ * Files of the directory being enumerated by one thread, for tasks that
+ * replace them: renaming over a file while its directory is read may let
+ * readdir return the name again, so they are handled once it ends.
+ */
+struct ClbtDeferred
+{
+	char* names;				/* NUL separated */
+	size_t used;
+	size_t capacity;
+};
+
+/* handles one file, dir is NULL for a root that is not a directory */
+typedef void(*ClbtFileFn)(struct ClbtWalker* walker, int dirfd, const char* dir, const char* name, int tid);
+
+int clbt_walk_begin(struct ClbtWalker* walker, const struct ClbtWalkOps* ops, void* user, int flags);
+void clbt_walk_root(struct ClbtWalker* walker, const char* root);
+int clbt_walk_end(struct ClbtWalker* walker);
+void clbt_walk_failed(struct ClbtWalker* walker);
+int clbt_walk_threads(const struct ClbtWalker* walker);
+void clbt_dir_retain(struct ClbtDir* dir);
+void clbt_dir_release(struct ClbtDir* dir, int tid);
+int clbt_entry_stat(struct ClbtEntry* entry);
+int clbt_entry_path(const struct ClbtEntry* entry, CP* out);
+void clbt_defer_file(struct ClbtWalker* walker, struct ClbtEntry* entry, struct ClbtDeferred* deferred, ClbtFileFn fn, int tid);
+void clbt_defer_run(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, struct ClbtDeferred* deferred, ClbtFileFn fn, int tid);
+#if CLBT_OS == 1
+int clbt_mode_type(mode_t mode);
+int clbt_open_read(const char* path, int sequential);
+int clbt_open_read_at(int dirfd, const char* name, int sequential);
+ssize_t clbt_read_full(int fd, void* buf, size_t len, off_t offset);
+int clbt_write_full(int fd, const void* buf, size_t len);
+int clbt_copy_prefix(int in, int out, off_t len, void* buf, size_t bufLen);
+int clbt_replace_begin(int dirfd, const char* name, CP* tmp, int tid);
+int clbt_replace_link(const char* target, int dirfd, const char* name, CP* tmp, int tid);
+int clbt_replace_commit(int dirfd, const char* name, const CP* tmp, int fd, const struct stat* st, int ok);
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Filter expressions, clbt_expr.c */
+
+struct ClbtExpr* clbt_expr_compile(const char* source);
+void clbt_expr_free(struct ClbtExpr* expr);
+const char* clbt_expr_source(const struct ClbtExpr* expr);
+int clbt_expr_constant(const struct ClbtExpr* expr);
+#if CLBT_OS == 1
+int clbt_expr_run(const struct ClbtExpr* expr, struct ClbtEntry* entry);
+int clbt_match_entry(struct ClbtEntry* entry);
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Sorting, clbt_sort.c */
+
+/* What a sort looks at, first member of whatever is sorted */
+struct ClbtSortKey
+{
+	const char* path;			/* NUL terminated */
+	uint64_t size;
+	int64_t mtime;				/* nanoseconds since the epoch */
+};
+
+int clbt_natural_compare(const char* a, const char* b);
+#if CLBT_OS == 1
+void clbt_sort_keys(struct ClbtSortKey** keys, size_t count, int by, int threads);
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Buffered output of all tasks, clbt_out.c */
+
+/* output formats, text lines end in NUL with --print0 */
+enum { CLBT_FORMAT_TEXT = 0, CLBT_FORMAT_NUL = 1, CLBT_FORMAT_JSONL = 2 };
+
+#define CLBT_RECORD_LOCAL	1024	/* record bytes kept on the stack */
+
+struct ClbtRecord
+{
+	char* data;					/* local or heap */
+	size_t used;
+	size_t capacity;
+	int count;					/* values so far */
+	int invalid;				/* a string had bytes of invalid UTF-8 */
+	char local[CLBT_RECORD_LOCAL];
+};
+
+void clbt_out_open(FILE* stream, int format);
+void clbt_out_close(void);
+void clbt_out_flush(void);
+void clbt_out_begin(int threads);
+void clbt_out_end(void);
+void clbt_out_write(int tid, const void* data, size_t len);
+void clbt_out_path(int tid, const char* path, size_t len);
+int clbt_out_enabled(void);
+int clbt_out_format(void);
+void clbt_record_begin(struct ClbtRecord* r);
+void clbt_record_string(struct ClbtRecord* r, const char* key, const char* value, size_t len);
+void clbt_record_join(struct ClbtRecord* r, const char* key, const char* dir, const char* name);
+void clbt_record_number(struct ClbtRecord* r, const char* key, unsigned long long value);
+void clbt_record_end(struct ClbtRecord* r, int tid);
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Binary listing snapshots, clbt_snap.c */
+
+/* columns of a snapshot block, in file order */
+enum { CLBT_SNAP_PATH = 0, CLBT_SNAP_SIZE = 1, CLBT_SNAP_MTIME = 2, CLBT_SNAP_MODE = 3, CLBT_SNAP_INO = 4, CLBT_SNAP_CTIME = 5, CLBT_SNAP_COLUMNS = 6 };
+
+/* One decoded snapshot entry */
+struct ClbtSnapEntry
+{
+	const char* path;			/* relative to the snapshot root, valid until the next step */
+	int length;					/* strlen of path */
+	uint64_t size;
+	int64_t mtime;				/* nanoseconds since the epoch */
+	uint32_t mode;				/* st_mode, type and permission bits */
+	uint64_t ino;
+	int64_t ctime;				/* nanoseconds since the epoch */
+	uint64_t ordinal;			/* position in the snapshot, from 0 */
+};
+
+/* A snapshot file mapped read only */
+struct ClbtSnap
+{
+	const unsigned char* base;
+	size_t size;
+	uint64_t entries;
+	uint32_t blocks;
+	const unsigned char* table;	/* offset, entries and length of every block */
+	const char* root;			/* walked directory, not NUL terminated */
+	int rootLength;
+};
+
+/* Sequential reader decoding one block at a time */
+struct ClbtSnapCursor
+{
+	const struct ClbtSnap* snap;
+	uint32_t block;				/* next block to load */
+	uint32_t left;				/* entries left in current block */
+	uint64_t next;				/* ordinal of the next entry */
+	const unsigned char* col[CLBT_SNAP_COLUMNS];
+	const unsigned char* end[CLBT_SNAP_COLUMNS];
+	CP path;					/* current path, rebuilt from shared prefixes */
+	int failed;					/* a corrupt block was seen */
+	struct ClbtSnapEntry entry;
+};
+
+#if CLBT_OS == 1
+void clbt_put32(unsigned char* p, uint32_t v);
+void clbt_put64(unsigned char* p, uint64_t v);
+uint32_t clbt_get32(const unsigned char* p);
+uint64_t clbt_get64(const unsigned char* p);
+size_t clbt_varint_put(unsigned char* p, uint64_t v);
+int clbt_varint_get(const unsigned char** p, const unsigned char* end, uint64_t* v);
+int clbt_snap_compare(const char* a, int alen, const char* b, int blen);
+int clbt_snap_open(struct ClbtSnap* snap, const char* file);
+void clbt_snap_close(struct ClbtSnap* snap);
+void clbt_snap_cursor_init(struct ClbtSnapCursor* cur, const struct ClbtSnap* snap, uint32_t block);
+void clbt_snap_cursor_destroy(struct ClbtSnapCursor* cur);
+void clbt_snap_seek(struct ClbtSnapCursor* cur, uint32_t block);
+int clbt_snap_goto(struct ClbtSnapCursor* cur, uint64_t ordinal);
+int clbt_snap_next(struct ClbtSnapCursor* cur);
+uint32_t clbt_snap_find(const struct ClbtSnap* snap, const char* key, int len);
+int clbt_snap_build(const char* root, const char* file, int walkFlags, int filter, int options, int* walked);
+int clbt_snap_refresh(const struct ClbtSnap* old, const char* file, int options, int* walked);
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Trigram index of the names in the filename index, clbt_trigram.c */
+
+struct ClbtTrigrams
+{
+	const unsigned char* base;	/* whole file, mapped read only */
+	size_t size;
+	uint32_t count;				/* trigrams in table */
+	const unsigned char* table;	/* trigram, entries and list offset, by trigram */
+};
+
+#if CLBT_OS == 1
+int clbt_trigram_build(const char* snapFile, const char* file, int options);
+int clbt_trigram_open(struct ClbtTrigrams* tri, const char* file, const struct ClbtSnap* snap);
+void clbt_trigram_close(struct ClbtTrigrams* tri);
+size_t clbt_trigram_candidates(const struct ClbtTrigrams* tri, uint32_t** set);
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Filename index, clbt_index.c */
+
+#if CLBT_OS == 1
+const char* clbt_index_file(void);
+int clbt_index_answer(const struct ClbtSnap* snap, const struct ClbtTrigrams* tri, int options);
+#endif
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Content digests, clbt_digest.c */
+
+enum { CLBT_DIGEST_NONE = 0, CLBT_DIGEST_XXH3 = 1, CLBT_DIGEST_SHA256 = 2, CLBT_DIGEST_BLAKE3 = 3 };
+
+#define CLBT_DIGEST_MAX			32		/* largest digest in bytes */
+#define CLBT_XXH_BUFFER_SIZE	256
+#define CLBT_BLAKE3_BLOCK_LEN	64
+#define CLBT_BLAKE3_CHUNK_LEN	1024
+
+struct ClbtSha256
+{
+	uint32_t h[8];
+	uint64_t total;
+	unsigned char buf[64];
+	int used;
+};
+
+struct ClbtXxh3
+{
+	uint64_t acc[8];
+	uint64_t total;
+	unsigned char buf[CLBT_XXH_BUFFER_SIZE];
+	int used;
+	int stripes;				/* stripes consumed in current block */
+};
+
+struct ClbtBlake3
+{
+	uint32_t cv[8];				/* chaining value of current chunk */
+	uint64_t chunkOffset;		/* index of first chunk in the whole input */
+	uint64_t chunks;			/* completed chunks */
+	unsigned char block[CLBT_BLAKE3_BLOCK_LEN];
+	int blockLen;
+	int chunkLen;
+	uint32_t stack[54][8];		/* chaining values of completed subtrees */
+	int stackLen;
+};
+
+/* A compression input not yet finalized, either a chunk end or a parent */
+struct ClbtBlake3Node
+{
+	uint32_t cv[8];
+	uint32_t block[16];
+	uint64_t counter;
+	uint32_t blockLen;
+	uint32_t flags;
+};
+
+struct ClbtDigest
+{
+	int algo;
+	union
+	{
+		struct ClbtXxh3 xxh3;
+		struct ClbtSha256 sha256;
+		struct ClbtBlake3 blake3;
+	} u;
+};
+
+int clbt_digest_parse(const char* name);
+int clbt_digest_size(int algo);
+void clbt_digest_init(struct ClbtDigest* d, int algo);
+void clbt_digest_update(struct ClbtDigest* d, const void* data, size_t len);
+int clbt_digest_final(struct ClbtDigest* d, unsigned char* out);
+void clbt_digest_hex(const unsigned char* digest, int len, char* out);
+
+void clbt_blake3_init(struct ClbtBlake3* s, uint64_t chunkOffset);
+void clbt_blake3_update(struct ClbtBlake3* s, const unsigned char* p, size_t len);
+void clbt_blake3_node(const struct ClbtBlake3* s, struct ClbtBlake3Node* node);
+void clbt_blake3_parent(const uint32_t* left, const uint32_t* right, struct ClbtBlake3Node* node);
+void clbt_blake3_cv(const struct ClbtBlake3Node* node, uint32_t* cv);
+void clbt_blake3_root(const struct ClbtBlake3Node* node, unsigned char* out);
+
+/*------------------------------------------------------------------------------------------------------*/
+/* Tasks */
+int clbt_task_list(int options);
+int clbt_list_sorted(int options);
+#if CLBT_OS == 1
+void clbt_list_record(struct ClbtWalker* walker, struct ClbtEntry* entry, const char* path, int len, int tid);
+#endif
+int clbt_task_delete(int options);
+int clbt_task_hash(int options);
+int clbt_task_dedupe(int options);
+int clbt_task_modify(int options);
+int clbt_task_du(int options);
+int clbt_task_top(int options);
+int clbt_task_stats(int options);
+int clbt_task_convert(int options);
+int clbt_task_sync(int options);
+int clbt_task_exec(int options);
+int clbt_task_snapshot(int options);
+int clbt_task_diff(int options);
+int clbt_task_index(int options);
+int clbt_index_list(int options);
+int clbt_task_watch(int options);
+int clbt_task_serve(int options);
+int clbt_serve_ask(int options);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end _CLBT_INTERNAL_H_ */
@@ -0,0 +1,402 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_iter.c
+ *
+ *   Description:
+ *
+ *   Walk iterator for programs embedding CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <pthread.h>
+
+#define CLBT_ITER_ENTRIES	512			/* entries per batch */
+#define CLBT_ITER_BYTES		(64 << 10)	/* path bytes per batch, more for a longer path */
+#define CLBT_ITER_QUEUED	4			/* full batches waiting per worker thread */
+
+/*
+ * The walk runs on its own pool as for any task, the caller only pulls.
+ * Each worker fills a batch of its own, without locking, and queues it
+ * once full. The caller takes batches off the queue and hands out their
+ * entries in place, a batch goes back to the workers when the caller asks
+ * for the entry after its last. Workers wait while the queue is full, so
+ * a slow caller holds a few batches per thread, never the whole tree.
+ */
+struct ClbtIterBatch
+{
+	struct ClbtIterBatch* next;
+	int count;					/* entries filled */
+	int used;					/* path bytes filled */
+	int capacity;				/* path bytes allocated */
+	char* paths;
+	struct ClbtWalkEntry entries[CLBT_ITER_ENTRIES];
+};
+
+struct ClbtWalkIter
+{
+	struct ClbtWalker walker;
+	int options;				/* CLBT_OPT_XXX given to clbt_walk_open() */
+	pthread_t driver;			/* waits for the walk to end */
+	pthread_mutex_t lock;		/* guards everything below */
+	pthread_cond_t ready;		/* a batch was queued or the walk ended */
+	pthread_cond_t room;		/* the caller took a batch or closes */
+	struct ClbtIterBatch* head;	/* full batches, in the order they were queued */
+	struct ClbtIterBatch* tail;
+	struct ClbtIterBatch* spare;/* batches to fill again */
+	int queued;
+	int limit;					/* most batches queued */
+	int done;					/* the walk ended, nothing more is queued */
+	int cancel;					/* closed early, atomic */
+	int ret;					/* of the walk */
+	struct ClbtIterBatch** filling;	/* per thread batch being filled */
+	struct ClbtIterBatch* current;	/* batch handed out by the caller */
+	int pos;						/* next entry of current */
+};
+
+static void clbt_iter_oom(void)
+{
+	clbt_error("Unable to allocate memory for walk iterator!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+/*
+ * An empty batch with room for len path bytes.
+ */
+static struct ClbtIterBatch* clbt_iter_batch(struct ClbtWalkIter* it, int len)
+{
+	struct ClbtIterBatch* batch;
+
+	if (len < CLBT_ITER_BYTES)
+		len = CLBT_ITER_BYTES;
+
+	pthread_mutex_lock(&it->lock);
+	batch = it->spare;
+	if (batch != NULL)
+		it->spare = batch->next;
+	pthread_mutex_unlock(&it->lock);
+
+	if (batch == NULL)
+	{
+		batch = (struct ClbtIterBatch*)malloc(sizeof(struct ClbtIterBatch));
+		if (batch == NULL)
+			clbt_iter_oom();
+		batch->paths = NULL;
+		batch->capacity = 0;
+	}
+	if (batch->capacity < len)
+	{
+		free(batch->paths);
+		batch->paths = (char*)malloc(len);
+		if (batch->paths == NULL)
+			clbt_iter_oom();
+		batch->capacity = len;
+	}
+	batch->next = NULL;
+	batch->count = 0;
+	batch->used = 0;
+	return batch;
+}
+
+static void clbt_iter_free(struct ClbtIterBatch* batch)
+{
+	struct ClbtIterBatch* next;
+
+	for (; batch != NULL; batch = next)
+	{
+		next = batch->next;
+		free(batch->paths);
+		free(batch);
+	}
+}
+
+/*
+ * Queue a filled batch, waiting for room, or drop it once closed.
+ */
+static void clbt_iter_push(struct ClbtWalkIter* it, struct ClbtIterBatch* batch)
+{
+	pthread_mutex_lock(&it->lock);
+	while (it->queued >= it->limit && !it->cancel)
+		pthread_cond_wait(&it->room, &it->lock);
+
+	if (it->cancel)
+	{
+		batch->next = it->spare;
+		it->spare = batch;
+	}
+	else
+	{
+		if (it->tail != NULL)
+			it->tail->next = batch;
+		else
+			it->head = batch;
+		it->tail = batch;
+		it->queued++;
+		pthread_cond_signal(&it->ready);
+	}
+	pthread_mutex_unlock(&it->lock);
+}
+
+static int clbt_iter_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtWalkIter* it = (struct ClbtWalkIter*)walker->user;
+	struct ClbtIterBatch* batch = it->filling[tid];
+	struct ClbtWalkEntry* e;
+	char* p;
+	const char* slash;
+	int dirLength = 0, len;
+
+	if (clbt_atomic_load(&it->cancel))
+		return CLBT_WALK_SKIP;
+	if (!clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+	if ((it->options & CLBT_OPT_STAT) && clbt_entry_stat(entry) != CLBT_OK)
+	{
+		if (entry->dir != NULL)
+			clbt_error("Cannot stat '%s/%s': %s", entry->dir->path, entry->name, strerror(errno));
+		else
+			clbt_error("Cannot stat '%s': %s", entry->name, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	/* the path is joined right into the batch the caller reads */
+	if (entry->dir != NULL)
+	{
+		dirLength = entry->dir->length;
+		if (dirLength < 1 || entry->dir->path[dirLength - 1] != '/')
+			dirLength++;
+	}
+	len = dirLength + entry->namelen;
+	if (batch != NULL && (batch->count == CLBT_ITER_ENTRIES || batch->capacity - batch->used <= len))
+	{
+		clbt_iter_push(it, batch);
+		batch = NULL;
+	}
+	if (batch == NULL)
+		batch = it->filling[tid] = clbt_iter_batch(it, len + 1);
+
+	p = batch->paths + batch->used;
+	if (dirLength > 0)
+	{
+		memcpy(p, entry->dir->path, entry->dir->length);
+		p[dirLength - 1] = '/';
+	}
+	memcpy(p + dirLength, entry->name, entry->namelen + 1);
+	batch->used += len + 1;
+
+	e = &batch->entries[batch->count++];
+	e->path = p;
+	e->length = len;
+	e->name = p + dirLength;
+	if (entry->dir == NULL && (slash = strrchr(p, '/')) != NULL && slash[1] != '\0')
+		e->name = slash + 1;
+	e->type = entry->type;
+	e->depth = entry->dir != NULL ? entry->dir->depth + 1 : 0;
+	e->hasStat = entry->hasStat;
+	if (entry->hasStat)
+	{
+		e->size = (unsigned long long)entry->st.st_size;
+		e->mtime = (long long)entry->st.st_mtim.tv_sec * 1000000000 + entry->st.st_mtim.tv_nsec;
+		e->mode = (unsigned int)entry->st.st_mode;
+	}
+	else
+	{
+		e->size = 0;
+		e->mtime = 0;
+		e->mode = 0;
+	}
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtIterOps = { clbt_iter_on_entry, NULL, NULL, NULL };
+
+/*
+ * Wait for the walk in the background, then queue what is left.
+ */
+static void* clbt_iter_driver(void* arg)
+{
+	struct ClbtWalkIter* it = (struct ClbtWalkIter*)arg;
+	int threads = clbt_walk_threads(&it->walker);
+	int ret, i;
+
+	ret = clbt_walk_end(&it->walker);
+	for (i = 0; i < threads; i++)
+	{
+		if (it->filling[i] != NULL && it->filling[i]->count > 0)
+			clbt_iter_push(it, it->filling[i]);
+		else if (it->filling[i] != NULL)
+			clbt_iter_free(it->filling[i]);
+		it->filling[i] = NULL;
+	}
+
+	pthread_mutex_lock(&it->lock);
+	it->ret = ret;
+	it->done = 1;
+	pthread_cond_broadcast(&it->ready);
+	pthread_mutex_unlock(&it->lock);
+	return NULL;
+}
+
+/*
+ * Start walking root, or the configured targets if NULL, recursively with
+ * CLBT_OPT_RECURSIVE. Entries are matched against input patterns and
+ * --expr given to clbt_config(), CLBT_OPT_STAT fills size, mtime and mode
+ * of every entry. NULL if the walk cannot be started.
+ */
+struct ClbtWalkIter* clbt_walk_open(const char* root, int options)
+{
+	struct ClbtWalkIter* it;
+	int i, threads;
+
+	/* make sure config is initialized */
+	clbt_config(-1, NULL);
+	clbt_set_quiet(options);
+
+	it = (struct ClbtWalkIter*)calloc(1, sizeof(struct ClbtWalkIter));
+	if (it == NULL)
+		clbt_iter_oom();
+	it->options = options;
+	pthread_mutex_init(&it->lock, NULL);
+	pthread_cond_init(&it->ready, NULL);
+	pthread_cond_init(&it->room, NULL);
+
+	clbt_walk_begin(&it->walker, &clbtIterOps, it, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	threads = clbt_walk_threads(&it->walker);
+	it->limit = threads * CLBT_ITER_QUEUED;
+	it->filling = (struct ClbtIterBatch**)calloc(threads, sizeof(struct ClbtIterBatch*));
+	if (it->filling == NULL)
+		clbt_iter_oom();
+
+	if (root != NULL)
+		clbt_walk_root(&it->walker, root);
+	else if (clbtConfig.targets.size < 1)
+		clbt_walk_root(&it->walker, ".");
+	else for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&it->walker, clbtConfig.targets.paths[i]->path);
+
+	if (pthread_create(&it->driver, NULL, clbt_iter_driver, it) != 0)
+	{
+		clbt_error("Cannot start the walk: %s", strerror(errno));
+		clbt_atomic_store(&it->cancel, 1);
+		clbt_walk_end(&it->walker);
+		for (i = 0; i < threads; i++)
+			clbt_iter_free(it->filling[i]);
+		free(it->filling);
+		clbt_iter_free(it->spare);
+		pthread_mutex_destroy(&it->lock);
+		pthread_cond_destroy(&it->ready);
+		pthread_cond_destroy(&it->room);
+		free(it);
+		return NULL;
+	}
+	return it;
+}
+
+/*
+ * Point *entry at the next entry and return 1, or return 0 once the walk
+ * is done. The entry stays valid until the next call. Entries come in no
+ * particular order, as many threads walk at once.
+ */
+int clbt_walk_next(struct ClbtWalkIter* it, const struct ClbtWalkEntry** entry)
+{
+	while (it->current == NULL || it->pos >= it->current->count)
+	{
+		pthread_mutex_lock(&it->lock);
+		if (it->current != NULL)
+		{
+			it->current->next = it->spare;
+			it->spare = it->current;
+			it->current = NULL;
+		}
+		while (it->head == NULL && !it->done)
+			pthread_cond_wait(&it->ready, &it->lock);
+		if (it->head == NULL)
+		{
+			pthread_mutex_unlock(&it->lock);
+			*entry = NULL;
+			return 0;
+		}
+		it->current = it->head;
+		it->head = it->head->next;
+		it->current->next = NULL;
+		if (it->head == NULL)
+			it->tail = NULL;
+		it->queued--;
+		pthread_cond_signal(&it->room);
+		pthread_mutex_unlock(&it->lock);
+		it->pos = 0;
+	}
+
+	*entry = &it->current->entries[it->pos++];
+	return 1;
+}
+
+/*
+ * Stop the walk if it is still going and release it. CLBT_FAILURE_IO if
+ * some entry could not be read, the error was printed then.
+ */
+int clbt_walk_close(struct ClbtWalkIter* it)
+{
+	int ret;
+
+	if (it == NULL)
+		return CLBT_INVALID_OP;
+
+	pthread_mutex_lock(&it->lock);
+	clbt_atomic_store(&it->cancel, 1);
+	pthread_cond_broadcast(&it->room);
+	pthread_mutex_unlock(&it->lock);
+	pthread_join(it->driver, NULL);
+
+	ret = it->ret;
+	clbt_iter_free(it->current);
+	clbt_iter_free(it->head);
+	clbt_iter_free(it->spare);
+	free(it->filling);
+	pthread_mutex_destroy(&it->lock);
+	pthread_cond_destroy(&it->ready);
+	pthread_cond_destroy(&it->room);
+	free(it);
+	return ret;
+}
+
+#else
+
+struct ClbtWalkIter* clbt_walk_open(const char* root, int options)
+{
+	(void)root;
+	(void)options;
+	clbt_config(-1, NULL);
+	clbt_unsupported("walk");
+	return NULL;
+}
+
+int clbt_walk_next(struct ClbtWalkIter* it, const struct ClbtWalkEntry** entry)
+{
+	(void)it;
+	*entry = NULL;
+	return 0;
+}
+
+int clbt_walk_close(struct ClbtWalkIter* it)
+{
+	(void)it;
+	return CLBT_FAILURE_OS;
+}
+
+#endif
@@ -0,0 +1,574 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_modify.c
+ *
+ *   Description:
+ *
+ *   Streaming in-place content substitution task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* memmem() */
+#endif
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <regex.h>
+
+#define CLBT_MODIFY_BLOCK	(1 << 20)	/* bytes per read and per write */
+#define CLBT_MODIFY_LINE	(16 << 20)	/* longest line a regex may look at */
+
+/*
+ * Files are streamed through a bounded window. Until the first match nothing
+ * but the scan happens, so unaffected files are never opened for writing and
+ * keep their mtime. On the first match a temporary file is created next to
+ * the original, the untouched prefix is copied over from the source and the
+ * rest is substituted on the fly, then renamed over the original.
+ *
+ * Literal searches look at the whole window and keep the longest search minus
+ * one byte between reads. Regular expressions are matched line by line, like
+ * sed, and never span lines.
+ */
+struct ClbtModifyRule
+{
+	const char* search;
+	size_t searchLen;
+	const char* replace;
+	size_t replaceLen;
+	regex_t re;
+};
+
+struct ClbtModifyTask
+{
+	struct ClbtModifyRule* rules;
+	int count;
+	int regex;
+	size_t longest;				/* longest literal search */
+	unsigned long scanned;		/* atomic */
+	unsigned long modified;		/* atomic */
+};
+
+struct ClbtModifyStream
+{
+	const struct ClbtModifyTask* task;
+	unsigned char* buf;			/* window, one spare byte for regex NUL */
+	size_t len;
+	size_t cap;
+	off_t base;					/* file offset of buf[0] */
+	int eof;
+	int notbol;					/* regex: search start is not at a line start */
+	size_t next;				/* where to search after the last match */
+	int rule;					/* rule of the last match */
+	regmatch_t groups[10];		/* regex groups of the last match, relative to buf */
+	unsigned char* out;			/* pending output */
+	size_t outLen;
+	int fd;
+	int outFd;					/* -1 until the first match */
+};
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Leftmost literal match in buf[from, len), matches starting in the last
+ * longest - 1 bytes are deferred until more data is read.
+ */
+static int clbt_modify_find_literal(struct ClbtModifyStream* s, size_t from, size_t* ms, size_t* me, size_t* safe)
+{
+	const struct ClbtModifyTask* task = s->task;
+	size_t limit = s->len;
+	const unsigned char* p;
+	const unsigned char* best = NULL;
+	size_t end;
+	int i;
+
+	if (!s->eof)
+		limit = s->len > task->longest - 1 ? s->len - (task->longest - 1) : 0;
+	*safe = limit > from ? limit : from;
+	if (from >= s->len)
+		return 0;
+
+	for (i = 0; i < task->count; i++)
+	{
+		/* later rules only win if they start before the best match so far */
+		end = s->len;
+		if (best != NULL && (size_t)(best - s->buf) + task->rules[i].searchLen - 1 < end)
+			end = (best - s->buf) + task->rules[i].searchLen - 1;
+		p = (const unsigned char*)memmem(s->buf + from, end - from, task->rules[i].search, task->rules[i].searchLen);
+		if (p != NULL && (best == NULL || p < best))
+		{
+			best = p;
+			s->rule = i;
+		}
+	}
+
+	if (best == NULL || (size_t)(best - s->buf) >= limit)
+		return 0;
+
+	*ms = best - s->buf;
+	*me = *ms + task->rules[s->rule].searchLen;
+	s->next = *me;
+	return 1;
+}
+
+/*
+ * Leftmost regex match on the first complete line at or after from that has one.
+ */
+static int clbt_modify_find_regex(struct ClbtModifyStream* s, size_t from, size_t* ms, size_t* me, size_t* safe)
+{
+	const struct ClbtModifyTask* task = s->task;
+	regmatch_t groups[10];
+	unsigned char* nl;
+	unsigned char saved;
+	size_t lineEnd;
+	int i, best, ret;
+
+	while (from < s->len)
+	{
+		nl = (unsigned char*)memchr(s->buf + from, '\n', s->len - from);
+		if (nl != NULL)
+			lineEnd = nl - s->buf;
+		else if (s->eof)
+			lineEnd = s->len;
+		else
+			break;
+
+		/* regexec needs a terminated string, the window has one spare byte */
+		saved = s->buf[lineEnd];
+		s->buf[lineEnd] = '\0';
+		best = -1;
+		for (i = 0; i < task->count; i++)
+		{
+			ret = regexec(&task->rules[i].re, (const char*)s->buf + from, 10, groups, s->notbol ? REG_NOTBOL : 0);
+			if (ret == 0 && (best < 0 || groups[0].rm_so < s->groups[0].rm_so))
+			{
+				best = i;
+				memcpy(s->groups, groups, sizeof(groups));
+			}
+		}
+		s->buf[lineEnd] = saved;
+
+		if (best >= 0)
+		{
+			for (i = 0; i < 10; i++)
+			{
+				if (s->groups[i].rm_so >= 0)
+				{
+					s->groups[i].rm_so += from;
+					s->groups[i].rm_eo += from;
+				}
+			}
+			s->rule = best;
+			*ms = s->groups[0].rm_so;
+			*me = s->groups[0].rm_eo;
+
+			/* never match empty twice at one place, and leave the line at its end */
+			if (*me == lineEnd)
+			{
+				s->next = lineEnd < s->len ? lineEnd + 1 : lineEnd;
+				s->notbol = 0;
+			}
+			else
+			{
+				s->next = *me == *ms ? *me + 1 : *me;
+				s->notbol = 1;
+			}
+			*safe = from;
+			return 1;
+		}
+
+		from = lineEnd < s->len ? lineEnd + 1 : lineEnd;
+		s->notbol = 0;
+		if (lineEnd == s->len)
+			break;
+	}
+
+	*safe = from;
+	return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static int clbt_modify_flush(struct ClbtModifyStream* s)
+{
+	if (clbt_write_full(s->outFd, s->out, s->outLen) != CLBT_OK)
+		return CLBT_FAILURE_IO;
+	s->outLen = 0;
+	return CLBT_OK;
+}
+
+static int clbt_modify_emit(struct ClbtModifyStream* s, const void* data, size_t len)
+{
+	size_t take;
+
+	while (len > 0)
+	{
+		if (s->outLen == CLBT_MODIFY_BLOCK && clbt_modify_flush(s) != CLBT_OK)
+			return CLBT_FAILURE_IO;
+		take = CLBT_MODIFY_BLOCK - s->outLen;
+		if (take > len)
+			take = len;
+		memcpy(s->out + s->outLen, data, take);
+		s->outLen += take;
+		data = (const char*)data + take;
+		len -= take;
+	}
+	return CLBT_OK;
+}
+
+static int clbt_modify_emit_replacement(struct ClbtModifyStream* s)
+{
+	const struct ClbtModifyRule* rule = &s->task->rules[s->rule];
+	const char* p = rule->replace;
+	const char* end = p + rule->replaceLen;
+	const char* run = p;
+	int g;
+
+	if (!s->task->regex)
+		return clbt_modify_emit(s, rule->replace, rule->replaceLen);
+
+	/* \0 - \9 insert groups, \\ a backslash */
+	for (; p < end; p++)
+	{
+		if (*p != '\\' || p + 1 >= end || !((p[1] >= '0' && p[1] <= '9') || p[1] == '\\'))
+			continue;
+		if (clbt_modify_emit(s, run, p - run) != CLBT_OK)
+			return CLBT_FAILURE_IO;
+		p++;
+		if (*p == '\\')
+		{
+			if (clbt_modify_emit(s, p, 1) != CLBT_OK)
+				return CLBT_FAILURE_IO;
+		}
+		else
+		{
+			g = *p - '0';
+			if (s->groups[g].rm_so >= 0
+				&& clbt_modify_emit(s, s->buf + s->groups[g].rm_so, s->groups[g].rm_eo - s->groups[g].rm_so) != CLBT_OK)
+				return CLBT_FAILURE_IO;
+		}
+		run = p + 1;
+	}
+	return clbt_modify_emit(s, run, end - run);
+}
+
+/*
+ * Stream one file through the rules, returns 1 if modified, 0 if untouched, -1 on failure.
+ */
+static int clbt_modify_file(struct ClbtModifyStream* s, int dirfd, const char* name, CP* tmp, int tid)
+{
+	struct stat st;
+	size_t from = 0, flushed = 0, shift;
+	size_t ms, me, safe;
+	ssize_t n;
+	int found, ret = CLBT_OK;
+
+	s->fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (s->fd < 0 || fstat(s->fd, &st) != 0)
+	{
+		if (s->fd >= 0)
+			close(s->fd);
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	s->len = 0;
+	s->base = 0;
+	s->eof = 0;
+	s->notbol = 0;
+	s->outLen = 0;
+	s->outFd = -1;
+
+	while (ret == CLBT_OK)
+	{
+		/* refill the window */
+		if (!s->eof)
+		{
+			if (s->len == s->cap)
+			{
+				if (!s->task->regex || s->cap >= CLBT_MODIFY_LINE)
+				{
+					errno = EFBIG;
+					ret = CLBT_FAILURE_IO;
+					break;
+				}
+				s->cap *= 2;
+				s->buf = (unsigned char*)realloc(s->buf, s->cap + 1);
+				if (s->buf == NULL)
+				{
+					clbt_error("Unable to reallocate memory for modify task!");
+					exit(CLBT_MEMORY_ERR);
+				}
+			}
+			n = clbt_read_full(s->fd, s->buf + s->len, s->cap - s->len, -1);
+			if (n < 0)
+			{
+				ret = CLBT_FAILURE_IO;
+				break;
+			}
+			s->eof = s->len + n < s->cap;
+			s->len += n;
+		}
+
+		while (ret == CLBT_OK)
+		{
+			found = s->task->regex ? clbt_modify_find_regex(s, from, &ms, &me, &safe)
+				: clbt_modify_find_literal(s, from, &ms, &me, &safe);
+			if (!found)
+				break;
+
+			if (s->outFd < 0)
+			{
+				/* first match, everything before it is copied as is */
+				s->outFd = clbt_replace_begin(dirfd, name, tmp, tid);
+				if (s->outFd < 0 || clbt_copy_prefix(s->fd, s->outFd, s->base + (off_t)ms, s->out, CLBT_MODIFY_BLOCK) != CLBT_OK)
+				{
+					ret = CLBT_FAILURE_IO;
+					break;
+				}
+				flushed = ms;
+			}
+
+			if (clbt_modify_emit(s, s->buf + flushed, ms - flushed) != CLBT_OK
+				|| clbt_modify_emit_replacement(s) != CLBT_OK)
+				ret = CLBT_FAILURE_IO;
+			flushed = me;
+			from = s->next;
+		}
+		if (ret != CLBT_OK)
+			break;
+
+		if (s->outFd >= 0 && safe > flushed)
+		{
+			if (clbt_modify_emit(s, s->buf + flushed, safe - flushed) != CLBT_OK)
+			{
+				ret = CLBT_FAILURE_IO;
+				break;
+			}
+			flushed = safe;
+		}
+		if (s->eof)
+			break;
+
+		/* drop what is emitted, or what can't be part of a match while scanning */
+		shift = s->outFd >= 0 ? flushed : safe;
+		if (from < safe)
+			from = safe;
+		memmove(s->buf, s->buf + shift, s->len - shift);
+		s->len -= shift;
+		s->base += shift;
+		from -= shift;
+		flushed -= shift;
+	}
+
+	if (s->outFd >= 0 && ret == CLBT_OK && s->len > flushed)
+		ret = clbt_modify_emit(s, s->buf + flushed, s->len - flushed);
+	close(s->fd);
+
+	if (s->outFd < 0)
+		return ret == CLBT_OK ? 0 : -1;
+
+	if (ret == CLBT_OK)
+		ret = clbt_modify_flush(s);
+	if (clbt_replace_commit(dirfd, name, tmp, s->outFd, &st, ret == CLBT_OK) != CLBT_OK)
+		return -1;
+	return 1;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+struct ClbtModifyWorker
+{
+	struct ClbtModifyStream stream;
+	CP tmp;
+	struct ClbtDeferred deferred;
+};
+
+struct ClbtModifyState
+{
+	struct ClbtModifyTask* task;
+	struct ClbtModifyWorker* workers;	/* per thread */
+};
+
+static void clbt_modify_report(struct ClbtWalker* walker, int ret, const char* dir, const char* name)
+{
+	struct ClbtModifyState* state = (struct ClbtModifyState*)walker->user;
+	struct ClbtRecord r;
+
+	clbt_atomic_add(&state->task->scanned, 1);
+	if (ret > 0)
+	{
+		clbt_atomic_add(&state->task->modified, 1);
+		clbt_record_begin(&r);
+		if (dir)
+			clbt_record_join(&r, "path", dir, name);
+		else
+			clbt_record_string(&r, "path", name, strlen(name));
+		clbt_record_end(&r, -1);
+	}
+	else if (ret < 0)
+	{
+		clbt_error("Cannot modify '%s%s%s': %s", dir ? dir : "", dir ? "/" : "", name, strerror(errno));
+		clbt_walk_failed(walker);
+	}
+}
+
+static void clbt_modify_one(struct ClbtWalker* walker, int dirfd, const char* dir, const char* name, int tid)
+{
+	struct ClbtModifyState* state = (struct ClbtModifyState*)walker->user;
+	struct ClbtModifyWorker* w = &state->workers[tid];
+
+	clbt_modify_report(walker, clbt_modify_file(&w->stream, dirfd, name, &w->tmp, tid), dir, name);
+}
+
+static int clbt_modify_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtModifyState* state = (struct ClbtModifyState*)walker->user;
+
+	if (entry->type == CLBT_TYPE_FILE && clbt_match_entry(entry))
+		clbt_defer_file(walker, entry, &state->workers[tid].deferred, clbt_modify_one, tid);
+	return CLBT_WALK_CONTINUE;
+}
+
+static void clbt_modify_on_dir_end(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid)
+{
+	struct ClbtModifyState* state = (struct ClbtModifyState*)walker->user;
+
+	clbt_defer_run(walker, dir, dirfd, &state->workers[tid].deferred, clbt_modify_one, tid);
+}
+
+static const struct ClbtWalkOps clbtModifyOps = { clbt_modify_on_entry, clbt_modify_on_dir_end, NULL, NULL };
+
+/*
+ * Substitute search strings by replacements in content of matching files,
+ * prints the path of every modified file.
+ */
+int clbt_task_modify(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtModifyTask task;
+	struct ClbtModifyState state;
+	char msg[256];
+	int i, ret, threads;
+
+	memset(&task, 0, sizeof(task));
+	task.count = clbtConfig.searches.size;
+	task.regex = (options & CLBT_OPT_REGEX) != 0;
+	if (task.count < 1)
+	{
+		clbt_error("Nothing to search for.");
+		return CLBT_INVALID_OP;
+	}
+
+	task.rules = (struct ClbtModifyRule*)calloc(task.count, sizeof(struct ClbtModifyRule));
+	if (task.rules == NULL)
+	{
+		clbt_error("Unable to allocate memory for modify task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	for (i = 0; i < task.count; i++)
+	{
+		task.rules[i].search = clbtConfig.searches.paths[i]->path;
+		task.rules[i].searchLen = strlen(task.rules[i].search);
+		task.rules[i].replace = i < clbtConfig.replaces.size ? clbtConfig.replaces.paths[i]->path : "";
+		task.rules[i].replaceLen = strlen(task.rules[i].replace);
+		if (task.rules[i].searchLen > task.longest)
+			task.longest = task.rules[i].searchLen;
+		if (!task.regex && task.rules[i].searchLen == 0)
+		{
+			clbt_error("Empty search string.");
+			free(task.rules);
+			return CLBT_INVALID_OP;
+		}
+		if (task.regex && (ret = regcomp(&task.rules[i].re, task.rules[i].search, REG_EXTENDED)) != 0)
+		{
+			regerror(ret, &task.rules[i].re, msg, sizeof(msg));
+			clbt_error("Invalid regular expression '%s': %s", task.rules[i].search, msg);
+			while (i-- > 0)
+				regfree(&task.rules[i].re);
+			free(task.rules);
+			return CLBT_INVALID_OP;
+		}
+	}
+
+	ret = CLBT_OK;
+	if (!clbt_confirm(options, "Modify content of matching files in %d target(s)?", clbtConfig.targets.size))
+		goto done;
+
+	ret = clbt_walk_begin(&walker, &clbtModifyOps, &state, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		goto done;
+
+	threads = clbt_walk_threads(&walker);
+	state.task = &task;
+	state.workers = (struct ClbtModifyWorker*)calloc(threads, sizeof(struct ClbtModifyWorker));
+	if (state.workers == NULL)
+	{
+		clbt_error("Unable to allocate memory for modify task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		state.workers[i].stream.task = &task;
+		state.workers[i].stream.cap = CLBT_MODIFY_BLOCK;
+		state.workers[i].stream.buf = (unsigned char*)malloc(CLBT_MODIFY_BLOCK + 1);
+		state.workers[i].stream.out = (unsigned char*)malloc(CLBT_MODIFY_BLOCK);
+		if (state.workers[i].stream.buf == NULL || state.workers[i].stream.out == NULL)
+		{
+			clbt_error("Unable to allocate memory for modify task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		clbt_path_init(&state.workers[i].tmp);
+	}
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+	clbt_verbose(options, "Modified %lu of %lu file(s).", task.modified, task.scanned);
+
+	for (i = 0; i < threads; i++)
+	{
+		free(state.workers[i].stream.buf);
+		free(state.workers[i].stream.out);
+		free(state.workers[i].deferred.names);
+		clbt_path_destroy(&state.workers[i].tmp);
+	}
+	free(state.workers);
+
+done:
+	if (task.regex)
+	{
+		for (i = 0; i < task.count; i++)
+			regfree(&task.rules[i].re);
+	}
+	free(task.rules);
+	return ret;
+}
+
+#else
+
+int clbt_task_modify(int options)
+{
+	(void)options;
+	return clbt_unsupported("modify");
+}
+
+#endif
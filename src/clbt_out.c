@@ -0,0 +1,622 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_out.c
+ *
+ *   Description:
+ *
+ *   Buffered output writer for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static int clbtOutFormat = CLBT_FORMAT_TEXT;
+
+/*------------------------------------------------------------------------------------------------------*/
+/*
+ * Records are what tasks print for machines: with --jsonl one JSON object
+ * per line, else values without keys separated by tabs and terminated by
+ * a newline, or NUL with --print0. Small records never touch the heap.
+ *
+ * Names are bytes, not necessarily UTF-8. In JSON a byte that is not part
+ * of a valid UTF-8 sequence is written as \u00XX and the record gets an
+ * "invalid_utf8":true member, so every line still parses.
+ */
+
+static void clbt_record_reserve(struct ClbtRecord* r, size_t extra)
+{
+	size_t capacity;
+	char* p;
+
+	if (r->used + extra <= r->capacity)
+		return;
+	capacity = (r->used + extra) * 2;
+	p = (char*)malloc(capacity);
+	if (p == NULL)
+	{
+		clbt_error("Unable to allocate memory for output!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	memcpy(p, r->data, r->used);
+	if (r->data != r->local)
+		free(r->data);
+	r->data = p;
+	r->capacity = capacity;
+}
+
+static void clbt_record_put(struct ClbtRecord* r, const char* s, size_t len)
+{
+	clbt_record_reserve(r, len);
+	memcpy(r->data + r->used, s, len);
+	r->used += len;
+}
+
+/*
+ * Length of the ASCII prefix that needs no JSON escape, 16 bytes at a time.
+ */
+static size_t clbt_json_clean(const unsigned char* p, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+	__m128i v, hit;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i*)(p + i));
+		/* bytes up to 0x1f are those where max(v, 0x1f) stays 0x1f */
+		hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+		if (_mm_movemask_epi8(_mm_or_si128(hit, v)) != 0)
+			break;
+	}
+#endif
+	for (; i < len; i++)
+	{
+		if (p[i] < 0x20 || p[i] >= 0x80 || p[i] == '"' || p[i] == '\\')
+			break;
+	}
+	return i;
+}
+
+/*
+ * Length of the valid UTF-8 sequence at p, 0 if there is none.
+ */
+static int clbt_utf8_length(const unsigned char* p, size_t len)
+{
+	int n, i;
+	unsigned c;
+
+	if (p[0] < 0xc2 || p[0] > 0xf4)
+		return 0;
+	n = p[0] < 0xe0 ? 2 : p[0] < 0xf0 ? 3 : 4;
+	if (len < (size_t)n)
+		return 0;
+	c = p[0] & (0x7f >> n);
+	for (i = 1; i < n; i++)
+	{
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (p[i] & 0x3f);
+	}
+	/* overlong, surrogate or beyond U+10FFFF */
+	if ((n == 3 && c < 0x800) || (n == 4 && c < 0x10000) || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+		return 0;
+	return n;
+}
+
+/*
+ * Append a string as JSON string content, valid UTF-8 is kept as it is.
+ */
+static void clbt_record_escape(struct ClbtRecord* r, const char* s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char* p = (const unsigned char*)s;
+	size_t clean;
+	char esc[6];
+	int n;
+
+	while (len > 0)
+	{
+		clean = clbt_json_clean(p, len);
+		clbt_record_put(r, (const char*)p, clean);
+		p += clean;
+		len -= clean;
+		if (len == 0)
+			break;
+
+		if (*p >= 0x80 && (n = clbt_utf8_length(p, len)) > 0)
+		{
+			clbt_record_put(r, (const char*)p, n);
+			p += n;
+			len -= n;
+			continue;
+		}
+		if (*p >= 0x80)
+			r->invalid = 1;
+
+		esc[0] = '\\';
+		n = 2;
+		switch (*p)
+		{
+		case '"': esc[1] = '"'; break;
+		case '\\': esc[1] = '\\'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[*p >> 4];
+			esc[5] = hex[*p & 15];
+			n = 6;
+			break;
+		}
+		clbt_record_put(r, esc, n);
+		p++;
+		len--;
+	}
+}
+
+/* separator and key of the next value */
+static void clbt_record_key(struct ClbtRecord* r, const char* key, int quoted)
+{
+	if (clbtOutFormat == CLBT_FORMAT_JSONL)
+	{
+		clbt_record_put(r, r->count ? ",\"" : "{\"", 2);
+		clbt_record_put(r, key, strlen(key));
+		clbt_record_put(r, quoted ? "\":\"" : "\":", quoted ? 3 : 2);
+	}
+	else if (r->count)
+	{
+		clbt_record_put(r, "\t", 1);
+	}
+	r->count++;
+}
+
+void clbt_record_begin(struct ClbtRecord* r)
+{
+	r->data = r->local;
+	r->used = 0;
+	r->capacity = sizeof(r->local);
+	r->count = 0;
+	r->invalid = 0;
+}
+
+void clbt_record_string(struct ClbtRecord* r, const char* key, const char* value, size_t len)
+{
+	clbt_record_key(r, key, 1);
+	if (clbtOutFormat != CLBT_FORMAT_JSONL)
+	{
+		clbt_record_put(r, value, len);
+		return;
+	}
+	clbt_record_escape(r, value, len);
+	clbt_record_put(r, "\"", 1);
+}
+
+/*
+ * A path given as directory and name, joined by '/'.
+ */
+void clbt_record_join(struct ClbtRecord* r, const char* key, const char* dir, const char* name)
+{
+	size_t len = strlen(dir);
+
+	clbt_record_key(r, key, 1);
+	if (clbtOutFormat != CLBT_FORMAT_JSONL)
+	{
+		clbt_record_put(r, dir, len);
+		if (len < 1 || dir[len - 1] != '/')
+			clbt_record_put(r, "/", 1);
+		clbt_record_put(r, name, strlen(name));
+		return;
+	}
+	clbt_record_escape(r, dir, len);
+	if (len < 1 || dir[len - 1] != '/')
+		clbt_record_put(r, "/", 1);
+	clbt_record_escape(r, name, strlen(name));
+	clbt_record_put(r, "\"", 1);
+}
+
+void clbt_record_number(struct ClbtRecord* r, const char* key, unsigned long long value)
+{
+	char digits[24];
+	int n = (int)sizeof(digits);
+
+	clbt_record_key(r, key, 0);
+	do
+	{
+		digits[--n] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	clbt_record_put(r, digits + n, sizeof(digits) - n);
+}
+
+/*
+ * Terminate the record and hand it to the writer of thread tid.
+ */
+void clbt_record_end(struct ClbtRecord* r, int tid)
+{
+	if (clbtOutFormat == CLBT_FORMAT_JSONL && r->invalid)
+		clbt_record_put(r, ",\"invalid_utf8\":true}\n", 22);
+	else if (clbtOutFormat == CLBT_FORMAT_JSONL)
+		clbt_record_put(r, r->count ? "}\n" : "{}\n", r->count ? 2 : 3);
+	else
+		clbt_record_put(r, clbtOutFormat == CLBT_FORMAT_NUL ? "\0" : "\n", 1);
+	clbt_out_write(tid, r->data, r->used);
+	if (r->data != r->local)
+		free(r->data);
+	r->data = r->local;
+}
+
+int clbt_out_format(void)
+{
+	return clbtOutFormat;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define CLBT_OUT_THREAD		(256 << 10)	/* per thread buffer */
+#define CLBT_OUT_SHARED		(64 << 10)	/* buffer of messages without thread id */
+#define CLBT_OUT_IOV		64			/* buffers handed to one writev() */
+
+/*
+ * Everything printed to stdout goes through here. Walker threads append
+ * to buffers of their own without any lock, messages from elsewhere to a
+ * shared buffer. Only complete lines are buffered, and a buffer reaches
+ * the fd in one write()/writev() under the lock, so lines never tear.
+ */
+struct ClbtOutBuffer
+{
+	char* data;
+	size_t used;
+	size_t capacity;
+};
+
+static struct
+{
+	int fd;							/* stdout unless clbt_out_open() said else, -1 drops all */
+	int failed;						/* stop writing after an error */
+	pthread_mutex_t lock;			/* guards fd, shared and writing */
+	struct ClbtOutBuffer shared;
+	struct ClbtOutBuffer* buffers;	/* per thread, between begin and end */
+	int threads;
+} clbtOut = { STDOUT_FILENO, 0, PTHREAD_MUTEX_INITIALIZER, { NULL, 0, 0 }, NULL, 0 };
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/* lock held */
+static void clbt_out_writev(struct iovec* iov, int count)
+{
+	ssize_t n;
+
+	while (count > 0 && clbtOut.fd >= 0 && !clbtOut.failed)
+	{
+		n = writev(clbtOut.fd, iov, count);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			clbtOut.failed = 1;
+			return;
+		}
+
+		/* partial write, skip what is done */
+		while (count > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Write a buffer followed by data, both may be empty.
+ */
+static void clbt_out_drain(struct ClbtOutBuffer* buffer, const void* data, size_t len)
+{
+	struct iovec iov[2];
+	int count = 0;
+
+	pthread_mutex_lock(&clbtOut.lock);
+	if (buffer->used > 0)
+	{
+		iov[count].iov_base = buffer->data;
+		iov[count++].iov_len = buffer->used;
+	}
+	if (len > 0)
+	{
+		iov[count].iov_base = (void*)data;
+		iov[count++].iov_len = len;
+	}
+	clbt_out_writev(iov, count);
+	pthread_mutex_unlock(&clbtOut.lock);
+	buffer->used = 0;
+}
+
+static void clbt_out_reserve(struct ClbtOutBuffer* buffer, size_t capacity)
+{
+	if (buffer->data != NULL)
+		return;
+	buffer->data = (char*)malloc(capacity);
+	if (buffer->data == NULL)
+	{
+		clbt_error("Unable to allocate memory for output!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	buffer->capacity = capacity;
+}
+
+/*
+ * Flush every buffer with as few writev() as possible, lock held.
+ */
+static void clbt_out_flush_all(void)
+{
+	struct iovec iov[CLBT_OUT_IOV];
+	int i, count = 0;
+
+	if (clbtOut.shared.used > 0)
+	{
+		iov[count].iov_base = clbtOut.shared.data;
+		iov[count++].iov_len = clbtOut.shared.used;
+		clbtOut.shared.used = 0;
+	}
+	for (i = 0; i < clbtOut.threads; i++)
+	{
+		if (clbtOut.buffers[i].used == 0)
+			continue;
+		iov[count].iov_base = clbtOut.buffers[i].data;
+		iov[count++].iov_len = clbtOut.buffers[i].used;
+		clbtOut.buffers[i].used = 0;
+		if (count == CLBT_OUT_IOV)
+		{
+			clbt_out_writev(iov, count);
+			count = 0;
+		}
+	}
+	if (count > 0)
+		clbt_out_writev(iov, count);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Send output to stream from now on, whatever stdio buffered goes first.
+ * NULL is a null sink, nothing is buffered or written until reopened.
+ */
+void clbt_out_open(FILE* stream, int format)
+{
+	if (stream)
+		fflush(stream);
+	pthread_mutex_lock(&clbtOut.lock);
+	clbt_out_flush_all();
+	clbtOutFormat = format;
+	clbtOut.fd = stream ? fileno(stream) : -1;
+	clbtOut.failed = 0;
+	pthread_mutex_unlock(&clbtOut.lock);
+}
+
+/*
+ * Write out everything buffered, the stream stays usable.
+ */
+void clbt_out_flush(void)
+{
+	pthread_mutex_lock(&clbtOut.lock);
+	clbt_out_flush_all();
+	pthread_mutex_unlock(&clbtOut.lock);
+}
+
+/*
+ * Flush and fall back to stdout, before the stream given to open is closed.
+ */
+void clbt_out_close(void)
+{
+	pthread_mutex_lock(&clbtOut.lock);
+	clbt_out_flush_all();
+	clbtOut.fd = STDOUT_FILENO;
+	clbtOut.failed = 0;
+	clbtOutFormat = CLBT_FORMAT_TEXT;
+	free(clbtOut.shared.data);
+	clbtOut.shared.data = NULL;
+	clbtOut.shared.capacity = 0;
+	pthread_mutex_unlock(&clbtOut.lock);
+}
+
+/*
+ * Give every walker thread a buffer of its own, until clbt_out_end().
+ */
+void clbt_out_begin(int threads)
+{
+	assert(clbtOut.buffers == NULL);
+
+	clbtOut.buffers = (struct ClbtOutBuffer*)calloc(threads, sizeof(struct ClbtOutBuffer));
+	if (clbtOut.buffers == NULL)
+	{
+		clbt_error("Unable to allocate memory for output!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	clbtOut.threads = threads;
+}
+
+void clbt_out_end(void)
+{
+	int i;
+
+	pthread_mutex_lock(&clbtOut.lock);
+	clbt_out_flush_all();
+	for (i = 0; i < clbtOut.threads; i++)
+		free(clbtOut.buffers[i].data);
+	free(clbtOut.buffers);
+	clbtOut.buffers = NULL;
+	clbtOut.threads = 0;
+	pthread_mutex_unlock(&clbtOut.lock);
+}
+
+/*
+ * Append complete lines, tid < 0 or without clbt_out_begin() means the
+ * caller is no walker thread.
+ */
+void clbt_out_write(int tid, const void* data, size_t len)
+{
+	struct ClbtOutBuffer* buffer;
+
+	if (clbtOut.fd < 0)
+		return;
+	if (tid < 0 || tid >= clbtOut.threads)
+	{
+		pthread_mutex_lock(&clbtOut.lock);
+		clbt_out_reserve(&clbtOut.shared, CLBT_OUT_SHARED);
+		if (clbtOut.shared.used + len > clbtOut.shared.capacity)
+		{
+			struct iovec iov[2];
+			iov[0].iov_base = clbtOut.shared.data;
+			iov[0].iov_len = clbtOut.shared.used;
+			iov[1].iov_base = (void*)data;
+			iov[1].iov_len = len;
+			clbt_out_writev(iov, 2);
+			clbtOut.shared.used = 0;
+		}
+		else
+		{
+			memcpy(clbtOut.shared.data + clbtOut.shared.used, data, len);
+			clbtOut.shared.used += len;
+		}
+		pthread_mutex_unlock(&clbtOut.lock);
+		return;
+	}
+
+	buffer = &clbtOut.buffers[tid];
+	clbt_out_reserve(buffer, CLBT_OUT_THREAD);
+	if (buffer->used + len > buffer->capacity)
+	{
+		clbt_out_drain(buffer, data, len);
+		return;
+	}
+	memcpy(buffer->data + buffer->used, data, len);
+	buffer->used += len;
+}
+
+/*
+ * Tell if output goes anywhere, so callers can skip building it.
+ */
+int clbt_out_enabled(void)
+{
+	return clbtOut.fd >= 0;
+}
+
+/*
+ * Fast path of listing, a path and its terminator without any formatting.
+ */
+void clbt_out_path(int tid, const char* path, size_t len)
+{
+	struct ClbtOutBuffer* buffer;
+	struct ClbtRecord r;
+
+	if (clbtOut.fd < 0)
+		return;
+	if (tid < 0 || tid >= clbtOut.threads || clbtOutFormat == CLBT_FORMAT_JSONL)
+	{
+		clbt_record_begin(&r);
+		clbt_record_string(&r, "path", path, len);
+		clbt_record_end(&r, tid);
+		return;
+	}
+
+	buffer = &clbtOut.buffers[tid];
+	clbt_out_reserve(buffer, CLBT_OUT_THREAD);
+	if (buffer->used + len + 1 > buffer->capacity)
+		clbt_out_drain(buffer, NULL, 0);
+	memcpy(buffer->data + buffer->used, path, len);
+	buffer->data[buffer->used + len] = clbtOutFormat == CLBT_FORMAT_NUL ? '\0' : '\n';
+	buffer->used += len + 1;
+}
+
+#else
+
+/* No walker threads, plain stdio is all that's needed */
+static FILE* clbtOutStream = NULL;
+static int clbtOutNull = 0;
+
+void clbt_out_open(FILE* stream, int format)
+{
+	clbtOutStream = stream;
+	clbtOutNull = stream == NULL;
+	clbtOutFormat = format;
+}
+
+void clbt_out_flush(void)
+{
+	fflush(clbtOutStream ? clbtOutStream : stdout);
+}
+
+void clbt_out_close(void)
+{
+	clbt_out_flush();
+	clbtOutStream = NULL;
+	clbtOutNull = 0;
+	clbtOutFormat = CLBT_FORMAT_TEXT;
+}
+
+void clbt_out_begin(int threads)
+{
+	(void)threads;
+}
+
+void clbt_out_end(void)
+{
+	clbt_out_flush();
+}
+
+void clbt_out_write(int tid, const void* data, size_t len)
+{
+	(void)tid;
+	if (!clbtOutNull)
+		fwrite(data, 1, len, clbtOutStream ? clbtOutStream : stdout);
+}
+
+int clbt_out_enabled(void)
+{
+	return !clbtOutNull;
+}
+
+void clbt_out_path(int tid, const char* path, size_t len)
+{
+	struct ClbtRecord r;
+
+	clbt_record_begin(&r);
+	clbt_record_string(&r, "path", path, len);
+	clbt_record_end(&r, tid);
+}
+
+#endif
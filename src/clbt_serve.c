@@ -0,0 +1,495 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_serve.c
+ *
+ *   Description:
+ *
+ *   Answer list queries from a warm filename index over a socket for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define CLBT_SERVE_REQUEST	(64 << 10)	/* largest query taken */
+#define CLBT_SERVE_BACKLOG	64			/* clients waiting for their turn */
+#define CLBT_SERVE_TIMEOUT	10			/* seconds a client may stall before it is dropped */
+
+/*
+ * A query is a run of NUL terminated "key=value" fields closed by an empty
+ * one: cwd, target and pattern as often as given, recurse=1, format as
+ * CLBT_FORMAT_XXX, fields as the bit numbers of CLBT_FIELD_XXX in print
+ * order and expr as given to --expr. The answer is what --list --use-index
+ * prints there, then a NUL, the exit code in decimal, a NUL and the errors
+ * and warnings of the query as the server would have printed them. No
+ * output holds an empty NUL terminated line, so the first NUL, or with
+ * --print0 the first one right after another, starts the trailer.
+ *
+ * The server keeps the index and its trigrams mapped, so they stay in the
+ * page cache, and maps them again once the index file is replaced. Queries
+ * take milliseconds and are answered one at a time, a client that stalls
+ * is dropped so it cannot hold up the others.
+ */
+struct ClbtServer
+{
+	const char* file;			/* index file */
+	struct ClbtSnap snap;		/* mapped index, base is NULL if none */
+	struct ClbtTrigrams tri;
+	int hasTrigrams;
+	struct stat st;				/* index file when it was mapped */
+};
+
+/*
+ * Map the index, again if the file was replaced since. A server that has
+ * one mapped keeps it when the new file cannot be read.
+ */
+static int clbt_serve_load(struct ClbtServer* server, int options)
+{
+	struct ClbtSnap snap;
+	struct stat st;
+	CP name;
+	int ret;
+
+	if (stat(server->file, &st) == 0 && server->snap.base != NULL && st.st_dev == server->st.st_dev
+		&& st.st_ino == server->st.st_ino && st.st_mtime == server->st.st_mtime && st.st_size == server->st.st_size)
+		return CLBT_OK;
+	if ((ret = clbt_snap_open(&snap, server->file)) != CLBT_OK)
+		return server->snap.base != NULL ? CLBT_OK : ret;
+
+	if (server->hasTrigrams)
+		clbt_trigram_close(&server->tri);
+	if (server->snap.base != NULL)
+		clbt_snap_close(&server->snap);
+	server->snap = snap;
+	server->st = st;
+
+	clbt_path_init(&name);
+	clbt_path_resize(&name, (int)strlen(server->file) + 8);
+	sprintf(name.path, "%s.tri", server->file);
+	server->hasTrigrams = clbt_trigram_open(&server->tri, name.path, &server->snap) == CLBT_OK;
+	clbt_path_destroy(&name);
+
+	clbt_verbose(options, "Serving %llu entries of '%.*s'.", (unsigned long long)snap.entries, snap.rootLength, snap.root);
+	return CLBT_OK;
+}
+
+/*
+ * Read one query into buf, 0 if the client left or sent too much.
+ */
+static int clbt_serve_read(int fd, char* buf, size_t size)
+{
+	size_t used = 0, i;
+	ssize_t n;
+
+	while (used < size)
+	{
+		n = read(fd, buf + used, size - used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+
+		/* the query ends with an empty field */
+		for (i = used; i < used + (size_t)n; i++)
+		{
+			if (buf[i] == '\0' && (i == 0 || buf[i - 1] == '\0'))
+				return 1;
+		}
+		used += n;
+	}
+	clbt_warning("Dropped a query longer than %d bytes.", CLBT_SERVE_REQUEST);
+	return 0;
+}
+
+/*
+ * Take the output format of a query, one of CLBT_FORMAT_XXX.
+ */
+static int clbt_serve_format(const char* value, int* format)
+{
+	if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0 && strcmp(value, "2") != 0)
+	{
+		clbt_error("Unknown output format '%s'.", value);
+		return 0;
+	}
+	*format = atoi(value);
+	return 1;
+}
+
+/*
+ * Take the field order of a query, each field at most once.
+ */
+static int clbt_serve_fields(const char* order)
+{
+	int bit, i;
+
+	for (i = 0; order[i] != '\0'; i++)
+	{
+		bit = order[i] - '0';
+		if (bit < 0 || bit > 8 || i + 1 >= (int)sizeof(clbtConfig.fieldOrder) || (clbtConfig.fields & (1 << bit)))
+			return CLBT_INVALID_OP;
+		clbtConfig.fields |= 1 << bit;
+		clbtConfig.fieldOrder[i] = order[i];
+	}
+	clbtConfig.fieldOrder[i] = '\0';
+	return CLBT_OK;
+}
+
+/*
+ * Answer one client with the config of its query, the server's own is put back after.
+ */
+static void clbt_serve_client(struct ClbtServer* server, int fd, char* buf, int options)
+{
+	const CL targets = clbtConfig.targets;
+	const CL patterns = clbtConfig.patterns;
+	const int fields = clbtConfig.fields;
+	char fieldOrder[sizeof(clbtConfig.fieldOrder)];
+	struct ClbtExpr* const expr = clbtConfig.expr;
+	struct timeval timeout;
+	const char* cwd = NULL;
+	const char* p;
+	char trailer[24];
+	char* messages = NULL;
+	size_t messagesLength = 0;
+	FILE* stream;
+	FILE* log;
+	int format = CLBT_FORMAT_TEXT;
+	int query = options & CLBT_OPT_VERBOSE;
+	int here = -1;
+	int len, ret;
+
+	timeout.tv_sec = CLBT_SERVE_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (!clbt_serve_read(fd, buf, CLBT_SERVE_REQUEST))
+	{
+		close(fd);
+		return;
+	}
+
+	/* what goes wrong is the client's to print */
+	log = open_memstream(&messages, &messagesLength);
+	clbt_redirect_messages(log);
+
+	clbt_list_init(&clbtConfig.targets);
+	clbt_list_init(&clbtConfig.patterns);
+	strcpy(fieldOrder, clbtConfig.fieldOrder);
+	clbtConfig.fields = 0;
+	clbtConfig.fieldOrder[0] = '\0';
+	clbtConfig.expr = NULL;
+	ret = CLBT_OK;
+	for (p = buf; *p != '\0'; p += strlen(p) + 1)
+	{
+		if (strncmp(p, "cwd=", 4) == 0)
+			cwd = p + 4;
+		else if (strncmp(p, "target=", 7) == 0)
+			clbt_list_append(&clbtConfig.targets, p + 7);
+		else if (strncmp(p, "pattern=", 8) == 0)
+			clbt_list_append(&clbtConfig.patterns, p + 8);
+		else if (strcmp(p, "recurse=1") == 0)
+			query |= CLBT_OPT_RECURSIVE;
+		else if (strncmp(p, "format=", 7) == 0 && !clbt_serve_format(p + 7, &format))
+			ret = CLBT_INVALID_OP;
+		else if (strncmp(p, "fields=", 7) == 0 && clbt_serve_fields(p + 7) != CLBT_OK)
+			ret = CLBT_INVALID_OP;
+		else if (strncmp(p, "expr=", 5) == 0 && clbtConfig.expr == NULL && (clbtConfig.expr = clbt_expr_compile(p + 5)) == NULL)
+			ret = CLBT_INVALID_OP;
+	}
+
+	/* relative targets are the client's, a relative index file is ours */
+	if (ret == CLBT_OK)
+		ret = clbt_serve_load(server, options);
+	if (ret == CLBT_OK && cwd != NULL)
+	{
+		here = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (chdir(cwd) != 0)
+		{
+			clbt_error("Cannot enter '%s': %s", cwd, strerror(errno));
+			ret = CLBT_FAILURE_IO;
+		}
+	}
+
+	stream = fdopen(fd, "w");
+	if (ret == CLBT_OK && stream != NULL)
+	{
+		clbt_out_open(stream, format);
+		ret = clbt_index_answer(&server->snap, server->hasTrigrams ? &server->tri : NULL, query);
+		clbt_out_close();
+	}
+	clbt_redirect_messages(NULL);
+	if (log != NULL)
+		fclose(log);
+	len = sprintf(trailer, "%c%d%c", '\0', ret, '\0');
+	if (clbt_write_full(fd, trailer, len) == CLBT_OK && messagesLength > 0)
+		clbt_write_full(fd, messages, messagesLength);
+	free(messages);
+
+	if (here >= 0)
+	{
+		if (fchdir(here) != 0)
+			clbt_error("Cannot return to the server directory: %s", strerror(errno));
+		close(here);
+	}
+	clbt_list_destroy(&clbtConfig.targets);
+	clbt_list_destroy(&clbtConfig.patterns);
+	clbtConfig.targets = targets;
+	clbtConfig.patterns = patterns;
+	clbtConfig.fields = fields;
+	strcpy(clbtConfig.fieldOrder, fieldOrder);
+	clbt_expr_free(clbtConfig.expr);
+	clbtConfig.expr = expr;
+	if (stream != NULL)
+		fclose(stream);
+	else
+		close(fd);
+}
+
+/*
+ * Remove a socket left by a server that is gone, never one still answering.
+ */
+static void clbt_serve_unlink_stale(const struct sockaddr_un* addr)
+{
+	struct stat st;
+	int fd;
+
+	if (lstat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+		return;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	if (connect(fd, (const struct sockaddr*)addr, sizeof(struct sockaddr_un)) != 0 && errno == ECONNREFUSED)
+		unlink(addr->sun_path);
+	close(fd);
+}
+
+static int clbt_serve_address(struct sockaddr_un* addr, const char* path)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		clbt_error("Socket path '%s' is too long.", path);
+		return CLBT_INVALID_OP;
+	}
+	strcpy(addr->sun_path, path);
+	return CLBT_OK;
+}
+
+/*
+ * Listen on the --serve socket and answer queries until killed.
+ */
+int clbt_task_serve(int options)
+{
+	struct ClbtServer server;
+	struct sockaddr_un addr;
+	char* buf;
+	int fd, client, ret;
+
+	if ((ret = clbt_serve_address(&addr, clbtConfig.serveSocket.path)) != CLBT_OK)
+		return ret;
+	memset(&server, 0, sizeof(server));
+	server.file = clbt_index_file();
+	if ((ret = clbt_serve_load(&server, options)) != CLBT_OK)
+		return ret;
+	buf = (char*)malloc(CLBT_SERVE_REQUEST);
+	if (buf == NULL)
+	{
+		clbt_error("Unable to allocate memory for queries!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	/* a client leaving early must not end the server */
+	signal(SIGPIPE, SIG_IGN);
+	clbt_serve_unlink_stale(&addr);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, CLBT_SERVE_BACKLOG) != 0)
+	{
+		clbt_error("Cannot listen on '%s': %s", addr.sun_path, strerror(errno));
+		ret = CLBT_FAILURE_IO;
+	}
+	else
+	{
+		clbt_verbose(options, "Listening on '%s'.", addr.sun_path);
+	}
+
+	while (ret == CLBT_OK)
+	{
+		client = accept(fd, NULL, NULL);
+		if (client >= 0)
+			clbt_serve_client(&server, client, buf, options);
+		else if (errno != EINTR && errno != ECONNABORTED)
+		{
+			clbt_error("Cannot accept on '%s': %s", addr.sun_path, strerror(errno));
+			ret = CLBT_FAILURE_IO;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	if (server.hasTrigrams)
+		clbt_trigram_close(&server.tri);
+	clbt_snap_close(&server.snap);
+	return ret;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* client */
+
+static void clbt_serve_field(CP* query, int* len, const char* key, const char* value)
+{
+	int n = (int)(strlen(key) + strlen(value) + 2);
+
+	if (query->length < *len + n + 1)
+		clbt_path_resize(query, (*len + n) * 2 + 1);
+	*len += sprintf(query->path + *len, "%s=%s", key, value) + 1;
+}
+
+/*
+ * Answer --list by asking the server on the --connect socket, its exit code
+ * becomes ours and its messages are printed here.
+ */
+int clbt_serve_ask(int options)
+{
+	struct sockaddr_un addr;
+	CP query;
+	char* cwd;
+	char* buf;
+	char code[24];
+	const char* nul;
+	const char* p;
+	const char* end;
+	ssize_t n;
+	int fd, i, len = 0, codeLength = -1, prevNul = 1;
+	int format = clbt_out_format();
+	int ret;
+
+	if ((ret = clbt_serve_address(&addr, clbtConfig.connectSocket.path)) != CLBT_OK)
+		return ret;
+
+	clbt_path_init(&query);
+	if ((cwd = realpath(".", NULL)) != NULL)
+		clbt_serve_field(&query, &len, "cwd", cwd);
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_serve_field(&query, &len, "target", clbtConfig.targets.paths[i]->path);
+	for (i = 0; i < clbtConfig.patterns.size; i++)
+		clbt_serve_field(&query, &len, "pattern", clbtConfig.patterns.paths[i]->path);
+	if (options & CLBT_OPT_RECURSIVE)
+		clbt_serve_field(&query, &len, "recurse", "1");
+	sprintf(code, "%d", format);
+	clbt_serve_field(&query, &len, "format", code);
+	clbt_serve_field(&query, &len, "fields", clbtConfig.fieldOrder);
+	if (clbtConfig.expr != NULL)
+		clbt_serve_field(&query, &len, "expr", clbt_expr_source(clbtConfig.expr));
+	query.path[len++] = '\0';
+	free(cwd);
+	if (len > CLBT_SERVE_REQUEST)
+	{
+		clbt_error("Query is too long for the server.");
+		clbt_path_destroy(&query);
+		return CLBT_INVALID_OP;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		clbt_error("Cannot connect to '%s': %s", addr.sun_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		clbt_path_destroy(&query);
+		return CLBT_FAILURE_IO;
+	}
+	ret = clbt_write_full(fd, query.path, len);
+	clbt_path_destroy(&query);
+	buf = (char*)malloc(CLBT_SERVE_REQUEST);
+	if (buf == NULL)
+	{
+		clbt_error("Unable to allocate memory for the answer!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	/* pass the output on up to the trailer, then take the code from it */
+	while (ret == CLBT_OK)
+	{
+		n = read(fd, buf, CLBT_SERVE_REQUEST);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p = buf;
+		end = buf + n;
+		if (codeLength < 0)
+		{
+			while (p < end && (nul = (const char*)memchr(p, '\0', end - p)) != NULL)
+			{
+				if (format != CLBT_FORMAT_NUL || (nul == p && prevNul))
+					break;
+				prevNul = 1;
+				p = nul + 1;
+			}
+			if (p < end && nul == NULL)
+				prevNul = 0;
+			if (p < end && nul != NULL)
+			{
+				clbt_out_write(-1, buf, nul - buf);
+				codeLength = 0;
+				p = nul + 1;
+			}
+			else
+			{
+				clbt_out_write(-1, buf, n);
+				continue;
+			}
+		}
+		while (p < end && (codeLength < 1 || code[codeLength - 1] != '\0') && codeLength < (int)sizeof(code) - 1)
+			code[codeLength++] = *p++;
+
+		/* the rest is what the server had to say about the query */
+		if (p < end)
+			clbt_error_raw(p, end - p);
+	}
+	close(fd);
+	free(buf);
+
+	if (ret != CLBT_OK || codeLength < 1 || memchr(code, '\0', codeLength) == NULL)
+	{
+		clbt_error("'%s' did not answer the query.", addr.sun_path);
+		return CLBT_FAILURE_IO;
+	}
+	return atoi(code);
+}
+
+#else
+
+int clbt_task_serve(int options)
+{
+	(void)options;
+	return clbt_unsupported("serve");
+}
+
+int clbt_serve_ask(int options)
+{
+	(void)options;
+	return clbt_unsupported("connect");
+}
+
+#endif
@@ -0,0 +1,1199 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_snap.c
+ *
+ *   Description:
+ *
+ *   Binary columnar snapshots of a listing for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#define CLBT_SNAP_MAGIC		"CLBS"
+#define CLBT_SNAP_VERSION	2
+#define CLBT_SNAP_HEADER	32			/* fixed header bytes, the root path follows */
+#define CLBT_SNAP_BLOCK		4096		/* entries per block */
+#define CLBT_SNAP_SLOT		16			/* bytes per block in the block table */
+#define CLBT_SNAP_CHUNK		(1 << 20)	/* path bytes per arena chunk */
+
+/*
+ * A snapshot holds the entries below one directory, sorted by path relative
+ * to it, '/' ordering before every other byte so a sub tree is contiguous.
+ * All numbers are little endian.
+ *
+ *   header   "CLBS", version u32, entries u64, table offset u64,
+ *            blocks u32, root length u32, root path
+ *   blocks   byte length of every column as varint, then the columns
+ *   table    offset u64, entries u32 and byte length u32 of every block
+ *
+ * Columns are path, size, mtime, mode, inode and ctime. Paths are front
+ * coded against the previous one, mtime (in nanoseconds) and inode are
+ * zigzag deltas, ctime is a zigzag delta from the mtime of the same entry,
+ * all as LEB128 varints. Every block starts from scratch, so it can be
+ * decoded alone straight from the mapped file. All blocks but the last hold
+ * CLBT_SNAP_BLOCK entries, so the block of an entry number is known.
+ */
+
+/* One walked entry waiting to be sorted */
+struct ClbtSnapItem
+{
+	const char* path;			/* relative path in the run arena */
+	int length;
+	uint32_t mode;
+	uint64_t size;
+	int64_t mtime;
+	uint64_t ino;
+	int64_t ctime;
+};
+
+/* Entries collected by one walker thread, sorted on their own afterwards */
+struct ClbtSnapRun
+{
+	struct ClbtSnapItem* items;
+	size_t count;
+	size_t capacity;
+	size_t next;				/* merge position */
+	char* chunk;				/* current arena chunk, first bytes link the previous one */
+	size_t chunkUsed;
+	size_t chunkSize;
+};
+
+struct ClbtSnapBuf
+{
+	unsigned char* data;
+	size_t used;
+	size_t capacity;
+};
+
+struct ClbtSnapWriter
+{
+	const char* file;
+	int fd;
+	int failed;
+	uint64_t offset;			/* bytes written so far */
+	uint64_t entries;
+	uint32_t blocks;
+	uint32_t count;				/* entries in current block */
+	const char* prev;			/* previous path of current block */
+	int prevLength;
+	int64_t mtime;				/* previous values of current block */
+	uint64_t ino;
+	struct ClbtSnapBuf col[CLBT_SNAP_COLUMNS];
+	struct ClbtSnapBuf table;
+};
+
+struct ClbtSnapTask
+{
+	struct ClbtSnapRun* runs;	/* per thread */
+	CP* buffers;				/* per thread path buffer */
+	int threads;
+	int skip;					/* bytes of root prefix cut from every path */
+	int filter;					/* keep only entries matching input patterns and --expr */
+};
+
+/*
+ * Compare two relative paths in snapshot order.
+ */
+int clbt_snap_compare(const char* a, int alen, const char* b, int blen)
+{
+	int i, n = alen < blen ? alen : blen;
+	int ca, cb;
+
+	for (i = 0; i < n && a[i] == b[i]; i++);
+	if (i == n)
+		return alen - blen;
+	ca = a[i] == '/' ? 0 : (unsigned char)a[i];
+	cb = b[i] == '/' ? 0 : (unsigned char)b[i];
+	return ca - cb;
+}
+
+static void clbt_snap_oom(void)
+{
+	clbt_error("Unable to allocate memory for snapshot!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* encoding, shared with other binary files */
+
+void clbt_put32(unsigned char* p, uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+void clbt_put64(unsigned char* p, uint64_t v)
+{
+	clbt_put32(p, (uint32_t)v);
+	clbt_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+uint32_t clbt_get32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t clbt_get64(const unsigned char* p)
+{
+	return (uint64_t)clbt_get32(p) | ((uint64_t)clbt_get32(p + 4) << 32);
+}
+
+static uint64_t clbt_snap_zigzag(int64_t v)
+{
+	return v < 0 ? ~((uint64_t)v << 1) : (uint64_t)v << 1;
+}
+
+static int64_t clbt_snap_unzigzag(uint64_t v)
+{
+	return (v & 1) ? (int64_t)~(v >> 1) : (int64_t)(v >> 1);
+}
+
+static void clbt_snap_reserve(struct ClbtSnapBuf* buf, size_t len)
+{
+	unsigned char* data;
+	size_t capacity;
+
+	if (buf->used + len <= buf->capacity)
+		return;
+	capacity = buf->capacity ? buf->capacity * 2 : 4096;
+	while (capacity < buf->used + len)
+		capacity *= 2;
+	data = (unsigned char*)realloc(buf->data, capacity);
+	if (data == NULL)
+		clbt_snap_oom();
+	buf->data = data;
+	buf->capacity = capacity;
+}
+
+/*
+ * Encode v as LEB128 varint of at most 10 bytes.
+ */
+size_t clbt_varint_put(unsigned char* p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80)
+	{
+		p[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (unsigned char)v;
+	return n;
+}
+
+static void clbt_snap_put_varint(struct ClbtSnapBuf* buf, uint64_t v)
+{
+	clbt_snap_reserve(buf, 10);
+	buf->used += clbt_varint_put(buf->data + buf->used, v);
+}
+
+/*
+ * Decode a varint and move *p past it, 0 if it runs past end.
+ */
+int clbt_varint_get(const unsigned char** p, const unsigned char* end, uint64_t* v)
+{
+	const unsigned char* s = *p;
+	uint64_t x = 0;
+	int shift = 0;
+
+	while (s < end && shift < 64)
+	{
+		x |= (uint64_t)(*s & 0x7f) << shift;
+		if ((*s++ & 0x80) == 0)
+		{
+			*p = s;
+			*v = x;
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* writer */
+
+static void clbt_snap_write(struct ClbtSnapWriter* w, const void* data, size_t len)
+{
+	if (w->failed)
+		return;
+	if (clbt_write_full(w->fd, data, len) != CLBT_OK)
+	{
+		clbt_error("Cannot write '%s': %s", w->file, strerror(errno));
+		w->failed = 1;
+		return;
+	}
+	w->offset += len;
+}
+
+static int clbt_snap_writer_open(struct ClbtSnapWriter* w, const char* file, const char* root, int rootLength)
+{
+	unsigned char header[CLBT_SNAP_HEADER];
+
+	memset(w, 0, sizeof(struct ClbtSnapWriter));
+	w->file = file;
+	w->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (w->fd < 0)
+	{
+		clbt_error("Cannot create '%s': %s", file, strerror(errno));
+		w->failed = 1;
+		return CLBT_FAILURE_IO;
+	}
+
+	/* counts are filled in once known */
+	memset(header, 0, sizeof(header));
+	memcpy(header, CLBT_SNAP_MAGIC, 4);
+	clbt_put32(header + 4, CLBT_SNAP_VERSION);
+	clbt_put32(header + 28, (uint32_t)rootLength);
+	clbt_snap_write(w, header, sizeof(header));
+	clbt_snap_write(w, root, rootLength);
+	return w->failed ? CLBT_FAILURE_IO : CLBT_OK;
+}
+
+static void clbt_snap_writer_flush(struct ClbtSnapWriter* w)
+{
+	unsigned char lens[CLBT_SNAP_COLUMNS * 10];
+	unsigned char* slot;
+	size_t n = 0;
+	uint64_t start = w->offset;
+	int i;
+
+	if (w->count == 0)
+		return;
+
+	for (i = 0; i < CLBT_SNAP_COLUMNS; i++)
+		n += clbt_varint_put(lens + n, w->col[i].used);
+	clbt_snap_write(w, lens, n);
+	for (i = 0; i < CLBT_SNAP_COLUMNS; i++)
+	{
+		clbt_snap_write(w, w->col[i].data, w->col[i].used);
+		w->col[i].used = 0;
+	}
+
+	clbt_snap_reserve(&w->table, CLBT_SNAP_SLOT);
+	slot = w->table.data + w->table.used;
+	clbt_put64(slot, start);
+	clbt_put32(slot + 8, w->count);
+	clbt_put32(slot + 12, (uint32_t)(w->offset - start));
+	w->table.used += CLBT_SNAP_SLOT;
+
+	w->blocks++;
+	w->count = 0;
+	w->prevLength = 0;
+	w->mtime = 0;
+	w->ino = 0;
+}
+
+/*
+ * Append one entry, paths must come in snapshot order and stay valid until
+ * the writer is closed.
+ */
+static void clbt_snap_writer_add(struct ClbtSnapWriter* w, const struct ClbtSnapItem* item)
+{
+	struct ClbtSnapBuf* col = &w->col[CLBT_SNAP_PATH];
+	int shared = 0;
+
+	while (shared < w->prevLength && shared < item->length && w->prev[shared] == item->path[shared])
+		shared++;
+	clbt_snap_put_varint(col, (uint64_t)shared);
+	clbt_snap_put_varint(col, (uint64_t)(item->length - shared));
+	clbt_snap_reserve(col, item->length - shared);
+	memcpy(col->data + col->used, item->path + shared, item->length - shared);
+	col->used += item->length - shared;
+
+	clbt_snap_put_varint(&w->col[CLBT_SNAP_SIZE], item->size);
+	clbt_snap_put_varint(&w->col[CLBT_SNAP_MTIME], clbt_snap_zigzag(item->mtime - w->mtime));
+	clbt_snap_put_varint(&w->col[CLBT_SNAP_MODE], item->mode);
+	clbt_snap_put_varint(&w->col[CLBT_SNAP_INO], clbt_snap_zigzag((int64_t)(item->ino - w->ino)));
+	clbt_snap_put_varint(&w->col[CLBT_SNAP_CTIME], clbt_snap_zigzag(item->ctime - item->mtime));
+
+	w->prev = item->path;
+	w->prevLength = item->length;
+	w->mtime = item->mtime;
+	w->ino = item->ino;
+	w->entries++;
+	if (++w->count == CLBT_SNAP_BLOCK)
+		clbt_snap_writer_flush(w);
+}
+
+/*
+ * Write the block table and the final header, remove the file on failure.
+ */
+static int clbt_snap_writer_close(struct ClbtSnapWriter* w)
+{
+	unsigned char header[20];
+	uint64_t table;
+	int i;
+
+	clbt_snap_writer_flush(w);
+	table = w->offset;
+	clbt_snap_write(w, w->table.data, w->table.used);
+
+	clbt_put64(header, w->entries);
+	clbt_put64(header + 8, table);
+	clbt_put32(header + 16, w->blocks);
+	if (!w->failed && pwrite(w->fd, header, sizeof(header), 8) != (ssize_t)sizeof(header))
+	{
+		clbt_error("Cannot write '%s': %s", w->file, strerror(errno));
+		w->failed = 1;
+	}
+	if (w->fd >= 0)
+	{
+		if (close(w->fd) != 0 && !w->failed)
+		{
+			clbt_error("Cannot write '%s': %s", w->file, strerror(errno));
+			w->failed = 1;
+		}
+		if (w->failed)
+			unlink(w->file);
+	}
+
+	for (i = 0; i < CLBT_SNAP_COLUMNS; i++)
+		free(w->col[i].data);
+	free(w->table.data);
+	return w->failed ? CLBT_FAILURE_IO : CLBT_OK;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* reader */
+
+/*
+ * Map a snapshot file and check its header.
+ */
+int clbt_snap_open(struct ClbtSnap* snap, const char* file)
+{
+	const unsigned char* base;
+	struct stat st;
+	uint64_t table;
+	int fd;
+
+	memset(snap, 0, sizeof(struct ClbtSnap));
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		clbt_error("Cannot open '%s': %s", file, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return CLBT_FAILURE_IO;
+	}
+	if (st.st_size < CLBT_SNAP_HEADER)
+	{
+		close(fd);
+		clbt_error("'%s' is not a CLBT snapshot.", file);
+		return CLBT_INVALID_OP;
+	}
+	base = (const unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == (const unsigned char*)MAP_FAILED)
+	{
+		clbt_error("Cannot map '%s': %s", file, strerror(errno));
+		return CLBT_FAILURE_IO;
+	}
+
+	snap->base = base;
+	snap->size = (size_t)st.st_size;
+	snap->entries = clbt_get64(base + 8);
+	table = clbt_get64(base + 16);
+	snap->blocks = clbt_get32(base + 24);
+	snap->rootLength = (int)clbt_get32(base + 28);
+	snap->root = (const char*)base + CLBT_SNAP_HEADER;
+	if (memcmp(base, CLBT_SNAP_MAGIC, 4) != 0 || clbt_get32(base + 4) != CLBT_SNAP_VERSION
+		|| snap->rootLength < 0 || table < CLBT_SNAP_HEADER + (uint64_t)snap->rootLength || table > snap->size
+		|| (snap->size - table) / CLBT_SNAP_SLOT < snap->blocks)
+	{
+		clbt_error("'%s' is not a CLBT snapshot.", file);
+		clbt_snap_close(snap);
+		return CLBT_INVALID_OP;
+	}
+	snap->table = base + table;
+	return CLBT_OK;
+}
+
+void clbt_snap_close(struct ClbtSnap* snap)
+{
+	if (snap->base != NULL)
+		munmap((void*)snap->base, snap->size);
+	snap->base = NULL;
+}
+
+void clbt_snap_cursor_init(struct ClbtSnapCursor* cur, const struct ClbtSnap* snap, uint32_t block)
+{
+	memset(cur, 0, sizeof(struct ClbtSnapCursor));
+	cur->snap = snap;
+	cur->block = block;
+	clbt_path_init(&cur->path);
+}
+
+/*
+ * Continue from the start of a block instead.
+ */
+void clbt_snap_seek(struct ClbtSnapCursor* cur, uint32_t block)
+{
+	cur->block = block;
+	cur->left = 0;
+}
+
+void clbt_snap_cursor_destroy(struct ClbtSnapCursor* cur)
+{
+	clbt_path_destroy(&cur->path);
+}
+
+/*
+ * Find the columns of a block, 0 if it does not fit in the file.
+ */
+static int clbt_snap_columns(const struct ClbtSnap* snap, uint32_t block, const unsigned char** col, const unsigned char** colEnd)
+{
+	const unsigned char* slot = snap->table + (size_t)block * CLBT_SNAP_SLOT;
+	uint64_t offset = clbt_get64(slot);
+	uint64_t length = clbt_get32(slot + 12);
+	const unsigned char* p;
+	const unsigned char* end;
+	uint64_t lens[CLBT_SNAP_COLUMNS];
+	int i;
+
+	if (offset > (uint64_t)(snap->table - snap->base) || length > (uint64_t)(snap->table - snap->base) - offset)
+		return 0;
+	p = snap->base + offset;
+	end = p + length;
+	for (i = 0; i < CLBT_SNAP_COLUMNS; i++)
+	{
+		if (!clbt_varint_get(&p, end, &lens[i]))
+			return 0;
+	}
+	for (i = 0; i < CLBT_SNAP_COLUMNS; i++)
+	{
+		if (lens[i] > (uint64_t)(end - p))
+			return 0;
+		col[i] = p;
+		colEnd[i] = p + lens[i];
+		p += lens[i];
+	}
+	return 1;
+}
+
+/*
+ * Find the block a scan for key starts in, the last one whose first path
+ * sorts before key. Only the first path of each probed block is read, it
+ * is never front coded.
+ */
+uint32_t clbt_snap_find(const struct ClbtSnap* snap, const char* key, int len)
+{
+	const unsigned char* col[CLBT_SNAP_COLUMNS];
+	const unsigned char* end[CLBT_SNAP_COLUMNS];
+	uint64_t shared, suffix;
+	uint32_t lo = 0, hi = snap->blocks, mid;
+
+	/* every block in [0, lo) starts before key, none in [hi, blocks) does */
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (clbt_snap_columns(snap, mid, col, end)
+			&& clbt_varint_get(&col[CLBT_SNAP_PATH], end[CLBT_SNAP_PATH], &shared)
+			&& clbt_varint_get(&col[CLBT_SNAP_PATH], end[CLBT_SNAP_PATH], &suffix)
+			&& shared == 0 && suffix <= (uint64_t)(end[CLBT_SNAP_PATH] - col[CLBT_SNAP_PATH])
+			&& clbt_snap_compare((const char*)col[CLBT_SNAP_PATH], (int)suffix, key, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 ? lo - 1 : 0;
+}
+
+/*
+ * Point the cursor at a block, 0 if it does not fit in the file.
+ */
+static int clbt_snap_load(struct ClbtSnapCursor* cur, uint32_t block)
+{
+	if (!clbt_snap_columns(cur->snap, block, cur->col, cur->end))
+		return 0;
+
+	cur->left = clbt_get32(cur->snap->table + (size_t)block * CLBT_SNAP_SLOT + 8);
+	if (cur->left > CLBT_SNAP_BLOCK || (block + 1 < cur->snap->blocks && cur->left != CLBT_SNAP_BLOCK))
+		return 0;
+	cur->next = (uint64_t)block * CLBT_SNAP_BLOCK;
+	cur->entry.length = 0;
+	cur->entry.mtime = 0;
+	cur->entry.ino = 0;
+	return 1;
+}
+
+/*
+ * Step to the next entry, 0 at the end or on a corrupt block.
+ */
+int clbt_snap_next(struct ClbtSnapCursor* cur)
+{
+	struct ClbtSnapEntry* e = &cur->entry;
+	uint64_t shared, suffix, v;
+
+	while (cur->left == 0)
+	{
+		if (cur->failed || cur->block >= cur->snap->blocks)
+			return 0;
+		if (!clbt_snap_load(cur, cur->block++))
+		{
+			cur->failed = 1;
+			return 0;
+		}
+	}
+
+	if (!clbt_varint_get(&cur->col[CLBT_SNAP_PATH], cur->end[CLBT_SNAP_PATH], &shared)
+		|| !clbt_varint_get(&cur->col[CLBT_SNAP_PATH], cur->end[CLBT_SNAP_PATH], &suffix)
+		|| shared > (uint64_t)e->length || suffix > (uint64_t)(cur->end[CLBT_SNAP_PATH] - cur->col[CLBT_SNAP_PATH])
+		|| shared + suffix >= 0x7fffffff)
+	{
+		cur->failed = 1;
+		return 0;
+	}
+	if ((uint64_t)cur->path.length <= shared + suffix)
+		clbt_path_resize(&cur->path, (int)(shared + suffix) * 2 + 1);
+	memcpy(cur->path.path + shared, cur->col[CLBT_SNAP_PATH], (size_t)suffix);
+	cur->col[CLBT_SNAP_PATH] += suffix;
+	e->length = (int)(shared + suffix);
+	cur->path.path[e->length] = '\0';
+	e->path = cur->path.path;
+
+	if (!clbt_varint_get(&cur->col[CLBT_SNAP_SIZE], cur->end[CLBT_SNAP_SIZE], &e->size))
+		cur->failed = 1;
+	if (clbt_varint_get(&cur->col[CLBT_SNAP_MTIME], cur->end[CLBT_SNAP_MTIME], &v))
+		e->mtime += clbt_snap_unzigzag(v);
+	else
+		cur->failed = 1;
+	if (clbt_varint_get(&cur->col[CLBT_SNAP_MODE], cur->end[CLBT_SNAP_MODE], &v))
+		e->mode = (uint32_t)v;
+	else
+		cur->failed = 1;
+	if (clbt_varint_get(&cur->col[CLBT_SNAP_INO], cur->end[CLBT_SNAP_INO], &v))
+		e->ino += (uint64_t)clbt_snap_unzigzag(v);
+	else
+		cur->failed = 1;
+	if (clbt_varint_get(&cur->col[CLBT_SNAP_CTIME], cur->end[CLBT_SNAP_CTIME], &v))
+		e->ctime = e->mtime + clbt_snap_unzigzag(v);
+	else
+		cur->failed = 1;
+	if (cur->failed)
+		return 0;
+
+	e->ordinal = cur->next++;
+	cur->left--;
+	return 1;
+}
+
+/*
+ * Step to the entry numbered ordinal, decoding on from the current one if it
+ * is further in the same block. 0 if there is no such entry.
+ */
+int clbt_snap_goto(struct ClbtSnapCursor* cur, uint64_t ordinal)
+{
+	uint32_t block = (uint32_t)(ordinal / CLBT_SNAP_BLOCK);
+
+	if (ordinal >= cur->snap->entries)
+		return 0;
+	if (cur->left == 0 || cur->block != block + 1 || cur->next > ordinal)
+		clbt_snap_seek(cur, block);
+	while (clbt_snap_next(cur))
+	{
+		if (cur->entry.ordinal == ordinal)
+			return 1;
+	}
+	return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* snapshot task */
+
+static const char* clbt_snap_run_copy(struct ClbtSnapRun* run, const char* path, int len)
+{
+	char* chunk;
+	size_t size;
+
+	if (run->chunk == NULL || run->chunkUsed + len > run->chunkSize)
+	{
+		size = sizeof(char*) + len > CLBT_SNAP_CHUNK ? sizeof(char*) + len : CLBT_SNAP_CHUNK;
+		chunk = (char*)malloc(size);
+		if (chunk == NULL)
+			clbt_snap_oom();
+		memcpy(chunk, &run->chunk, sizeof(char*));
+		run->chunk = chunk;
+		run->chunkUsed = sizeof(char*);
+		run->chunkSize = size;
+	}
+	chunk = run->chunk + run->chunkUsed;
+	memcpy(chunk, path, len);
+	run->chunkUsed += len;
+	return chunk;
+}
+
+static void clbt_snap_run_free(struct ClbtSnapRun* run)
+{
+	char* chunk = run->chunk;
+	char* prev;
+
+	while (chunk != NULL)
+	{
+		memcpy(&prev, chunk, sizeof(char*));
+		free(chunk);
+		chunk = prev;
+	}
+	free(run->items);
+}
+
+static void clbt_snap_item_stat(struct ClbtSnapItem* item, const struct stat* st)
+{
+	item->mode = (uint32_t)st->st_mode;
+	item->size = (uint64_t)st->st_size;
+	item->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	item->ino = (uint64_t)st->st_ino;
+	item->ctime = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static int clbt_snap_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtSnapTask* task = (struct ClbtSnapTask*)walker->user;
+	struct ClbtSnapRun* run = &task->runs[tid];
+	struct ClbtSnapItem* item;
+	int len;
+
+	if (task->filter && !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	len = clbt_entry_path(entry, &task->buffers[tid]);
+	if (clbt_entry_stat(entry) != CLBT_OK)
+	{
+		clbt_error("Cannot stat '%s': %s", task->buffers[tid].path, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	if (run->count == run->capacity)
+	{
+		run->capacity = run->capacity ? run->capacity * 2 : 1024;
+		item = (struct ClbtSnapItem*)realloc(run->items, run->capacity * sizeof(struct ClbtSnapItem));
+		if (item == NULL)
+			clbt_snap_oom();
+		run->items = item;
+	}
+	item = &run->items[run->count++];
+	item->length = len - task->skip;
+	item->path = clbt_snap_run_copy(run, task->buffers[tid].path + task->skip, item->length);
+	clbt_snap_item_stat(item, &entry->st);
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtSnapOps = { clbt_snap_on_entry, NULL, NULL, NULL };
+
+static int clbt_snap_item_compare(const void* a, const void* b)
+{
+	const struct ClbtSnapItem* x = (const struct ClbtSnapItem*)a;
+	const struct ClbtSnapItem* y = (const struct ClbtSnapItem*)b;
+	return clbt_snap_compare(x->path, x->length, y->path, y->length);
+}
+
+static void clbt_snap_sort_job(void* arg, int tid)
+{
+	struct ClbtSnapRun* run = (struct ClbtSnapRun*)arg;
+	(void)tid;
+	qsort(run->items, run->count, sizeof(struct ClbtSnapItem), clbt_snap_item_compare);
+}
+
+static int clbt_snap_run_less(const struct ClbtSnapRun* runs, int a, int b)
+{
+	const struct ClbtSnapItem* x = &runs[a].items[runs[a].next];
+	const struct ClbtSnapItem* y = &runs[b].items[runs[b].next];
+	return clbt_snap_compare(x->path, x->length, y->path, y->length) < 0;
+}
+
+static void clbt_snap_sift(const struct ClbtSnapRun* runs, int* heap, int n, int i)
+{
+	int child, top = heap[i];
+
+	while ((child = i * 2 + 1) < n)
+	{
+		if (child + 1 < n && clbt_snap_run_less(runs, heap[child + 1], heap[child]))
+			child++;
+		if (!clbt_snap_run_less(runs, heap[child], top))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = top;
+}
+
+/*
+ * Merge the sorted runs straight into the writer.
+ */
+static void clbt_snap_merge(struct ClbtSnapTask* task, struct ClbtSnapWriter* w)
+{
+	struct ClbtSnapRun* runs = task->runs;
+	int* heap = (int*)malloc(sizeof(int) * task->threads);
+	int i, n = 0;
+
+	if (heap == NULL)
+		clbt_snap_oom();
+	for (i = 0; i < task->threads; i++)
+	{
+		if (runs[i].count > 0)
+			heap[n++] = i;
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		clbt_snap_sift(runs, heap, n, i);
+
+	while (n > 0)
+	{
+		i = heap[0];
+		clbt_snap_writer_add(w, &runs[i].items[runs[i].next++]);
+		if (runs[i].next == runs[i].count)
+			heap[0] = heap[--n];
+		clbt_snap_sift(runs, heap, n, 0);
+	}
+	free(heap);
+}
+
+/*
+ * Walk a directory and write every entry below it to file, walkFlags are
+ * CLBT_WALK_XXX, filter keeps only entries matching input patterns and
+ * --expr. Failures of the walk go to *walked, the file is written with what
+ * could be read.
+ */
+int clbt_snap_build(const char* root, const char* file, int walkFlags, int filter, int options, int* walked)
+{
+	struct ClbtSnapTask task;
+	struct ClbtSnapWriter w;
+	struct ClbtWalker walker;
+	struct ClbtPool* pool;
+	struct stat st;
+	int i, len, ret;
+
+	if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		clbt_error("Target '%s' is not a directory.", root);
+		return CLBT_INVALID_OP;
+	}
+	len = (int)strlen(root);
+
+	ret = clbt_walk_begin(&walker, &clbtSnapOps, &task, walkFlags);
+	if (ret != CLBT_OK)
+		return ret;
+	task.threads = clbt_walk_threads(&walker);
+	task.skip = len > 0 && root[len - 1] == '/' ? len : len + 1;
+	task.filter = filter;
+	task.runs = (struct ClbtSnapRun*)calloc(task.threads, sizeof(struct ClbtSnapRun));
+	task.buffers = (CP*)malloc(sizeof(CP) * task.threads);
+	if (task.runs == NULL || task.buffers == NULL)
+		clbt_snap_oom();
+	for (i = 0; i < task.threads; i++)
+		clbt_path_init(&task.buffers[i]);
+
+	clbt_walk_root(&walker, root);
+	*walked = clbt_walk_end(&walker);
+
+	/* every thread sorts what it found, then the runs are merged on the fly */
+	pool = clbt_pool_create(task.threads);
+	for (i = 0; i < task.threads; i++)
+		clbt_pool_submit(pool, clbt_snap_sort_job, &task.runs[i]);
+	clbt_pool_wait(pool);
+	clbt_pool_destroy(pool);
+
+	if (clbt_snap_writer_open(&w, file, root, len) == CLBT_OK)
+		clbt_snap_merge(&task, &w);
+	ret = clbt_snap_writer_close(&w);
+	if (ret == CLBT_OK)
+		clbt_verbose(options, "Wrote %llu entries in %u blocks, %llu bytes.",
+			(unsigned long long)w.entries, w.blocks, (unsigned long long)w.offset);
+
+	for (i = 0; i < task.threads; i++)
+	{
+		clbt_snap_run_free(&task.runs[i]);
+		clbt_path_destroy(&task.buffers[i]);
+	}
+	free(task.runs);
+	free(task.buffers);
+	return ret;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* refresh */
+
+/*
+ * A refresh rewrites a recursive snapshot from an older one, in the order it
+ * is read. Every directory is still stat'ed, but only those whose mtime or
+ * ctime moved are read again, the entries of the others are copied. Adding,
+ * removing or renaming an entry touches the mtime of its directory, while
+ * the size and times of files in an untouched directory stay as recorded.
+ */
+struct ClbtSnapRefresh
+{
+	struct ClbtSnapWriter w;
+	struct ClbtSnapCursor cur;	/* old entries */
+	int more;					/* cur holds an old entry not handled yet */
+	CP path;					/* entry being looked at, under the root */
+	int skip;					/* bytes of root prefix cut from every path */
+	CP last[2];					/* the last two paths written, for front coding */
+	int turn;
+	unsigned long long dirs;	/* directories stat'ed */
+	unsigned long long reads;	/* directories read again */
+	int errors;
+};
+
+static void clbt_snap_refresh_dir(struct ClbtSnapRefresh* r, int len, int changed);
+
+static void clbt_snap_refresh_add(struct ClbtSnapRefresh* r, struct ClbtSnapItem* item)
+{
+	CP* last = &r->last[r->turn];
+
+	r->turn ^= 1;
+	clbt_path_set(last, item->path, item->length);
+	item->path = last->path;
+	clbt_snap_writer_add(&r->w, item);
+}
+
+/*
+ * Copy the old entry at the cursor as it is.
+ */
+static void clbt_snap_refresh_copy(struct ClbtSnapRefresh* r)
+{
+	const struct ClbtSnapEntry* e = &r->cur.entry;
+	struct ClbtSnapItem item;
+
+	item.path = e->path;
+	item.length = e->length;
+	item.mode = e->mode;
+	item.size = e->size;
+	item.mtime = e->mtime;
+	item.ino = e->ino;
+	item.ctime = e->ctime;
+	clbt_snap_refresh_add(r, &item);
+	r->more = clbt_snap_next(&r->cur);
+}
+
+/*
+ * Length of the relative part of a path of len bytes, 0 for the root.
+ */
+static int clbt_snap_refresh_rel(const struct ClbtSnapRefresh* r, int len)
+{
+	return len > r->skip ? len - r->skip : 0;
+}
+
+/*
+ * 1 if the old entry at the cursor is below the directory whose path is len bytes.
+ */
+static int clbt_snap_refresh_below(const struct ClbtSnapRefresh* r, int len)
+{
+	const struct ClbtSnapEntry* e = &r->cur.entry;
+	int rel = clbt_snap_refresh_rel(r, len);
+
+	if (!r->more)
+		return 0;
+	return rel == 0 || (e->length > rel && e->path[rel] == '/' && memcmp(e->path, r->path.path + r->skip, rel) == 0);
+}
+
+/*
+ * Drop the old entries below a path of len bytes.
+ */
+static void clbt_snap_refresh_drop(struct ClbtSnapRefresh* r, int len)
+{
+	while (clbt_snap_refresh_below(r, len))
+		r->more = clbt_snap_next(&r->cur);
+}
+
+/*
+ * Drop the old entries sorting before a path of len bytes, 1 if the next
+ * one is that path.
+ */
+static int clbt_snap_refresh_seek(struct ClbtSnapRefresh* r, int len)
+{
+	const char* rel = r->path.path + r->skip;
+	int cmp;
+
+	while (r->more)
+	{
+		cmp = clbt_snap_compare(r->cur.entry.path, r->cur.entry.length, rel, len - r->skip);
+		if (cmp >= 0)
+			return cmp == 0;
+		r->more = clbt_snap_next(&r->cur);
+	}
+	return 0;
+}
+
+/*
+ * Append a name to the directory path of len bytes, return the new length.
+ */
+static int clbt_snap_refresh_join(struct ClbtSnapRefresh* r, int len, const char* name, int nameLength)
+{
+	if (r->path.length < len + nameLength + 2)
+		clbt_path_resize(&r->path, (len + nameLength) * 2 + 2);
+	if (len == 0 || r->path.path[len - 1] != '/')
+		r->path.path[len++] = '/';
+	memcpy(r->path.path + len, name, nameLength);
+	len += nameLength;
+	r->path.path[len] = '\0';
+	return len;
+}
+
+/*
+ * Write the entry at a path of len bytes, then what is below it. found
+ * tells the cursor is at its old entry.
+ */
+static void clbt_snap_refresh_entry(struct ClbtSnapRefresh* r, int len, const struct stat* st, int found)
+{
+	struct ClbtSnapItem item;
+	int changed = 1;
+
+	item.path = r->path.path + r->skip;
+	item.length = len - r->skip;
+	clbt_snap_item_stat(&item, st);
+	if (found)
+	{
+		changed = !S_ISDIR(r->cur.entry.mode) || r->cur.entry.mtime != item.mtime || r->cur.entry.ctime != item.ctime;
+		r->more = clbt_snap_next(&r->cur);
+	}
+	clbt_snap_refresh_add(r, &item);
+
+	if (S_ISDIR(st->st_mode))
+		clbt_snap_refresh_dir(r, len, changed);
+	else
+		clbt_snap_refresh_drop(r, len);
+}
+
+/*
+ * Copy the entries of an unchanged directory, following its sub directories.
+ * Their own old entries come first, so the next one below is always a child.
+ */
+static void clbt_snap_refresh_keep(struct ClbtSnapRefresh* r, int len)
+{
+	const struct ClbtSnapEntry* e = &r->cur.entry;
+	struct stat st;
+	int rel = clbt_snap_refresh_rel(r, len);
+	int name = rel > 0 ? rel + 1 : 0;
+	int child;
+
+	while (clbt_snap_refresh_below(r, len))
+	{
+		if (!S_ISDIR(e->mode))
+		{
+			clbt_snap_refresh_copy(r);
+			continue;
+		}
+
+		child = clbt_snap_refresh_join(r, len, e->path + name, e->length - name);
+		r->dirs++;
+		if (lstat(r->path.path, &st) == 0)
+		{
+			clbt_snap_refresh_entry(r, child, &st, 1);
+			continue;
+		}
+		if (errno != ENOENT)
+		{
+			clbt_error("Cannot stat '%s': %s", r->path.path, strerror(errno));
+			r->errors++;
+		}
+		r->more = clbt_snap_next(&r->cur);
+		clbt_snap_refresh_drop(r, child);
+	}
+}
+
+/*
+ * Read a new or changed directory again, merging its entries with the old ones.
+ */
+static void clbt_snap_refresh_read(struct ClbtSnapRefresh* r, int len)
+{
+	struct ClbtSnapItem* items = NULL;
+	size_t* offsets = NULL;
+	char* names = NULL;
+	size_t count = 0, capacity = 0, used = 0, size = 0, i, n;
+	struct dirent* de;
+	struct stat st;
+	DIR* dp = NULL;
+	int fd, child;
+	void* p;
+
+	r->reads++;
+	fd = open(r->path.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (len > r->skip ? O_NOFOLLOW : 0));
+	if (fd < 0 || (dp = fdopendir(fd)) == NULL)
+	{
+		clbt_error("Cannot open directory '%s': %s", r->path.path, strerror(errno));
+		r->errors++;
+		if (fd >= 0)
+			close(fd);
+		clbt_snap_refresh_drop(r, len);
+		return;
+	}
+
+	/* names land in one buffer that may move, so only offsets are kept until the end */
+	while (1)
+	{
+		errno = 0;
+		if ((de = readdir(dp)) == NULL)
+		{
+			if (errno != 0)
+			{
+				clbt_error("Cannot read directory '%s': %s", r->path.path, strerror(errno));
+				r->errors++;
+			}
+			break;
+		}
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+
+		n = strlen(de->d_name) + 1;
+		if (used + n > size)
+		{
+			size = (used + n) * 2;
+			if ((p = realloc(names, size)) == NULL)
+				clbt_snap_oom();
+			names = (char*)p;
+		}
+		if (count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			if ((p = realloc(offsets, capacity * sizeof(size_t))) == NULL)
+				clbt_snap_oom();
+			offsets = (size_t*)p;
+		}
+		memcpy(names + used, de->d_name, n);
+		offsets[count++] = used;
+		used += n;
+	}
+	closedir(dp);
+
+	if (count > 0)
+	{
+		items = (struct ClbtSnapItem*)malloc(count * sizeof(struct ClbtSnapItem));
+		if (items == NULL)
+			clbt_snap_oom();
+	}
+	for (i = 0; i < count; i++)
+	{
+		items[i].path = names + offsets[i];
+		items[i].length = (int)strlen(items[i].path);
+	}
+	qsort(items, count, sizeof(struct ClbtSnapItem), clbt_snap_item_compare);
+
+	for (i = 0; i < count; i++)
+	{
+		child = clbt_snap_refresh_join(r, len, items[i].path, items[i].length);
+		if (lstat(r->path.path, &st) != 0)
+		{
+			/* gone since it was read */
+			if (errno != ENOENT)
+			{
+				clbt_error("Cannot stat '%s': %s", r->path.path, strerror(errno));
+				r->errors++;
+			}
+			continue;
+		}
+		if (S_ISDIR(st.st_mode))
+			r->dirs++;
+		clbt_snap_refresh_entry(r, child, &st, clbt_snap_refresh_seek(r, child));
+	}
+	clbt_snap_refresh_drop(r, len);
+
+	free(items);
+	free(offsets);
+	free(names);
+}
+
+static void clbt_snap_refresh_dir(struct ClbtSnapRefresh* r, int len, int changed)
+{
+	if (changed)
+		clbt_snap_refresh_read(r, len);
+	else
+		clbt_snap_refresh_keep(r, len);
+}
+
+/*
+ * Write a fresh copy of a recursive snapshot to file, reading only the
+ * directories changed since. The root has no entry of its own, it is always
+ * read. Failures to read the tree go to *walked like for a walk.
+ */
+int clbt_snap_refresh(const struct ClbtSnap* old, const char* file, int options, int* walked)
+{
+	struct ClbtSnapRefresh r;
+	struct stat st;
+	int len = old->rootLength;
+	int ret;
+
+	memset(&r, 0, sizeof(r));
+	clbt_path_init(&r.path);
+	clbt_path_set(&r.path, old->root, len);
+	if (stat(r.path.path, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		clbt_error("Target '%s' is not a directory.", r.path.path);
+		clbt_path_destroy(&r.path);
+		return CLBT_INVALID_OP;
+	}
+	r.skip = len > 0 && r.path.path[len - 1] == '/' ? len : len + 1;
+	clbt_path_init(&r.last[0]);
+	clbt_path_init(&r.last[1]);
+	clbt_snap_cursor_init(&r.cur, old, 0);
+
+	if (clbt_snap_writer_open(&r.w, file, old->root, len) == CLBT_OK)
+	{
+		r.more = clbt_snap_next(&r.cur);
+		clbt_snap_refresh_read(&r, len);
+		if (r.cur.failed)
+		{
+			clbt_error("Cannot refresh from a corrupt snapshot.");
+			r.w.failed = 1;
+		}
+	}
+	ret = clbt_snap_writer_close(&r.w);
+	if (ret == CLBT_OK)
+		clbt_verbose(options, "Checked %llu directories, read %llu again, wrote %llu entries.",
+			r.dirs + 1, r.reads, (unsigned long long)r.w.entries);
+	*walked = r.errors ? CLBT_FAILURE_IO : CLBT_OK;
+
+	clbt_snap_cursor_destroy(&r.cur);
+	clbt_path_destroy(&r.last[0]);
+	clbt_path_destroy(&r.last[1]);
+	clbt_path_destroy(&r.path);
+	return ret;
+}
+
+/*
+ * Walk the only target and write every entry below it to a snapshot.
+ */
+int clbt_task_snapshot(int options)
+{
+	int walked = CLBT_OK;
+	int ret;
+
+	if (clbtConfig.targets.size != 1)
+	{
+		clbt_error("Snapshot takes exactly one directory.");
+		return CLBT_INVALID_OP;
+	}
+	ret = clbt_snap_build(clbtConfig.targets.paths[0]->path, clbtConfig.snapshot.path,
+		(options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0, 1, options, &walked);
+	return ret != CLBT_OK ? ret : walked;
+}
+
+#else
+
+int clbt_task_snapshot(int options)
+{
+	(void)options;
+	return clbt_unsupported("snapshot");
+}
+
+#endif
@@ -0,0 +1,754 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_sort.c
+ *
+ *   Description:
+ *
+ *   Sorted listing by name, natural name order, size or mtime for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define CLBT_SORT_DIGIT(c)	((c) >= '0' && (c) <= '9')
+
+/*
+ * Natural order of two names, digit runs compare by their value, so file9
+ * sorts before file10. Leading zeros do not count, names equal but for
+ * them compare as 0, callers break such ties with strcmp().
+ */
+int clbt_natural_compare(const char* a, const char* b)
+{
+	const unsigned char* x = (const unsigned char*)a;
+	const unsigned char* y = (const unsigned char*)b;
+	size_t xn, yn;
+	int c;
+
+	for (;;)
+	{
+		if (CLBT_SORT_DIGIT(*x) && CLBT_SORT_DIGIT(*y))
+		{
+			while (*x == '0')
+				x++;
+			while (*y == '0')
+				y++;
+			for (xn = 0; CLBT_SORT_DIGIT(x[xn]); xn++)
+				;
+			for (yn = 0; CLBT_SORT_DIGIT(y[yn]); yn++)
+				;
+			if (xn != yn)
+				return xn < yn ? -1 : 1;
+			if ((c = memcmp(x, y, xn)) != 0)
+				return c;
+			x += xn;
+			y += yn;
+			continue;
+		}
+		if (*x != *y)
+			return *x < *y ? -1 : 1;
+		if (*x == '\0')
+			return 0;
+		x++;
+		y++;
+	}
+}
+
+#if CLBT_OS == 1
+
+#define CLBT_SORT_SMALL		32			/* ranges sorted by insertion */
+#define CLBT_SORT_RADIX		256			/* smaller ranges are merge sorted */
+#define CLBT_SORT_PARALLEL	(1 << 16)	/* fewer keys are sorted by one thread */
+#define CLBT_SORT_CHUNK		(1 << 20)	/* path bytes per arena chunk */
+
+/*
+ * Keys are never compared as strings if it can be helped. Every key is
+ * given a 64 bit prefix that orders like the key itself: the numeric key
+ * turned so larger sorts first, or the next 8 bytes of the path, big
+ * endian. For natural order the path is read as if every digit run were
+ * written '0', its length without leading zeros and its digits, which
+ * compares bytewise like clbt_natural_compare(). The (prefix, index) pairs
+ * are radix sorted and only runs of equal prefixes look further: the part
+ * of the path they all share is skipped and they are sorted again on the
+ * next prefix, until a run shares nothing more and is left to a merge sort
+ * with full compares. The bytes all paths share, the root mostly, are
+ * skipped from the start. Chunks are sorted by pool threads and merged
+ * pairwise, rounds in parallel.
+ */
+struct ClbtSortPair
+{
+	uint64_t key;				/* prefix at the current level */
+	const char* path;			/* of the key, one pointer less to chase */
+	size_t index;				/* into keys */
+};
+
+struct ClbtSorter
+{
+	struct ClbtSortKey** keys;
+	int by;						/* CLBT_SORT_XXX */
+	int numeric;				/* first level is size or mtime */
+	size_t skip;				/* path bytes all keys share */
+	struct ClbtSortPair* pairs;
+	struct ClbtSortPair* tmp;	/* as large as pairs */
+};
+
+/* one chunk to sort, or two neighbouring runs to merge */
+struct ClbtSortJob
+{
+	struct ClbtSorter* s;
+	size_t begin;
+	size_t mid;					/* second run of a merge starts here */
+	size_t end;
+	const struct ClbtSortPair* from;
+	struct ClbtSortPair* to;
+	size_t common;				/* path bytes the chunk shares with the first key */
+};
+
+static void clbt_sort_oom(void)
+{
+	clbt_error("Unable to allocate memory for sorting!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+static uint64_t clbt_sort_pack(const unsigned char* bytes)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | bytes[i];
+	return v;
+}
+
+static uint64_t clbt_sort_name_prefix(const char* path)
+{
+	unsigned char bytes[8];
+	int i;
+
+	for (i = 0; i < 8 && path[i] != '\0'; i++)
+		bytes[i] = (unsigned char)path[i];
+	for (; i < 8; i++)
+		bytes[i] = 0;
+	return clbt_sort_pack(bytes);
+}
+
+/*
+ * Prefix of path in natural order, path must not start inside a digit run.
+ */
+static uint64_t clbt_sort_natural_prefix(const char* path)
+{
+	const unsigned char* p = (const unsigned char*)path;
+	unsigned char bytes[8];
+	size_t len, i;
+	int n = 0;
+
+	while (n < 8 && *p != '\0')
+	{
+		if (!CLBT_SORT_DIGIT(*p))
+		{
+			bytes[n++] = *p++;
+			continue;
+		}
+		while (*p == '0')
+			p++;
+		for (len = 0; CLBT_SORT_DIGIT(p[len]); len++)
+			;
+		bytes[n++] = '0';
+		if (n < 8)
+			bytes[n++] = (unsigned char)(len > 255 ? 255 : len);
+		for (i = 0; i < len && n < 8; i++)
+			bytes[n++] = p[i];
+		p += len;
+	}
+	while (n < 8)
+		bytes[n++] = 0;
+	return clbt_sort_pack(bytes);
+}
+
+static uint64_t clbt_sort_prefix(const struct ClbtSorter* s, const struct ClbtSortPair* pair, int numeric, size_t offset)
+{
+	const struct ClbtSortKey* k;
+
+	if (numeric)
+	{
+		k = s->keys[pair->index];
+		return s->by == CLBT_SORT_SIZE ? ~k->size : ~((uint64_t)k->mtime ^ 0x8000000000000000ULL);
+	}
+	if (s->by == CLBT_SORT_NATURAL)
+		return clbt_sort_natural_prefix(pair->path + offset);
+	return clbt_sort_name_prefix(pair->path + offset);
+}
+
+/*
+ * Full order of two keys sharing offset path bytes, size and mtime larger
+ * first, then by path.
+ */
+static int clbt_sort_compare(const struct ClbtSorter* s, const struct ClbtSortPair* a, const struct ClbtSortPair* b, int numeric, size_t offset)
+{
+	const struct ClbtSortKey* x;
+	const struct ClbtSortKey* y;
+	int c;
+
+	if (numeric)
+	{
+		x = s->keys[a->index];
+		y = s->keys[b->index];
+		if (s->by == CLBT_SORT_SIZE && x->size != y->size)
+			return x->size > y->size ? -1 : 1;
+		if (s->by == CLBT_SORT_MTIME && x->mtime != y->mtime)
+			return x->mtime > y->mtime ? -1 : 1;
+		offset = s->skip;
+	}
+	if (s->by == CLBT_SORT_NATURAL && (c = clbt_natural_compare(a->path + offset, b->path + offset)) != 0)
+		return c;
+	return strcmp(a->path + offset, b->path + offset);
+}
+
+static int clbt_sort_less(const struct ClbtSorter* s, const struct ClbtSortPair* a, const struct ClbtSortPair* b, int numeric, size_t offset)
+{
+	if (a->key != b->key)
+		return a->key < b->key;
+	return clbt_sort_compare(s, a, b, numeric, offset) < 0;
+}
+
+static void clbt_sort_insert(const struct ClbtSorter* s, struct ClbtSortPair* pairs, size_t n, int numeric, size_t offset)
+{
+	struct ClbtSortPair t;
+	size_t i, j;
+
+	for (i = 1; i < n; i++)
+	{
+		t = pairs[i];
+		for (j = i; j > 0 && clbt_sort_less(s, &t, &pairs[j - 1], numeric, offset); j--)
+			pairs[j] = pairs[j - 1];
+		pairs[j] = t;
+	}
+}
+
+static void clbt_sort_merge(const struct ClbtSorter* s, const struct ClbtSortPair* a, size_t an,
+	const struct ClbtSortPair* b, size_t bn, struct ClbtSortPair* out, int numeric, size_t offset)
+{
+	while (an > 0 && bn > 0)
+	{
+		if (clbt_sort_less(s, b, a, numeric, offset))
+		{
+			*out++ = *b++;
+			bn--;
+		}
+		else
+		{
+			*out++ = *a++;
+			an--;
+		}
+	}
+	memcpy(out, a, an * sizeof(struct ClbtSortPair));
+	memcpy(out + an, b, bn * sizeof(struct ClbtSortPair));
+}
+
+/*
+ * Merge sort of small ranges, or of pairs whose prefixes tell nothing more.
+ */
+static void clbt_sort_compared(const struct ClbtSorter* s, struct ClbtSortPair* pairs, struct ClbtSortPair* tmp, size_t n, int numeric, size_t offset)
+{
+	size_t half = n / 2;
+
+	if (n <= CLBT_SORT_SMALL)
+	{
+		clbt_sort_insert(s, pairs, n, numeric, offset);
+		return;
+	}
+	clbt_sort_compared(s, pairs, tmp, half, numeric, offset);
+	clbt_sort_compared(s, pairs + half, tmp + half, n - half, numeric, offset);
+	clbt_sort_merge(s, pairs, half, pairs + half, n - half, tmp, numeric, offset);
+	memcpy(pairs, tmp, n * sizeof(struct ClbtSortPair));
+}
+
+/*
+ * LSD radix sort on the whole prefix, bytes equal in all pairs are skipped.
+ */
+static void clbt_sort_radix(struct ClbtSortPair* pairs, struct ClbtSortPair* tmp, size_t n)
+{
+	size_t count[8][256];
+	struct ClbtSortPair* from = pairs;
+	struct ClbtSortPair* to = tmp;
+	struct ClbtSortPair* t;
+	size_t i, c, pos;
+	int b;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+	{
+		for (b = 0; b < 8; b++)
+			count[b][(pairs[i].key >> (b * 8)) & 255]++;
+	}
+
+	for (b = 0; b < 8; b++)
+	{
+		if (count[b][(pairs[0].key >> (b * 8)) & 255] == n)
+			continue;
+		for (c = 0, pos = 0; c < 256; c++)
+		{
+			i = count[b][c];
+			count[b][c] = pos;
+			pos += i;
+		}
+		for (i = 0; i < n; i++)
+			to[count[b][(from[i].key >> (b * 8)) & 255]++] = from[i];
+		t = from;
+		from = to;
+		to = t;
+	}
+	if (from != pairs)
+		memcpy(pairs, from, n * sizeof(struct ClbtSortPair));
+}
+
+/*
+ * Path bytes from offset on that all pairs share, never ending inside a
+ * digit run in natural order.
+ */
+static size_t clbt_sort_common(const struct ClbtSorter* s, const struct ClbtSortPair* pairs, size_t n, size_t offset)
+{
+	const char* first = pairs[0].path;
+	const char* path;
+	size_t common = offset + strlen(first + offset);
+	size_t i, j;
+
+	for (i = 1; i < n && common > offset; i++)
+	{
+		path = pairs[i].path;
+		for (j = offset; j < common && path[j] == first[j]; j++)
+			;
+		common = j;
+	}
+	if (s->by == CLBT_SORT_NATURAL)
+	{
+		while (common > offset && CLBT_SORT_DIGIT(first[common - 1]))
+			common--;
+	}
+	return common;
+}
+
+static void clbt_sort_range(const struct ClbtSorter* s, struct ClbtSortPair* pairs, struct ClbtSortPair* tmp, size_t n, int numeric, size_t offset);
+
+/*
+ * Sort a run of equal prefixes, numeric ties go on by path.
+ */
+static void clbt_sort_ties(const struct ClbtSorter* s, struct ClbtSortPair* pairs, struct ClbtSortPair* tmp, size_t n, int numeric, size_t offset)
+{
+	size_t common;
+
+	if (numeric)
+	{
+		clbt_sort_range(s, pairs, tmp, n, 0, s->skip);
+		return;
+	}
+	common = clbt_sort_common(s, pairs, n, offset);
+	if (common > offset)
+		clbt_sort_range(s, pairs, tmp, n, 0, common);
+	else
+		clbt_sort_compared(s, pairs, tmp, n, 0, offset);
+}
+
+/*
+ * Sort pairs on their prefix at offset, pairs keep that prefix on return.
+ */
+static void clbt_sort_range(const struct ClbtSorter* s, struct ClbtSortPair* pairs, struct ClbtSortPair* tmp, size_t n, int numeric, size_t offset)
+{
+	uint64_t key;
+	size_t i, j, k;
+
+	for (i = 0; i < n; i++)
+		pairs[i].key = clbt_sort_prefix(s, &pairs[i], numeric, offset);
+	if (n < CLBT_SORT_RADIX)
+	{
+		clbt_sort_compared(s, pairs, tmp, n, numeric, offset);
+		return;
+	}
+
+	clbt_sort_radix(pairs, tmp, n);
+	for (i = 0; i < n; i = j)
+	{
+		key = pairs[i].key;
+		for (j = i + 1; j < n && pairs[j].key == key; j++)
+			;
+		if (j - i < 2)
+			continue;
+		clbt_sort_ties(s, pairs + i, tmp + i, j - i, numeric, offset);
+		for (k = i; k < j; k++)
+			pairs[k].key = key;
+	}
+}
+
+static void clbt_sort_common_job(void* arg, int tid)
+{
+	struct ClbtSortJob* job = (struct ClbtSortJob*)arg;
+	const char* first = job->s->keys[0]->path;
+	const char* path;
+	size_t i, j;
+
+	(void)tid;
+	for (i = job->begin; i < job->end && job->common > 0; i++)
+	{
+		path = job->s->keys[i]->path;
+		for (j = 0; j < job->common && path[j] == first[j]; j++)
+			;
+		job->common = j;
+	}
+}
+
+static void clbt_sort_chunk_job(void* arg, int tid)
+{
+	struct ClbtSortJob* job = (struct ClbtSortJob*)arg;
+	struct ClbtSorter* s = job->s;
+	size_t i;
+
+	(void)tid;
+	for (i = job->begin; i < job->end; i++)
+	{
+		s->pairs[i].path = s->keys[i]->path;
+		s->pairs[i].index = i;
+	}
+	clbt_sort_range(s, s->pairs + job->begin, s->tmp + job->begin, job->end - job->begin, s->numeric, s->numeric ? 0 : s->skip);
+}
+
+static void clbt_sort_merge_job(void* arg, int tid)
+{
+	struct ClbtSortJob* job = (struct ClbtSortJob*)arg;
+	struct ClbtSorter* s = job->s;
+
+	(void)tid;
+	clbt_sort_merge(s, job->from + job->begin, job->mid - job->begin, job->from + job->mid, job->end - job->mid,
+		job->to + job->begin, s->numeric, s->numeric ? 0 : s->skip);
+}
+
+static void clbt_sort_run(struct ClbtPool* pool, struct ClbtSortJob* jobs, int n, ClbtJobFn fn)
+{
+	int i;
+
+	if (pool == NULL)
+	{
+		for (i = 0; i < n; i++)
+			fn(&jobs[i], 0);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		clbt_pool_submit(pool, fn, &jobs[i]);
+	clbt_pool_wait(pool);
+}
+
+/*
+ * Sort keys in place by CLBT_SORT_XXX, on up to threads threads.
+ */
+void clbt_sort_keys(struct ClbtSortKey** keys, size_t count, int by, int threads)
+{
+	struct ClbtSorter s;
+	struct ClbtSortJob* jobs;
+	struct ClbtPool* pool = NULL;
+	struct ClbtSortPair* from;
+	struct ClbtSortPair* to;
+	struct ClbtSortPair* t;
+	struct ClbtSortKey** sorted;
+	size_t* bounds;
+	size_t i, chunk;
+	int j, n, m, width;
+
+	if (count < 2)
+		return;
+	if (threads <= 0)
+		threads = clbt_default_jobs();
+	n = count < CLBT_SORT_PARALLEL ? 1 : threads;
+
+	memset(&s, 0, sizeof(s));
+	s.keys = keys;
+	s.by = by;
+	s.numeric = by == CLBT_SORT_SIZE || by == CLBT_SORT_MTIME;
+	s.pairs = (struct ClbtSortPair*)malloc(count * sizeof(struct ClbtSortPair));
+	s.tmp = (struct ClbtSortPair*)malloc(count * sizeof(struct ClbtSortPair));
+	jobs = (struct ClbtSortJob*)calloc(n, sizeof(struct ClbtSortJob));
+	bounds = (size_t*)malloc((n + 1) * sizeof(size_t));
+	if (s.pairs == NULL || s.tmp == NULL || jobs == NULL || bounds == NULL)
+		clbt_sort_oom();
+
+	chunk = (count + n - 1) / n;
+	for (j = 0; j <= n; j++)
+		bounds[j] = (size_t)j * chunk < count ? (size_t)j * chunk : count;
+	for (j = 0; j < n; j++)
+	{
+		jobs[j].s = &s;
+		jobs[j].begin = bounds[j];
+		jobs[j].end = bounds[j + 1];
+		jobs[j].common = strlen(keys[0]->path);
+	}
+	if (n > 1)
+		pool = clbt_pool_create(n);
+
+	clbt_sort_run(pool, jobs, n, clbt_sort_common_job);
+	s.skip = jobs[0].common;
+	for (j = 1; j < n; j++)
+	{
+		if (jobs[j].common < s.skip)
+			s.skip = jobs[j].common;
+	}
+	if (by == CLBT_SORT_NATURAL)
+	{
+		while (s.skip > 0 && CLBT_SORT_DIGIT(keys[0]->path[s.skip - 1]))
+			s.skip--;
+	}
+	clbt_sort_run(pool, jobs, n, clbt_sort_chunk_job);
+
+	/* merge neighbouring runs, a round at a time */
+	from = s.pairs;
+	to = s.tmp;
+	for (width = 1; width < n; width *= 2)
+	{
+		for (j = 0, m = 0; j < n; j += 2 * width, m++)
+		{
+			jobs[m].begin = bounds[j];
+			jobs[m].mid = bounds[j + width < n ? j + width : n];
+			jobs[m].end = bounds[j + 2 * width < n ? j + 2 * width : n];
+			jobs[m].from = from;
+			jobs[m].to = to;
+		}
+		clbt_sort_run(pool, jobs, m, clbt_sort_merge_job);
+		t = from;
+		from = to;
+		to = t;
+	}
+	if (pool != NULL)
+		clbt_pool_destroy(pool);
+
+	sorted = (struct ClbtSortKey**)malloc(count * sizeof(struct ClbtSortKey*));
+	if (sorted == NULL)
+		clbt_sort_oom();
+	for (i = 0; i < count; i++)
+		sorted[i] = keys[from[i].index];
+	memcpy(keys, sorted, count * sizeof(struct ClbtSortKey*));
+
+	free(sorted);
+	free(bounds);
+	free(jobs);
+	free(s.pairs);
+	free(s.tmp);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+/* sorted list task */
+
+/* One listed entry, kept until everything is walked */
+struct ClbtSortItem
+{
+	struct ClbtSortKey key;		/* first, only this is sorted */
+	int length;
+	int name;					/* offset of the name in path */
+	int type;
+	int hasStat;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t ino;
+};
+
+/* Entries collected by one walker thread */
+struct ClbtSortRun
+{
+	struct ClbtSortItem* items;
+	size_t count;
+	size_t capacity;
+	char* chunk;				/* current arena chunk, first bytes link the previous one */
+	size_t chunkUsed;
+	size_t chunkSize;
+	CP buffer;					/* path of the entry being looked at */
+};
+
+struct ClbtSortTask
+{
+	struct ClbtSortRun* runs;	/* per thread */
+	int threads;
+	int needStat;				/* the order or --fields need stat() */
+};
+
+static const char* clbt_sort_run_copy(struct ClbtSortRun* run, const char* path, int len)
+{
+	char* chunk;
+	size_t size;
+
+	if (run->chunk == NULL || run->chunkUsed + len + 1 > run->chunkSize)
+	{
+		size = sizeof(char*) + len + 1 > CLBT_SORT_CHUNK ? sizeof(char*) + len + 1 : CLBT_SORT_CHUNK;
+		chunk = (char*)malloc(size);
+		if (chunk == NULL)
+			clbt_sort_oom();
+		memcpy(chunk, &run->chunk, sizeof(char*));
+		run->chunk = chunk;
+		run->chunkUsed = sizeof(char*);
+		run->chunkSize = size;
+	}
+	chunk = run->chunk + run->chunkUsed;
+	memcpy(chunk, path, len + 1);
+	run->chunkUsed += len + 1;
+	return chunk;
+}
+
+static void clbt_sort_run_free(struct ClbtSortRun* run)
+{
+	char* chunk = run->chunk;
+	char* prev;
+
+	while (chunk != NULL)
+	{
+		memcpy(&prev, chunk, sizeof(char*));
+		free(chunk);
+		chunk = prev;
+	}
+	free(run->items);
+	clbt_path_destroy(&run->buffer);
+}
+
+static int clbt_sort_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtSortTask* task = (struct ClbtSortTask*)walker->user;
+	struct ClbtSortRun* run = &task->runs[tid];
+	struct ClbtSortItem* item;
+	int len;
+
+	if (!clbt_out_enabled() || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	len = clbt_entry_path(entry, &run->buffer);
+	if (task->needStat && clbt_entry_stat(entry) != CLBT_OK)
+	{
+		clbt_error("Cannot stat '%s': %s", run->buffer.path, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	if (run->count == run->capacity)
+	{
+		run->capacity = run->capacity ? run->capacity * 2 : 1024;
+		item = (struct ClbtSortItem*)realloc(run->items, run->capacity * sizeof(struct ClbtSortItem));
+		if (item == NULL)
+			clbt_sort_oom();
+		run->items = item;
+	}
+	item = &run->items[run->count++];
+	memset(item, 0, sizeof(struct ClbtSortItem));
+	item->key.path = clbt_sort_run_copy(run, run->buffer.path, len);
+	item->length = len;
+	item->name = len - entry->namelen;
+	item->type = entry->type;
+	item->hasStat = entry->hasStat;
+	if (entry->hasStat)
+	{
+		item->key.size = (uint64_t)entry->st.st_size;
+		item->key.mtime = (int64_t)entry->st.st_mtim.tv_sec * 1000000000 + entry->st.st_mtim.tv_nsec;
+		item->mode = (uint32_t)entry->st.st_mode;
+		item->uid = (uint32_t)entry->st.st_uid;
+		item->gid = (uint32_t)entry->st.st_gid;
+		item->ino = (uint64_t)entry->st.st_ino;
+	}
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtSortOps = { clbt_sort_on_entry, NULL, NULL, NULL };
+
+static void clbt_sort_print(const struct ClbtSortItem* item)
+{
+	struct ClbtEntry entry;
+
+	if (clbtConfig.fields == 0)
+	{
+		clbt_out_path(0, item->key.path, item->length);
+		return;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	entry.dirfd = -1;
+	entry.name = item->key.path + item->name;
+	entry.namelen = item->length - item->name;
+	entry.type = item->type;
+	entry.hasStat = item->hasStat;
+	entry.st.st_size = (off_t)item->key.size;
+	entry.st.st_mtim.tv_sec = (time_t)(item->key.mtime / 1000000000);
+	entry.st.st_mtim.tv_nsec = (long)(item->key.mtime % 1000000000);
+	entry.st.st_mode = (mode_t)item->mode;
+	entry.st.st_uid = (uid_t)item->uid;
+	entry.st.st_gid = (gid_t)item->gid;
+	entry.st.st_ino = (ino_t)item->ino;
+	clbt_list_record(NULL, &entry, item->key.path, item->length, 0);
+}
+
+/*
+ * List files in targets like list task, but all at once in --sort order.
+ */
+int clbt_list_sorted(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtSortTask task;
+	struct ClbtSortKey** keys;
+	size_t i, j, n;
+	int ret;
+
+	memset(&task, 0, sizeof(task));
+	task.needStat = clbtConfig.sort == CLBT_SORT_SIZE || clbtConfig.sort == CLBT_SORT_MTIME
+		|| (clbtConfig.fields & ~(CLBT_FIELD_PATH | CLBT_FIELD_NAME | CLBT_FIELD_TYPE));
+
+	ret = clbt_walk_begin(&walker, &clbtSortOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	task.threads = clbt_walk_threads(&walker);
+	task.runs = (struct ClbtSortRun*)calloc(task.threads, sizeof(struct ClbtSortRun));
+	if (task.runs == NULL)
+		clbt_sort_oom();
+	for (i = 0; i < (size_t)task.threads; i++)
+		clbt_path_init(&task.runs[i].buffer);
+
+	for (i = 0; i < (size_t)clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	for (i = 0, n = 0; i < (size_t)task.threads; i++)
+		n += task.runs[i].count;
+	keys = (struct ClbtSortKey**)malloc((n > 0 ? n : 1) * sizeof(struct ClbtSortKey*));
+	if (keys == NULL)
+		clbt_sort_oom();
+	for (i = 0, n = 0; i < (size_t)task.threads; i++)
+	{
+		for (j = 0; j < task.runs[i].count; j++)
+			keys[n++] = &task.runs[i].items[j].key;
+	}
+	clbt_sort_keys(keys, n, clbtConfig.sort, task.threads);
+	clbt_verbose(options, "Sorted %lu entries.", (unsigned long)n);
+
+	clbt_out_begin(1);
+	for (i = 0; i < n; i++)
+		clbt_sort_print((const struct ClbtSortItem*)keys[i]);
+	clbt_out_end();
+
+	free(keys);
+	for (i = 0; i < (size_t)task.threads; i++)
+		clbt_sort_run_free(&task.runs[i]);
+	free(task.runs);
+	return ret;
+}
+
+#else
+
+int clbt_list_sorted(int options)
+{
+	(void)options;
+	return clbt_unsupported("sort");
+}
+
+#endif
@@ -0,0 +1,390 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_stats.c
+ *
+ *   Description:
+ *
+ *   File counts and bytes grouped by extension, owner, age or size for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#if CLBT_OS == 1
+#include <pwd.h>
+
+#define CLBT_STATS_DAY		86400
+
+/*
+ * Every thread counts into a hash table of its own, keyed by extension or
+ * by a number: uid, age bucket or size bucket. Nothing is shared during
+ * the walk and nothing is kept per file, the tables are folded into one
+ * at the end and printed, groups by extension or owner largest first,
+ * age and size buckets in their order.
+ */
+struct ClbtStatsGroup
+{
+	uint64_t hash;
+	uint64_t number;			/* key unless by extension */
+	char* ext;					/* key by extension */
+	int used;					/* 0 marks an empty slot */
+	unsigned long long files;
+	unsigned long long bytes;
+};
+
+struct ClbtStatsTable
+{
+	struct ClbtStatsGroup* slots;
+	size_t capacity;			/* power of two */
+	size_t count;
+};
+
+struct ClbtStatsTask
+{
+	int by;						/* CLBT_STATS_XXX */
+	time_t now;					/* ages count from here */
+	struct ClbtStatsTable* tables;	/* per thread */
+};
+
+/* ages split at these days, the last bucket is anything older */
+static const int clbtStatsDays[] = { 1, 7, 30, 90, 365, 730 };
+static const char* const clbtStatsAges[] = { "<1d", "1d-7d", "7d-30d", "30d-90d", "90d-1y", "1y-2y", ">2y" };
+
+static void clbt_stats_oom(void)
+{
+	clbt_error("Unable to allocate memory for stats!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+static uint64_t clbt_stats_hash(const char* ext, uint64_t number)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	if (ext == NULL)
+		h = number * 0x9E3779B97F4A7C15ULL;
+	else for (; *ext; ext++)
+		h = (h ^ (unsigned char)*ext) * 0x100000001B3ULL;
+	return h ^ (h >> 29);
+}
+
+static struct ClbtStatsGroup* clbt_stats_slot(struct ClbtStatsTable* t, uint64_t hash, const char* ext, uint64_t number)
+{
+	size_t mask = t->capacity - 1;
+	size_t i;
+
+	for (i = (size_t)hash & mask; t->slots[i].used; i = (i + 1) & mask)
+	{
+		if (t->slots[i].hash == hash && t->slots[i].number == number
+			&& (ext == NULL || strcmp(t->slots[i].ext, ext) == 0))
+			break;
+	}
+	return &t->slots[i];
+}
+
+/*
+ * The group of a key, added if new.
+ */
+static struct ClbtStatsGroup* clbt_stats_group(struct ClbtStatsTable* t, const char* ext, uint64_t number)
+{
+	uint64_t hash = clbt_stats_hash(ext, number);
+	struct ClbtStatsGroup* old;
+	struct ClbtStatsGroup* g;
+	size_t i, oldCapacity;
+
+	/* keep at most half of the slots used */
+	if ((t->count + 1) * 2 > t->capacity)
+	{
+		old = t->slots;
+		oldCapacity = t->capacity;
+		t->capacity = oldCapacity ? oldCapacity * 2 : 64;
+		t->slots = (struct ClbtStatsGroup*)calloc(t->capacity, sizeof(struct ClbtStatsGroup));
+		if (t->slots == NULL)
+			clbt_stats_oom();
+		for (i = 0; i < oldCapacity; i++)
+		{
+			if (old[i].used)
+				*clbt_stats_slot(t, old[i].hash, old[i].ext, old[i].number) = old[i];
+		}
+		free(old);
+	}
+
+	g = clbt_stats_slot(t, hash, ext, number);
+	if (!g->used)
+	{
+		g->used = 1;
+		g->hash = hash;
+		g->number = number;
+		if (ext != NULL && (g->ext = strdup(ext)) == NULL)
+			clbt_stats_oom();
+		t->count++;
+	}
+	return g;
+}
+
+/*
+ * Extension of a file name, empty for none or a dot file.
+ */
+static const char* clbt_stats_ext(const char* name)
+{
+	const char* slash = strrchr(name, '/');
+	const char* dot;
+
+	if (slash != NULL)
+		name = slash + 1;
+	dot = strrchr(name, '.');
+	return dot != NULL && dot != name ? dot + 1 : "";
+}
+
+/*
+ * Size bucket, 0 for empty files and k + 1 for sizes in [2^k, 2^(k+1)).
+ */
+static uint64_t clbt_stats_size_bucket(unsigned long long size)
+{
+	uint64_t k = 0;
+
+	while (size != 0)
+	{
+		size >>= 1;
+		k++;
+	}
+	return k;
+}
+
+static uint64_t clbt_stats_age_bucket(const struct ClbtStatsTask* task, time_t mtime)
+{
+	uint64_t i;
+	double days = difftime(task->now, mtime) / CLBT_STATS_DAY;
+
+	for (i = 0; i < sizeof(clbtStatsDays) / sizeof(clbtStatsDays[0]); i++)
+	{
+		if (days < clbtStatsDays[i])
+			break;
+	}
+	return i;
+}
+
+static int clbt_stats_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtStatsTask* task = (struct ClbtStatsTask*)walker->user;
+	struct ClbtStatsTable* t = &task->tables[tid];
+	struct ClbtStatsGroup* g;
+
+	if (entry->type != CLBT_TYPE_FILE || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	if (clbt_entry_stat(entry) != CLBT_OK)
+	{
+		if (entry->dir)
+			clbt_error("Cannot stat '%s/%s': %s", entry->dir->path, entry->name, strerror(errno));
+		else
+			clbt_error("Cannot stat '%s': %s", entry->name, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	switch (task->by)
+	{
+	case CLBT_STATS_EXT:
+		g = clbt_stats_group(t, clbt_stats_ext(entry->name), 0);
+		break;
+	case CLBT_STATS_UID:
+		g = clbt_stats_group(t, NULL, (uint64_t)entry->st.st_uid);
+		break;
+	case CLBT_STATS_AGE:
+		g = clbt_stats_group(t, NULL, clbt_stats_age_bucket(task, entry->st.st_mtime));
+		break;
+	default:
+		g = clbt_stats_group(t, NULL, clbt_stats_size_bucket((unsigned long long)entry->st.st_size));
+		break;
+	}
+	g->files++;
+	g->bytes += (unsigned long long)entry->st.st_size;
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtStatsOps = { clbt_stats_on_entry, NULL, NULL, NULL };
+
+/* groups by extension and owner, most bytes first */
+static int clbt_stats_compare_bytes(const void* a, const void* b)
+{
+	const struct ClbtStatsGroup* x = (const struct ClbtStatsGroup*)a;
+	const struct ClbtStatsGroup* y = (const struct ClbtStatsGroup*)b;
+
+	if (x->bytes != y->bytes)
+		return x->bytes > y->bytes ? -1 : 1;
+	if (x->ext != NULL)
+		return strcmp(x->ext, y->ext);
+	return x->number < y->number ? -1 : x->number > y->number;
+}
+
+/* age and size buckets in order */
+static int clbt_stats_compare_bucket(const void* a, const void* b)
+{
+	const struct ClbtStatsGroup* x = (const struct ClbtStatsGroup*)a;
+	const struct ClbtStatsGroup* y = (const struct ClbtStatsGroup*)b;
+
+	return x->number < y->number ? -1 : x->number > y->number;
+}
+
+/*
+ * Print a power of two bytes with the largest unit it is a whole number of.
+ */
+static void clbt_stats_units(char* buf, unsigned long long bytes)
+{
+	static const char units[] = "BKMGTPE";
+	int u = 0;
+
+	while (bytes >= 1024 && bytes % 1024 == 0)
+	{
+		bytes /= 1024;
+		u++;
+	}
+	sprintf(buf, "%llu%c", bytes, units[u]);
+}
+
+static void clbt_stats_print(const struct ClbtStatsTask* task, const struct ClbtStatsGroup* g)
+{
+	struct ClbtRecord r;
+	struct passwd pw;
+	struct passwd* found = NULL;
+	char buf[1024];
+	char hi[32];
+
+	clbt_record_begin(&r);
+	switch (task->by)
+	{
+	case CLBT_STATS_EXT:
+		clbt_record_string(&r, "ext", g->ext, strlen(g->ext));
+		break;
+	case CLBT_STATS_UID:
+		clbt_record_number(&r, "uid", g->number);
+		if (getpwuid_r((uid_t)g->number, &pw, buf, sizeof(buf), &found) != 0 || found == NULL)
+			clbt_record_string(&r, "user", "", 0);
+		else
+			clbt_record_string(&r, "user", pw.pw_name, strlen(pw.pw_name));
+		break;
+	case CLBT_STATS_AGE:
+		clbt_record_string(&r, "age", clbtStatsAges[g->number], strlen(clbtStatsAges[g->number]));
+		break;
+	default:
+		/* from the lower bound up to but not including the upper one */
+		if (g->number == 0)
+		{
+			strcpy(buf, "0B");
+		}
+		else
+		{
+			clbt_stats_units(buf, 1ULL << (g->number - 1));
+			strcat(buf, "-");
+			if (g->number < 64)
+			{
+				clbt_stats_units(hi, 1ULL << g->number);
+				strcat(buf, hi);
+			}
+		}
+		clbt_record_string(&r, "size", buf, strlen(buf));
+		break;
+	}
+	clbt_record_number(&r, "files", g->files);
+	clbt_record_number(&r, "bytes", g->bytes);
+	clbt_record_end(&r, -1);
+}
+
+/*
+ * Print file counts and bytes below targets grouped by --stats-by.
+ */
+int clbt_task_stats(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtStatsTask task;
+	struct ClbtStatsTable* all;
+	struct ClbtStatsTable* t;
+	struct ClbtStatsGroup* g;
+	struct ClbtStatsGroup* groups;
+	unsigned long long files = 0, bytes = 0;
+	size_t i, n;
+	int j, ret, threads;
+
+	memset(&task, 0, sizeof(task));
+	task.by = clbtConfig.statsBy;
+	task.now = time(NULL);
+
+	ret = clbt_walk_begin(&walker, &clbtStatsOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	threads = clbt_walk_threads(&walker);
+	task.tables = (struct ClbtStatsTable*)calloc(threads, sizeof(struct ClbtStatsTable));
+	if (task.tables == NULL)
+		clbt_stats_oom();
+
+	for (j = 0; j < clbtConfig.targets.size; j++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[j]->path);
+	ret = clbt_walk_end(&walker);
+
+	/* fold every table into the first */
+	all = &task.tables[0];
+	for (j = 1; j < threads; j++)
+	{
+		t = &task.tables[j];
+		for (i = 0; i < t->capacity; i++)
+		{
+			if (!t->slots[i].used)
+				continue;
+			g = clbt_stats_group(all, t->slots[i].ext, t->slots[i].number);
+			g->files += t->slots[i].files;
+			g->bytes += t->slots[i].bytes;
+			free(t->slots[i].ext);
+		}
+		free(t->slots);
+	}
+
+	groups = (struct ClbtStatsGroup*)malloc((all->count > 0 ? all->count : 1) * sizeof(struct ClbtStatsGroup));
+	if (groups == NULL)
+		clbt_stats_oom();
+	for (i = 0, n = 0; i < all->capacity; i++)
+	{
+		if (all->slots[i].used)
+			groups[n++] = all->slots[i];
+	}
+	qsort(groups, n, sizeof(struct ClbtStatsGroup),
+		task.by == CLBT_STATS_EXT || task.by == CLBT_STATS_UID ? clbt_stats_compare_bytes : clbt_stats_compare_bucket);
+
+	for (i = 0; i < n; i++)
+	{
+		clbt_stats_print(&task, &groups[i]);
+		files += groups[i].files;
+		bytes += groups[i].bytes;
+		free(groups[i].ext);
+	}
+	clbt_verbose(options, "Counted %llu file(s) of %llu byte(s) in %lu group(s).", files, bytes, (unsigned long)n);
+
+	free(groups);
+	free(all->slots);
+	free(task.tables);
+	return ret;
+}
+
+#else
+
+int clbt_task_stats(int options)
+{
+	(void)options;
+	return clbt_unsupported("stats");
+}
+
+#endif
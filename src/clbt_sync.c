@@ -0,0 +1,785 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_sync.c
+ *
+ *   Description:
+ *
+ *   Tree mirror task for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* O_NOATIME */
+#endif
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+
+#define CLBT_SYNC_BLOCK		(1 << 20)	/* bytes per read when verifying */
+#define CLBT_SYNC_LARGE		(1 << 20)	/* files copied by a job of their own */
+
+/*
+ * Source and destination directories are enumerated as pairs by one job,
+ * both listings are sorted by name and merge-joined: names only in the
+ * source are added, names only in the destination removed, names in both
+ * compared by type, size and mtime, or content with --verify. Unchanged
+ * files cost two fstatat() calls and nothing else.
+ *
+ * Sub directories become jobs of their own, opened relative to the fds of
+ * their parent pair so a component swapped for a symbolic link is never
+ * followed. Like the walker, every pair counts what is still pending below
+ * it and keeps its fds until then, so directory modes and times are copied
+ * bottom-up once nothing inside changes any more. Until then destination
+ * directories stay writable by the owner, even for a read-only source.
+ */
+struct ClbtSyncTask
+{
+	struct ClbtPool* pool;
+	int verify;
+	unsigned char** buffers;	/* per thread, two blocks for --verify */
+	unsigned long errors;		/* atomic */
+	unsigned long copied;		/* atomic */
+	unsigned long removed;		/* atomic */
+	unsigned long touched;		/* times fixed without copy, atomic */
+};
+
+struct ClbtSyncDir
+{
+	struct ClbtSyncTask* task;
+	struct ClbtSyncDir* parent;
+	char* src;
+	char* dst;
+	char* name;					/* last component, NULL for the root pair */
+	int srcfd;					/* open until released, -1 if not */
+	int dstfd;
+	int pending;				/* atomic, own job plus running children */
+	int hasStat;
+	mode_t mode;				/* permission bits of the source */
+	struct timespec times[2];	/* atime and mtime of the source */
+};
+
+struct ClbtSyncName
+{
+	const char* name;
+	int type;					/* CLBT_TYPE_XXX */
+};
+
+struct ClbtSyncList
+{
+	char* names;
+	size_t used;
+	size_t capacity;
+	struct ClbtSyncName* items;
+	int size;
+	int itemCapacity;
+};
+
+struct ClbtSyncCopy
+{
+	struct ClbtSyncDir* dir;	/* retained until copied */
+	char* name;
+	struct stat st;
+};
+
+static void clbt_sync_dir_job(void* arg, int tid);
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void clbt_sync_failed(struct ClbtSyncTask* task, const char* what, const char* path)
+{
+	clbt_error("Cannot %s '%s': %s", what, path, strerror(errno));
+	clbt_atomic_add(&task->errors, 1);
+}
+
+/*
+ * Report one change: "+ path" for created, "* path" for retimed and
+ * "- path" for removed entries, or an {"action","path"} record.
+ */
+static void clbt_sync_report(const char* action, const char* path)
+{
+	struct ClbtRecord r;
+	char mark = '+';
+
+	if (clbt_out_format() != CLBT_FORMAT_JSONL)
+	{
+		if (strcmp(action, "touch") == 0)
+			mark = '*';
+		else if (strcmp(action, "remove") == 0)
+			mark = '-';
+		clbt_println("%c %s%s", mark, path, strcmp(action, "mkdir") == 0 ? "/" : "");
+		return;
+	}
+	clbt_record_begin(&r);
+	clbt_record_string(&r, "action", action, strlen(action));
+	clbt_record_string(&r, "path", path, strlen(path));
+	clbt_record_end(&r, -1);
+}
+
+static char* clbt_sync_join(const char* dir, const char* name)
+{
+	size_t len = strlen(dir);
+	char* path = (char*)malloc(len + strlen(name) + 2);
+
+	if (path == NULL)
+	{
+		clbt_error("Unable to allocate memory for sync task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	memcpy(path, dir, len);
+	if (len < 1 || path[len - 1] != '/')
+		path[len++] = '/';
+	strcpy(path + len, name);
+	return path;
+}
+
+static struct ClbtSyncDir* clbt_sync_dir_new(struct ClbtSyncTask* task, struct ClbtSyncDir* parent, const char* src, const char* dst, const char* name)
+{
+	struct ClbtSyncDir* dir = (struct ClbtSyncDir*)calloc(1, sizeof(struct ClbtSyncDir));
+
+	if (dir == NULL || (dir->src = strdup(src)) == NULL || (dir->dst = strdup(dst)) == NULL
+		|| (name != NULL && (dir->name = strdup(name)) == NULL))
+	{
+		clbt_error("Unable to allocate memory for sync task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	dir->task = task;
+	dir->parent = parent;
+	dir->srcfd = -1;
+	dir->dstfd = -1;
+	dir->pending = 1;
+	if (parent)
+		clbt_atomic_add(&parent->pending, 1);
+	return dir;
+}
+
+/*
+ * Drop one reference, finished directories get their mode and times bottom-up.
+ */
+static void clbt_sync_dir_release(struct ClbtSyncDir* dir)
+{
+	struct ClbtSyncDir* parent;
+
+	while (dir != NULL && clbt_atomic_sub(&dir->pending, 1) == 0)
+	{
+		if (dir->hasStat && (fchmod(dir->dstfd, dir->mode) != 0 || futimens(dir->dstfd, dir->times) != 0))
+			clbt_sync_failed(dir->task, "set mode and times of", dir->dst);
+		if (dir->srcfd >= 0)
+			close(dir->srcfd);
+		if (dir->dstfd >= 0)
+			close(dir->dstfd);
+		parent = dir->parent;
+		free(dir->src);
+		free(dir->dst);
+		free(dir->name);
+		free(dir);
+		dir = parent;
+	}
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static int clbt_sync_type(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return CLBT_TYPE_FILE;
+	if (S_ISDIR(mode))
+		return CLBT_TYPE_DIR;
+	if (S_ISLNK(mode))
+		return CLBT_TYPE_LINK;
+	return CLBT_TYPE_OTHER;
+}
+
+static int clbt_sync_compare(const void* a, const void* b)
+{
+	return strcmp(((const struct ClbtSyncName*)a)->name, ((const struct ClbtSyncName*)b)->name);
+}
+
+/*
+ * Read a whole directory and sort it by name.
+ */
+static int clbt_sync_list(struct ClbtSyncList* list, int fd)
+{
+	struct stat st;
+	struct dirent* de;
+	DIR* dp;
+	size_t len, offset;
+	int i, type;
+	void* p;
+
+	list->used = 0;
+	list->size = 0;
+
+	/* the listing owns a dup, fd stays usable for *at() calls */
+	fd = dup(fd);
+	if (fd < 0 || (dp = fdopendir(fd)) == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		return CLBT_FAILURE_IO;
+	}
+
+	while (1)
+	{
+		errno = 0;
+		if ((de = readdir(dp)) == NULL)
+			break;
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+
+#ifdef DT_UNKNOWN
+		switch (de->d_type)
+		{
+		case DT_REG: type = CLBT_TYPE_FILE; break;
+		case DT_DIR: type = CLBT_TYPE_DIR; break;
+		case DT_LNK: type = CLBT_TYPE_LINK; break;
+		case DT_UNKNOWN: type = CLBT_TYPE_UNKNOWN; break;
+		default: type = CLBT_TYPE_OTHER; break;
+		}
+#else
+		type = CLBT_TYPE_UNKNOWN;
+#endif
+		if (type == CLBT_TYPE_UNKNOWN)
+			type = fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 ? clbt_sync_type(st.st_mode) : CLBT_TYPE_OTHER;
+
+		len = strlen(de->d_name) + 1;
+		if (list->used + len > list->capacity)
+		{
+			list->capacity = (list->used + len) * 2;
+			p = realloc(list->names, list->capacity);
+			if (p == NULL)
+			{
+				clbt_error("Unable to reallocate memory for sync task!");
+				exit(CLBT_MEMORY_ERR);
+			}
+			list->names = (char*)p;
+		}
+		if (list->size == list->itemCapacity)
+		{
+			list->itemCapacity = list->itemCapacity ? list->itemCapacity * 2 : 64;
+			p = realloc(list->items, list->itemCapacity * sizeof(struct ClbtSyncName));
+			if (p == NULL)
+			{
+				clbt_error("Unable to reallocate memory for sync task!");
+				exit(CLBT_MEMORY_ERR);
+			}
+			list->items = (struct ClbtSyncName*)p;
+		}
+
+		/* names may move while growing, keep offsets until the end */
+		memcpy(list->names + list->used, de->d_name, len);
+		list->items[list->size].name = (const char*)(size_t)list->used;
+		list->items[list->size].type = type;
+		list->size++;
+		list->used += len;
+	}
+	closedir(dp);
+	if (errno != 0)
+		return CLBT_FAILURE_IO;
+
+	for (i = 0; i < list->size; i++)
+	{
+		offset = (size_t)list->items[i].name;
+		list->items[i].name = list->names + offset;
+	}
+	qsort(list->items, list->size, sizeof(struct ClbtSyncName), clbt_sync_compare);
+	return CLBT_OK;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Remove a destination entry, directories with everything below.
+ */
+static int clbt_sync_remove(int dirfd, const char* name, int type)
+{
+	struct dirent* de;
+	DIR* dp;
+	int fd, ret = CLBT_OK;
+
+	if (type != CLBT_TYPE_DIR)
+		return unlinkat(dirfd, name, 0) == 0 ? CLBT_OK : CLBT_FAILURE_IO;
+
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || (dp = fdopendir(fd)) == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		return CLBT_FAILURE_IO;
+	}
+	while (ret == CLBT_OK && (de = readdir(dp)) != NULL)
+	{
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+		if (unlinkat(fd, de->d_name, 0) == 0)
+			continue;
+		if (errno == EISDIR || errno == EPERM)
+			ret = clbt_sync_remove(fd, de->d_name, CLBT_TYPE_DIR);
+		else
+			ret = CLBT_FAILURE_IO;
+	}
+	closedir(dp);
+	if (ret == CLBT_OK && unlinkat(dirfd, name, AT_REMOVEDIR) != 0)
+		ret = CLBT_FAILURE_IO;
+	return ret;
+}
+
+/*
+ * Compare content of two files of equal size.
+ */
+static int clbt_sync_same_content(struct ClbtSyncTask* task, const struct ClbtSyncDir* dir, const char* name, int tid)
+{
+	unsigned char* a = task->buffers[tid];
+	unsigned char* b = a + CLBT_SYNC_BLOCK;
+	int fa, fb, same = 1;
+	ssize_t na, nb;
+
+	fa = clbt_open_read_at(dir->srcfd, name, 1);
+	fb = clbt_open_read_at(dir->dstfd, name, 1);
+	if (fa < 0 || fb < 0)
+	{
+		same = -1;
+	}
+	else
+	{
+		do
+		{
+			na = clbt_read_full(fa, a, CLBT_SYNC_BLOCK, -1);
+			nb = clbt_read_full(fb, b, CLBT_SYNC_BLOCK, -1);
+			if (na < 0 || nb < 0)
+				same = -1;
+			else if (na != nb || memcmp(a, b, na) != 0)
+				same = 0;
+		} while (same == 1 && na == CLBT_SYNC_BLOCK);
+	}
+	if (fa >= 0)
+		close(fa);
+	if (fb >= 0)
+		close(fb);
+	return same;
+}
+
+/*
+ * Copy a file next to its destination and rename it over, reflink first,
+ * then the kernel copy, plain read/write as a last resort.
+ */
+static int clbt_sync_copy_file(struct ClbtSyncTask* task, const struct ClbtSyncDir* dir, const char* name, const struct stat* st, int tid)
+{
+	struct timespec times[2];
+	CP tmp;
+	int in, out, ok = 0;
+
+	in = clbt_open_read_at(dir->srcfd, name, 1);
+	if (in < 0)
+		return CLBT_FAILURE_IO;
+
+	clbt_path_init(&tmp);
+	out = clbt_replace_begin(dir->dstfd, name, &tmp, tid);
+	if (out >= 0)
+	{
+#ifdef FICLONE
+		ok = ioctl(out, FICLONE, in) == 0;
+#endif
+		if (!ok)
+			ok = clbt_copy_prefix(in, out, st->st_size, task->buffers[tid], CLBT_SYNC_BLOCK * 2) == CLBT_OK;
+		times[0] = st->st_atim;
+		times[1] = st->st_mtim;
+		if (ok && futimens(out, times) != 0)
+			ok = 0;
+		ok = clbt_replace_commit(dir->dstfd, name, &tmp, out, st, ok) == CLBT_OK;
+	}
+	close(in);
+	clbt_path_destroy(&tmp);
+	return ok ? CLBT_OK : CLBT_FAILURE_IO;
+}
+
+static void clbt_sync_copy_job(void* arg, int tid)
+{
+	struct ClbtSyncCopy* copy = (struct ClbtSyncCopy*)arg;
+	struct ClbtSyncDir* dir = copy->dir;
+	char* dst = clbt_sync_join(dir->dst, copy->name);
+
+	if (clbt_sync_copy_file(dir->task, dir, copy->name, &copy->st, tid) == CLBT_OK)
+	{
+		clbt_atomic_add(&dir->task->copied, 1);
+		clbt_sync_report("copy", dst);
+	}
+	else
+	{
+		clbt_sync_failed(dir->task, "copy to", dst);
+	}
+
+	free(dst);
+	free(copy->name);
+	free(copy);
+	clbt_sync_dir_release(dir);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Bring one destination file in line with the source, dst may not exist.
+ */
+static void clbt_sync_file(struct ClbtSyncDir* dir, int srcfd, int dstfd, const char* name, int exists, int tid)
+{
+	struct ClbtSyncTask* task = dir->task;
+	struct ClbtSyncCopy* copy;
+	struct stat st, dt;
+	struct timespec times[2];
+	char* src;
+	char* dst;
+	int same;
+
+	if (fstatat(srcfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+	{
+		src = clbt_sync_join(dir->src, name);
+		clbt_sync_failed(task, "stat", src);
+		free(src);
+		return;
+	}
+	if (exists && fstatat(dstfd, name, &dt, AT_SYMLINK_NOFOLLOW) != 0)
+		exists = 0;
+
+	if (exists && st.st_size == dt.st_size)
+	{
+		same = st.st_mtim.tv_sec == dt.st_mtim.tv_sec && st.st_mtim.tv_nsec == dt.st_mtim.tv_nsec;
+		if (same && !task->verify)
+			return;
+
+		/* equal size, let the content decide */
+		if (task->verify)
+		{
+			dst = clbt_sync_join(dir->dst, name);
+			if (clbt_sync_same_content(task, dir, name, tid) == 1)
+			{
+				times[0] = st.st_atim;
+				times[1] = st.st_mtim;
+				if (!same && utimensat(dstfd, name, times, AT_SYMLINK_NOFOLLOW) == 0)
+				{
+					clbt_atomic_add(&task->touched, 1);
+					clbt_sync_report("touch", dst);
+				}
+				same = 1;
+			}
+			else
+			{
+				same = 0;
+			}
+			free(dst);
+			if (same)
+				return;
+		}
+	}
+
+	copy = (struct ClbtSyncCopy*)malloc(sizeof(struct ClbtSyncCopy));
+	if (copy == NULL || (copy->name = strdup(name)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for sync task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	copy->dir = dir;
+	copy->st = st;
+	clbt_atomic_add(&dir->pending, 1);
+
+	/* large files are copied while the directory goes on */
+	if (st.st_size >= CLBT_SYNC_LARGE)
+		clbt_pool_submit(task->pool, clbt_sync_copy_job, copy);
+	else
+		clbt_sync_copy_job(copy, tid);
+}
+
+static void clbt_sync_link(struct ClbtSyncDir* dir, int srcfd, int dstfd, const char* name, int exists)
+{
+	char target[4096], current[4096];
+	ssize_t n, m;
+	char* dst;
+
+	n = readlinkat(srcfd, name, target, sizeof(target) - 1);
+	if (n < 0)
+		return;
+	target[n] = '\0';
+
+	if (exists)
+	{
+		m = readlinkat(dstfd, name, current, sizeof(current) - 1);
+		if (m == n && memcmp(target, current, n) == 0)
+			return;
+		unlinkat(dstfd, name, 0);
+	}
+
+	dst = clbt_sync_join(dir->dst, name);
+	if (symlinkat(target, dstfd, name) == 0)
+	{
+		clbt_atomic_add(&dir->task->copied, 1);
+		clbt_sync_report("link", dst);
+	}
+	else
+	{
+		clbt_sync_failed(dir->task, "create link", dst);
+	}
+	free(dst);
+}
+
+static void clbt_sync_subdir(struct ClbtSyncDir* dir, int srcfd, int dstfd, const char* name, int exists)
+{
+	struct ClbtSyncDir* child;
+	struct stat st;
+	char* src = clbt_sync_join(dir->src, name);
+	char* dst = clbt_sync_join(dir->dst, name);
+
+	if (!exists)
+	{
+		/* the source mode is applied once the directory is complete */
+		if (fstatat(srcfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || mkdirat(dstfd, name, (st.st_mode & 07777) | S_IRWXU) != 0)
+		{
+			clbt_sync_failed(dir->task, "create directory", dst);
+			free(src);
+			free(dst);
+			return;
+		}
+		clbt_sync_report("mkdir", dst);
+	}
+
+	child = clbt_sync_dir_new(dir->task, dir, src, dst, name);
+	clbt_pool_submit(dir->task->pool, clbt_sync_dir_job, child);
+	free(src);
+	free(dst);
+}
+
+/*
+ * Open a directory of a pair, below the root never through a symbolic link.
+ */
+static int clbt_sync_open_dir(int dirfd, const char* name, int extra)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (dirfd != AT_FDCWD ? O_NOFOLLOW : 0);
+	int fd = openat(dirfd, name, flags | extra);
+
+	if (fd < 0 && errno == EPERM && extra != 0)
+		fd = openat(dirfd, name, flags);
+	return fd;
+}
+
+static void clbt_sync_dir_job(void* arg, int tid)
+{
+	struct ClbtSyncDir* dir = (struct ClbtSyncDir*)arg;
+	struct ClbtSyncTask* task = dir->task;
+	struct ClbtSyncList srcList, dstList;
+	struct ClbtSyncName* s;
+	struct ClbtSyncName* d;
+	struct stat st, dt;
+	char* path;
+	int srcfd, dstfd, i, j, c;
+
+	memset(&srcList, 0, sizeof(srcList));
+	memset(&dstList, 0, sizeof(dstList));
+
+	/* both fds stay with dir until it is released, jobs below open relative to them */
+	srcfd = dir->srcfd = clbt_sync_open_dir(dir->parent ? dir->parent->srcfd : AT_FDCWD, dir->parent ? dir->name : dir->src, O_NOATIME);
+	dstfd = dir->dstfd = clbt_sync_open_dir(dir->parent ? dir->parent->dstfd : AT_FDCWD, dir->parent ? dir->name : dir->dst, 0);
+	if (srcfd < 0 || clbt_sync_list(&srcList, srcfd) != CLBT_OK)
+	{
+		clbt_sync_failed(task, "read directory", dir->src);
+		goto done;
+	}
+	if (dstfd < 0 || clbt_sync_list(&dstList, dstfd) != CLBT_OK)
+	{
+		clbt_sync_failed(task, "read directory", dir->dst);
+		goto done;
+	}
+
+	/* mode and times are copied on release, until then the owner may write */
+	if (fstat(srcfd, &st) == 0)
+	{
+		dir->mode = st.st_mode & 07777;
+		dir->times[0] = st.st_atim;
+		dir->times[1] = st.st_mtim;
+		dir->hasStat = 1;
+	}
+	if (fstat(dstfd, &dt) == 0 && (dt.st_mode & S_IRWXU) != S_IRWXU)
+		fchmod(dstfd, (dt.st_mode & 07777) | S_IRWXU);
+
+	/* merge-join of both sorted listings */
+	for (i = 0, j = 0; i < srcList.size || j < dstList.size;)
+	{
+		s = i < srcList.size ? &srcList.items[i] : NULL;
+		d = j < dstList.size ? &dstList.items[j] : NULL;
+		c = s == NULL ? 1 : d == NULL ? -1 : strcmp(s->name, d->name);
+
+		/* gone from the source, or replaced by another type */
+		if (c > 0 || (c == 0 && s->type != d->type))
+		{
+			path = clbt_sync_join(dir->dst, d->name);
+			if (clbt_sync_remove(dstfd, d->name, d->type) == CLBT_OK)
+			{
+				clbt_atomic_add(&task->removed, 1);
+				clbt_sync_report("remove", path);
+			}
+			else
+			{
+				clbt_sync_failed(task, "remove", path);
+			}
+			free(path);
+			j++;
+			if (c > 0)
+				continue;
+			c = -1;
+		}
+
+		switch (s->type)
+		{
+		case CLBT_TYPE_FILE:
+			clbt_sync_file(dir, srcfd, dstfd, s->name, c == 0, tid);
+			break;
+		case CLBT_TYPE_DIR:
+			clbt_sync_subdir(dir, srcfd, dstfd, s->name, c == 0);
+			break;
+		case CLBT_TYPE_LINK:
+			clbt_sync_link(dir, srcfd, dstfd, s->name, c == 0);
+			break;
+		default:
+			/* devices, fifos and sockets are not mirrored */
+			break;
+		}
+		i++;
+		if (c == 0)
+			j++;
+	}
+
+done:
+	free(srcList.names);
+	free(srcList.items);
+	free(dstList.names);
+	free(dstList.items);
+	clbt_sync_dir_release(dir);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Make the destination an exact copy of the only target, with as little
+ * I/O as the differences allow.
+ */
+int clbt_task_sync(int options)
+{
+	struct ClbtSyncTask task;
+	struct stat st;
+	char* src;
+	char* dst;
+	size_t len, dlen;
+	int i, threads, created;
+
+	if (clbtConfig.targets.size != 1)
+	{
+		clbt_error("Sync takes exactly one source directory.");
+		return CLBT_INVALID_OP;
+	}
+	if (stat(clbtConfig.targets.paths[0]->path, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		clbt_error("Source '%s' is not a directory.", clbtConfig.targets.paths[0]->path);
+		return CLBT_INVALID_OP;
+	}
+	created = mkdir(clbtConfig.syncDest.path, (st.st_mode & 07777) | S_IRWXU) == 0;
+	if (!created && errno != EEXIST)
+	{
+		clbt_error("Cannot create '%s': %s", clbtConfig.syncDest.path, strerror(errno));
+		return CLBT_FAILURE_IO;
+	}
+
+	/* never mirror a tree into itself */
+	src = realpath(clbtConfig.targets.paths[0]->path, NULL);
+	dst = realpath(clbtConfig.syncDest.path, NULL);
+	if (src == NULL || dst == NULL)
+	{
+		clbt_error("Cannot resolve source or destination: %s", strerror(errno));
+		free(src);
+		free(dst);
+		return CLBT_FAILURE_IO;
+	}
+	/* nor onto an ancestor, whose extra entries would include the source */
+	len = strlen(src);
+	dlen = strlen(dst);
+	if ((strncmp(src, dst, len) == 0 && (dst[len] == '\0' || dst[len] == '/' || len == 1))
+		|| (strncmp(dst, src, dlen) == 0 && (src[dlen] == '/' || dlen == 1)))
+	{
+		if (dlen < len)
+			clbt_error("Source '%s' is inside destination '%s'.", src, dst);
+		else
+			clbt_error("Destination '%s' is inside source '%s'.", dst, src);
+		if (created)
+			rmdir(dst);
+		free(src);
+		free(dst);
+		return CLBT_INVALID_OP;
+	}
+	free(src);
+	free(dst);
+
+	if (!clbt_confirm(options, "Mirror '%s' to '%s', removing what is not in the source?",
+		clbtConfig.targets.paths[0]->path, clbtConfig.syncDest.path))
+		return CLBT_OK;
+
+	memset(&task, 0, sizeof(task));
+	task.verify = (options & CLBT_OPT_VERIFY) != 0;
+	task.pool = clbt_pool_create(clbtConfig.jobs);
+	threads = clbt_pool_threads(task.pool);
+	task.buffers = (unsigned char**)calloc(threads, sizeof(unsigned char*));
+	if (task.buffers == NULL)
+	{
+		clbt_error("Unable to allocate memory for sync task!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		task.buffers[i] = (unsigned char*)malloc(CLBT_SYNC_BLOCK * 2);
+		if (task.buffers[i] == NULL)
+		{
+			clbt_error("Unable to allocate memory for sync task!");
+			exit(CLBT_MEMORY_ERR);
+		}
+	}
+
+	clbt_pool_submit(task.pool, clbt_sync_dir_job,
+		clbt_sync_dir_new(&task, NULL, clbtConfig.targets.paths[0]->path, clbtConfig.syncDest.path, NULL));
+	clbt_pool_wait(task.pool);
+	clbt_pool_destroy(task.pool);
+
+	for (i = 0; i < threads; i++)
+		free(task.buffers[i]);
+	free(task.buffers);
+
+	clbt_verbose(options, "Copied %lu, removed %lu, retimed %lu entries.", task.copied, task.removed, task.touched);
+	return task.errors ? CLBT_FAILURE_IO : CLBT_OK;
+}
+
+#else
+
+int clbt_task_sync(int options)
+{
+	(void)options;
+	return clbt_unsupported("sync");
+}
+
+#endif
@@ -0,0 +1,247 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_top.c
+ *
+ *   Description:
+ *
+ *   Largest or newest files for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+
+/*
+ * Every thread keeps the best N files it has seen in a min heap, so the
+ * worst kept is on top and a file that does not beat it costs one compare,
+ * its path is not even built. The heaps are merged and sorted once at the
+ * end, memory stays at N records per thread however many files there are.
+ * Ties go to the smaller path, so the answer does not depend on timing.
+ */
+struct ClbtTopRecord
+{
+	int64_t key;				/* size in bytes or mtime in nanoseconds */
+	char* path;
+};
+
+/* records kept by one thread, a min heap on key */
+struct ClbtTopWorker
+{
+	struct ClbtTopRecord* items;
+	int size;
+	CP buffer;					/* path of the entry being looked at */
+};
+
+struct ClbtTopTask
+{
+	int count;					/* records wanted */
+	int by;						/* CLBT_TOP_XXX */
+	struct ClbtTopWorker* workers;	/* per thread */
+	unsigned long files;		/* atomic */
+};
+
+static void clbt_top_oom(void)
+{
+	clbt_error("Unable to allocate memory for top files!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+/*
+ * Order of records, negative if a is worse than b.
+ */
+static int clbt_top_order(int64_t akey, const char* apath, int64_t bkey, const char* bpath)
+{
+	if (akey != bkey)
+		return akey < bkey ? -1 : 1;
+	return strcmp(bpath, apath);
+}
+
+static void clbt_top_heap_down(struct ClbtTopWorker* w, int i)
+{
+	struct ClbtTopRecord t;
+	int c;
+
+	while ((c = 2 * i + 1) < w->size)
+	{
+		if (c + 1 < w->size && clbt_top_order(w->items[c + 1].key, w->items[c + 1].path, w->items[c].key, w->items[c].path) < 0)
+			c++;
+		if (clbt_top_order(w->items[i].key, w->items[i].path, w->items[c].key, w->items[c].path) <= 0)
+			break;
+		t = w->items[i];
+		w->items[i] = w->items[c];
+		w->items[c] = t;
+		i = c;
+	}
+}
+
+static char* clbt_top_copy(const char* path, int len)
+{
+	char* copy = (char*)malloc(len + 1);
+
+	if (copy == NULL)
+		clbt_top_oom();
+	memcpy(copy, path, len + 1);
+	return copy;
+}
+
+static int clbt_top_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtTopTask* task = (struct ClbtTopTask*)walker->user;
+	struct ClbtTopWorker* w = &task->workers[tid];
+	struct ClbtTopRecord t;
+	int64_t key;
+	int i, len;
+
+	if (entry->type != CLBT_TYPE_FILE || !clbt_match_entry(entry))
+		return CLBT_WALK_CONTINUE;
+
+	if (clbt_entry_stat(entry) != CLBT_OK)
+	{
+		if (entry->dir)
+			clbt_error("Cannot stat '%s/%s': %s", entry->dir->path, entry->name, strerror(errno));
+		else
+			clbt_error("Cannot stat '%s': %s", entry->name, strerror(errno));
+		clbt_walk_failed(walker);
+		return CLBT_WALK_CONTINUE;
+	}
+	clbt_atomic_add(&task->files, 1);
+
+	if (task->by == CLBT_TOP_MTIME)
+		key = (int64_t)entry->st.st_mtim.tv_sec * 1000000000 + entry->st.st_mtim.tv_nsec;
+	else
+		key = (int64_t)entry->st.st_size;
+
+	/* full heap, only a better file replaces the worst kept */
+	if (w->size == task->count && key < w->items[0].key)
+		return CLBT_WALK_CONTINUE;
+
+	len = clbt_entry_path(entry, &w->buffer);
+	if (w->size == task->count)
+	{
+		if (clbt_top_order(key, w->buffer.path, w->items[0].key, w->items[0].path) <= 0)
+			return CLBT_WALK_CONTINUE;
+		free(w->items[0].path);
+		w->items[0].key = key;
+		w->items[0].path = clbt_top_copy(w->buffer.path, len);
+		clbt_top_heap_down(w, 0);
+		return CLBT_WALK_CONTINUE;
+	}
+
+	i = w->size++;
+	w->items[i].key = key;
+	w->items[i].path = clbt_top_copy(w->buffer.path, len);
+	while (i > 0 && clbt_top_order(w->items[i].key, w->items[i].path, w->items[(i - 1) / 2].key, w->items[(i - 1) / 2].path) < 0)
+	{
+		t = w->items[i];
+		w->items[i] = w->items[(i - 1) / 2];
+		w->items[(i - 1) / 2] = t;
+		i = (i - 1) / 2;
+	}
+	return CLBT_WALK_CONTINUE;
+}
+
+static const struct ClbtWalkOps clbtTopOps = { clbt_top_on_entry, NULL, NULL, NULL };
+
+static int clbt_top_compare(const void* a, const void* b)
+{
+	const struct ClbtTopRecord* x = (const struct ClbtTopRecord*)a;
+	const struct ClbtTopRecord* y = (const struct ClbtTopRecord*)b;
+
+	return clbt_top_order(y->key, y->path, x->key, x->path);
+}
+
+/*
+ * Print the largest or newest --top files below targets, best first.
+ */
+int clbt_task_top(int options)
+{
+	struct ClbtWalker walker;
+	struct ClbtTopTask task;
+	struct ClbtRecord r;
+	struct ClbtTopRecord* all;
+	int i, j, n, ret, threads;
+
+	memset(&task, 0, sizeof(task));
+	task.count = clbtConfig.top;
+	task.by = clbtConfig.topBy;
+	if (task.count < 1)
+		return CLBT_OK;
+
+	ret = clbt_walk_begin(&walker, &clbtTopOps, &task, (options & CLBT_OPT_RECURSIVE) ? CLBT_WALK_RECURSE : 0);
+	if (ret != CLBT_OK)
+		return ret;
+
+	threads = clbt_walk_threads(&walker);
+	task.workers = (struct ClbtTopWorker*)calloc(threads, sizeof(struct ClbtTopWorker));
+	if (task.workers == NULL)
+		clbt_top_oom();
+	for (i = 0; i < threads; i++)
+	{
+		task.workers[i].items = (struct ClbtTopRecord*)malloc(task.count * sizeof(struct ClbtTopRecord));
+		if (task.workers[i].items == NULL)
+			clbt_top_oom();
+		clbt_path_init(&task.workers[i].buffer);
+	}
+
+	for (i = 0; i < clbtConfig.targets.size; i++)
+		clbt_walk_root(&walker, clbtConfig.targets.paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	/* merge what every thread kept, then sort once */
+	for (i = 0, n = 0; i < threads; i++)
+		n += task.workers[i].size;
+	all = (struct ClbtTopRecord*)malloc((n > 0 ? n : 1) * sizeof(struct ClbtTopRecord));
+	if (all == NULL)
+		clbt_top_oom();
+	for (i = 0, n = 0; i < threads; i++)
+	{
+		for (j = 0; j < task.workers[i].size; j++)
+			all[n++] = task.workers[i].items[j];
+		free(task.workers[i].items);
+		clbt_path_destroy(&task.workers[i].buffer);
+	}
+	qsort(all, n, sizeof(struct ClbtTopRecord), clbt_top_compare);
+
+	for (i = 0; i < n; i++)
+	{
+		if (i < task.count)
+		{
+			clbt_record_begin(&r);
+			if (task.by == CLBT_TOP_MTIME)
+				clbt_record_number(&r, "mtime", (unsigned long long)(all[i].key / 1000000000));
+			else
+				clbt_record_number(&r, "size", (unsigned long long)all[i].key);
+			clbt_record_string(&r, "path", all[i].path, strlen(all[i].path));
+			clbt_record_end(&r, -1);
+		}
+		free(all[i].path);
+	}
+	free(all);
+
+	clbt_verbose(options, "Ranked %lu file(s).", task.files);
+	free(task.workers);
+	return ret;
+}
+
+#else
+
+int clbt_task_top(int options)
+{
+	(void)options;
+	return clbt_unsupported("top");
+}
+
+#endif
@@ -0,0 +1,478 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_trigram.c
+ *
+ *   Description:
+ *
+ *   Trigram index narrowing name queries on the filename index for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define CLBT_TRIGRAM_MAGIC		"CLBG"
+#define CLBT_TRIGRAM_VERSION	1
+#define CLBT_TRIGRAM_HEADER		40			/* fixed header bytes */
+#define CLBT_TRIGRAM_SLOT		16			/* bytes per trigram in the table */
+#define CLBT_TRIGRAM_KEYS		(1 << 24)	/* every possible trigram */
+#define CLBT_TRIGRAM_BUFFER		(1 << 20)	/* posting bytes written at once */
+#define CLBT_TRIGRAM_QUERY		64			/* most trigrams looked up per pattern */
+
+/*
+ * For every 3 byte sequence in the name of an entry, the trigram file keeps
+ * the sorted list of entry numbers in the snapshot of the filename index
+ * whose names contain it. A '*' or '?' pattern can only match names that
+ * contain every trigram of its literal parts, so intersecting those lists
+ * gives the few entries the exact matcher has to look at.
+ *
+ *   header   "CLBG", version u32, snapshot entries u64, snapshot size u64,
+ *            table offset u64, trigrams u32, 0 u32
+ *   lists    first entry number, then deltas, as varints
+ *   table    trigram u32, entries u32 and list offset u64, by trigram
+ */
+
+static uint32_t clbt_trigram_key(const char* s)
+{
+	return ((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) | (unsigned char)s[2];
+}
+
+/*
+ * Collect the distinct trigrams of name into keys, sorted.
+ */
+static int clbt_trigram_keys(const char* name, int len, uint32_t* keys)
+{
+	uint32_t key;
+	int i, j, n = 0;
+
+	for (i = 0; i + 3 <= len; i++)
+	{
+		key = clbt_trigram_key(name + i);
+		/* insertion keeps the short list sorted and unique */
+		for (j = n; j > 0 && keys[j - 1] > key; j--);
+		if (j > 0 && keys[j - 1] == key)
+			continue;
+		memmove(keys + j + 1, keys + j, (n - j) * sizeof(uint32_t));
+		keys[j] = key;
+		n++;
+	}
+	return n;
+}
+
+static const char* clbt_trigram_name(const struct ClbtSnapEntry* e, int* len)
+{
+	const char* name = strrchr(e->path, '/');
+
+	name = name != NULL ? name + 1 : e->path;
+	*len = e->length - (int)(name - e->path);
+	return name;
+}
+
+static void clbt_trigram_oom(void)
+{
+	clbt_error("Unable to allocate memory for trigram index!");
+	exit(CLBT_MEMORY_ERR);
+}
+
+/*
+ * Write the trigram file of a snapshot. Two passes over the snapshot count
+ * and then place every entry number, so the lists come out sorted with no
+ * per trigram allocation.
+ */
+int clbt_trigram_build(const char* snapFile, const char* file, int options)
+{
+	struct ClbtSnap snap;
+	struct ClbtSnapCursor cur;
+	uint32_t* ends;
+	uint32_t* lists;
+	uint32_t* keys = NULL;
+	unsigned char* buf;
+	unsigned char* table;
+	unsigned char header[CLBT_TRIGRAM_HEADER];
+	uint64_t total = 0, offset, prev;
+	uint32_t t, start, used = 0, count = 0;
+	size_t n = 0;
+	int i, k, len, capacity = 0, pass, fd, ret;
+	const char* name;
+
+	if ((ret = clbt_snap_open(&snap, snapFile)) != CLBT_OK)
+		return ret;
+	ends = (uint32_t*)calloc(CLBT_TRIGRAM_KEYS, sizeof(uint32_t));
+	if (ends == NULL)
+		clbt_trigram_oom();
+	lists = NULL;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		clbt_snap_cursor_init(&cur, &snap, 0);
+		while (clbt_snap_next(&cur))
+		{
+			name = clbt_trigram_name(&cur.entry, &len);
+			if (len > capacity)
+			{
+				capacity = len * 2;
+				keys = (uint32_t*)realloc(keys, capacity * sizeof(uint32_t));
+				if (keys == NULL)
+					clbt_trigram_oom();
+			}
+			k = clbt_trigram_keys(name, len, keys);
+			if (pass == 0)
+				total += k;
+			for (i = 0; i < k; i++)
+			{
+				if (pass == 0)
+					ends[keys[i]]++;
+				else
+					lists[ends[keys[i]]++] = (uint32_t)cur.entry.ordinal;
+			}
+		}
+		ret = cur.failed ? CLBT_INVALID_OP : CLBT_OK;
+		clbt_snap_cursor_destroy(&cur);
+		if (ret != CLBT_OK || pass == 1)
+			break;
+
+		if (total >= 0xffffffffu || snap.entries >= 0xffffffffu)
+		{
+			clbt_error("Too many names for a trigram index.");
+			ret = CLBT_INVALID_OP;
+			break;
+		}
+		/* counts become start positions, which pass two moves to the ends */
+		for (t = 0, start = 0; t < CLBT_TRIGRAM_KEYS; t++)
+		{
+			count += ends[t] > 0;
+			used = ends[t];
+			ends[t] = start;
+			start += used;
+		}
+		lists = (uint32_t*)malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+		if (lists == NULL)
+			clbt_trigram_oom();
+	}
+	free(keys);
+	if (ret != CLBT_OK)
+	{
+		clbt_error("Snapshot '%s' is corrupt.", snapFile);
+		free(ends);
+		free(lists);
+		clbt_snap_close(&snap);
+		return ret;
+	}
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	buf = (unsigned char*)malloc(CLBT_TRIGRAM_BUFFER);
+	table = (unsigned char*)malloc((size_t)count * CLBT_TRIGRAM_SLOT + 1);
+	if (buf == NULL || table == NULL)
+		clbt_trigram_oom();
+	if (fd < 0)
+	{
+		clbt_error("Cannot create '%s': %s", file, strerror(errno));
+		ret = CLBT_FAILURE_IO;
+	}
+
+	memset(header, 0, sizeof(header));
+	offset = CLBT_TRIGRAM_HEADER;
+	if (ret == CLBT_OK && clbt_write_full(fd, header, sizeof(header)) != CLBT_OK)
+		ret = CLBT_FAILURE_IO;
+	for (t = 0, start = 0; t < CLBT_TRIGRAM_KEYS && ret == CLBT_OK; start = ends[t++])
+	{
+		if (ends[t] == start)
+			continue;
+		clbt_put32(table + n * CLBT_TRIGRAM_SLOT, t);
+		clbt_put32(table + n * CLBT_TRIGRAM_SLOT + 4, ends[t] - start);
+		clbt_put64(table + n * CLBT_TRIGRAM_SLOT + 8, offset);
+		n++;
+		for (prev = 0, used = 0; start < ends[t]; start++)
+		{
+			used += (uint32_t)clbt_varint_put(buf + used, lists[start] - prev);
+			prev = lists[start];
+			if (used > CLBT_TRIGRAM_BUFFER - 10 || start + 1 == ends[t])
+			{
+				if (clbt_write_full(fd, buf, used) != CLBT_OK)
+					ret = CLBT_FAILURE_IO;
+				offset += used;
+				used = 0;
+			}
+		}
+	}
+
+	if (ret == CLBT_OK)
+	{
+		memcpy(header, CLBT_TRIGRAM_MAGIC, 4);
+		clbt_put32(header + 4, CLBT_TRIGRAM_VERSION);
+		clbt_put64(header + 8, snap.entries);
+		clbt_put64(header + 16, snap.size);
+		clbt_put64(header + 24, offset);
+		clbt_put32(header + 32, count);
+		if (clbt_write_full(fd, table, n * CLBT_TRIGRAM_SLOT) != CLBT_OK
+			|| pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+			ret = CLBT_FAILURE_IO;
+	}
+	if (fd >= 0)
+	{
+		if (close(fd) != 0)
+			ret = CLBT_FAILURE_IO;
+		if (ret != CLBT_OK)
+		{
+			clbt_error("Cannot write '%s': %s", file, strerror(errno));
+			unlink(file);
+		}
+	}
+	if (ret == CLBT_OK)
+		clbt_verbose(options, "Wrote %u trigrams of %llu names.", count, (unsigned long long)snap.entries);
+
+	free(table);
+	free(buf);
+	free(lists);
+	free(ends);
+	clbt_snap_close(&snap);
+	return ret;
+}
+
+/*
+ * Map the trigram file belonging to snap, CLBT_FAILURE_IO without a message
+ * if there is none.
+ */
+int clbt_trigram_open(struct ClbtTrigrams* tri, const char* file, const struct ClbtSnap* snap)
+{
+	const unsigned char* base;
+	struct stat st;
+	uint64_t table;
+	int fd;
+
+	memset(tri, 0, sizeof(struct ClbtTrigrams));
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return CLBT_FAILURE_IO;
+	if (fstat(fd, &st) != 0 || st.st_size < CLBT_TRIGRAM_HEADER)
+	{
+		close(fd);
+		clbt_warning("'%s' is not a trigram index, scanning every name.", file);
+		return CLBT_INVALID_OP;
+	}
+	base = (const unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == (const unsigned char*)MAP_FAILED)
+		return CLBT_FAILURE_IO;
+
+	tri->base = base;
+	tri->size = (size_t)st.st_size;
+	table = clbt_get64(base + 24);
+	tri->count = clbt_get32(base + 32);
+	if (memcmp(base, CLBT_TRIGRAM_MAGIC, 4) != 0 || clbt_get32(base + 4) != CLBT_TRIGRAM_VERSION
+		|| table < CLBT_TRIGRAM_HEADER || table > tri->size || (tri->size - table) / CLBT_TRIGRAM_SLOT < tri->count)
+	{
+		clbt_warning("'%s' is not a trigram index, scanning every name.", file);
+		clbt_trigram_close(tri);
+		return CLBT_INVALID_OP;
+	}
+	if (clbt_get64(base + 8) != snap->entries || clbt_get64(base + 16) != snap->size)
+	{
+		clbt_warning("'%s' does not belong to the index, scanning every name.", file);
+		clbt_trigram_close(tri);
+		return CLBT_INVALID_OP;
+	}
+	tri->table = base + table;
+	return CLBT_OK;
+}
+
+void clbt_trigram_close(struct ClbtTrigrams* tri)
+{
+	if (tri->base != NULL)
+		munmap((void*)tri->base, tri->size);
+	tri->base = NULL;
+}
+
+/*
+ * Find the list of a trigram, 0 if no name has it.
+ */
+static int clbt_trigram_list(const struct ClbtTrigrams* tri, uint32_t key, const unsigned char** p, const unsigned char** end, uint32_t* count)
+{
+	uint32_t lo = 0, hi = tri->count, mid, k;
+	const unsigned char* slot;
+	uint64_t from, to;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		k = clbt_get32(tri->table + (size_t)mid * CLBT_TRIGRAM_SLOT);
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	slot = tri->table + (size_t)lo * CLBT_TRIGRAM_SLOT;
+	if (lo == tri->count || clbt_get32(slot) != key)
+		return 0;
+
+	from = clbt_get64(slot + 8);
+	to = lo + 1 < tri->count ? clbt_get64(slot + CLBT_TRIGRAM_SLOT + 8) : (uint64_t)(tri->table - tri->base);
+	if (from > to || to > (uint64_t)(tri->table - tri->base))
+		return 0;
+	*p = tri->base + from;
+	*end = tri->base + to;
+	*count = clbt_get32(slot + 4);
+	return 1;
+}
+
+/*
+ * Keep the entries in set[0, n) that are also in the list at p, in place.
+ */
+static size_t clbt_trigram_intersect(uint32_t* set, size_t n, const unsigned char* p, const unsigned char* end)
+{
+	uint64_t v, id = 0;
+	size_t i = 0, kept = 0;
+	int first = 1;
+
+	while (i < n && clbt_varint_get(&p, end, &v))
+	{
+		id = first ? v : id + v;
+		first = 0;
+		while (i < n && set[i] < id)
+			i++;
+		if (i < n && set[i] == id)
+			set[kept++] = set[i++];
+	}
+	return kept;
+}
+
+/*
+ * Entries that may match one pattern. *set is NULL if the pattern has no
+ * literal part of 3 bytes, then it can match anything.
+ */
+static size_t clbt_trigram_pattern(const struct ClbtTrigrams* tri, const char* pattern, uint32_t** set)
+{
+	const unsigned char* p[CLBT_TRIGRAM_QUERY];
+	const unsigned char* end[CLBT_TRIGRAM_QUERY];
+	uint32_t want[CLBT_TRIGRAM_QUERY];
+	uint32_t counts[CLBT_TRIGRAM_QUERY];
+	uint32_t key, tmp;
+	const unsigned char* swap;
+	uint64_t v, id = 0;
+	size_t n = 0;
+	int i, j, len, lists = 0;
+
+	*set = NULL;
+	while (*pattern)
+	{
+		/* trigrams of every literal run between wildcards */
+		len = (int)strcspn(pattern, "*?");
+		for (i = 0; i + 3 <= len && lists < CLBT_TRIGRAM_QUERY; i++)
+		{
+			key = clbt_trigram_key(pattern + i);
+			for (j = 0; j < lists && want[j] != key; j++);
+			if (j == lists)
+				want[lists++] = key;
+		}
+		pattern += len;
+		while (*pattern == '*' || *pattern == '?')
+			pattern++;
+	}
+	if (lists == 0)
+		return 0;
+
+	/* a missing trigram means no match, otherwise start from the shortest list */
+	for (i = 0; i < lists; i++)
+	{
+		if (!clbt_trigram_list(tri, want[i], &p[i], &end[i], &counts[i]))
+		{
+			*set = (uint32_t*)malloc(sizeof(uint32_t));
+			if (*set == NULL)
+				clbt_trigram_oom();
+			return 0;
+		}
+		for (j = i; j > 0 && counts[j - 1] > counts[j]; j--)
+		{
+			tmp = counts[j]; counts[j] = counts[j - 1]; counts[j - 1] = tmp;
+			swap = p[j]; p[j] = p[j - 1]; p[j - 1] = swap;
+			swap = end[j]; end[j] = end[j - 1]; end[j - 1] = swap;
+		}
+	}
+
+	*set = (uint32_t*)malloc((counts[0] + 1) * sizeof(uint32_t));
+	if (*set == NULL)
+		clbt_trigram_oom();
+	while (n < counts[0] && clbt_varint_get(&p[0], end[0], &v))
+	{
+		id = n == 0 ? v : id + v;
+		(*set)[n++] = (uint32_t)id;
+	}
+	for (i = 1; i < lists && n > 0; i++)
+		n = clbt_trigram_intersect(*set, n, p[i], end[i]);
+	return n;
+}
+
+/*
+ * Entry numbers that may match any input pattern, sorted. 0 and *set NULL if
+ * some pattern cannot be narrowed, so every name has to be checked.
+ */
+size_t clbt_trigram_candidates(const struct ClbtTrigrams* tri, uint32_t** set)
+{
+	uint32_t* all = NULL;
+	uint32_t* one;
+	uint32_t* merged;
+	size_t n = 0, m, i, j, k;
+	int pattern;
+
+	*set = NULL;
+	if (clbtConfig.patterns.size < 1)
+		return 0;
+
+	for (pattern = 0; pattern < clbtConfig.patterns.size; pattern++)
+	{
+		m = clbt_trigram_pattern(tri, clbtConfig.patterns.paths[pattern]->path, &one);
+		if (one == NULL)
+		{
+			free(all);
+			return 0;
+		}
+		if (all == NULL)
+		{
+			all = one;
+			n = m;
+			continue;
+		}
+
+		/* patterns are alternatives, so their sets are merged */
+		merged = (uint32_t*)malloc((n + m + 1) * sizeof(uint32_t));
+		if (merged == NULL)
+			clbt_trigram_oom();
+		for (i = 0, j = 0, k = 0; i < n || j < m;)
+		{
+			if (j == m || (i < n && all[i] < one[j]))
+				merged[k++] = all[i++];
+			else if (i == n || one[j] < all[i])
+				merged[k++] = one[j++];
+			else
+			{
+				merged[k++] = all[i++];
+				j++;
+			}
+		}
+		free(all);
+		free(one);
+		all = merged;
+		n = k;
+	}
+
+	*set = all;
+	return n;
+}
+
+#endif
@@ -0,0 +1,811 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_walk.c
+ *
+ *   Description:
+ *
+ *   Thread pool and parallel directory walker for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* O_NOATIME, copy_file_range() */
+#endif
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+
+struct ClbtJob
+{
+	ClbtJobFn fn;
+	void* arg;
+	struct ClbtJob* next;
+};
+
+struct ClbtPool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;		/* job available or stopping */
+	pthread_cond_t idle;		/* no outstanding jobs */
+	struct ClbtJob* jobs;		/* LIFO, keeps the walk frontier small */
+	struct ClbtJob* spare;		/* recycled job nodes */
+	int outstanding;			/* queued + running jobs */
+	int stop;
+	int threads;
+	pthread_t* workers;
+};
+
+struct ClbtWorkerArg
+{
+	struct ClbtPool* pool;
+	int tid;
+};
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void* clbt_pool_worker(void* p)
+{
+	struct ClbtWorkerArg* warg = (struct ClbtWorkerArg*)p;
+	struct ClbtPool* pool = warg->pool;
+	int tid = warg->tid;
+	struct ClbtJob* job;
+	ClbtJobFn fn;
+	void* arg;
+
+	free(warg);
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (pool->jobs == NULL && !pool->stop)
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		if (pool->jobs == NULL)
+			break;
+
+		job = pool->jobs;
+		pool->jobs = job->next;
+		fn = job->fn;
+		arg = job->arg;
+		job->next = pool->spare;
+		pool->spare = job;
+		pthread_mutex_unlock(&pool->lock);
+
+		fn(arg, tid);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->outstanding == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Number of worker threads to use when not configured.
+ */
+int clbt_default_jobs(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+/*
+ * Create a pool with the specified number of threads, <= 0 means default.
+ */
+struct ClbtPool* clbt_pool_create(int threads)
+{
+	struct ClbtPool* pool;
+	struct ClbtWorkerArg* warg;
+	int i;
+
+	if (threads <= 0)
+		threads = clbt_default_jobs();
+
+	pool = (struct ClbtPool*)calloc(1, sizeof(struct ClbtPool));
+	if (pool == NULL || (pool->workers = (pthread_t*)malloc(sizeof(pthread_t) * threads)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for thread pool!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->threads = threads;
+
+	for (i = 0; i < threads; i++)
+	{
+		warg = (struct ClbtWorkerArg*)malloc(sizeof(struct ClbtWorkerArg));
+		if (warg == NULL)
+		{
+			clbt_error("Unable to allocate memory for thread pool!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		warg->pool = pool;
+		warg->tid = i;
+		if (pthread_create(&pool->workers[i], NULL, clbt_pool_worker, warg) != 0)
+		{
+			clbt_error("Unable to create worker thread: %s", strerror(errno));
+			exit(CLBT_FAILURE_OS);
+		}
+	}
+
+	return pool;
+}
+
+/*
+ * Queue a job, safe to call from inside a running job.
+ */
+void clbt_pool_submit(struct ClbtPool* pool, ClbtJobFn fn, void* arg)
+{
+	struct ClbtJob* job;
+
+	pthread_mutex_lock(&pool->lock);
+	job = pool->spare;
+	if (job != NULL)
+	{
+		pool->spare = job->next;
+	}
+	else if ((job = (struct ClbtJob*)malloc(sizeof(struct ClbtJob))) == NULL)
+	{
+		clbt_error("Unable to allocate memory for job!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	job->fn = fn;
+	job->arg = arg;
+	job->next = pool->jobs;
+	pool->jobs = job;
+	pool->outstanding++;
+	pthread_cond_signal(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait until all jobs, including jobs submitted by jobs, are finished.
+ */
+void clbt_pool_wait(struct ClbtPool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->outstanding > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Stop workers and release the pool.
+ */
+void clbt_pool_destroy(struct ClbtPool* pool)
+{
+	struct ClbtJob* job;
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->workers[i], NULL);
+
+	while ((job = pool->spare) != NULL)
+	{
+		pool->spare = job->next;
+		free(job);
+	}
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->ready);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+int clbt_pool_threads(const struct ClbtPool* pool)
+{
+	return pool->threads;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static int clbt_dirent_type(unsigned char type)
+{
+	switch (type)
+	{
+#ifdef DT_REG
+	case DT_REG: return CLBT_TYPE_FILE;
+	case DT_DIR: return CLBT_TYPE_DIR;
+	case DT_LNK: return CLBT_TYPE_LINK;
+	case DT_UNKNOWN: return CLBT_TYPE_UNKNOWN;
+#endif
+	default: return CLBT_TYPE_OTHER;
+	}
+}
+
+int clbt_mode_type(mode_t mode)
+{
+	if (S_ISREG(mode)) return CLBT_TYPE_FILE;
+	if (S_ISDIR(mode)) return CLBT_TYPE_DIR;
+	if (S_ISLNK(mode)) return CLBT_TYPE_LINK;
+	return CLBT_TYPE_OTHER;
+}
+
+/*
+ * Fill entry->st if not yet, symbolic links are not followed.
+ */
+int clbt_entry_stat(struct ClbtEntry* entry)
+{
+	if (entry->hasStat)
+		return CLBT_OK;
+
+	if (fstatat(entry->dirfd, entry->name, &entry->st, AT_SYMLINK_NOFOLLOW) != 0)
+		return CLBT_FAILURE_IO;
+
+	entry->hasStat = 1;
+	entry->type = clbt_mode_type(entry->st.st_mode);
+	return CLBT_OK;
+}
+
+/*
+ * Build the full path of entry into out.
+ */
+int clbt_entry_path(const struct ClbtEntry* entry, CP* out)
+{
+	int len;
+
+	if (entry->dir == NULL)
+	{
+		clbt_path_set(out, entry->name, entry->namelen);
+		return entry->namelen;
+	}
+
+	len = entry->dir->length + entry->namelen + 2;
+	if (out->length < len)
+		clbt_path_resize(out, len * 2);
+
+	len = entry->dir->length;
+	memcpy(out->path, entry->dir->path, len);
+	if (len < 1 || out->path[len - 1] != '/')
+		out->path[len++] = '/';
+	memcpy(out->path + len, entry->name, entry->namelen + 1);
+	return len + entry->namelen;
+}
+
+/*
+ * Hand entry to fn once its directory is enumerated, a root that is not a
+ * directory right away.
+ */
+void clbt_defer_file(struct ClbtWalker* walker, struct ClbtEntry* entry, struct ClbtDeferred* deferred, ClbtFileFn fn, int tid)
+{
+	char* buf;
+
+	if (entry->dir == NULL)
+	{
+		fn(walker, entry->dirfd, NULL, entry->name, tid);
+		return;
+	}
+
+	if (deferred->used + entry->namelen + 1 > deferred->capacity)
+	{
+		deferred->capacity = (deferred->used + entry->namelen + 1) * 2;
+		buf = (char*)realloc(deferred->names, deferred->capacity);
+		if (buf == NULL)
+		{
+			clbt_error("Unable to reallocate memory for deferred files!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		deferred->names = buf;
+	}
+	memcpy(deferred->names + deferred->used, entry->name, entry->namelen + 1);
+	deferred->used += entry->namelen + 1;
+}
+
+/*
+ * Call fn on every file deferred while dir was enumerated, from on_dir_end.
+ */
+void clbt_defer_run(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, struct ClbtDeferred* deferred, ClbtFileFn fn, int tid)
+{
+	const char* name = deferred->names;
+
+	for (; name < deferred->names + deferred->used; name += strlen(name) + 1)
+		fn(walker, dirfd, dir->path, name, tid);
+	deferred->used = 0;
+}
+
+static struct ClbtDir* clbt_dir_new(struct ClbtWalker* walker, struct ClbtDir* parent, const char* name, int namelen)
+{
+	struct ClbtDir* dir = (struct ClbtDir*)malloc(sizeof(struct ClbtDir));
+	int len;
+
+	if (dir == NULL)
+	{
+		clbt_error("Unable to allocate memory for directory!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	len = parent == NULL ? namelen : parent->length + namelen + 1;
+	dir->path = (char*)malloc(len + 1);
+	if (dir->path == NULL)
+	{
+		clbt_error("Unable to allocate memory for directory!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	if (parent == NULL)
+	{
+		memcpy(dir->path, name, namelen + 1);
+		dir->name = 0;
+	}
+	else
+	{
+		len = parent->length;
+		memcpy(dir->path, parent->path, len);
+		if (len < 1 || dir->path[len - 1] != '/')
+			dir->path[len++] = '/';
+		memcpy(dir->path + len, name, namelen + 1);
+		dir->name = len;
+		len += namelen;
+	}
+
+	dir->parent = parent;
+	dir->walker = walker;
+	dir->length = len;
+	dir->depth = parent == NULL ? 0 : parent->depth + 1;
+	dir->pending = 1;
+	dir->fd = -1;
+	dir->data = NULL;
+	return dir;
+}
+
+/*
+ * Hold the directory open for work scheduled outside of its enumeration.
+ */
+void clbt_dir_retain(struct ClbtDir* dir)
+{
+	clbt_atomic_add(&dir->pending, 1);
+}
+
+/*
+ * Drop one reference, finished directories are reported bottom-up to the root.
+ */
+void clbt_dir_release(struct ClbtDir* dir, int tid)
+{
+	struct ClbtDir* parent;
+	struct ClbtWalker* walker;
+
+	while (dir != NULL && clbt_atomic_sub(&dir->pending, 1) == 0)
+	{
+		walker = dir->walker;
+		if (walker->ops->on_dir_post)
+			walker->ops->on_dir_post(walker, dir, tid);
+
+		if (dir->fd >= 0)
+			close(dir->fd);
+		parent = dir->parent;
+		free(dir->path);
+		free(dir);
+		dir = parent;
+	}
+}
+
+void clbt_walk_failed(struct ClbtWalker* walker)
+{
+	clbt_atomic_add(&walker->errors, 1);
+}
+
+int clbt_walk_threads(const struct ClbtWalker* walker)
+{
+	return clbt_pool_threads(walker->pool);
+}
+
+/*
+ * Sub directories are opened relative to their parent's fd, a component
+ * swapped for a symbolic link during the walk is never followed.
+ */
+static int clbt_open_dir(struct ClbtWalker* walker, const struct ClbtDir* dir)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	int base = dir->parent != NULL ? dir->parent->fd : AT_FDCWD;
+	int fd;
+
+	/* roots may be symbolic links given by the user, never follow below them */
+	if (dir->parent != NULL || (walker->flags & CLBT_WALK_NOFOLLOW))
+		flags |= O_NOFOLLOW;
+
+	if (walker->flags & CLBT_WALK_NOATIME)
+	{
+		fd = openat(base, dir->path + dir->name, flags | O_NOATIME);
+		if (fd >= 0 || errno != EPERM)
+			return fd;
+	}
+	return openat(base, dir->path + dir->name, flags);
+}
+
+static void clbt_walk_dir(void* arg, int tid)
+{
+	struct ClbtDir* dir = (struct ClbtDir*)arg;
+	struct ClbtWalker* walker = dir->walker;
+	struct ClbtEntry entry;
+	struct ClbtDir* child;
+	struct dirent* de;
+	DIR* dp;
+	int fd, ret;
+
+	fd = clbt_open_dir(walker, dir);
+	if (fd < 0 && errno == ENOENT && (walker->flags & CLBT_WALK_VANISHED))
+	{
+		clbt_dir_release(dir, tid);
+		return;
+	}
+	if (fd < 0 || (dp = fdopendir(fd)) == NULL)
+	{
+		clbt_error("Cannot open directory '%s': %s", dir->path, strerror(errno));
+		clbt_walk_failed(walker);
+		if (fd >= 0)
+			close(fd);
+		clbt_dir_release(dir, tid);
+		return;
+	}
+
+	if (walker->ops->on_dir_begin)
+		walker->ops->on_dir_begin(walker, dir, fd, tid);
+
+	while (1)
+	{
+		errno = 0;
+		if ((de = readdir(dp)) == NULL)
+		{
+			if (errno != 0)
+			{
+				clbt_error("Cannot read directory '%s': %s", dir->path, strerror(errno));
+				clbt_walk_failed(walker);
+			}
+			break;
+		}
+
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+
+		entry.dir = dir;
+		entry.dirfd = fd;
+		entry.name = de->d_name;
+		entry.namelen = strlen(de->d_name);
+		entry.type = clbt_dirent_type(de->d_type);
+		entry.hasStat = 0;
+		if (entry.type == CLBT_TYPE_UNKNOWN && clbt_entry_stat(&entry) != CLBT_OK)
+		{
+			if (errno == ENOENT && (walker->flags & CLBT_WALK_VANISHED))
+				continue;
+			clbt_error("Cannot stat '%s/%s': %s", dir->path, entry.name, strerror(errno));
+			clbt_walk_failed(walker);
+			continue;
+		}
+
+		ret = walker->ops->on_entry(walker, &entry, tid);
+		if (entry.type == CLBT_TYPE_DIR && ret == CLBT_WALK_CONTINUE && (walker->flags & CLBT_WALK_RECURSE))
+		{
+			/* children open themselves relative to this fd, held until dir is released */
+			if (dir->fd < 0 && (dir->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+			{
+				clbt_error("Cannot open directory '%s/%s': %s", dir->path, entry.name, strerror(errno));
+				clbt_walk_failed(walker);
+				continue;
+			}
+			child = clbt_dir_new(walker, dir, entry.name, entry.namelen);
+			clbt_dir_retain(dir);
+			clbt_pool_submit(walker->pool, clbt_walk_dir, child);
+		}
+	}
+
+	if (walker->ops->on_dir_end)
+		walker->ops->on_dir_end(walker, dir, fd, tid);
+
+	closedir(dp);
+	clbt_dir_release(dir, tid);
+}
+
+struct ClbtWalkRoot
+{
+	struct ClbtWalker* walker;
+	char* path;
+};
+
+static void clbt_walk_root_job(void* arg, int tid)
+{
+	struct ClbtWalkRoot* root = (struct ClbtWalkRoot*)arg;
+	struct ClbtWalker* walker = root->walker;
+	struct ClbtEntry entry;
+
+	entry.dir = NULL;
+	entry.dirfd = AT_FDCWD;
+	entry.name = root->path;
+	entry.namelen = strlen(root->path);
+	/* with NOFOLLOW a symlink root is handed over as an entry, never descended */
+	if (((walker->flags & CLBT_WALK_NOFOLLOW) ? lstat(root->path, &entry.st) : stat(root->path, &entry.st)) != 0)
+	{
+		if (errno != ENOENT || !(walker->flags & CLBT_WALK_VANISHED))
+		{
+			clbt_error("Cannot access '%s': %s", root->path, strerror(errno));
+			clbt_walk_failed(walker);
+		}
+	}
+	else if (S_ISDIR(entry.st.st_mode))
+	{
+		clbt_walk_dir(clbt_dir_new(walker, NULL, root->path, entry.namelen), tid);
+	}
+	else
+	{
+		entry.hasStat = 1;
+		entry.type = clbt_mode_type(entry.st.st_mode);
+		walker->ops->on_entry(walker, &entry, tid);
+	}
+
+	free(root->path);
+	free(root);
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Open a file for reading without touching its atime, hint sequential access if asked.
+ */
+int clbt_open_read(const char* path, int sequential)
+{
+	return clbt_open_read_at(AT_FDCWD, path, sequential);
+}
+
+/*
+ * Same as clbt_open_read, name is relative to dirfd.
+ */
+int clbt_open_read_at(int dirfd, const char* name, int sequential)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOATIME);
+
+	if (fd < 0 && errno == EPERM)
+		fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (fd >= 0 && sequential)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+	(void)sequential;
+#endif
+	return fd;
+}
+
+/*
+ * Read until len bytes or end of file, offset < 0 reads at the current position.
+ * Returns bytes read or -1 on error.
+ */
+ssize_t clbt_read_full(int fd, void* buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len)
+	{
+		if (offset < 0)
+			n = read(fd, (char*)buf + done, len - done);
+		else
+			n = pread(fd, (char*)buf + done, len - done, offset + done);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return (ssize_t)done;
+}
+
+/*
+ * Write all of buf, retrying short writes.
+ */
+int clbt_write_full(int fd, const void* buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len)
+	{
+		n = write(fd, (const char*)buf + done, len - done);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return CLBT_FAILURE_IO;
+		}
+		done += n;
+	}
+	return CLBT_OK;
+}
+
+/*
+ * Copy the first len bytes of in to the current position of out, buf is only
+ * used when the kernel can't copy by itself.
+ */
+int clbt_copy_prefix(int in, int out, off_t len, void* buf, size_t bufLen)
+{
+	off_t done = 0;
+	ssize_t n;
+
+#if defined(__linux__)
+	loff_t offset = 0;
+	while (done < len)
+	{
+		n = copy_file_range(in, &offset, out, NULL, (size_t)(len - done), 0);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+#endif
+
+	while (done < len)
+	{
+		n = clbt_read_full(in, buf, len - done < (off_t)bufLen ? (size_t)(len - done) : bufLen, done);
+		if (n <= 0 || clbt_write_full(out, buf, n) != CLBT_OK)
+			return CLBT_FAILURE_IO;
+		done += n;
+	}
+	return CLBT_OK;
+}
+
+/* i-th temporary name next to name, unique to this process and thread */
+static void clbt_replace_name(const char* name, CP* tmp, int tid, int i)
+{
+	const char* slash = strrchr(name, '/');
+	int dirlen = slash ? (int)(slash - name) + 1 : 0;
+
+	clbt_path_resize(tmp, strlen(name) + 64);
+	sprintf(tmp->path, "%.*s.%s.clbt%ld-%d-%d", dirlen, name, name + dirlen, (long)getpid(), tid, i);
+}
+
+/*
+ * Create a temporary file next to dirfd/name, the name is left in tmp.
+ * Returns the open fd or -1.
+ */
+int clbt_replace_begin(int dirfd, const char* name, CP* tmp, int tid)
+{
+	int fd = -1, i;
+
+	for (i = 0; i < 100; i++)
+	{
+		clbt_replace_name(name, tmp, tid, i);
+		fd = openat(dirfd, tmp->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+	return fd;
+}
+
+/*
+ * Like clbt_replace_begin, but the temporary name is a hard link to target.
+ * Once it is checked, rename it over dirfd/name or unlink it.
+ */
+int clbt_replace_link(const char* target, int dirfd, const char* name, CP* tmp, int tid)
+{
+	int i;
+
+	for (i = 0; i < 100; i++)
+	{
+		clbt_replace_name(name, tmp, tid, i);
+		if (linkat(AT_FDCWD, target, dirfd, tmp->path, 0) == 0)
+			return CLBT_OK;
+		if (errno != EEXIST)
+			break;
+	}
+	return CLBT_FAILURE_IO;
+}
+
+/*
+ * Finish a temporary file from clbt_replace_begin. If ok, mode and owner of
+ * st are copied and it atomically replaces dirfd/name, otherwise or on any
+ * failure it is removed. errno of the first failure is kept.
+ */
+int clbt_replace_commit(int dirfd, const char* name, const CP* tmp, int fd, const struct stat* st, int ok)
+{
+	int err;
+
+	if (ok && fchmod(fd, st->st_mode & 07777) != 0)
+		ok = 0;
+	if (ok && fchown(fd, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+		ok = 0;
+	if (close(fd) != 0)
+		ok = 0;
+	if (ok && renameat(dirfd, tmp->path, dirfd, name) == 0)
+		return CLBT_OK;
+
+	err = errno;
+	unlinkat(dirfd, tmp->path, 0);
+	errno = err;
+	return CLBT_FAILURE_IO;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+/*
+ * Start a walker with its own thread pool.
+ */
+int clbt_walk_begin(struct ClbtWalker* walker, const struct ClbtWalkOps* ops, void* user, int flags)
+{
+	assert(walker != NULL && ops != NULL && ops->on_entry != NULL);
+
+	walker->ops = ops;
+	walker->user = user;
+	walker->flags = flags;
+	walker->errors = 0;
+	walker->pool = clbt_pool_create(clbtConfig.jobs);
+	return CLBT_OK;
+}
+
+/*
+ * Schedule a root to be walked, directories are enumerated, files reported as is.
+ */
+void clbt_walk_root(struct ClbtWalker* walker, const char* root)
+{
+	struct ClbtWalkRoot* job = (struct ClbtWalkRoot*)malloc(sizeof(struct ClbtWalkRoot));
+	int len = strlen(root);
+
+	if (job == NULL || (job->path = (char*)malloc(len + 1)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for walk root!");
+		exit(CLBT_MEMORY_ERR);
+	}
+
+	memcpy(job->path, root, len + 1);
+	/* drop trailing separators so joined paths stay clean */
+	while (len > 1 && job->path[len - 1] == '/')
+		job->path[--len] = '\0';
+
+	job->walker = walker;
+	clbt_pool_submit(walker->pool, clbt_walk_root_job, job);
+}
+
+/*
+ * Wait for all roots to finish and release the walker.
+ */
+int clbt_walk_end(struct ClbtWalker* walker)
+{
+	clbt_pool_wait(walker->pool);
+	clbt_pool_destroy(walker->pool);
+	walker->pool = NULL;
+	return walker->errors ? CLBT_FAILURE_IO : CLBT_OK;
+}
+
+#else /* CLBT_OS == 0 */
+#include <Windows.h>
+
+int clbt_default_jobs(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+#endif
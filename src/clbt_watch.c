@@ -0,0 +1,391 @@
+/***********************************************************************/
+/*
+ *   Script File: clbt_watch.c
+ *
+ *   Description:
+ *
+ *   Report changes below the targets as they happen for CLBT
+ *
+ *
+ *   Author: Joshua Zhang (zzbhf@mail.missouri.edu)
+ *   Date since: Feb-2015
+ *
+ *   Copyright (c) <2015> <Joshua Z. ZHANG>	 - All Rights Reserved.
+ *
+ *	 Open source according to LGPLv3 License.
+ *	 No warrenty implied, use at your own risk.
+ */
+/***********************************************************************/
+
+#include "clbt_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if CLBT_OS == 1
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define CLBT_WATCH_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)
+#define CLBT_WATCH_BUFFER	(64 << 10)	/* bytes of events taken per read */
+#define CLBT_WATCH_QUIET	10			/* ms without events that ends a burst */
+
+/*
+ * A walk puts an inotify watch on every directory as soon as it is opened,
+ * so entries made while it is read are not missed, then the task sleeps in
+ * read() until the kernel has events. Each batch is reported as "+ path",
+ * "- path" or "* path", or {"change","path"} records like diff, and flushed
+ * at once. Repeats for one path within a burst, like the close and the
+ * attribute change after a write, are dropped. A directory that shows up is
+ * walked for watches of its own and everything in it is reported as added,
+ * one removed or moved away is reported alone.
+ */
+struct ClbtWatch
+{
+	int fd;						/* inotify instance */
+	char** paths;				/* directory of every watch descriptor, NULL if unused */
+	int count;					/* slots in paths */
+	int watches;				/* slots in use */
+	pthread_mutex_t lock;		/* guards paths while walking */
+	int report;					/* report what a walk finds as added */
+	CP* buffers;				/* per thread path buffer of a walk */
+	CL added;					/* directories that showed up, walked after a batch */
+	CP last;					/* path of the last event reported */
+	const char* lastChange;		/* its change, NULL once events stopped for a while */
+};
+
+/*
+ * Report one change the way diff does, as a line or a record.
+ */
+static void clbt_watch_report(const char* change, const char* path, int len)
+{
+	struct ClbtRecord r;
+	char mark = '+';
+
+	if (clbt_out_format() != CLBT_FORMAT_JSONL)
+	{
+		if (strcmp(change, "removed") == 0)
+			mark = '-';
+		else if (strcmp(change, "modified") == 0)
+			mark = '*';
+		clbt_println("%c %s", mark, path);
+		return;
+	}
+	clbt_record_begin(&r);
+	clbt_record_string(&r, "change", change, strlen(change));
+	clbt_record_string(&r, "path", path, len);
+	clbt_record_end(&r, -1);
+}
+
+/* lock held while walking */
+static void clbt_watch_set(struct ClbtWatch* watch, int wd, const char* path, int len)
+{
+	char** paths;
+	int count;
+
+	if (wd >= watch->count)
+	{
+		count = wd * 2 + 16;
+		paths = (char**)realloc(watch->paths, count * sizeof(char*));
+		if (paths == NULL)
+		{
+			clbt_error("Unable to allocate memory for watches!");
+			exit(CLBT_MEMORY_ERR);
+		}
+		memset(paths + watch->count, 0, (count - watch->count) * sizeof(char*));
+		watch->paths = paths;
+		watch->count = count;
+	}
+
+	/* the same directory reached twice keeps its descriptor */
+	if (watch->paths[wd] == NULL)
+		watch->watches++;
+	free(watch->paths[wd]);
+	if ((watch->paths[wd] = (char*)malloc(len + 1)) == NULL)
+	{
+		clbt_error("Unable to allocate memory for watches!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	memcpy(watch->paths[wd], path, len + 1);
+}
+
+static void clbt_watch_drop(struct ClbtWatch* watch, int wd)
+{
+	free(watch->paths[wd]);
+	watch->paths[wd] = NULL;
+	watch->watches--;
+}
+
+static int clbt_watch_on_entry(struct ClbtWalker* walker, struct ClbtEntry* entry, int tid)
+{
+	struct ClbtWatch* watch = (struct ClbtWatch*)walker->user;
+	int len;
+
+	if (entry->dir == NULL)
+	{
+		clbt_warning("'%s' is not a directory, it is not watched.", entry->name);
+		return CLBT_WALK_CONTINUE;
+	}
+	if (watch->report && clbt_match_entry(entry))
+	{
+		len = clbt_entry_path(entry, &watch->buffers[tid]);
+		clbt_watch_report("added", watch->buffers[tid].path, len);
+	}
+	return CLBT_WALK_CONTINUE;
+}
+
+static void clbt_watch_on_dir_begin(struct ClbtWalker* walker, struct ClbtDir* dir, int dirfd, int tid)
+{
+	struct ClbtWatch* watch = (struct ClbtWatch*)walker->user;
+	int wd;
+
+	(void)dirfd;
+	(void)tid;
+	/* roots may be symbolic links given by the user, never follow below them */
+	wd = inotify_add_watch(watch->fd, dir->path, CLBT_WATCH_EVENTS | IN_ONLYDIR | (dir->parent != NULL ? IN_DONT_FOLLOW : 0));
+	if (wd < 0)
+	{
+		/* removed since it was opened, its delete event is on the way */
+		if (errno == ENOENT)
+			return;
+		if (errno == ENOSPC)
+			clbt_error("Cannot watch '%s': too many watches, raise fs.inotify.max_user_watches.", dir->path);
+		else
+			clbt_error("Cannot watch '%s': %s", dir->path, strerror(errno));
+		clbt_walk_failed(walker);
+		return;
+	}
+	pthread_mutex_lock(&watch->lock);
+	clbt_watch_set(watch, wd, dir->path, dir->length);
+	pthread_mutex_unlock(&watch->lock);
+}
+
+static const struct ClbtWalkOps clbtWatchOps = { clbt_watch_on_entry, NULL, NULL, clbt_watch_on_dir_begin };
+
+/*
+ * Walk roots to watch every directory below them.
+ */
+static int clbt_watch_walk(struct ClbtWatch* watch, const CL* roots, int flags)
+{
+	struct ClbtWalker walker;
+	int i, threads, ret;
+
+	ret = clbt_walk_begin(&walker, &clbtWatchOps, watch, flags);
+	if (ret != CLBT_OK)
+		return ret;
+	threads = clbt_walk_threads(&walker);
+	watch->buffers = (CP*)malloc(sizeof(CP) * threads);
+	if (watch->buffers == NULL)
+	{
+		clbt_error("Unable to allocate memory for watches!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	for (i = 0; i < threads; i++)
+		clbt_path_init(&watch->buffers[i]);
+
+	for (i = 0; i < roots->size; i++)
+		clbt_walk_root(&walker, roots->paths[i]->path);
+	ret = clbt_walk_end(&walker);
+
+	for (i = 0; i < threads; i++)
+		clbt_path_destroy(&watch->buffers[i]);
+	free(watch->buffers);
+	watch->buffers = NULL;
+	return ret;
+}
+
+/*
+ * Stop watching a directory moved away and everything below it, their
+ * paths are stale. A move inside the targets shows up again as added.
+ */
+static void clbt_watch_forget(struct ClbtWatch* watch, const char* path, int len)
+{
+	int wd;
+
+	for (wd = 0; wd < watch->count; wd++)
+	{
+		if (watch->paths[wd] != NULL && strncmp(watch->paths[wd], path, len) == 0
+			&& (watch->paths[wd][len] == '\0' || watch->paths[wd][len] == '/'))
+		{
+			inotify_rm_watch(watch->fd, wd);
+			clbt_watch_drop(watch, wd);
+		}
+	}
+}
+
+static void clbt_watch_event(struct ClbtWatch* watch, const struct inotify_event* ev, int recurse, CP* path)
+{
+	struct ClbtEntry entry;
+	const char* dir;
+	const char* change;
+	int len, dirLength, nameLength;
+
+	if (ev->mask & IN_Q_OVERFLOW)
+	{
+		clbt_warning("Too many changes at once, some were not reported.");
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= watch->count || watch->paths[ev->wd] == NULL)
+		return;
+	if (ev->mask & IN_IGNORED)
+	{
+		clbt_watch_drop(watch, ev->wd);
+		return;
+	}
+	/* changes of a watched directory itself come from its parent too */
+	if (ev->len == 0)
+		return;
+
+	dir = watch->paths[ev->wd];
+	dirLength = (int)strlen(dir);
+	nameLength = (int)strlen(ev->name);
+	len = dirLength + nameLength + 1;
+	if (path->length < len + 1)
+		clbt_path_resize(path, len * 2 + 1);
+	memcpy(path->path, dir, dirLength);
+	if (dirLength > 0 && dir[dirLength - 1] == '/')
+		len--;
+	else
+		path->path[dirLength++] = '/';
+	memcpy(path->path + dirLength, ev->name, nameLength + 1);
+
+	if (ev->mask & IN_ISDIR)
+	{
+		if (recurse && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+			clbt_list_append(&watch->added, path->path);
+		else if (ev->mask & IN_MOVED_FROM)
+			clbt_watch_forget(watch, path->path, len);
+	}
+	if (!clbt_match_patterns(ev->name))
+		return;
+	if (clbtConfig.expr != NULL)
+	{
+		/* a removed entry cannot be stat'ed, so tests needing it fail */
+		memset(&entry, 0, sizeof(entry));
+		entry.dirfd = AT_FDCWD;
+		entry.name = path->path;
+		entry.namelen = len;
+		entry.type = (ev->mask & IN_ISDIR) ? CLBT_TYPE_DIR : CLBT_TYPE_UNKNOWN;
+		if (!clbt_expr_run(clbtConfig.expr, &entry))
+			return;
+	}
+
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		change = "added";
+	else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		change = "removed";
+	else
+		change = "modified";
+
+	/* a write comes with a close and often an attribute change, say it once */
+	if (watch->lastChange != NULL && strcmp(watch->last.path, path->path) == 0
+		&& (change == watch->lastChange || (change[0] == 'm' && watch->lastChange[0] == 'a')))
+		return;
+	clbt_watch_report(change, path->path, len);
+	watch->lastChange = change;
+	clbt_path_set(&watch->last, path->path, len);
+}
+
+/*
+ * Watch the targets, recursively with -R, and print every change until
+ * interrupted or nothing is left to watch.
+ */
+int clbt_task_watch(int options)
+{
+	struct ClbtWatch watch;
+	struct pollfd pfd;
+	const struct inotify_event* ev;
+	const int recurse = (options & CLBT_OPT_RECURSIVE) != 0;
+	const int flags = recurse ? CLBT_WALK_RECURSE : 0;
+	char* buf;
+	char* p;
+	CP path;
+	ssize_t n;
+	int i, ret;
+
+	memset(&watch, 0, sizeof(watch));
+	watch.fd = inotify_init1(IN_CLOEXEC);
+	if (watch.fd < 0)
+	{
+		clbt_error("Cannot start watching: %s", strerror(errno));
+		return CLBT_FAILURE_IO;
+	}
+	buf = (char*)malloc(CLBT_WATCH_BUFFER);
+	if (buf == NULL)
+	{
+		clbt_error("Unable to allocate memory for watches!");
+		exit(CLBT_MEMORY_ERR);
+	}
+	pthread_mutex_init(&watch.lock, NULL);
+	clbt_list_init(&watch.added);
+	clbt_path_init(&watch.last);
+	clbt_path_init(&path);
+
+	ret = clbt_watch_walk(&watch, &clbtConfig.targets, flags);
+	clbt_verbose(options, "Watching %d directories.", watch.watches);
+	watch.report = 1;
+
+	while (watch.watches > 0)
+	{
+		/* events of one burst often repeat, they are reported at once but only once */
+		pfd.fd = watch.fd;
+		pfd.events = POLLIN;
+		if (watch.lastChange != NULL && poll(&pfd, 1, CLBT_WATCH_QUIET) == 0)
+			watch.lastChange = NULL;
+		n = read(watch.fd, buf, CLBT_WATCH_BUFFER);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			clbt_error("Cannot read changes: %s", strerror(errno));
+			ret = CLBT_FAILURE_IO;
+			break;
+		}
+
+		/* the kernel hands out whole events only */
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event*)p;
+			clbt_watch_event(&watch, ev, recurse, &path);
+		}
+		if (watch.added.size > 0)
+		{
+			/* a directory may be gone again before it is walked, that is no failure */
+			if (clbt_watch_walk(&watch, &watch.added, flags | CLBT_WALK_VANISHED) != CLBT_OK)
+				ret = CLBT_FAILURE_IO;
+			for (i = 0; i < watch.added.size; i++)
+			{
+				if (access(watch.added.paths[i]->path, F_OK) != 0 && errno == ENOENT)
+					clbt_watch_forget(&watch, watch.added.paths[i]->path, (int)strlen(watch.added.paths[i]->path));
+			}
+			clbt_list_destroy(&watch.added);
+			clbt_list_init(&watch.added);
+		}
+		clbt_out_flush();
+	}
+	clbt_verbose(options, "Nothing left to watch.");
+
+	for (i = 0; i < watch.count; i++)
+		free(watch.paths[i]);
+	free(watch.paths);
+	free(buf);
+	clbt_path_destroy(&path);
+	clbt_path_destroy(&watch.last);
+	clbt_list_destroy(&watch.added);
+	pthread_mutex_destroy(&watch.lock);
+	close(watch.fd);
+	return ret;
+}
+
+#else
+
+int clbt_task_watch(int options)
+{
+	(void)options;
+	return clbt_unsupported("watch");
+}
+
+#endif
@@ -24,7 +24,7 @@
 #define AUTHOR "Joshua Z. Zhang - Feb 2015"
 
 
-void chkargs(int argc, char **argv)
+int chkargs(int argc, char **argv)
 {
 	/* use lower case for tasks, upper case letters for options */
 	struct arg_lit  *list = arg_lit0("l", "list", "list files");
@@ -35,12 +35,49 @@ void chkargs(int argc, char **argv)
 	struct arg_lit  *verbose = arg_lit0("V", "verbose", "print debug information");
 	struct arg_lit  *version = arg_lit0(NULL, "version", "print version information and exit");
 	struct arg_lit  *rename = arg_lit0("r", "rename", "perform rename");
+	struct arg_lit  *del = arg_lit0("d", "delete", "delete targets, or only files matching input patterns and --expr");
+	struct arg_str  *hash = arg_str0(NULL, "hash", "xxh3|sha256|blake3", "hash content of every file");
+	struct arg_lit  *dedupe = arg_lit0(NULL, "dedupe", "find duplicate files");
+	struct arg_str  *link = arg_str0(NULL, "link", "hard|reflink", "replace duplicates by links, with --dedupe");
+	struct arg_lit  *du = arg_lit0(NULL, "du", "print disk usage of every directory in KiB, largest first");
+	struct arg_int  *limit = arg_int0(NULL, "limit", "K", "print only the K largest, with --du");
+	struct arg_int  *top = arg_int0(NULL, "top", "N", "print the N largest files, or newest with --by mtime");
+	struct arg_str  *by = arg_str0(NULL, "by", "size|mtime", "what --top ranks files by, default size");
+	struct arg_str  *statsby = arg_str0(NULL, "stats-by", "ext|uid|age|sizebucket", "print file counts and bytes grouped by extension, owner, age or size");
+	struct arg_str  *eol = arg_str0(NULL, "eol", "lf|crlf", "convert line endings of matching text files");
+	struct arg_lit  *stripbom = arg_lit0(NULL, "strip-bom", "remove UTF-8 BOM from matching text files");
+	struct arg_lit  *toutf8 = arg_lit0(NULL, "to-utf8", "convert UTF-16 and non UTF-8 (as Latin-1) text files to UTF-8");
+	struct arg_file *sync = arg_file0(NULL, "sync", "dest", "mirror the only target directory to dest, removing extras");
+	struct arg_lit  *verify = arg_lit0(NULL, "verify", "compare content of files with equal size, with --sync");
+	struct arg_str  *exec = arg_str0("x", "exec", "\"cmd [args]\"", "run cmd on matching files, packed per invocation, at \"{}\" or appended");
+	struct arg_lit  *coproc = arg_lit0(NULL, "coproc", "start cmd once per thread and stream paths to its stdin, with --exec");
+	struct arg_lit  *null = arg_lit0("0", "null", "paths and output of --coproc are NUL terminated");
+	struct arg_lit  *keeporder = arg_lit0(NULL, "keep-order", "print output of --exec commands in the order they started");
+	struct arg_file *snapshot = arg_file0(NULL, "snapshot", "file", "write a sorted binary snapshot of the only target directory to file");
+	struct arg_file *diff = arg_file0(NULL, "diff", "old", "print entries added, removed or modified from snapshot old to the target snapshot");
+	struct arg_str  *index = arg_str0(NULL, "index", "build|refresh", "build the filename index of the only target directory, or refresh it");
+	struct arg_lit  *useindex = arg_lit0(NULL, "use-index", "answer --list from the filename index instead of walking");
+	struct arg_file *indexfile = arg_file0(NULL, "index-file", "file", "filename index to use, default $HOME/.clbt.index");
+	struct arg_lit  *watch = arg_lit0(NULL, "watch", "after other tasks, print changes below the targets as they happen");
+	struct arg_file *serve = arg_file0(NULL, "serve", "sock", "after other tasks, answer --list queries from the filename index on socket sock");
+	struct arg_file *connect = arg_file0(NULL, "connect", "sock", "answer --list by asking the --serve server on socket sock");
+	struct arg_lit  *print0 = arg_lit0(NULL, "print0", "terminate every output line with NUL instead of newline");
+	struct arg_lit  *jsonl = arg_lit0(NULL, "jsonl", "print one JSON object per line");
+	struct arg_str  *fields = arg_str0(NULL, "fields", "path,size,mtime", "fields printed by --list in the order given: path,name,type,size,mtime,mode,uid,gid,ino");
+	struct arg_str  *sort = arg_str0(NULL, "sort", "name|natural|size|mtime", "sort --list output by path, path with numbers by value, or largest or newest first");
+	struct arg_str  *search = arg_strn("s", "search", "text", 0, argc + 2, "substitute text in content of matching files");
+	struct arg_str  *replace = arg_strn(NULL, "replace", "text", 0, argc + 2, "replacement of n-th --search, empty if missing");
+	struct arg_lit  *regex = arg_lit0("E", "regex", "--search is an extended regular expression, \\1-\\9 in --replace");
 	struct arg_str	*infile = arg_strn("i", "infile", "filename", 0, argc + 2, "input filename pattern");
+	struct arg_str  *expr = arg_str0(NULL, "expr", "expression", "filter entries like find with -name, -type, -size, -mtime, -and, -or, -not and ( )");
+	struct arg_int  *jobs = arg_int0("j", "jobs", "N", "number of worker threads, default one per cpu");
+	struct arg_file *target = arg_filen(NULL, NULL, "target", 0, argc + 2, "target files/directories, default current directory (required by delete)");
 	struct arg_end  *end = arg_end(20);
 
-	void* argtable[10];
+	void* argtable[46];
 	const char* progname = argv[0];
 	int nerrors;
+	int i;
 	int clbtOptions = CLBT_OPT_DEFAULT;
 	int clbtTasks = CLBT_TASK_DEFAULT;
 
@@ -53,8 +90,44 @@ void chkargs(int argc, char **argv)
 	argtable[5] = verbose;
 	argtable[6] = version;
 	argtable[7] = rename;
-	argtable[8] = infile;
-	argtable[9] = end;
+	argtable[8] = del;
+	argtable[9] = hash;
+	argtable[10] = dedupe;
+	argtable[11] = link;
+	argtable[12] = du;
+	argtable[13] = limit;
+	argtable[14] = top;
+	argtable[15] = by;
+	argtable[16] = statsby;
+	argtable[17] = eol;
+	argtable[18] = stripbom;
+	argtable[19] = toutf8;
+	argtable[20] = sync;
+	argtable[21] = verify;
+	argtable[22] = exec;
+	argtable[23] = coproc;
+	argtable[24] = null;
+	argtable[25] = keeporder;
+	argtable[26] = snapshot;
+	argtable[27] = diff;
+	argtable[28] = index;
+	argtable[29] = useindex;
+	argtable[30] = indexfile;
+	argtable[31] = watch;
+	argtable[32] = serve;
+	argtable[33] = connect;
+	argtable[34] = print0;
+	argtable[35] = jsonl;
+	argtable[36] = fields;
+	argtable[37] = sort;
+	argtable[38] = search;
+	argtable[39] = replace;
+	argtable[40] = regex;
+	argtable[41] = infile;
+	argtable[42] = expr;
+	argtable[43] = jobs;
+	argtable[44] = target;
+	argtable[45] = end;
 	
 
 	/* verify the argtable[] entries were allocated sucessfully */
@@ -117,16 +190,146 @@ void chkargs(int argc, char **argv)
 	if (verbose->count) clbtOptions |= CLBT_OPT_VERBOSE;
 	if (quiet->count) clbtOptions |= CLBT_OPT_QUIET;
 	if (recurse->count) clbtOptions |= CLBT_OPT_RECURSIVE;
+	if (regex->count) clbtOptions |= CLBT_OPT_REGEX;
+	if (verify->count) clbtOptions |= CLBT_OPT_VERIFY;
+	if (coproc->count) clbtOptions |= CLBT_OPT_COPROC;
+	if (null->count) clbtOptions |= CLBT_OPT_NULL;
+	if (keeporder->count) clbtOptions |= CLBT_OPT_KEEPORDER;
+	if (print0->count) clbtOptions |= CLBT_OPT_PRINT0;
+	if (jsonl->count) clbtOptions |= CLBT_OPT_JSONL;
+	if (useindex->count) clbtOptions |= CLBT_OPT_USEINDEX;
 	
 	/* set core routine tasks */
 	if (list->count) clbtTasks |= CLBT_TASK_LIST;
 	if (rename->count) clbtTasks |= CLBT_TASK_RENAME;
+	if (del->count) clbtTasks |= CLBT_TASK_DELETE;
+	if (hash->count) clbtTasks |= CLBT_TASK_HASH;
+	if (dedupe->count) clbtTasks |= CLBT_TASK_DEDUPE;
+	if (search->count) clbtTasks |= CLBT_TASK_MODIFY;
+	if (du->count) clbtTasks |= CLBT_TASK_DU;
+	if (eol->count || stripbom->count || toutf8->count) clbtTasks |= CLBT_TASK_CONVERT;
+	if (sync->count) clbtTasks |= CLBT_TASK_SYNC;
+	if (exec->count) clbtTasks |= CLBT_TASK_EXEC;
+	if (snapshot->count) clbtTasks |= CLBT_TASK_SNAPSHOT;
+	if (diff->count) clbtTasks |= CLBT_TASK_DIFF;
+	if (index->count) clbtTasks |= CLBT_TASK_INDEX;
+	if (watch->count) clbtTasks |= CLBT_TASK_WATCH;
+	if (serve->count) clbtTasks |= CLBT_TASK_SERVE;
+	if (top->count) clbtTasks |= CLBT_TASK_TOP;
+	if (statsby->count) clbtTasks |= CLBT_TASK_STATS;
+
+	/* set core routine config */
+	for (i = 0; i < target->count; i++) clbt_config(CLBT_CFG_TARGET, target->filename[i]);
+	for (i = 0; i < infile->count; i++) clbt_config(CLBT_CFG_PATTERN, infile->sval[i]);
+	for (i = 0; i < search->count; i++) clbt_config(CLBT_CFG_SEARCH, search->sval[i]);
+	for (i = 0; i < replace->count; i++) clbt_config(CLBT_CFG_REPLACE, replace->sval[i]);
+	if (hash->count && clbt_config(CLBT_CFG_HASH, hash->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown hash algorithm '%s'\n", progname, hash->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (link->count && clbt_config(CLBT_CFG_LINK, link->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown link mode '%s'\n", progname, link->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (eol->count && clbt_config(CLBT_CFG_CONVERT, eol->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown line ending '%s'\n", progname, eol->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (stripbom->count) clbt_config(CLBT_CFG_CONVERT, "nobom");
+	if (toutf8->count) clbt_config(CLBT_CFG_CONVERT, "utf8");
+	if (sync->count) clbt_config(CLBT_CFG_SYNC, sync->filename[0]);
+	if (snapshot->count) clbt_config(CLBT_CFG_SNAPSHOT, snapshot->filename[0]);
+	if (diff->count) clbt_config(CLBT_CFG_DIFF, diff->filename[0]);
+	if (indexfile->count) clbt_config(CLBT_CFG_INDEX_FILE, indexfile->filename[0]);
+	if (serve->count) clbt_config(CLBT_CFG_SERVE, serve->filename[0]);
+	if (connect->count) clbt_config(CLBT_CFG_CONNECT, connect->filename[0]);
+	if (index->count && clbt_config(CLBT_CFG_INDEX, index->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown index action '%s'\n", progname, index->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (exec->count && clbt_config(CLBT_CFG_EXEC, exec->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unbalanced quote in command '%s'\n", progname, exec->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (expr->count && clbt_config(CLBT_CFG_EXPR, expr->sval[0]) != CLBT_OK)
+	{
+		printf("%s: invalid expression '%s'\n", progname, expr->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (by->count && clbt_config(CLBT_CFG_BY, by->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown ranking '%s'\n", progname, by->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (statsby->count && clbt_config(CLBT_CFG_STATS_BY, statsby->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown grouping '%s'\n", progname, statsby->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (fields->count && clbt_config(CLBT_CFG_FIELDS, fields->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown or repeated field in '%s'\n", progname, fields->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (sort->count && clbt_config(CLBT_CFG_SORT, sort->sval[0]) != CLBT_OK)
+	{
+		printf("%s: unknown sort order '%s'\n", progname, sort->sval[0]);
+		arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+		exit(CLBT_INVALID_OP);
+	}
+	if (jobs->count)
+	{
+		char buf[32];
+		sprintf(buf, "%d", jobs->ival[0]);
+		if (clbt_config(CLBT_CFG_JOBS, buf) != CLBT_OK)
+		{
+			printf("%s: --jobs needs a non-negative count\n", progname);
+			arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+			exit(CLBT_INVALID_OP);
+		}
+	}
+	if (limit->count)
+	{
+		char buf[32];
+		sprintf(buf, "%d", limit->ival[0]);
+		if (clbt_config(CLBT_CFG_LIMIT, buf) != CLBT_OK)
+		{
+			printf("%s: --limit needs a non-negative count\n", progname);
+			arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+			exit(CLBT_INVALID_OP);
+		}
+	}
+	if (top->count)
+	{
+		char buf[32];
+		sprintf(buf, "%d", top->ival[0]);
+		if (clbt_config(CLBT_CFG_TOP, buf) != CLBT_OK)
+		{
+			printf("%s: --top needs a positive count\n", progname);
+			arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+			exit(CLBT_INVALID_OP);
+		}
+	}
 
 	/* free argtable now */
 	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
 
 	/* start core routine */
-	clbt_run(clbtOptions, clbtTasks);
+	return clbt_run(clbtOptions, clbtTasks);
 }
 
 
@@ -148,6 +351,5 @@ void test0()
 
 int main(int argc, char **argv)
 {
-	chkargs(argc, argv);
-	return CLBT_OK;
+	return chkargs(argc, argv);
 }
\ No newline at end of file